@@ -0,0 +1,1117 @@
+#include "Benchmark.h"
+#include "FluidSolver.h"
+#include "MACFluidSolver.h"
+#include "QuadtreeFluidSolver.h"
+#include "FluidSolver3D.h"
+#include "DistributedFluidSolver.h"
+#include "EnsembleFluidSolver.h"
+#include "SimulationThread.h"
+#include "Checkpoint.h"
+#include "FrameRecorder.h"
+#include "BlockedSum.h"
+#include "FieldRaster.h"
+#include "ParticleSystem.h"
+#include "MemoryUsage.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "StopWatch.h"
+#include <string.h>
+#include <assert.h>
+
+// Scripted scene shared by the benchmarks: a smoke source near the bottom
+// and a sideways stir during the first steps, in the same units the UI uses.
+template <class Solver>
+static void inject_benchmark_sources(Solver & solver, int step)
+{
+	int n = solver.n;
+	solver.set_density_source(n/2 + (n-10)*n, 50.*solver.h);
+	if (step < 20)
+		solver.set_velocity_source(n/3 + (n/2)*n, vec2(100., -50.));
+}
+
+template <class Solver>
+static void run_projection_case(FILE *fp, const char *name, Solver & solver, int iterations, int steps)
+{
+	solver.reset();
+	solver.pressure_iterations = iterations;
+	double residual = 0.;
+	CStopWatch timer;
+	long long ns = 0;
+	for (int step = 0; step < steps; step++) {
+		inject_benchmark_sources(solver, step);
+		timer.restart();
+		solver.update();
+		ns += timer.nanoseconds();
+		residual += solver.divergence_residual();
+	}
+	fprintf(fp, "%-12s %6d %12.3f %14.6e\n", name, iterations, ns*1e-6/steps, residual/steps);
+}
+
+void benchmark_projection(FILE *fp, int steps)
+{
+	CFluidSolver collocated;
+	CMACFluidSolver staggered;
+	int iterations[] = {1, 2, 5, 10, 20, 40};
+
+	fprintf(fp, "Projection: n = %d, %d steps, residual = RMS of each solver's own discrete divergence\n", collocated.n, steps);
+	fprintf(fp, "%-12s %6s %12s %14s\n", "solver", "iters", "ms/step", "residual");
+	for (int k = 0; k < (int) (sizeof(iterations)/sizeof(iterations[0])); k++) {
+		run_projection_case(fp, "collocated", collocated, iterations[k], steps);
+		run_projection_case(fp, "MAC", staggered, iterations[k], steps);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_bricks(FILE *fp, int steps)
+{
+	CFluidSolver dense;
+	CFluidSolver sparse;
+	sparse.set_sparse(true);
+
+	fprintf(fp, "Sparse tiles: n = %d, tile = %d, %d steps\n", dense.n, BRICK_SIZE, steps);
+	fprintf(fp, "%6s %12s %12s %14s %12s\n", "step", "dense ms", "sparse ms", "active tiles", "max |diff|");
+	CStopWatch timer;
+	long long dense_ns = 0, sparse_ns = 0;
+	for (int step = 0; step < steps; step++) {
+		// plume only: a small smoke source rising from the bottom
+		dense.set_density_source(dense.n/2 + (dense.n-10)*dense.n, 50.*dense.h);
+		sparse.set_density_source(sparse.n/2 + (sparse.n-10)*sparse.n, 50.*sparse.h);
+		timer.restart();
+		dense.update();
+		dense_ns += timer.nanoseconds();
+		timer.restart();
+		sparse.update();
+		sparse_ns += timer.nanoseconds();
+		if ((step+1) % 10 == 0) {
+			double diff = 0.;
+			for (int i = 0; i < dense.size; i++)
+				diff = fabs(dense.density[i] - sparse.density[i]) > diff ? fabs(dense.density[i] - sparse.density[i]) : diff;
+			fprintf(fp, "%6d %12.3f %12.3f %8d/%-5d %12.3e\n", step+1, dense_ns*1e-6/10, sparse_ns*1e-6/10,
+				sparse.bricks.num_active, sparse.bricks.nt*sparse.bricks.nt, diff);
+			dense_ns = sparse_ns = 0;
+		}
+	}
+
+	//sparse mode switched on mid-run keeps the smoke that is already there moving
+	std::vector<double> before(dense.density, dense.density + dense.size);
+	dense.set_sparse(true);
+	int moved = 0, occupied = 0;
+	for (int step = 0; step < 20; step++)
+		dense.update();
+	for (int i = 0; i < dense.size; i++)
+		if (before[i] != 0.) {
+			occupied++;
+			moved += dense.density[i] != before[i];
+		}
+	fprintf(fp, "sparse on after %d dense steps: %d/%d tiles active, %d of %d smoke cells changed in 20 steps\n",
+		steps, dense.bricks.num_active, dense.bricks.nt*dense.bricks.nt, moved, occupied);
+	assert(occupied == 0 || moved > 0);
+	fprintf(fp, "\n");
+}
+
+static double relative_error(double* a, double* reference, int size)
+{
+	double e = 0., r = 0.;
+	for (int i = 0; i < size; i++) {
+		e += (a[i]-reference[i])*(a[i]-reference[i]);
+		r += reference[i]*reference[i];
+	}
+	return r > 0 ? sqrt(e/r) : sqrt(e);
+}
+
+static int cell_count(CFluidSolver & solver) {return solver.size;}
+static int cell_count(CQuadtreeFluidSolver & solver) {return solver.num_leaves;}
+
+template <class Solver>
+static long long run_plume(Solver & solver, int steps, double* mean_cells)
+{
+	CStopWatch timer;
+	long long ns = 0;
+	double cells = 0.;
+	int n = solver.n;
+	for (int step = 0; step < steps; step++) {
+		solver.set_density_source(n/2 + (n-10)*n, 50.*solver.h);
+		timer.restart();
+		solver.update();
+		ns += timer.nanoseconds();
+		cells += cell_count(solver);
+	}
+	if (mean_cells)
+		*mean_cells = cells/steps;
+	return ns;
+}
+
+void benchmark_quadtree(FILE *fp, int steps)
+{
+	int n = 64;
+	CFluidSolver uniform(n);
+	double uniform_cells;
+	long long uniform_ns = run_plume(uniform, steps, &uniform_cells);
+
+	//the quadtree restricted to the finest level is the reference for the adaptivity error alone
+	CQuadtreeFluidSolver finest(n);
+	finest.max_leaf_size = 1;
+	finest.reset();
+	double finest_cells;
+	long long finest_ns = run_plume(finest, steps, &finest_cells);
+	finest.resample();
+
+	fprintf(fp, "Quadtree: n = %d, %d steps of a rising plume, error = relative L2 density error\n", n, steps);
+	fprintf(fp, "%-20s %10s %10s %14s %14s\n", "solver", "cells", "ms/step", "vs uniform", "vs finest tree");
+	fprintf(fp, "%-20s %10.0f %10.3f %14s %14.4f\n", "uniform", uniform_cells, uniform_ns*1e-6/steps, "-", relative_error(uniform.density, finest.density, finest.size));
+	fprintf(fp, "%-20s %10.0f %10.3f %14.4f %14s\n", "quadtree finest", finest_cells, finest_ns*1e-6/steps, relative_error(finest.density, uniform.density, uniform.size), "-");
+
+	double thresholds[] = {0.02, 0.05, 0.2, 1.0};
+	for (int k = 0; k < (int) (sizeof(thresholds)/sizeof(thresholds[0])); k++) {
+		CQuadtreeFluidSolver adaptive(n);
+		adaptive.refine_threshold = thresholds[k];
+		double cells;
+		long long ns = run_plume(adaptive, steps, &cells);
+		adaptive.resample();
+		char name[32];
+		sprintf(name, "quadtree %.2f", thresholds[k]);
+		fprintf(fp, "%-20s %10.0f %10.3f %14.4f %14.4f\n", name, cells, ns*1e-6/steps,
+			relative_error(adaptive.density, uniform.density, uniform.size), relative_error(adaptive.density, finest.density, finest.size));
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_3d(FILE *fp, int max_n, int steps)
+{
+	int threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	fprintf(fp, "3D solver: %d steps per size, %d thread(s)\n", steps, threads);
+	fprintf(fp, "%6s %10s %12s %14s %10s\n", "n", "MB", "ms/step", "Mcells/s", "CG iters");
+	for (int n = 32; n <= max_n; n *= 2) {
+		CFluidSolver3D solver(n);
+		CStopWatch timer;
+		long long ns = 0;
+		for (int step = 0; step <= steps; step++) {
+			// a small block of smoke near the bottom and a sideways push
+			for (int k = n/2-2; k < n/2+2; k++)
+				for (int i = n/2-2; i < n/2+2; i++)
+					solver.set_density_source(i, n-n/6, k, 50.*solver.h);
+			solver.set_velocity_source(n/3, n/2, n/2, vec3(100., -50., 20.));
+			timer.restart();
+			solver.update();
+			if (step > 0) // the first step warms up the caches and page tables
+				ns += timer.nanoseconds();
+		}
+		double ms = ns*1e-6/steps;
+		fprintf(fp, "%6d %10.1f %12.3f %14.2f %10d\n", n, 9.0*sizeof(float)*solver.size/1e6, ms,
+			solver.size/(ms*1e-3)/1e6, solver.last_iterations);
+	}
+	fprintf(fp, "\n");
+}
+
+static void distributed_sources(CDistributedFluidSolver & solver, int step)
+{
+	inject_benchmark_sources(solver, step);
+}
+
+static double max_difference(double* a, double* b, int size)
+{
+	double d = 0.;
+	for (int k = 0; k < size; k++)
+		if (fabs(a[k] - b[k]) > d)
+			d = fabs(a[k] - b[k]);
+	return d;
+}
+
+void benchmark_distributed(FILE *fp, int n, int max_ranks, int steps)
+{
+	fprintf(fp, "Distributed solver: n = %d, %d steps\n", n, steps);
+	fprintf(fp, "%-12s %12s %14s\n", "ranks", "ms/step", "max diff");
+
+	// reference: the same solver with no neighbours, in this process
+	CLocalTransport local;
+	CDistributedFluidSolver reference(n, &local);
+	CStopWatch timer;
+	for (int step = 0; step < steps; step++) {
+		distributed_sources(reference, step);
+		reference.update();
+	}
+	double* expected = new double[reference.size];
+	reference.copy_owned_rows(expected, reference.density);
+	fprintf(fp, "%-12s %12.3f %14.6e\n", "in-process", timer.nanoseconds()*1e-6/steps, 0.);
+
+#ifndef _WIN32
+	double* result = new double[reference.size];
+	for (int ranks = 1; ranks <= max_ranks; ranks *= 2) {
+		timer.restart();
+		// the time includes forking the workers and setting up the segment
+		bool ok = run_distributed(ranks, n, steps, distributed_sources, result);
+		double ms = timer.nanoseconds()*1e-6/steps;
+		if (ok)
+			fprintf(fp, "%-12d %12.3f %14.6e\n", ranks, ms, max_difference(result, expected, reference.size));
+		else
+			fprintf(fp, "%-12d failed\n", ranks);
+	}
+	delete[] result;
+#else
+	fprintf(fp, "multi-process runs need fork(), not available on this platform\n");
+#endif
+	delete[] expected;
+	fprintf(fp, "\n");
+}
+
+void benchmark_ensemble(FILE *fp, int n, int steps)
+{
+	const int lanes = 8;
+	double viscosity[lanes], buoyancy[lanes];
+	for (int l = 0; l < lanes; l++) {
+		viscosity[l] = 0.05*l;
+		buoyancy[l] = 0.05 + 0.025*l;
+	}
+	fprintf(fp, "Ensemble solver: n = %d, %d lanes, %d steps\n", n, lanes, steps);
+	fprintf(fp, "%-24s %12s %14s\n", "solver", "ms/step", "ms/instance");
+
+	CStopWatch timer;
+	long long ns = 0;
+	CFluidSolver* separate[lanes];
+	for (int l = 0; l < lanes; l++) {
+		separate[l] = new CFluidSolver(n);
+		separate[l]->setup_velocity_diffusion_matrix(viscosity[l]);
+		separate[l]->viscosity_coef = viscosity[l];
+	}
+	for (int step = 0; step < steps; step++)
+		for (int l = 0; l < lanes; l++) {
+			// CFluidSolver has a fixed buoyancy, only the viscosity varies
+			inject_benchmark_sources(*separate[l], step);
+			timer.restart();
+			separate[l]->update();
+			ns += timer.nanoseconds();
+		}
+	for (int l = 0; l < lanes; l++)
+		delete separate[l];
+	fprintf(fp, "%-24s %12.3f %14.3f\n", "CFluidSolver x 8", ns*1e-6/steps, ns*1e-6/steps/lanes);
+
+	// the same matrix-free PCG as the ensemble, one scene at a time
+	ns = 0;
+	CLocalTransport local;
+	double* expected = new double[n*n*lanes];
+	for (int l = 0; l < lanes; l++) {
+		CDistributedFluidSolver scalar(n, &local);
+		scalar.viscosity_coef = viscosity[l];
+		for (int step = 0; step < steps; step++) {
+			inject_benchmark_sources(scalar, step);
+			timer.restart();
+			scalar.update();
+			ns += timer.nanoseconds();
+		}
+		for (int c = 0; c < n*n; c++)
+			expected[c*lanes + l] = scalar.density[scalar.index(c % n, c / n)];
+	}
+	fprintf(fp, "%-24s %12.3f %14.3f\n", "scalar matrix-free x 8", ns*1e-6/steps, ns*1e-6/steps/lanes);
+
+	ns = 0;
+	CEnsembleFluidSolver<lanes> ensemble(n);
+	for (int l = 0; l < lanes; l++)
+		ensemble.viscosity_coef[l] = viscosity[l];
+	for (int step = 0; step < steps; step++) {
+		inject_benchmark_sources(ensemble, step);
+		timer.restart();
+		ensemble.update();
+		ns += timer.nanoseconds();
+	}
+	fprintf(fp, "%-24s %12.3f %14.3f\n", "ensemble", ns*1e-6/steps, ns*1e-6/steps/lanes);
+	fprintf(fp, "largest lane difference from the scalar runs: %e\n", max_difference(ensemble.density, expected, n*n*lanes));
+
+	// a buoyancy sweep only exists in the ensemble
+	ensemble.reset();
+	for (int l = 0; l < lanes; l++) {
+		ensemble.viscosity_coef[l] = viscosity[l];
+		ensemble.buoyancy_coef[l] = buoyancy[l];
+	}
+	fprintf(fp, "buoyancy sweep, pressure CG iterations per lane after %d steps:", steps);
+	for (int step = 0; step < steps; step++) {
+		inject_benchmark_sources(ensemble, step);
+		ensemble.update();
+	}
+	for (int l = 0; l < lanes; l++)
+		fprintf(fp, " %d", ensemble.lane_iterations[l]);
+	delete[] expected;
+	fprintf(fp, "\n\n");
+}
+
+// the benchmark scene, per frame rather than per step
+static void inject_frame_sources(CFluidSolver & solver, int frame)
+{
+	int n = solver.n;
+	solver.set_density_source(n/2 + (n-10)*n, 50.*solver.frame_time);
+	if (frame >= 10 && frame < 20)
+		solver.set_velocity_source(n/3 + (n/2)*n, vec2(100., -50.));
+}
+
+static void run_adaptive_case(FILE *fp, const char *name, CFluidSolver & solver, bool adaptive, int substeps, int steps, double* reference)
+{
+	solver.reset();
+	solver.adaptive_step = adaptive;
+	solver.fixed_substeps = substeps;
+	double max_cfl = 0.;
+	CStopWatch timer;
+	long long ns = 0;
+	for (int frame = 0; frame < steps; frame++) {
+		inject_frame_sources(solver, frame);
+		timer.restart();
+		solver.update();
+		ns += timer.nanoseconds();
+		if (solver.last_cfl > max_cfl)
+			max_cfl = solver.last_cfl;
+	}
+	fprintf(fp, "%-20s %10.3f %12.1f %10.2f", name, ns*1e-6/steps, solver.solve_count/solver.simulated_time, max_cfl);
+	if (reference)
+		fprintf(fp, " %12.4f\n", relative_error(solver.density, reference, solver.size));
+	else
+		fprintf(fp, " %12s\n", "-");
+}
+
+void benchmark_adaptive_step(FILE *fp, int steps)
+{
+	CFluidSolver solver;
+	fprintf(fp, "Adaptive time step: n = %d, %d frames of %.2f, CFL target %.1f\n", solver.n, steps, solver.frame_time, solver.cfl_target);
+	fprintf(fp, "%-20s %10s %12s %10s %12s\n", "stepping", "ms/frame", "solves/s", "max CFL", "rel. error");
+
+	run_adaptive_case(fp, "16 sub-steps", solver, false, 16, steps, NULL);
+	double* reference = new double[solver.size];
+	for (int i = 0; i < solver.size; i++)
+		reference[i] = solver.density[i];
+
+	// the fewest fixed sub-steps that keep the stir frames under the target
+	run_adaptive_case(fp, "adaptive", solver, true, 1, steps, reference);
+	int worst = 1;
+	solver.reset();
+	solver.adaptive_step = true;
+	for (int frame = 0; frame < steps; frame++) {
+		inject_frame_sources(solver, frame);
+		solver.update();
+		if (solver.last_substeps > worst)
+			worst = solver.last_substeps;
+	}
+	char name[32];
+	sprintf(name, "%d sub-steps", worst);
+	run_adaptive_case(fp, name, solver, false, worst, steps, reference);
+	run_adaptive_case(fp, "1 step", solver, false, 1, steps, reference);
+	delete[] reference;
+	fprintf(fp, "\n");
+}
+
+static const char *advection_name(int mode)
+{
+	if (mode == ADVECT_MACCORMACK)
+		return "MacCormack";
+	if (mode == ADVECT_BFECC)
+		return "BFECC";
+	return "semi-Lagrangian";
+}
+
+void benchmark_advection(FILE *fp, int steps)
+{
+	fprintf(fp, "Advection: disc carried once around a solid rotation in %d steps\n", steps);
+	fprintf(fp, "%-16s %6s %12s %12s %10s\n", "scheme", "n", "ms/advect", "rel. error", "peak");
+	for (int n = 32; n <= 128; n *= 2)
+		for (int mode = ADVECT_SEMI_LAGRANGIAN; mode <= ADVECT_BFECC; mode++) {
+			CFluidSolver solver(n);
+			solver.advection_mode = mode;
+			double c = 0.5*(n-1);
+			double omega = 2.*3.14159265358979/(steps*solver.h);
+			double* initial = new double[solver.size];
+			for (int j = 0; j < n; j++)
+				for (int i = 0; i < n; i++) {
+					int k = i + j*n;
+					double dx = i - (c + n/4), dy = j - c;
+					solver.velocity[k] = vec2(-omega*(j-c), omega*(i-c));
+					initial[k] = dx*dx + dy*dy < (n/8.)*(n/8.) ? 1. : 0.;
+					solver.diffused_density[k] = initial[k];
+				}
+			// density_advection() reads diffused_density and writes density
+			CStopWatch timer;
+			long long ns = 0;
+			for (int step = 0; step < steps; step++) {
+				timer.restart();
+				solver.density_advection();
+				ns += timer.nanoseconds();
+				for (int k = 0; k < solver.size; k++)
+					solver.diffused_density[k] = solver.density[k];
+			}
+			double peak = 0.;
+			for (int k = 0; k < solver.size; k++)
+				peak = solver.density[k] > peak ? solver.density[k] : peak;
+			fprintf(fp, "%-16s %6d %12.4f %12.4f %10.4f\n", advection_name(mode), n, ns*1e-6/steps,
+				relative_error(solver.density, initial, solver.size), peak);
+			delete[] initial;
+		}
+
+	fprintf(fp, "Full steps on the plume scene, n = 60\n");
+	fprintf(fp, "%-16s %12s\n", "scheme", "ms/step");
+	for (int mode = ADVECT_SEMI_LAGRANGIAN; mode <= ADVECT_BFECC; mode++) {
+		CFluidSolver solver;
+		solver.advection_mode = mode;
+		CStopWatch timer;
+		long long ns = 0;
+		for (int step = 0; step < 100; step++) {
+			inject_benchmark_sources(solver, step);
+			timer.restart();
+			solver.update();
+			ns += timer.nanoseconds();
+		}
+		fprintf(fp, "%-16s %12.3f\n", advection_name(mode), ns*1e-6/100);
+	}
+	fprintf(fp, "\n");
+}
+
+// stands in for drawing a frame: touches every cell until ms have passed
+static double render_frame(CFrameSnapshot & frame, double ms)
+{
+	CStopWatch timer;
+	double sum = 0.;
+	do {
+		for (int k = 0; k < frame.size; k++)
+			sum += frame.density[k];
+	} while (timer.nanoseconds() < ms*1e6);
+	return sum;
+}
+
+void benchmark_simulation_thread(FILE *fp, int frames, double render_ms)
+{
+	fprintf(fp, "Simulation thread: %d frames, %.1f ms render per drawn frame\n", frames, render_ms);
+	fprintf(fp, "%-14s %12s %12s %12s %14s %14s\n", "mode", "steps/s", "drawn/s", "skipped", "latency ms", "max latency");
+
+	// step, copy, draw, all on this thread; a frame is drawn as soon as it exists
+	CFluidSolver solver;
+	CFrameSnapshot snapshot;
+	CStopWatch timer;
+	for (int step = 0; step < frames; step++) {
+		inject_benchmark_sources(solver, step);
+		solver.update();
+		snapshot.copy_from(solver);
+		render_frame(snapshot, render_ms);
+	}
+	double seconds = timer.seconds();
+	fprintf(fp, "%-14s %12.1f %12.1f %12d %14.3f %14.3f\n", "synchronous", frames/seconds, frames/seconds, 0, 0., 0.);
+
+	// the stepper runs flat out, the reader draws whatever is newest
+	solver.reset();
+	CSimulationThread simulation(solver);
+	simulation.frame_interval_ms = 0;
+	// the stepper runs unattended, so the scene gets one burst of sources
+	inject_benchmark_sources(solver, 0);
+	timer.restart();
+	simulation.start();
+	while (simulation.frames_published < frames) {
+		if (simulation.fetch_frame())
+			render_frame(simulation.frame(), render_ms);
+		else
+			std::this_thread::yield();
+	}
+	simulation.stop();
+	seconds = timer.seconds();
+	fprintf(fp, "%-14s %12.1f %12.1f %12lld %14.3f %14.3f\n", "threaded", simulation.frames_published/seconds,
+		simulation.frames_displayed/seconds, simulation.frames_skipped, simulation.latency_ms, simulation.max_latency_ms);
+	fprintf(fp, "\n");
+}
+
+void benchmark_checkpoint(FILE *fp, int n, int steps)
+{
+	const char *paths[2] = {"benchmark_checkpoint_0.tmp", "benchmark_checkpoint_1.tmp"};
+	const int after = 20;
+	fprintf(fp, "Checkpoint: n = %d, saved after %d adaptive frames, compared after %d more\n", n, steps, after);
+	fprintf(fp, "%-12s %10s %10s %10s %10s %12s %12s\n", "operators", "MB", "save ms", "open ms", "restore ms", "restore GB/s", "max diff");
+
+	// a run whose operators have been rescaled many times
+	CFluidSolver solver(n);
+	solver.adaptive_step = true;
+	for (int frame = 0; frame < steps; frame++) {
+		inject_frame_sources(solver, frame);
+		if (frame == steps/2) {
+			solver.viscosity_coef = 0.05;
+			solver.setup_velocity_diffusion_matrix(solver.viscosity_coef);
+		}
+		solver.update();
+	}
+
+	// pass 0 rebuilds the operators from h and viscosity, pass 1 saves them
+	long long save_ns[2];
+	bool saved[2];
+	for (int pass = 0; pass < 2; pass++) {
+		CStopWatch timer;
+		saved[pass] = save_checkpoint(solver, paths[pass], pass == 1);
+		save_ns[pass] = timer.nanoseconds();
+	}
+	for (int frame = steps; frame < steps + after; frame++) {
+		inject_frame_sources(solver, frame);
+		solver.update();
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		const char *name = pass == 1 ? "saved" : "rebuilt";
+		CFluidSolver restored(n);
+		CCheckpointFile file;
+		CStopWatch timer;
+		bool ok = saved[pass] && file.open(paths[pass]);
+		long long open_ns = timer.nanoseconds();
+		timer.restart();
+		ok = ok && file.restore(restored);
+		long long restore_ns = timer.nanoseconds();
+		double mb = ok ? file.header->file_size/1e6 : 0.;
+		file.close();
+		remove(paths[pass]);
+		if (!ok) {
+			fprintf(fp, "%-12s cannot write or restore %s\n", name, paths[pass]);
+			continue;
+		}
+		for (int frame = steps; frame < steps + after; frame++) {
+			inject_frame_sources(restored, frame);
+			restored.update();
+		}
+		fprintf(fp, "%-12s %10.1f %10.3f %10.3f %10.3f %12.2f %12.3e\n", name, mb, save_ns[pass]*1e-6, open_ns*1e-6,
+			restore_ns*1e-6, mb*1e6/restore_ns, max_difference(restored.density, solver.density, solver.size));
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_recorder(FILE *fp, int n, int steps)
+{
+	const char *path = "benchmark_recording.tmp";
+	fprintf(fp, "Frame recorder: n = %d, %d steps, quantum 1e-6, keyframe every 32 frames\n", n, steps);
+	fprintf(fp, "%-18s %10s %12s %8s %8s %8s %12s %10s %12s\n", "recording", "ms/step", "capture us", "frames", "dropped",
+		"ratio", "write ms/fr", "seek ms", "max error");
+
+	CFluidSolver solver(n);
+	CStopWatch timer;
+	for (int step = 0; step < steps; step++) {
+		inject_benchmark_sources(solver, step);
+		solver.update();
+	}
+	fprintf(fp, "%-18s %10.3f\n", "off", timer.nanoseconds()*1e-6/steps);
+
+	const int everys[] = {1, 1, 5};
+	const bool velocities[] = {false, true, true};
+	std::vector<double> originals((size_t) steps*solver.size);
+	double* density = new double[solver.size];
+	vec2* velocity = new vec2[solver.size];
+	for (int c = 0; c < 3; c++) {
+		solver.reset();
+		CFrameRecorder recorder;
+		if (!recorder.open(path, n, everys[c], velocities[c])) {
+			fprintf(fp, "cannot write %s\n", path);
+			break;
+		}
+		long long step_ns = 0, capture_ns = 0;
+		for (int step = 0; step < steps; step++) {
+			inject_benchmark_sources(solver, step);
+			timer.restart();
+			solver.update();
+			long long updated = timer.nanoseconds();
+			recorder.capture(solver);
+			long long captured = timer.nanoseconds();
+			step_ns += captured;
+			capture_ns += captured - updated;
+			for (int i = 0; i < solver.size; i++)
+				originals[(size_t) step*solver.size + i] = solver.density[i];
+		}
+		recorder.close();
+
+		// random access, each read from a fresh position
+		CFrameReader reader;
+		double max_error = 0.;
+		long long seek_ns = 0;
+		int reads = 0;
+		if (reader.open(path) && reader.num_frames() > 0) {
+			unsigned int state = 1;
+			for (reads = 0; reads < 20; reads++) {
+				state = state*1664525u + 1013904223u;
+				int frame = (int) ((state >> 8) % reader.num_frames());
+				timer.restart();
+				reader.read(frame, density, velocity);
+				seek_ns += timer.nanoseconds();
+				double* original = &originals[(size_t) reader.step(frame)*solver.size];
+				double error = max_difference(density, original, solver.size);
+				if (error > max_error)
+					max_error = error;
+			}
+		}
+		reader.close();
+		remove(path);
+
+		char name[32];
+		sprintf(name, "every %d%s", everys[c], velocities[c] ? " +velocity" : "");
+		fprintf(fp, "%-18s %10.3f %12.1f %8lld %8lld %8.1f %12.3f %10.3f %12.3e\n", name, step_ns*1e-6/steps,
+			capture_ns*1e-3/(recorder.frames_captured + recorder.frames_dropped), (long long) recorder.frames_written,
+			(long long) recorder.frames_dropped, (double) recorder.raw_bytes/recorder.bytes_written,
+			recorder.encode_ns*1e-6/recorder.frames_written, reads ? seek_ns*1e-6/reads : 0., max_error);
+	}
+	delete[] density;
+	delete[] velocity;
+	fprintf(fp, "\n");
+}
+
+void benchmark_direct_solve(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Direct solve: %d steps, against BiCG with the default iteration limits\n", steps);
+	fprintf(fp, "%-6s %12s %10s %12s %12s %10s %12s %12s %12s\n", "n", "nnz(L)", "factor ms", "BiCG ms/st", "direct ms/st",
+		"break-even", "BiCG div", "direct div", "max diff");
+	for (int n = 32; n <= max_n; n *= 2) {
+		CFluidSolver iterative(n), direct(n);
+		direct.direct_solve = true;
+
+		// factorize up front, so the stepping below only times the solves
+		CStopWatch timer;
+		bool ok = direct.laplacian_factor.factorize(direct.laplacian, direct.dissection_order) &&
+			direct.diffusion_factor.factorize(direct.diffusion, direct.dissection_order) &&
+			direct.velocity_diffusion_factor.factorize(direct.velocity_diffusion, direct.dissection_order);
+		long long factor_ns = timer.nanoseconds();
+		if (!ok) {
+			fprintf(fp, "%-6d factorization failed\n", n);
+			continue;
+		}
+		long long nnz = direct.laplacian_factor.nnz() + direct.diffusion_factor.nnz() + direct.velocity_diffusion_factor.nnz();
+
+		long long step_ns[2];
+		CFluidSolver* solvers[2] = {&iterative, &direct};
+		for (int s = 0; s < 2; s++) {
+			timer.restart();
+			for (int step = 0; step < steps; step++) {
+				inject_benchmark_sources(*solvers[s], step);
+				solvers[s]->update();
+			}
+			step_ns[s] = timer.nanoseconds() / steps;
+		}
+
+		char break_even[32];
+		if (step_ns[1] < step_ns[0])
+			sprintf(break_even, "%lld", (factor_ns + step_ns[0] - step_ns[1] - 1) / (step_ns[0] - step_ns[1]));
+		else
+			sprintf(break_even, "never");
+		fprintf(fp, "%-6d %12lld %10.2f %12.3f %12.3f %10s %12.3e %12.3e %12.3e\n", n, nnz, factor_ns*1e-6,
+			step_ns[0]*1e-6, step_ns[1]*1e-6, break_even, iterative.divergence_residual(), direct.divergence_residual(),
+			max_difference(direct.density, iterative.density, n*n));
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_splats(FILE *fp, int max_n, int steps)
+{
+	const int num_splats = 16;
+	fprintf(fp, "Source splats: %d Gaussian splats of radius 2 per step, %d steps\n", num_splats, steps);
+	fprintf(fp, "%-6s %10s %14s %14s %10s\n", "n", "touched", "list us/step", "sweep us/step", "speedup");
+	for (int n = 64; n <= max_n; n *= 2) {
+		CFluidSolver solver(n);
+		SSplat splats[num_splats];
+		for (int s = 0; s < num_splats; s++) {
+			SSplat splat = {(double) (7*s*n/num_splats % (n-8) + 4), (double) ((3*s + 1)*n/(3*num_splats) + 4), 2., 1., vec2(1., -1.)};
+			splats[s] = splat;
+		}
+
+		long long list_ns = 0, sweep_ns = 0;
+		int touched = 0;
+		CStopWatch timer;
+		for (int step = 0; step < steps; step++) {
+			timer.restart();
+			solver.add_splats(splats, num_splats);
+			solver.apply_density_sources();
+			solver.apply_velocity_sources();
+			touched = (int) solver.density_source_cells.size();
+			solver.clean_density_source();
+			solver.clean_velocity_source();
+			list_ns += timer.nanoseconds();
+
+			timer.restart();
+			solver.add_splats(splats, num_splats);
+			for (int i = 0; i < solver.size; i++) {
+				solver.density[i] += solver.density_source[i];
+				solver.velocity[i] = solver.velocity[i] + solver.velocity_source[i];
+			}
+			for (int i = 0; i < solver.size; i++) {
+				solver.density_source[i] = 0.;
+				solver.velocity_source[i] = vec2(0., 0.);
+			}
+			sweep_ns += timer.nanoseconds();
+			// the sweep cleared the sources behind the lists' back
+			solver.rebuild_source_cells();
+		}
+		fprintf(fp, "%-6d %10d %14.2f %14.2f %10.1f\n", n, touched,
+			list_ns*1e-3/steps, sweep_ns*1e-3/steps, list_ns > 0 ? (double) sweep_ns/list_ns : 0.);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_arena(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Field arena: %d steps\n", steps);
+	fprintf(fp, "%-6s %10s %14s %14s %6s %12s %12s\n", "n", "fields MB", "normal ms/st", "huge ms/st", "huge", "resize ms", "allocations");
+	for (int n = 128; n <= max_n; n *= 2) {
+		double step_ms[2];
+		bool huge = false;
+		CFluidSolver solver(n);
+		for (int pass = 0; pass < 2; pass++) {
+			solver.arena.huge_pages = pass == 1;
+			solver.resize(n);
+			huge = solver.arena.on_huge_pages();
+			CStopWatch timer;
+			for (int step = 0; step < steps; step++) {
+				inject_benchmark_sources(solver, step);
+				solver.update();
+			}
+			step_ms[pass] = timer.nanoseconds()*1e-6/steps;
+		}
+
+		// down and back up again: the block is kept, so no allocator call
+		long long allocations = solver.arena.allocations;
+		CStopWatch timer;
+		solver.resize(n/2);
+		solver.resize(n);
+		double resize_ms = timer.nanoseconds()*1e-6/2;
+		fprintf(fp, "%-6d %10.1f %14.3f %14.3f %6s %12.2f %12lld\n", n, solver.arena.used()/1e6, step_ms[0], step_ms[1],
+			huge ? "yes" : "no", resize_ms, solver.arena.allocations - allocations);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_fused_velocity(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Fused velocity passes: %d steps\n", steps);
+	fprintf(fp, "%-6s %-10s %12s %12s %12s\n", "n", "passes", "MB/step", "ms/step", "max diff");
+	for (int n = 512; n <= max_n; n *= 2) {
+		//one solver at a time: a 1024^2 solver alone is over 1 GB
+		const char* names[2] = {"separate", "fused"};
+		std::vector<double> reference;
+		for (int s = 0; s < 2; s++) {
+			CFluidSolver solver(n);
+			solver.fused_velocity = s == 1;
+			long long bytes = 0;
+			CStopWatch timer;
+			for (int step = 0; step < steps; step++) {
+				inject_benchmark_sources(solver, step);
+				solver.update();
+				bytes += solver.velocity_bytes;
+			}
+			double ms = timer.nanoseconds()*1e-6/steps;
+			if (s == 0)
+				reference.assign(solver.density, solver.density + solver.size);
+			fprintf(fp, "%-6d %-10s %12.1f %12.3f %12.3e\n", n, names[s], bytes/1e6/steps, ms,
+				max_difference(solver.density, reference.data(), n*n));
+		}
+	}
+	fprintf(fp, "\n");
+}
+
+static void set_threads(int threads)
+{
+#ifdef _OPENMP
+	omp_set_num_threads(threads);
+#endif
+}
+
+static double naive_parallel_dot(double* a, double* b, int count)
+{
+	double sum = 0.;
+	#pragma omp parallel for schedule(static) reduction(+:sum) if (count >= SUM_PARALLEL_MIN)
+	for (int k = 0; k < count; k++)
+		sum += a[k]*b[k];
+	return sum;
+}
+
+void benchmark_reductions(FILE *fp, int max_count, int repeats)
+{
+	int max_threads = 1;
+#ifdef _OPENMP
+	max_threads = omp_get_max_threads();
+#endif
+	fprintf(fp, "Reductions: %d repeats, same bits checked on 1 to 4 threads\n", repeats);
+	fprintf(fp, "%-10s %12s %12s %12s %8s %8s %14s\n", "count", "loop us", "naive us", "blocked us", "naive", "blocked", "dot");
+	for (int count = 1 << 12; count <= max_count; count *= 16) {
+		double* a = new double[count];
+		double* b = new double[count];
+		double* partials = new double[sum_blocks(count)];
+		// terms of mixed sign and magnitude, so the summation order shows
+		for (int k = 0; k < count; k++) {
+			a[k] = sin(0.37*k)*pow(10., k%9 - 4);
+			b[k] = cos(0.11*k) + 0.5;
+		}
+
+		double naive[4], blocked[4];
+		for (int t = 0; t < 4; t++) {
+			set_threads(t + 1);
+			naive[t] = naive_parallel_dot(a, b, count);
+			blocked[t] = blocked_sum(count, partials, [&](int k) {return a[k]*b[k];});
+		}
+		bool naive_same = true, blocked_same = true;
+		for (int t = 1; t < 4; t++) {
+			naive_same = naive_same && memcmp(&naive[t], &naive[0], sizeof(double)) == 0;
+			blocked_same = blocked_same && memcmp(&blocked[t], &blocked[0], sizeof(double)) == 0;
+		}
+
+		set_threads(max_threads);
+		volatile double sink = 0.;	// keeps the plain loop from being dropped; printed as the dot product
+		long long ns[3];
+		for (int method = 0; method < 3; method++) {
+			CStopWatch timer;
+			for (int r = 0; r < repeats; r++) {
+				if (method == 0) {
+					double sum = 0.;
+					for (int k = 0; k < count; k++)
+						sum += a[k]*b[k];
+					sink = sum;
+				} else if (method == 1)
+					sink = naive_parallel_dot(a, b, count);
+				else
+					sink = blocked_sum(count, partials, [&](int k) {return a[k]*b[k];});
+			}
+			ns[method] = timer.nanoseconds();
+		}
+		fprintf(fp, "%-10d %12.2f %12.2f %12.2f %8s %8s %14.8g\n", count, ns[0]*1e-3/repeats, ns[1]*1e-3/repeats, ns[2]*1e-3/repeats,
+			naive_same ? "same" : "differ", blocked_same ? "same" : "differ", (double) sink);
+		delete [] a;
+		delete [] b;
+		delete [] partials;
+	}
+
+	// a whole solver: the same steps on 1 and on 4 threads
+	const int n = 256, steps = 10;
+	fprintf(fp, "%-10s %12s %12s %12s\n", "threads", "ms/step", "p iters", "max diff");
+	CFluidSolver reference(n);
+	for (int threads = 1; threads <= 4; threads *= 4) {
+		set_threads(threads);
+		CFluidSolver solver(n);
+		CFluidSolver & run = threads == 1 ? reference : solver;
+		CStopWatch timer;
+		for (int step = 0; step < steps; step++) {
+			inject_benchmark_sources(run, step);
+			run.update();
+		}
+		fprintf(fp, "%-10d %12.3f %12d %12.3e\n", threads, timer.nanoseconds()*1e-6/steps,
+			run.stats.solves[SOLVE_PRESSURE].iterations, max_difference(run.density, reference.density, n*n));
+	}
+	set_threads(max_threads);
+	fprintf(fp, "\n");
+}
+
+void benchmark_task_graph(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Task graph: %d steps\n", steps);
+	fprintf(fp, "%-6s %12s %12s %12s %12s %8s %12s\n", "n", "seq ms/st", "graph ms/st", "work ms", "critical ms", "bound", "max diff");
+	for (int n = 128; n <= max_n; n *= 2) {
+		CFluidSolver sequential(n), graph(n);
+		sequential.task_graph = false;
+		CFluidSolver* solvers[2] = {&sequential, &graph};
+		double step_ms[2];
+		for (int s = 0; s < 2; s++) {
+			CStopWatch timer;
+			for (int step = 0; step < steps; step++) {
+				inject_benchmark_sources(*solvers[s], step);
+				solvers[s]->update();
+			}
+			step_ms[s] = timer.nanoseconds()*1e-6/steps;
+		}
+		CTaskGraph & tasks = graph.step_graph;
+		fprintf(fp, "%-6d %12.3f %12.3f %12.3f %12.3f %8.2f %12.3e\n", n, step_ms[0], step_ms[1], tasks.work_ns*1e-6,
+			tasks.critical_ns*1e-6, tasks.critical_ns > 0 ? (double) tasks.work_ns/tasks.critical_ns : 0.,
+			max_difference(graph.density, sequential.density, n*n));
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_raster(FILE *fp, int size, int frames)
+{
+	fprintf(fp, "Field raster: %d x %d pixels, %d frames\n", size, size, frames);
+	fprintf(fp, "%-6s %12s %12s %12s %14s\n", "n", "per cell ms", "nearest ms", "bilinear ms", "bilinear Mpx/s");
+	std::vector<uint32_t> cells((size_t) size*size);
+	for (int n = 64; n <= 1024; n *= 4) {
+		CFluidSolver solver(n);
+		for (int step = 0; step < 5; step++) {
+			inject_benchmark_sources(solver, step);
+			solver.update();
+		}
+
+		//the view's old loop, with a pixel block fill standing in for FillSolidRect
+		CStopWatch timer;
+		for (int f = 0; f < frames; f++)
+			for (int i = 0; i < n; i++)
+				for (int j = 0; j < n; j++) {
+					int c = (int) ((1 - solver.density[i+j*n])*255);
+					if (c < 0)
+						c = 0;
+					if (c > 255)
+						c = 255;
+					uint32_t colour = c | c << 8 | c << 16 | 0xff000000;
+					int x0 = i*size/n, x1 = (i+1)*size/n, y0 = j*size/n, y1 = (j+1)*size/n;
+					for (int y = y0; y < y1; y++)
+						for (int x = x0; x < x1; x++)
+							cells[(size_t) y*size + x] = colour;
+				}
+		double cell_ms = timer.nanoseconds()*1e-6/frames;
+
+		double ms[2];
+		for (int b = 0; b < 2; b++) {
+			CFieldRaster raster;
+			raster.bilinear = b == 1;
+			raster.resize(size, size);
+			timer.restart();
+			for (int f = 0; f < frames; f++)
+				raster.draw(solver.density, n);
+			ms[b] = timer.nanoseconds()*1e-6/frames;
+		}
+		fprintf(fp, "%-6d %12.3f %12.3f %12.3f %14.1f\n", n, cell_ms, ms[0], ms[1], ms[1] > 0 ? size*size*1e-3/ms[1] : 0.);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_particles(FILE *fp, int max_particles, int steps)
+{
+	const int n = 256;
+	CFluidSolver solver(n);
+	for (int step = 0; step < 20; step++) {
+		inject_benchmark_sources(solver, step);
+		solver.update();
+	}
+	fprintf(fp, "Particles: n = %d, %d steps through a frozen velocity field\n", n, steps);
+	fprintf(fp, "%-10s %14s %14s %14s %10s\n", "particles", "Euler M/s", "RK2 M/s", "RK2 sorted M/s", "sort ms");
+	for (int number = 1 << 16; number <= max_particles; number *= 4) {
+		double rate[3], sort_ms = 0.;
+		for (int run = 0; run < 3; run++) {
+			CParticleSystem particles;
+			particles.emit_box(1., 1., n - 2., n - 2., number);
+			particles.integrator = run == 0 ? PARTICLE_EULER : PARTICLE_RK2;
+			particles.sort_interval = 0;
+			if (run == 2) {
+				CStopWatch sort_timer;
+				particles.sort_by_cell(n);
+				sort_ms = sort_timer.nanoseconds()*1e-6;
+			}
+			CStopWatch timer;
+			for (int step = 0; step < steps; step++)
+				particles.advect(solver.velocity, n, solver.h);
+			long long ns = timer.nanoseconds();
+			rate[run] = ns > 0 ? particles.particle_steps*1e3/ns : 0.;
+		}
+		fprintf(fp, "%-10d %14.1f %14.1f %14.1f %10.2f\n", number, rate[0], rate[1], rate[2], sort_ms);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_obstacles(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Obstacles: a disk of radius n/8 in the middle, %d steps\n", steps);
+	fprintf(fp, "%-6s %12s %12s %12s %12s %12s %12s %10s\n", "n", "free ms/st", "disk ms/st", "moving ms/st",
+		"redraw ms", "BiCG ms", "masked ms", "mask KB");
+	for (int n = 128; n <= max_n; n *= 2) {
+		CFluidSolver free_flow(n), disk(n), moving(n);
+		double radius = n/8.;
+		disk.obstacles.fill_disk(n/2., n/2., radius, true);
+		moving.obstacle_velocity = vec2(n/4., 0.);
+		CFluidSolver* solvers[3] = {&free_flow, &disk, &moving};
+		double step_ms[3];
+		long long redraw_ns = 0;
+		for (int s = 0; s < 3; s++) {
+			CStopWatch timer;
+			for (int step = 0; step < steps; step++) {
+				inject_benchmark_sources(*solvers[s], step);
+				if (s == 2) {
+					//the disk crosses the middle of the grid at n/4 cells per unit time
+					CStopWatch redraw;
+					double x = n/2. + moving.obstacle_velocity.x*(moving.simulated_time - steps*moving.h/2);
+					moving.obstacles.clear();
+					moving.obstacles.fill_disk(x, n/2., radius, true);
+					redraw_ns += redraw.nanoseconds();
+				}
+				solvers[s]->update();
+			}
+			step_ms[s] = timer.nanoseconds()*1e-6/steps;
+		}
+
+		//one pressure solve of the same iterations through the matrix and the mask
+		double* work[5] = {disk.solve_work[0][0], disk.solve_work[0][1], disk.solve_work[0][2], disk.solve_work[0][3], disk.solve_work[0][4]};
+		double residual;
+		CStopWatch matrix_timer;
+		free_flow.laplacian.solve(free_flow.pressure, free_flow.divergence, 0., free_flow.pressure_iterations);
+		double matrix_ms = matrix_timer.nanoseconds()*1e-6;
+		CStopWatch mask_timer;
+		disk.obstacles.poisson_solve(disk.pressure, disk.divergence, 0., disk.pressure_iterations, work, residual);
+		double mask_ms = mask_timer.nanoseconds()*1e-6;
+
+		fprintf(fp, "%-6d %12.3f %12.3f %12.3f %12.4f %12.3f %12.3f %10.1f\n", n, step_ms[0], step_ms[1], step_ms[2],
+			redraw_ns*1e-6/steps, matrix_ms, mask_ms, n*disk.obstacles.words*8/1024.);
+	}
+	fprintf(fp, "\n");
+}
+
+void benchmark_memory(FILE *fp, int max_n, int steps)
+{
+	fprintf(fp, "Memory: direct_solve, after %d steps; heap columns %s\n", steps,
+		heap_counting() ? "counted" : "not counted (build with FLUID_COUNT_ALLOCATIONS)");
+	fprintf(fp, "%-6s %10s %12s %10s %12s %10s %10s %12s %12s %12s\n", "n", "arena MB", "operators MB", "B/nonzero",
+		"factors MB", "total MB", "B/cell", "ctor allocs", "step allocs", "step peak KB");
+	for (int n = 128; n <= max_n; n *= 2) {
+		SHeapCounts before = heap_counts();
+		CFluidSolver solver(n);
+		SHeapCounts built = heap_counts();
+		solver.direct_solve = true;
+		long long step_allocations = 0, peak_bytes = 0;
+		for (int step = 0; step < steps; step++) {
+			inject_benchmark_sources(solver, step);
+			reset_heap_peak();
+			SHeapCounts start = heap_counts();
+			solver.update();
+			SHeapCounts end = heap_counts();
+			if (step > 0) {
+				step_allocations += end.allocations - start.allocations;
+				if (end.peak_bytes - start.live_bytes > peak_bytes)
+					peak_bytes = end.peak_bytes - start.live_bytes;
+			}
+		}
+
+		CMemoryReport report;
+		report.measure(solver);
+		long long elements = 0;
+		size_t matrix_bytes = 0, factor_bytes = 0;
+		for (int op = 0; op < CMemoryReport::NUM_OPERATORS; op++) {
+			elements += report.operators[op].elements;
+			matrix_bytes += report.operators[op].total();
+			factor_bytes += report.factor_bytes[op];
+		}
+		const double MB = 1./(1 << 20);
+		fprintf(fp, "%-6d %10.2f %12.2f %10.1f %12.2f %10.2f %10.1f %12lld %12lld %12.1f\n", n,
+			report.arena_capacity*MB, matrix_bytes*MB, elements > 0 ? (double) matrix_bytes/elements : 0.,
+			factor_bytes*MB, report.total()*MB, (double) report.total()/solver.size,
+			built.allocations - before.allocations, step_allocations, peak_bytes/1024.);
+	}
+	fprintf(fp, "\n");
+}
+
+bool run_all_benchmarks(FILE *fp, const std::atomic<bool>* cancel)
+{
+	void (*benchmarks[])(FILE*) = {
+		[](FILE* f) {benchmark_projection(f);},
+		[](FILE* f) {benchmark_bricks(f);},
+		[](FILE* f) {benchmark_quadtree(f);},
+		[](FILE* f) {benchmark_3d(f);},
+		[](FILE* f) {benchmark_distributed(f);},
+		[](FILE* f) {benchmark_ensemble(f);},
+		[](FILE* f) {benchmark_adaptive_step(f);},
+		[](FILE* f) {benchmark_advection(f);},
+		[](FILE* f) {benchmark_simulation_thread(f);},
+		[](FILE* f) {benchmark_checkpoint(f);},
+		[](FILE* f) {benchmark_recorder(f);},
+		[](FILE* f) {benchmark_direct_solve(f);},
+		[](FILE* f) {benchmark_splats(f);},
+		[](FILE* f) {benchmark_arena(f);},
+		[](FILE* f) {benchmark_fused_velocity(f, 512);},
+		[](FILE* f) {benchmark_reductions(f);},
+		[](FILE* f) {benchmark_task_graph(f);},
+		[](FILE* f) {benchmark_raster(f);},
+		[](FILE* f) {benchmark_particles(f);},
+		[](FILE* f) {benchmark_obstacles(f);},
+		[](FILE* f) {benchmark_memory(f);},
+	};
+	for (size_t k = 0; k < sizeof(benchmarks)/sizeof(benchmarks[0]); k++) {
+		if (cancel && *cancel)
+			return false;
+		benchmarks[k](fp);
+		fflush(fp);
+	}
+	return true;
+}
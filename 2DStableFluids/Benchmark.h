@@ -0,0 +1,124 @@
+// Benchmark.h: timing and quality comparisons between the solver variants.
+// Each benchmark writes a plain-text table to the given file.
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <atomic>
+#include <stdio.h>
+
+// Divergence residual against compute time for the collocated and MAC solvers,
+// for a range of pressure iteration counts.
+void benchmark_projection(FILE *fp, int steps = 100);
+
+// Step time of the dense solver against the sparse-tile mode on the same scene,
+// with the active tile count and the largest density difference; then sparse
+// mode switched on in the middle of the dense run, which must keep its smoke moving.
+void benchmark_bricks(FILE *fp, int steps = 100);
+
+// Cell count, step time and density error of the adaptive quadtree solver at
+// several refinement thresholds, against the uniform solver at the same
+// finest resolution.
+void benchmark_quadtree(FILE *fp, int steps = 100);
+
+// Throughput of the 3D solver (cell updates per second, full steps) for
+// n = 32, 64, ... up to max_n; 256^3 takes 600 MB.
+void benchmark_3d(FILE *fp, int max_n = 256, int steps = 5);
+
+// Step time of the slab-decomposed solver on 1, 2, 4, ... up to max_ranks
+// worker processes, with the largest density difference against the same
+// scene run in this process. Needs fork(), so it only reports on POSIX.
+void benchmark_distributed(FILE *fp, int n = 128, int max_ranks = 4, int steps = 50);
+
+// Time per step of an 8-lane CEnsembleFluidSolver sweep over viscosity and
+// buoyancy, against 8 separate CFluidSolver objects and 8 separate scalar
+// runs of the same matrix-free algorithm (which the lanes must reproduce).
+void benchmark_ensemble(FILE *fp, int n = 64, int steps = 50);
+
+// Solves per simulated second, time per frame and largest CFL number of
+// CFluidSolver with one step per frame, with fixed sub-steps sized for the
+// worst frame, and with CFL-driven adaptive sub-steps, on a scene with a
+// short strong stir. The density error is against 16 sub-steps per frame.
+void benchmark_adaptive_step(FILE *fp, int steps = 100);
+
+// Detail retention of the advection schemes: a sharp disc carried once
+// around a solid rotation, error and remaining peak against time per
+// advection, for n = 32, 64, 128; then full step times on the plume scene.
+void benchmark_advection(FILE *fp, int steps = 200);
+
+// Frames per second and frame latency of CSimulationThread against stepping
+// and drawing on one thread, with a reader that spends render_ms on every
+// frame it draws.
+void benchmark_simulation_thread(FILE *fp, int frames = 200, double render_ms = 4.);
+
+// Save and restore times of a checkpoint with and without the operators,
+// and the largest density difference between the original run and the
+// restored one after both ran on from the checkpoint.
+void benchmark_checkpoint(FILE *fp, int n = 256, int steps = 50);
+
+// Step time with a CFrameRecorder capturing density (and velocity) every
+// k steps against no recording, the time capture() takes on the stepping
+// thread, compression ratio, writer time per frame, and the time and
+// quantization error of reading random frames back.
+void benchmark_recorder(FILE *fp, int n = 128, int steps = 300);
+
+// Factorization time and fill of the cached Cholesky factors, step time
+// with them against BiCG, and the number of steps after which the
+// factorization has paid for itself, for n = 32, 64, ... up to max_n. The
+// divergence residuals show what the exact pressure solve buys as well.
+void benchmark_direct_solve(FILE *fp, int max_n = 256, int steps = 50);
+
+// Cost per step of adding, applying and clearing 16 Gaussian splats through
+// the touched-cell lists, against applying and clearing the same sources by
+// a sweep over the whole grid, for n = 64, 128, ... up to max_n.
+void benchmark_splats(FILE *fp, int max_n = 512, int steps = 200);
+
+// Step time with the solver fields on normal and on huge pages, and the time
+// and allocator calls of resizing the solver down and back up, for
+// n = 128, 256, ... up to max_n.
+void benchmark_arena(FILE *fp, int max_n = 512, int steps = 50);
+
+// Field bytes moved by the velocity passes per step and step time with the
+// fused velocity passes against the separate ones, for n = 512 up to max_n.
+// Both do the same solves, so the step time difference is the passes.
+// The solvers run one after the other; n = 1024 needs about 1.4 GB
+// (fluidsim -bench-fused 1024), so run_all_benchmarks() stops at 512.
+void benchmark_fused_velocity(FILE *fp, int max_n = 1024, int steps = 10);
+
+// Time per dot product of a plain loop, an OpenMP reduction(+) and
+// blocked_sum(), for 4K, 64K, ... up to max_count terms, and whether each
+// gives the same bits on 1 to 4 threads. The solve columns run the pressure
+// solve of an n = 256 grid on 1 and 4 threads.
+void benchmark_reductions(FILE *fp, int max_count = 1 << 20, int repeats = 100);
+
+// Step time in sequence and as a task graph, for n = 128, 256, ... up to
+// max_n, with the graph's work (the sum of its task times) and critical
+// path: work / critical path is the most any number of threads could gain.
+void benchmark_task_graph(FILE *fp, int max_n = 512, int steps = 20);
+
+// Time per frame of shading an n x n density field into a size x size
+// image: the view's old way (clamp every cell and fill its block of pixels)
+// against CFieldRaster nearest and bilinear, for n = 64, 256 and 1024.
+void benchmark_raster(FILE *fp, int size = 600, int frames = 20);
+
+// Particles advected per second through the flow of an n = 256 grid, for
+// 64K, 256K, ... up to max_particles tracers: Euler and RK2 in emission
+// order, and RK2 sorted by tile, with the time of one sort.
+void benchmark_particles(FILE *fp, int max_particles = 1 << 20, int steps = 20);
+
+// Step time of the free flow, around a disk of solid cells and around a
+// disk that is redrawn further along at every step, for n = 128, 256, ...
+// up to max_n; then the time of redrawing it, and of one pressure solve
+// through the laplacian matrix and through the obstacle mask.
+void benchmark_obstacles(FILE *fp, int max_n = 512, int steps = 20);
+
+// Memory of a direct_solve solver for n = 128, 256, ... up to max_n, after
+// steps updates (see CMemoryReport): the arena, the three operators' linked
+// elements and their bytes per nonzero, the Cholesky factors and the total.
+// With FLUID_COUNT_ALLOCATIONS also the heap allocations of the constructor
+// and of the updates after the first, and the most heap one update took.
+void benchmark_memory(FILE *fp, int max_n = 512, int steps = 10);
+
+// Run every benchmark above. Once *cancel is set no further benchmark is
+// started (the one running finishes); false if that cut the run short.
+bool run_all_benchmarks(FILE *fp, const std::atomic<bool>* cancel = NULL);
@@ -0,0 +1,41 @@
+// BlockedSum.h: sums that come out bit for bit the same on any number of threads
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#define SUM_BLOCK 1024				// terms per block, fixed: never derived from the thread count
+#define SUM_PARALLEL_MIN (16*SUM_BLOCK)	// shorter sums stay on one thread
+
+inline int sum_blocks(int count) {return (count + SUM_BLOCK - 1) / SUM_BLOCK;}
+
+// Adds up the first count of partials by a pairwise tree whose shape only
+// depends on count. Overwrites partials.
+inline double tree_sum(double* partials, int count)
+{
+	if (count == 0)
+		return 0.;
+	for (int stride = 1; stride < count; stride *= 2)
+		for (int b = 0; b + stride < count; b += 2*stride)
+			partials[b] += partials[b + stride];
+	return partials[0];
+}
+
+// Sum of term(k) for k = 0 .. count-1, where term may also update vectors
+// at k. The range is cut into blocks of SUM_BLOCK; every block is summed in
+// order by one thread, and the block sums go through tree_sum(), so the
+// result does not depend on how OpenMP (if enabled) shares the blocks out.
+// partials needs sum_blocks(count) doubles.
+template <class Term>
+double blocked_sum(int count, double* partials, Term term)
+{
+	int blocks = sum_blocks(count);
+	#pragma omp parallel for schedule(static) if (count >= SUM_PARALLEL_MIN)
+	for (int b = 0; b < blocks; b++) {
+		int end = (b + 1)*SUM_BLOCK < count ? (b + 1)*SUM_BLOCK : count;
+		double sum = 0.;
+		for (int k = b*SUM_BLOCK; k < end; k++)
+			sum += term(k);
+		partials[b] = sum;
+	}
+	return tree_sum(partials, blocks);
+}
@@ -0,0 +1,72 @@
+#include "FluidSolver.h"
+
+void CBrickGrid::update_activity(double* density, vec2* velocity, double** scalars, int num_scalars, vec2** vectors, int num_vectors)
+{
+	if (!sparse)
+		return;
+
+	for (int t = 0; t < nt*nt; t++)
+		tile_occupied[t] = 0;
+
+	double max_speed2 = 0.;
+	for (int k = 0; k < num_active_cells; k++) {
+		vec2 & vel = velocity[active_cells[k]];
+		double speed2 = vel.x*vel.x + vel.y*vel.y;
+		if (speed2 > max_speed2)
+			max_speed2 = speed2;
+	}
+	double speed_threshold2 = velocity_fraction*velocity_fraction*max_speed2;
+	if (speed_threshold2 < threshold*threshold)
+		speed_threshold2 = threshold*threshold;
+
+	for (int k = 0; k < num_active; k++) {
+		int t = active_tiles[k];
+		int i0, i1, j0, j1;
+		bounds(t, i0, i1, j0, j1);
+		bool occupied = false;
+		for (int j = j0; j < j1 && !occupied; j++)
+			for (int i = i0; i < i1; i++) {
+				int index = i + j*n;
+				vec2 & vel = velocity[index];
+				if (fabs(density[index]) > threshold || vel.x*vel.x + vel.y*vel.y > speed_threshold2) {
+					occupied = true;
+					break;
+				}
+			}
+		if (occupied) {
+			// the tile and its 8 neighbours stay active
+			int ti = t % nt, tj = t / nt;
+			for (int dj = -1; dj <= 1; dj++)
+				for (int di = -1; di <= 1; di++)
+					if (ti+di >= 0 && ti+di < nt && tj+dj >= 0 && tj+dj < nt)
+						tile_occupied[ti+di + (tj+dj)*nt] = 1;
+		}
+	}
+
+	// deactivate the tiles that are no longer needed
+	for (int k = 0; k < num_active; k++) {
+		int t = active_tiles[k];
+		if (tile_occupied[t])
+			continue;
+		int i0, i1, j0, j1;
+		bounds(t, i0, i1, j0, j1);
+		for (int j = j0; j < j1; j++)
+			for (int i = i0; i < i1; i++) {
+				int index = i + j*n;
+				density[index] = 0.;
+				velocity[index] = vec2(0.,0.);
+				for (int s = 0; s < num_scalars; s++)
+					scalars[s][index] = 0.;
+				for (int s = 0; s < num_vectors; s++)
+					vectors[s][index] = vec2(0.,0.);
+			}
+		set_tile(t, 0);
+	}
+
+	// newly activated neighbours
+	for (int t = 0; t < nt*nt; t++)
+		if (tile_occupied[t] && !tile_active[t])
+			set_tile(t, 1);
+
+	rebuild_lists();
+}
@@ -0,0 +1,174 @@
+// BrickGrid.h: tile (brick) activity tracking for CFluidSolver
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <math.h>
+#include "FieldArena.h"
+
+class vec2;
+
+#define BRICK_SIZE 8
+
+// The n x n grid is split into BRICK_SIZE x BRICK_SIZE tiles. Solver stages
+// only visit the cells of active tiles, so their cost follows the area the
+// smoke and the flow actually occupy.
+//
+// A tile stays active while any of its cells holds density above threshold,
+// or a velocity above velocity_fraction of the largest speed in the active
+// set (the pressure solve leaves a small velocity everywhere, so an absolute
+// velocity threshold would activate the whole domain). The tiles around an
+// occupied tile are activated too so the flow can move into them during the
+// next step. When a tile goes inactive its cells are
+// zeroed, so the solver can rely on everything outside the active set being 0.
+//
+// With sparse == false every tile is permanently active and the solver
+// behaves exactly like the dense one.
+class CBrickGrid
+{
+public:
+	int n;				// cells along one side
+	int nt;				// tiles along one side
+	bool sparse;
+	double threshold;			// densities below this count as empty
+	double velocity_fraction;	// relative speed below which a cell counts as still
+
+	unsigned char* tile_active;		// nt*nt flags
+	unsigned char* tile_occupied;	// scratch for update_activity
+	int* active_tiles;				// list of active tile indices
+	int num_active;
+
+	unsigned char* cell_mask;		// n*n flags, 1 for cells in active tiles
+	int* active_cells;				// list of cells in active tiles
+	int num_active_cells;
+
+public:
+	CBrickGrid()
+	{
+		n = nt = 0;
+		tile_active = tile_occupied = cell_mask = NULL;
+		active_tiles = active_cells = NULL;
+		num_active = num_active_cells = 0;
+		sparse = false;
+		threshold = 1e-4;
+		velocity_fraction = 0.05;
+	}
+
+	// The arrays live in the owner's arena: add them to its layout for an
+	// n x n grid, and call reset() once the layout is committed.
+	void add_fields(CFieldArena & arena, int grid_n)
+	{
+		n = grid_n;
+		nt = (n + BRICK_SIZE - 1) / BRICK_SIZE;
+		arena.add(tile_active, nt*nt);
+		arena.add(tile_occupied, nt*nt);
+		arena.add(active_tiles, nt*nt);
+		arena.add(cell_mask, n*n);
+		arena.add(active_cells, n*n);
+	}
+
+	// cell range [i0,i1) x [j0,j1) covered by tile t
+	void bounds(int t, int & i0, int & i1, int & j0, int & j1)
+	{
+		i0 = (t % nt) * BRICK_SIZE;
+		j0 = (t / nt) * BRICK_SIZE;
+		i1 = i0 + BRICK_SIZE < n ? i0 + BRICK_SIZE : n;
+		j1 = j0 + BRICK_SIZE < n ? j0 + BRICK_SIZE : n;
+	}
+
+	// same range, clipped to the interior cells 1..n-2
+	void interior_bounds(int t, int & i0, int & i1, int & j0, int & j1)
+	{
+		bounds(t, i0, i1, j0, j1);
+		if (i0 < 1) i0 = 1;
+		if (j0 < 1) j0 = 1;
+		if (i1 > n-1) i1 = n-1;
+		if (j1 > n-1) j1 = n-1;
+	}
+
+	int tile_of(int index) {return (index % n) / BRICK_SIZE + ((index / n) / BRICK_SIZE) * nt;};
+	bool all_active() {return num_active == nt*nt;};
+
+	void activate_all()
+	{
+		for (int t = 0; t < nt*nt; t++)
+			tile_active[t] = 1;
+		for (int i = 0; i < n*n; i++)
+			cell_mask[i] = 1;
+		rebuild_lists();
+	}
+
+	// In sparse mode nothing is active until a source touches it
+	void reset()
+	{
+		if (!sparse) {
+			activate_all();
+			return;
+		}
+		for (int t = 0; t < nt*nt; t++)
+			tile_active[t] = 0;
+		for (int i = 0; i < n*n; i++)
+			cell_mask[i] = 0;
+		rebuild_lists();
+	}
+
+	// Restore an active set saved from tile_active (a checkpoint)
+	void set_active_tiles(const unsigned char* flags)
+	{
+		for (int t = 0; t < nt*nt; t++)
+			set_tile(t, flags[t] ? 1 : 0);
+		rebuild_lists();
+	}
+
+	void set_sparse(bool enable)
+	{
+		sparse = enable;
+		activate_all();
+	}
+
+	// Called when a source is written into a cell, so its tile joins the active set
+	void touch(int index)
+	{
+		int t = tile_of(index);
+		if (tile_active[t])
+			return;
+		set_tile(t, 1);
+		active_tiles[num_active++] = t;
+		append_cells(t);
+	}
+
+	// Re-evaluate the active set after a step. Every field passed in is cleared
+	// over the tiles that go inactive.
+	void update_activity(double* density, vec2* velocity, double** scalars, int num_scalars, vec2** vectors, int num_vectors);
+
+protected:
+	void set_tile(int t, unsigned char state)
+	{
+		tile_active[t] = state;
+		int i0, i1, j0, j1;
+		bounds(t, i0, i1, j0, j1);
+		for (int j = j0; j < j1; j++)
+			for (int i = i0; i < i1; i++)
+				cell_mask[i + j*n] = state;
+	}
+
+	void append_cells(int t)
+	{
+		int i0, i1, j0, j1;
+		bounds(t, i0, i1, j0, j1);
+		for (int j = j0; j < j1; j++)
+			for (int i = i0; i < i1; i++)
+				active_cells[num_active_cells++] = i + j*n;
+	}
+
+	void rebuild_lists()
+	{
+		num_active = 0;
+		num_active_cells = 0;
+		for (int t = 0; t < nt*nt; t++)
+			if (tile_active[t]) {
+				active_tiles[num_active++] = t;
+				append_cells(t);
+			}
+	}
+};
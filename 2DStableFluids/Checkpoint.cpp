@@ -0,0 +1,351 @@
+#include "Checkpoint.h"
+#include "FluidSolver.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char checkpoint_magic[8] = {'S','F','L','U','I','D','C','K'};
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+// position of e among the elements of its row, counted over all rows
+static int element_slot(CSparseMatrix & m, const std::vector<int> & row_start, CMatrixElement* e)
+{
+	int k = row_start[e->i];
+	for (CMatrixElement* x = m.rowList[e->i]; x != e; x = x->rowNext)
+		k++;
+	return k;
+}
+
+// set1Value puts every new element at the head of its row and of its column,
+// so the lists of m were produced by an insertion order in which every
+// element comes after its rowNext and its colNext. Reinserting in any such
+// order gives back the same lists, and with them the same summation order in
+// multMatVec and multTransMatVec.
+static void insertion_order(CSparseMatrix & m, std::vector<CMatrixElement*> & order)
+{
+	std::vector<int> row_start(m.numRows + 1, 0);
+	for (int r = 0; r < m.numRows; r++) {
+		int count = 0;
+		for (CMatrixElement* e = m.rowList[r]; e != NULL; e = e->rowNext)
+			count++;
+		row_start[r+1] = row_start[r] + count;
+	}
+	std::vector<unsigned char> done(row_start[m.numRows], 0);
+	std::vector<CMatrixElement*> stack;
+	order.clear();
+	order.reserve(row_start[m.numRows]);
+	for (int r = 0; r < m.numRows; r++)
+		for (CMatrixElement* e = m.rowList[r]; e != NULL; e = e->rowNext) {
+			stack.push_back(e);
+			while (!stack.empty()) {
+				CMatrixElement* t = stack.back();
+				int k = element_slot(m, row_start, t);
+				if (done[k])
+					stack.pop_back();
+				else if (t->rowNext && !done[element_slot(m, row_start, t->rowNext)])
+					stack.push_back(t->rowNext);
+				else if (t->colNext && !done[element_slot(m, row_start, t->colNext)])
+					stack.push_back(t->colNext);
+				else {
+					done[k] = 1;
+					order.push_back(t);
+					stack.pop_back();
+				}
+			}
+		}
+}
+
+bool save_checkpoint(CFluidSolver & solver, const char* path, bool with_operators)
+{
+	SCheckpointHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.byte_order = 0x01020304;
+	header.n = solver.n;
+	header.h = solver.h;
+	header.frame_time = solver.frame_time;
+	header.viscosity_coef = solver.viscosity_coef;
+	header.cfl_target = solver.cfl_target;
+	header.simulated_time = solver.simulated_time;
+	header.obstacle_velocity[0] = solver.obstacle_velocity.x;
+	header.obstacle_velocity[1] = solver.obstacle_velocity.y;
+	header.solve_count = solver.solve_count;
+	header.pressure_iterations = solver.pressure_iterations;
+	header.advection_mode = solver.advection_mode;
+	header.adaptive_step = solver.adaptive_step;
+	header.max_substeps = solver.max_substeps;
+	header.fixed_substeps = solver.fixed_substeps;
+	header.sparse = solver.bricks.sparse;
+
+	// the sections as (id, element size, count, source)
+	const void* sources[CHECKPOINT_MAX_SECTIONS];
+	int nt = solver.bricks.nt;
+	int num = 0;
+	SCheckpointSection* s = header.sections;
+	s[num].id = CKPT_DENSITY; s[num].element_size = sizeof(double); s[num].count = solver.size; sources[num++] = solver.density;
+	s[num].id = CKPT_VELOCITY; s[num].element_size = sizeof(vec2); s[num].count = solver.size; sources[num++] = solver.velocity;
+	s[num].id = CKPT_PRESSURE; s[num].element_size = sizeof(double); s[num].count = solver.size; sources[num++] = solver.pressure;
+	s[num].id = CKPT_DENSITY_SOURCE; s[num].element_size = sizeof(double); s[num].count = solver.size; sources[num++] = solver.density_source;
+	s[num].id = CKPT_VELOCITY_SOURCE; s[num].element_size = sizeof(vec2); s[num].count = solver.size; sources[num++] = solver.velocity_source;
+	s[num].id = CKPT_DIFFUSED_DENSITY; s[num].element_size = sizeof(double); s[num].count = solver.size; sources[num++] = solver.diffused_density;
+	s[num].id = CKPT_ACTIVE_TILES; s[num].element_size = 1; s[num].count = nt*nt; sources[num++] = solver.bricks.tile_active;
+	s[num].id = CKPT_OBSTACLES; s[num].element_size = sizeof(uint64_t); s[num].count = solver.n*solver.obstacles.words; sources[num++] = solver.obstacles.bits;
+
+	CSparseMatrix* operators[CKPT_NUM_OPERATORS] = {&solver.laplacian, &solver.diffusion, &solver.velocity_diffusion};
+	std::vector<int> rows[CKPT_NUM_OPERATORS], cols[CKPT_NUM_OPERATORS];
+	std::vector<double> values[CKPT_NUM_OPERATORS];
+	if (with_operators)
+		for (int m = 0; m < CKPT_NUM_OPERATORS; m++) {
+			std::vector<CMatrixElement*> order;
+			insertion_order(*operators[m], order);
+			for (size_t k = 0; k < order.size(); k++) {
+				rows[m].push_back(order[k]->i);
+				cols[m].push_back(order[k]->j);
+				values[m].push_back(order[k]->value);
+			}
+			int first = CKPT_OPERATORS + 4*m;
+			s[num].id = first; s[num].element_size = sizeof(int); s[num].count = order.size(); sources[num++] = rows[m].data();
+			s[num].id = first+1; s[num].element_size = sizeof(int); s[num].count = order.size(); sources[num++] = cols[m].data();
+			s[num].id = first+2; s[num].element_size = sizeof(double); s[num].count = order.size(); sources[num++] = values[m].data();
+			s[num].id = first+3; s[num].element_size = sizeof(double); s[num].count = operators[m]->numRows; sources[num++] = operators[m]->diagonal;
+		}
+	header.num_sections = num;
+
+	uint64_t offset = align_up(sizeof(SCheckpointHeader));
+	for (int k = 0; k < num; k++) {
+		s[k].offset = offset;
+		offset = align_up(offset + s[k].count*s[k].element_size);
+	}
+	header.file_size = offset;
+
+	// the whole image in memory, then one write
+	char* image = new char[(size_t) header.file_size];
+	memset(image, 0, (size_t) header.file_size);
+	memcpy(image, &header, sizeof(header));
+	for (int k = 0; k < num; k++)
+		memcpy(image + s[k].offset, sources[k], (size_t) (s[k].count*s[k].element_size));
+
+	bool ok = false;
+	FILE* fp = fopen(path, "wb");
+	if (fp) {
+		setvbuf(fp, NULL, _IONBF, 0);
+		ok = fwrite(image, 1, (size_t) header.file_size, fp) == header.file_size;
+		ok = fclose(fp) == 0 && ok;
+	}
+	delete[] image;
+	return ok;
+}
+
+CCheckpointFile::CCheckpointFile():
+header(NULL), base(NULL), bytes(0)
+{
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = NULL;
+#endif
+}
+
+CCheckpointFile::~CCheckpointFile(void)
+{
+	close();
+}
+
+bool CCheckpointFile::open(const char* path)
+{
+	close();
+#ifdef _WIN32
+	file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart < (LONGLONG) sizeof(SCheckpointHeader)) {
+		close();
+		return false;
+	}
+	bytes = (size_t) file_size.QuadPart;
+	mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_handle)
+		base = (const char*) MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+	if (!base) {
+		close();
+		return false;
+	}
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(SCheckpointHeader)) {
+		::close(fd);
+		return false;
+	}
+	bytes = (size_t) st.st_size;
+	void* mapped = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		bytes = 0;
+		return false;
+	}
+	base = (const char*) mapped;
+#endif
+
+	// everything restore() relies on is checked here, once
+	const SCheckpointHeader* h = (const SCheckpointHeader*) base;
+	bool ok = memcmp(h->magic, checkpoint_magic, sizeof(h->magic)) == 0 && h->version == CHECKPOINT_VERSION &&
+		h->byte_order == 0x01020304 && h->file_size == bytes && h->n > 0 &&
+		h->num_sections >= 0 && h->num_sections <= CHECKPOINT_MAX_SECTIONS;
+	for (int k = 0; ok && k < h->num_sections; k++) {
+		const SCheckpointSection & s = h->sections[k];
+		ok = s.offset % CHECKPOINT_ALIGN == 0 && s.element_size > 0 && s.offset <= bytes &&
+			s.count <= (bytes - s.offset)/s.element_size;
+	}
+	if (!ok) {
+		close();
+		return false;
+	}
+	header = h;
+	return true;
+}
+
+void CCheckpointFile::close()
+{
+#ifdef _WIN32
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	mapping_handle = NULL;
+	file_handle = INVALID_HANDLE_VALUE;
+#else
+	if (base)
+		munmap((void*) base, bytes);
+#endif
+	base = NULL;
+	bytes = 0;
+	header = NULL;
+}
+
+const void* CCheckpointFile::section(int id, uint64_t* count) const
+{
+	if (count)
+		*count = 0;
+	if (!header)
+		return NULL;
+	for (int k = 0; k < header->num_sections; k++)
+		if ((int) header->sections[k].id == id) {
+			if (count)
+				*count = header->sections[k].count;
+			return base + header->sections[k].offset;
+		}
+	return NULL;
+}
+
+void CCheckpointFile::restore_operator(CSparseMatrix & m, int first) const
+{
+	uint64_t nnz, num_diagonal;
+	const int* rows = (const int*) section(first, &nnz);
+	const int* cols = (const int*) section(first+1);
+	const double* values = (const double*) section(first+2);
+	const double* diagonal = (const double*) section(first+3, &num_diagonal);
+	m.setDimensions(m.numRows, m.numCols);
+	for (uint64_t k = 0; k < nnz; k++)
+		m.set1Value(rows[k], cols[k], values[k]);
+	memcpy(m.diagonal, diagonal, (size_t) num_diagonal*sizeof(double));
+}
+
+bool CCheckpointFile::restore(CFluidSolver & solver) const
+{
+	if (!header || header->n != solver.n)
+		return false;
+
+	// every field section must be there with the right size before anything is touched
+	int nt = solver.bricks.nt;
+	const int field_ids[] = {CKPT_DENSITY, CKPT_VELOCITY, CKPT_PRESSURE, CKPT_DENSITY_SOURCE, CKPT_VELOCITY_SOURCE,
+		CKPT_DIFFUSED_DENSITY, CKPT_ACTIVE_TILES, CKPT_OBSTACLES};
+	const uint64_t field_counts[] = {(uint64_t) solver.size, (uint64_t) solver.size, (uint64_t) solver.size,
+		(uint64_t) solver.size, (uint64_t) solver.size, (uint64_t) solver.size, (uint64_t) (nt*nt),
+		(uint64_t) solver.n*solver.obstacles.words};
+	for (int f = 0; f < 8; f++) {
+		uint64_t count;
+		if (!section(field_ids[f], &count) || count != field_counts[f])
+			return false;
+	}
+	bool operators = has_operators();
+	CSparseMatrix* matrices[CKPT_NUM_OPERATORS] = {&solver.laplacian, &solver.diffusion, &solver.velocity_diffusion};
+	for (int m = 0; operators && m < CKPT_NUM_OPERATORS; m++) {
+		uint64_t nnz, num_cols, num_values, num_diagonal;
+		int first = CKPT_OPERATORS + 4*m;
+		const int* rows = (const int*) section(first, &nnz);
+		const int* cols = (const int*) section(first+1, &num_cols);
+		const void* values = section(first+2, &num_values);
+		if (!rows || !cols || !values || num_cols != nnz || num_values != nnz
+			|| !section(first+3, &num_diagonal) || num_diagonal != (uint64_t) solver.size)
+			return false;
+		for (uint64_t k = 0; k < nnz; k++)
+			if (rows[k] < 0 || rows[k] >= solver.size || cols[k] < 0 || cols[k] >= solver.size)
+				return false;
+	}
+
+	memcpy(solver.density, section(CKPT_DENSITY), solver.size*sizeof(double));
+	const double* velocity = (const double*) section(CKPT_VELOCITY);
+	for (int k = 0; k < solver.size; k++)
+		solver.velocity[k] = vec2(velocity[2*k], velocity[2*k+1]);
+	memcpy(solver.pressure, section(CKPT_PRESSURE), solver.size*sizeof(double));
+	memcpy(solver.density_source, section(CKPT_DENSITY_SOURCE), solver.size*sizeof(double));
+	const double* velocity_source = (const double*) section(CKPT_VELOCITY_SOURCE);
+	for (int k = 0; k < solver.size; k++)
+		solver.velocity_source[k] = vec2(velocity_source[2*k], velocity_source[2*k+1]);
+	memcpy(solver.diffused_density, section(CKPT_DIFFUSED_DENSITY), solver.size*sizeof(double));
+	solver.rebuild_source_cells();
+	memcpy(solver.obstacles.bits, section(CKPT_OBSTACLES), (size_t) solver.n*solver.obstacles.words*sizeof(uint64_t));
+	solver.obstacles.recount();
+
+	double viscosity = solver.viscosity_coef;
+	solver.frame_time = header->frame_time;
+	solver.viscosity_coef = header->viscosity_coef;
+	solver.cfl_target = header->cfl_target;
+	solver.simulated_time = header->simulated_time;
+	solver.obstacle_velocity = vec2(header->obstacle_velocity[0], header->obstacle_velocity[1]);
+	solver.solve_count = header->solve_count;
+	solver.pressure_iterations = header->pressure_iterations;
+	solver.advection_mode = header->advection_mode;
+	solver.adaptive_step = header->adaptive_step != 0;
+	solver.max_substeps = header->max_substeps;
+	solver.fixed_substeps = header->fixed_substeps;
+	solver.stats.reset();
+
+	if (operators) {
+		for (int m = 0; m < CKPT_NUM_OPERATORS; m++)
+			restore_operator(*matrices[m], CKPT_OPERATORS + 4*m);
+		solver.h = header->h;
+		solver.invalidate_factors();
+	} else {
+		//the same operators a solver gets when it is set up at this h and
+		//viscosity; a solver that already is keeps its own
+		if (solver.h != header->h)
+			solver.set_time_step(header->h);
+		if (viscosity != solver.viscosity_coef)
+			solver.setup_velocity_diffusion_matrix(solver.viscosity_coef);
+	}
+
+	solver.bricks.set_sparse(header->sparse != 0);
+	if (header->sparse)
+		solver.bricks.set_active_tiles((const unsigned char*) section(CKPT_ACTIVE_TILES));
+	return true;
+}
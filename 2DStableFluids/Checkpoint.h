@@ -0,0 +1,106 @@
+// Checkpoint.h: binary checkpoint and restart of the CFluidSolver state
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class CFluidSolver;
+class CSparseMatrix;
+
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_ALIGN 64
+#define CHECKPOINT_MAX_SECTIONS 24
+
+// section ids; every operator has four sections (row, column and value of
+// each element in insertion order, then the diagonal)
+enum {
+	CKPT_DENSITY,
+	CKPT_VELOCITY,
+	CKPT_PRESSURE,
+	CKPT_DENSITY_SOURCE,
+	CKPT_VELOCITY_SOURCE,
+	CKPT_DIFFUSED_DENSITY,	// the starting guess of the next density solve
+	CKPT_ACTIVE_TILES,
+	CKPT_OBSTACLES,		// the words of CObstacleMask
+	CKPT_OPERATORS,		// laplacian, diffusion, velocity_diffusion
+	CKPT_NUM_OPERATORS = 3
+};
+
+struct SCheckpointSection
+{
+	uint32_t id;
+	uint32_t element_size;
+	uint64_t offset;	// from the start of the file, a multiple of CHECKPOINT_ALIGN
+	uint64_t count;
+};
+
+// The file is this header followed by the sections, each starting on a
+// CHECKPOINT_ALIGN boundary. Every field has a fixed size, so a mapped file
+// is used in place: the header is read through a pointer and the arrays are
+// copied straight into the solver. The byte order is that of the writer;
+// a file from a machine of the other order is rejected.
+struct SCheckpointHeader
+{
+	char magic[8];			// "SFLUIDCK"
+	uint32_t version;
+	uint32_t byte_order;	// 0x01020304 as the writer stored it
+	uint64_t file_size;
+	int32_t n;
+	int32_t num_sections;
+
+	// solver parameters
+	double h;
+	double frame_time;
+	double viscosity_coef;
+	double cfl_target;
+	double simulated_time;
+	double obstacle_velocity[2];
+	int64_t solve_count;
+	int32_t pressure_iterations;
+	int32_t advection_mode;
+	int32_t adaptive_step;
+	int32_t max_substeps;
+	int32_t fixed_substeps;
+	int32_t sparse;
+
+	SCheckpointSection sections[CHECKPOINT_MAX_SECTIONS];
+};
+
+// Write the whole state of solver to path in one write. With operators the
+// three matrices are stored too, so a restart continues bit for bit even
+// after the time step or the viscosity changed many times; without them
+// the restore rebuilds the matrices from h and viscosity_coef.
+bool save_checkpoint(CFluidSolver & solver, const char* path, bool with_operators = false);
+
+// A checkpoint file mapped read-only into memory
+class CCheckpointFile
+{
+public:
+	const SCheckpointHeader* header;	// NULL until open() succeeds
+
+	CCheckpointFile();
+	~CCheckpointFile(void);
+
+	// map the file and check the header and the section table
+	bool open(const char* path);
+	void close();
+
+	// start of a section in the mapping, or NULL (and count 0) if the file does not have it
+	const void* section(int id, uint64_t* count = NULL) const;
+	bool has_operators() const {return section(CKPT_OPERATORS) != NULL;};
+
+	// copy the state into solver, which must have the same n
+	bool restore(CFluidSolver & solver) const;
+
+protected:
+	const char* base;
+	size_t bytes;
+#ifdef _WIN32
+	void* file_handle;
+	void* mapping_handle;
+#endif
+
+	void restore_operator(CSparseMatrix & m, int first) const;
+};
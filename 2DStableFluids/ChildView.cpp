@@ -4,6 +4,8 @@
 #include "stdafx.h"
 #include "2DStableFluids.h"
 #include "ChildView.h"
+#include "Benchmark.h"
+#include "Checkpoint.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -12,13 +14,23 @@
 
 // CChildView
 
-CChildView::CChildView()
+CChildView::CChildView():
+simulation(fluidSolver)
 {
 	windowSize = 600;
 	dx = windowSize/fluidSolver.n;
 	showDensity = true;
 	showVelocity = false;
 	showGrid = false;
+	shading = COLORMAP_GREY;
+	raster.bgra = true;
+	raster.bilinear = false;
+	showParticles = false;
+	particle_frame = -1;
+	showObstacle = false;
+	benchmarking = false;
+	benchmark_cancel = false;
+	resume_after_benchmark = false;
 	m_timer = 0;
 	leftButton = false;
 	rightButton = false;
@@ -26,6 +38,10 @@ CChildView::CChildView()
 
 CChildView::~CChildView()
 {
+	//the benchmark running finishes, the rest are skipped
+	benchmark_cancel = true;
+	if (benchmark_thread.joinable())
+		benchmark_thread.join();
 }
 
 
@@ -38,6 +54,7 @@ BEGIN_MESSAGE_MAP(CChildView, CWnd)
 	ON_WM_RBUTTONUP()
 	ON_WM_MOUSEMOVE()
 	ON_WM_KEYDOWN()
+	ON_MESSAGE(WM_BENCHMARK_DONE, OnBenchmarkDone)
 END_MESSAGE_MAP()
 
 
@@ -81,21 +98,44 @@ void CChildView::OnPaint()
     CPen qCirclePen(PS_SOLID, 5, qCircleColor);
     CPen* pqOrigPen = MemDC.SelectObject(&qCirclePen);
 
-	int grid_number = fluidSolver.n;
+	// the newest finished frame, or the one drawn last time
+	simulation.fetch_frame();
+	CFrameSnapshot & frame = simulation.frame();
+	int grid_number = frame.n;
 	
 	if (showDensity)
 	{
-		for (int cell_i = 0; cell_i < grid_number; cell_i++)
-			for (int cell_j = 0; cell_j < grid_number; cell_j++)
-			{
-				int c = (int) ( (1 - fluidSolver.density[cell_i+cell_j*grid_number]) * 255);
-				if (c < 0)
-					c = 0;
-				if (c > 255)
-					c = 255;
-				qCircleColor = RGB(c, c, c);                  		
- 				MemDC.FillSolidRect(cell_i * dx, cell_j * dx, dx, dx, qCircleColor);			
+		// the whole field as one top-down 32-bit DIB
+		int size = grid_number * dx;
+		if (raster.width != size || raster.height != size)
+			raster.resize(size, size);
+		bool speed = shading >= NUM_COLORMAPS;
+		raster.auto_range = speed;
+		if (speed)
+			raster.draw_speed(frame.velocity, grid_number);
+		else
+			raster.draw(frame.density, grid_number);
+		if (showParticles && grid_number > 0) {
+			if (frame.frame != particle_frame) {
+				//catch up with the frames the triple buffer skipped, in at most 8 sub-steps
+				long long frames = particle_frame >= 0 && frame.frame > particle_frame ? frame.frame - particle_frame : 1;
+				int substeps = frames < 8 ? (int) frames : 8;
+				for (int s = 0; s < substeps; s++)
+					particles.advect(frame.velocity, grid_number, frames*fluidSolver.frame_time/substeps);
+				particle_frame = frame.frame;
 			}
+			particles.plot(raster.pixels.data(), raster.width, raster.height, grid_number, 0xffff4000);
+		}
+		BITMAPINFO bmi;
+		ZeroMemory(&bmi, sizeof(bmi));
+		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.bmiHeader.biWidth = raster.width;
+		bmi.bmiHeader.biHeight = -raster.height;
+		bmi.bmiHeader.biPlanes = 1;
+		bmi.bmiHeader.biBitCount = 32;
+		bmi.bmiHeader.biCompression = BI_RGB;
+		StretchDIBits(MemDC.GetSafeHdc(), 0, 0, raster.width, raster.height, 0, 0, raster.width, raster.height,
+			raster.pixels.data(), &bmi, DIB_RGB_COLORS, SRCCOPY);
 	}
 
 	if (showVelocity)
@@ -109,12 +149,23 @@ void CChildView::OnPaint()
 		for (int cell_i = 0; cell_i < grid_number; cell_i++)
 			for (int cell_j = 0; cell_j < grid_number; cell_j++)
 			{
-				v = fluidSolver.v(cell_i, cell_j);
+				v = frame.v(cell_i, cell_j);
 				MemDC.MoveTo((cell_i) * dx, (cell_j) * dx);
 				MemDC.LineTo((int) ((cell_i) * dx + v->x * dx) , (int) ( (cell_j) * dx + v->y * dx));
 			}
 	}
 
+	if (showObstacle)
+	{
+		//the cells within n/10 of the middle, as 'W' drew them
+		CBrush qBrush(RGB(90,90,90));
+		CBrush* pOrigBrush = MemDC.SelectObject(&qBrush);
+		MemDC.SelectStockObject(NULL_PEN);
+		double centre = (grid_number/2 + 0.5)*dx, radius = (grid_number/10. + 0.5)*dx;
+		MemDC.Ellipse((int) (centre - radius), (int) (centre - radius), (int) (centre + radius), (int) (centre + radius));
+		MemDC.SelectObject(pOrigBrush);
+	}
+
 	//Draw Grid lines
 	if (showGrid)
 	{
@@ -139,7 +190,7 @@ void CChildView::OnPaint()
 
 
 	int TextWidth = 250;
-	int TextHeight = 300;
+	int TextHeight = 760;
 	CDC MemDC1; 
     CBitmap MemBitmap1;
     MemDC1.CreateCompatibleDC(NULL);
@@ -161,9 +212,72 @@ void CChildView::OnPaint()
     s2 = s1 + s2;
     MemDC1.TextOutW(3, 30, s2);
 
+	// Display sparse tile state
+	if (fluidSolver.bricks.sparse)
+		s2.Format(_T("Sparse tiles: %d / %d active"), frame.active_tiles, fluidSolver.bricks.nt*fluidSolver.bricks.nt);
+	else
+		s2 = _T("Sparse tiles: off");
+	MemDC1.TextOutW(3, 50, s2);
+
+	// Display time stepping: sub-steps of the last frame and solve rate
+	s2.Format(_T("Step: %s x%d, CFL %.2f"), fluidSolver.adaptive_step ? _T("adaptive") : _T("fixed"),
+		frame.substeps, frame.cfl);
+	MemDC1.TextOutW(3, 70, s2);
+	s2.Format(_T("Solves / sim. second: %.1f"), frame.solves_per_second);
+	MemDC1.TextOutW(3, 90, s2);
+
+	// Display advection scheme
+	if (fluidSolver.advection_mode == ADVECT_MACCORMACK)
+		s2 = _T("Advection: MacCormack");
+	else if (fluidSolver.advection_mode == ADVECT_BFECC)
+		s2 = _T("Advection: BFECC");
+	else
+		s2 = _T("Advection: semi-Lagrangian");
+	MemDC1.TextOutW(3, 110, s2);
+
+	// Display simulation thread statistics
+	s2.Format(_T("Step: %.1f ms, %.1f steps/s"), simulation.last_step_ns*1e-6, simulation.running() ? simulation.steps_per_second() : 0.);
+	MemDC1.TextOutW(3, 130, s2);
+	s2.Format(_T("Latency: %.1f ms, skipped %I64d"), simulation.latency_ms, simulation.frames_skipped);
+	MemDC1.TextOutW(3, 150, s2);
+
+	// Display solver statistics: step time percentiles, the slowest stage and the solves
+	const CSolverStats & stats = frame.stats;
+	int slowest = 0;
+	for (int s = 1; s < NUM_STAGES; s++)
+		if (stats.percentile_ns(s, 0.5) > stats.percentile_ns(slowest, 0.5))
+			slowest = s;
+	s2.Format(_T("Solver: p50 %.2f ms, p99 %.2f ms"), stats.percentile_ns(NUM_STAGES, 0.5)*1e-6, stats.percentile_ns(NUM_STAGES, 0.99)*1e-6);
+	MemDC1.TextOutW(3, 170, s2);
+	s2.Format(_T("Slowest: %S %.2f ms"), CSolverStats::stage_name(slowest), stats.percentile_ns(slowest, 0.5)*1e-6);
+	MemDC1.TextOutW(3, 190, s2);
+	s2.Format(_T("Iterations: d %d, v %d/%d, p %d (p99 %d)"), stats.solves[SOLVE_DENSITY].iterations,
+		stats.solves[SOLVE_VELOCITY_X].iterations, stats.solves[SOLVE_VELOCITY_Y].iterations,
+		stats.solves[SOLVE_PRESSURE].iterations, stats.percentile_iterations(SOLVE_PRESSURE, 0.99));
+	MemDC1.TextOutW(3, 210, s2);
+	if (fluidSolver.direct_solve)
+		s2 = _T("Pressure residual: direct solve");
+	else
+		s2.Format(_T("Pressure residual: %.2e"), stats.solves[SOLVE_PRESSURE].residual);
+	MemDC1.TextOutW(3, 230, s2);
+
+	// Display the frame recorder
+	if (recorder.recording())
+		s2.Format(_T("Recording: %I64d frames, %.1f:1, dropped %I64d"), (long long) recorder.frames_written,
+			recorder.bytes_written > 0 ? (double) recorder.raw_bytes/recorder.bytes_written : 0., (long long) recorder.frames_dropped);
+	else
+		s2 = _T("Recording: off");
+	MemDC1.TextOutW(3, 250, s2);
+
+	// Display the critical path of the step's task graph
+	if (stats.critical_ns > 0)
+		s2.Format(_T("Critical path: %.2f of %.2f ms"), stats.critical_ns*1e-6, stats.step_ns*1e-6);
+	else
+		s2 = _T("Task graph: off");
+	MemDC1.TextOutW(3, 270, s2);
 
 	MemDC1.SetTextColor(RGB(255,255,255));
-	int row = 55; // Adjusted starting row for guide text
+	int row = 295; // Adjusted starting row for guide text
 	MemDC1.TextOutW(3,row,_T("User Interface Guide:"));
 	row += 20;
 	MemDC1.TextOutW(8,row,_T("Z : Start Animation"));
@@ -185,6 +299,32 @@ void CChildView::OnPaint()
 	MemDC1.TextOutW(8, row, _T("+/= : Increase Viscosity"));
 	row += 20;
 	MemDC1.TextOutW(8, row, _T("-/_ : Decrease Viscosity"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("S : Sparse tiles on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("T : Adaptive time step on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("M : Cycle advection scheme"));
+	row += 20;
+	MemDC1.TextOutW(8, row, benchmarking ? _T("B : Benchmarks running...") : _T("B : Run benchmarks"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("K : Save checkpoint"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("L : Load checkpoint"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("O : Record frames on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("C : Direct (Cholesky) solves on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("P : Parallel task graph on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("H : Shading: density/speed, colormap"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("I : Bilinear/nearest upscaling"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("X : Tracer particles on/off"));
+	row += 20;
+	MemDC1.TextOutW(8, row, _T("W : Solid disk obstacle on/off"));
 
 
 	dc.BitBlt(windowSize+1,0,TextWidth,TextHeight,&MemDC1,0,0,NOTSRCCOPY);
@@ -193,15 +333,34 @@ void CChildView::OnPaint()
 
 }
 
+LRESULT CChildView::OnBenchmarkDone(WPARAM wParam, LPARAM lParam)
+{
+	if (benchmark_thread.joinable())
+		benchmark_thread.join();
+	benchmarking = false;
+	if (resume_after_benchmark) {
+		simulation.start();
+		m_timer = SetTimer(1, (int) (25), NULL);
+	}
+	Invalidate(false);
+	if (wParam == BENCHMARK_DONE)
+		AfxMessageBox(_T("Benchmarks written to benchmark_log.txt"));
+	else if (wParam == BENCHMARK_FAILED)
+		AfxMessageBox(_T("Benchmarks failed, see benchmark_log.txt"));
+	else
+		AfxMessageBox(_T("Cannot write benchmark_log.txt"));
+	return 0;
+}
+
 void CChildView::OnTimer(UINT_PTR nIDEvent)
 {
 	if (leftButton) {
 		int index = Find_Cell_Index(current_point);	 
 		// Inject density
-		fluidSolver.density_source[index] = 50.* fluidSolver.h;
+		simulation.add_density_source(index, 50.* fluidSolver.frame_time);
 	}
 
-	fluidSolver.update();
+	// the simulation thread steps on its own, the timer only repaints
 
 	Invalidate(false);
 	CWnd::OnTimer(nIDEvent);
@@ -249,7 +408,7 @@ void CChildView::OnMouseMove(UINT nFlags, CPoint point)
 	if (rightButton) {
 		int index = Find_Cell_Index(old_point);
 		//Modify velocity
-		fluidSolver.velocity_source[index] = vec2(current_point.x-old_point.x,current_point.y-old_point.y)*50.;
+		simulation.add_velocity_source(index, vec2(current_point.x-old_point.x,current_point.y-old_point.y)*50.);
 	}
 
 	CWnd::OnMouseMove(nFlags, point);
@@ -263,22 +422,29 @@ void CChildView::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 	{
 	case 'a':
 	case 'A':
-		fluidSolver.update();
+		if (benchmarking)
+			break;
+		simulation.step_once();
+		Invalidate(false);
 		break;
 	case 'Z':
 	case 'z':
+		if (benchmarking)
+			break;
 		if (m_timer) {
 			KillTimer(m_timer);
 			m_timer = 0;
+			simulation.stop();
 		}
 		else
 		{
+		   simulation.start();
 		   m_timer = SetTimer(1, (int) (25), NULL);
 		}
 		break;
 	case 'r':
 	case 'R':
-		fluidSolver.reset();
+		simulation.edit([](CFluidSolver & solver) {solver.reset();});
 		Invalidate(false);
 		break;
 	case 'D':
@@ -297,18 +463,132 @@ void CChildView::OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags)
 		InvalidateRect(NULL,FALSE);
 		break;
     case VK_OEM_PLUS: // Increase viscosity (+/= key)
-        fluidSolver.viscosity_coef *= 1.2; // Increase by 20%
-        fluidSolver.setup_velocity_diffusion_matrix(fluidSolver.viscosity_coef);
+        simulation.edit([](CFluidSolver & solver) {
+            solver.viscosity_coef *= 1.2; // Increase by 20%
+            solver.setup_velocity_diffusion_matrix(solver.viscosity_coef);
+        });
         Invalidate(false); // Redraw to show new viscosity value
         break;
     case VK_OEM_MINUS: // Decrease viscosity (-/_ key)
-        fluidSolver.viscosity_coef /= 1.2; // Decrease by factor
-        if (fluidSolver.viscosity_coef < 1e-6) { // Clamp minimum value
-            fluidSolver.viscosity_coef = 0; // Set to zero if very small
-        }
-        fluidSolver.setup_velocity_diffusion_matrix(fluidSolver.viscosity_coef);
+        simulation.edit([](CFluidSolver & solver) {
+            solver.viscosity_coef /= 1.2; // Decrease by factor
+            if (solver.viscosity_coef < 1e-6) { // Clamp minimum value
+                solver.viscosity_coef = 0; // Set to zero if very small
+            }
+            solver.setup_velocity_diffusion_matrix(solver.viscosity_coef);
+        });
         Invalidate(false); // Redraw to show new viscosity value
         break;
+	case 'S': // Toggle the sparse tile mode
+	case 's':
+		simulation.edit([](CFluidSolver & solver) {solver.set_sparse(!solver.bricks.sparse);});
+		Invalidate(false);
+		break;
+	case 'T': // Toggle CFL-driven sub-stepping
+	case 't':
+		simulation.edit([](CFluidSolver & solver) {solver.adaptive_step = !solver.adaptive_step;});
+		Invalidate(false);
+		break;
+	case 'C': // Cached Cholesky factors instead of BiCG
+	case 'c':
+		simulation.edit([](CFluidSolver & solver) {solver.direct_solve = !solver.direct_solve;});
+		Invalidate(false);
+		break;
+	case 'H': // Shade density or speed, cycling through the colormaps
+	case 'h':
+		shading = (shading + 1) % (2*NUM_COLORMAPS);
+		raster.colormap.set_preset(shading % NUM_COLORMAPS);
+		Invalidate(false);
+		break;
+	case 'I': // Bilinear or nearest upscaling of the shaded field
+	case 'i':
+		raster.bilinear = !raster.bilinear;
+		Invalidate(false);
+		break;
+	case 'X': // Seed 100000 tracers over the grid, or remove them
+	case 'x':
+		showParticles = !showParticles;
+		particles.clear();
+		if (showParticles)
+			particles.emit_box(1., 1., fluidSolver.n - 2., fluidSolver.n - 2., 100000);
+		particle_frame = simulation.frame().frame;
+		Invalidate(false);
+		break;
+	case 'W': // A solid disk of radius n/10 in the middle of the grid
+	case 'w':
+		showObstacle = !showObstacle;
+		simulation.edit([this](CFluidSolver & solver) {
+			solver.obstacles.clear();
+			if (showObstacle)
+				solver.obstacles.fill_disk(solver.n/2, solver.n/2, solver.n/10., true);
+		});
+		Invalidate(false);
+		break;
+	case 'P': // Step as a task graph on two threads, or in sequence
+	case 'p':
+		simulation.edit([](CFluidSolver & solver) {solver.task_graph = !solver.task_graph;});
+		Invalidate(false);
+		break;
+	case 'M': // Semi-Lagrangian -> MacCormack -> BFECC
+	case 'm':
+		simulation.edit([](CFluidSolver & solver) {solver.advection_mode = (solver.advection_mode + 1) % 3;});
+		Invalidate(false);
+		break;
+	case 'B': // Run the solver benchmarks, results go to benchmark_log.txt
+	case 'b':
+		if (benchmarking)
+			break;
+		benchmarking = true;
+		resume_after_benchmark = m_timer != 0;
+		if (m_timer) {
+			KillTimer(m_timer);
+			m_timer = 0;
+			simulation.stop();
+		}
+		{
+			HWND hwnd = GetSafeHwnd();
+			benchmark_thread = std::thread([this, hwnd] {
+				FILE *fp = fopen("benchmark_log.txt", "w");
+				int result = BENCHMARK_NO_LOG;
+				if (fp) {
+					try {
+						result = run_all_benchmarks(fp, &benchmark_cancel) ? BENCHMARK_DONE : BENCHMARK_FAILED;
+					} catch (const std::exception & e) {
+						fprintf(fp, "\nbenchmarks stopped: %s\n", e.what());
+						result = BENCHMARK_FAILED;
+					} catch (...) {
+						fprintf(fp, "\nbenchmarks stopped by an exception\n");
+						result = BENCHMARK_FAILED;
+					}
+					fclose(fp);
+				}
+				::PostMessage(hwnd, WM_BENCHMARK_DONE, result, 0);
+			});
+		}
+		Invalidate(false);
+		break;
+	case 'K': // Save the whole solver state to fluid_checkpoint.bin
+	case 'k':
+		simulation.edit([](CFluidSolver & solver) {save_checkpoint(solver, "fluid_checkpoint.bin", true);});
+		break;
+	case 'L': // Continue from fluid_checkpoint.bin
+	case 'l':
+		{
+			CCheckpointFile file;
+			if (file.open("fluid_checkpoint.bin"))
+				simulation.edit([&file](CFluidSolver & solver) {file.restore(solver);});
+		}
+		Invalidate(false);
+		break;
+	case 'O': // Record density and velocity of every step to fluid_recording.sfr
+	case 'o':
+		if (recorder.recording()) {
+			simulation.edit([this](CFluidSolver &) {simulation.recorder = NULL;});
+			recorder.close();
+		} else if (recorder.open("fluid_recording.sfr", fluidSolver.n, 1, true))
+			simulation.edit([this](CFluidSolver &) {simulation.recorder = &recorder;});
+		Invalidate(false);
+		break;
 	}
 
 	CWnd::OnKeyDown(nChar, nRepCnt, nFlags);
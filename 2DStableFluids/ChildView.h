@@ -2,9 +2,18 @@
 // ChildView.h : interface of the CChildView class
 //
 #include "FluidSolver.h"
+#include "SimulationThread.h"
+#include "FieldRaster.h"
+#include "ParticleSystem.h"
+#include <atomic>
+#include <thread>
 
 #pragma once
 
+// posted by the benchmark thread when it is done; wParam is a BENCHMARK_* result
+#define WM_BENCHMARK_DONE (WM_APP + 1)
+enum { BENCHMARK_NO_LOG, BENCHMARK_DONE, BENCHMARK_FAILED };
+
 
 // CChildView window
 
@@ -24,6 +33,19 @@ public:
 	bool showDensity;
 	bool showVelocity;
 	bool showGrid;
+	int shading;			//colormap preset; + NUM_COLORMAPS shades |velocity| instead of density
+	CFieldRaster raster;	//the shaded field, blitted in one call
+	bool showParticles;
+	CParticleSystem particles;	//tracers, advected to every new frame on the UI thread
+	long long particle_frame;	//the frame they were last advected through
+	bool showObstacle;			//a solid disk in the middle of the grid
+
+	//The benchmarks run on their own thread while the simulation is stopped,
+	//so neither the UI nor the stepping competes with their timings
+	std::thread benchmark_thread;
+	bool benchmarking;
+	std::atomic<bool> benchmark_cancel;	//set by the destructor; no further benchmark starts
+	bool resume_after_benchmark;	//the animation was running when they started
 
 	//Interaction states
 	bool leftButton;
@@ -32,6 +54,8 @@ public:
 	CPoint old_point;
 
 	CFluidSolver fluidSolver;
+	CFrameRecorder recorder; // declared before simulation, so the thread stops before it closes
+	CSimulationThread simulation; // steps fluidSolver; painting reads its snapshots
 // Operations
 public:
 	int Find_Cell_Index(CPoint point);
@@ -56,5 +80,6 @@ public:
 	afx_msg void OnRButtonUp(UINT nFlags, CPoint point);
 	afx_msg void OnMouseMove(UINT nFlags, CPoint point);
 	afx_msg void OnKeyDown(UINT nChar, UINT nRepCnt, UINT nFlags);
+	afx_msg LRESULT OnBenchmarkDone(WPARAM wParam, LPARAM lParam);
 };
 
@@ -0,0 +1,399 @@
+#include "DistributedFluidSolver.h"
+#include <string.h>
+#ifndef _WIN32
+#include "ShmTransport.h"
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+//Slab-decomposed CFluidSolver, see DistributedFluidSolver.h
+
+CDistributedFluidSolver::CDistributedFluidSolver(int grid_n, CHaloTransport* t, int halo_rows):
+n(grid_n), size(grid_n*grid_n), h(0.1), transport(t)
+{
+	int ranks = transport->num_ranks();
+	int rank = transport->rank();
+	j0 = rank*n/ranks;
+	j1 = (rank+1)*n/ranks;
+	rows = j1 - j0;
+	// a neighbour can only send rows it owns
+	halo = halo_rows < n/ranks ? halo_rows : n/ranks;
+	local_size = (rows + 2*halo)*n;
+
+	density = new double[local_size];
+	u = new double[local_size];
+	v = new double[local_size];
+	pressure = new double[local_size];
+	divergence = new double[local_size];
+	density_source = new double[local_size];
+	u_source = new double[local_size];
+	v_source = new double[local_size];
+	r = new double[local_size];
+	p = new double[local_size];
+	q = new double[local_size];
+	send_low = new double[3*halo*n];
+	send_high = new double[3*halo*n];
+	recv_low = new double[3*halo*n];
+	recv_high = new double[3*halo*n];
+
+	diffusion_coef = 0.3*h;
+	pressure_iterations = 10;
+	last_iterations = 0;
+	reset();
+}
+
+CDistributedFluidSolver::~CDistributedFluidSolver(void)
+{
+	delete[] density;
+	delete[] u;
+	delete[] v;
+	delete[] pressure;
+	delete[] divergence;
+	delete[] density_source;
+	delete[] u_source;
+	delete[] v_source;
+	delete[] r;
+	delete[] p;
+	delete[] q;
+	delete[] send_low;
+	delete[] send_high;
+	delete[] recv_low;
+	delete[] recv_high;
+}
+
+void CDistributedFluidSolver::reset()
+{
+	for (int c = 0; c < local_size; c++) {
+		density[c] = 0.;
+		u[c] = v[c] = 0.;
+		pressure[c] = 0.;
+		divergence[c] = 0.;
+		density_source[c] = 0.;
+		u_source[c] = v_source[c] = 0.;
+		r[c] = p[c] = q[c] = 0.;
+	}
+	viscosity_coef = 0.1;
+}
+
+void CDistributedFluidSolver::set_density_source(int index, double value)
+{
+	int i = index % n, j = index / n;
+	// the solves assume the wall cells stay at zero
+	if (owns(j) && i > 0 && i < n-1 && j > 0 && j < n-1)
+		density_source[this->index(i,j)] = value;
+}
+
+void CDistributedFluidSolver::set_velocity_source(int index, vec2 value)
+{
+	int i = index % n, j = index / n;
+	if (owns(j) && i > 0 && i < n-1 && j > 0 && j < n-1) {
+		u_source[this->index(i,j)] = value.x;
+		v_source[this->index(i,j)] = value.y;
+	}
+}
+
+void CDistributedFluidSolver::copy_owned_rows(double* global, double* field)
+{
+	memcpy(global + j0*n, field + halo*n, rows*n*sizeof(double));
+}
+
+void CDistributedFluidSolver::exchange_halo(double** fields, int num_fields, int width)
+{
+	int row_block = width*n;
+	for (int f = 0; f < num_fields; f++) {
+		memcpy(send_low + f*row_block, fields[f] + halo*n, row_block*sizeof(double));
+		memcpy(send_high + f*row_block, fields[f] + (halo+rows-width)*n, row_block*sizeof(double));
+	}
+	transport->exchange(send_low, send_high, recv_low, recv_high, num_fields*row_block);
+	// ranks at the top and bottom of the domain keep zeros outside it
+	for (int f = 0; f < num_fields; f++) {
+		if (transport->rank() > 0)
+			memcpy(fields[f] + (halo-width)*n, recv_low + f*row_block, row_block*sizeof(double));
+		if (transport->rank() < transport->num_ranks()-1)
+			memcpy(fields[f] + (halo+rows)*n, recv_high + f*row_block, row_block*sizeof(double));
+	}
+}
+
+void CDistributedFluidSolver::update()
+{
+	updateDensity();
+	updateVelocity();
+	for (int c = 0; c < local_size; c++)
+		density_source[c] = u_source[c] = v_source[c] = 0.;
+}
+
+void CDistributedFluidSolver::updateDensity()
+{
+	for (int c = 0; c < local_size; c++)
+		density[c] += density_source[c];
+
+	//Diffusion process: (I + c L) density_new = density_old
+	for (int c = 0; c < local_size; c++)
+		divergence[c] = density[c];
+	solve(density, divergence, 1., diffusion_coef, diffusion_coef, 1e-8, 30);
+
+	//the backtraces below read up to halo rows into the neighbours
+	double* fields[3] = {density, u, v};
+	exchange_halo(fields, 3, halo);
+	advect(r, density);
+	double* swap = density; density = r; r = swap;
+}
+
+void CDistributedFluidSolver::updateVelocity()
+{
+	//density advection above already refreshed the velocity halo
+	advect(r, u);
+	advect(q, v);
+	double* swap;
+	swap = u; u = r; r = swap;
+	swap = v; v = q; q = swap;
+
+	// Sources, and buoyancy force (proportional to density, acts upwards)
+	double buoyancy_coef = 0.1;
+	for (int j = j0; j < j1; j++)
+		for (int i = 0; i < n; i++) {
+			int c = index(i,j);
+			u[c] += u_source[c];
+			v[c] += v_source[c];
+			if (density[c] > 0)
+				v[c] -= buoyancy_coef * density[c];
+		}
+
+	// Velocity Diffusion step, one component at a time
+	double coef = viscosity_coef * h;
+	if (coef > 0) {
+		double* components[2] = {u, v};
+		for (int d = 0; d < 2; d++) {
+			for (int c = 0; c < local_size; c++)
+				divergence[c] = components[d][c];
+			solve(components[d], divergence, 1., coef, coef, 1e-8, 30);
+		}
+	}
+
+	projection();
+}
+
+void CDistributedFluidSolver::projection()
+{
+	//set boundary condition
+	for (int j = j0; j < j1; j++) {
+		if (j == 0 || j == n-1) {
+			for (int i = 0; i < n; i++)
+				u[index(i,j)] = v[index(i,j)] = 0.;
+		} else {
+			u[index(0,j)] = v[index(0,j)] = 0.;
+			u[index(n-1,j)] = v[index(n-1,j)] = 0.;
+		}
+	}
+
+	//compute divergence
+	double* velocity[2] = {u, v};
+	exchange_halo(velocity, 2, 1);
+	int jb0 = j0 > 1 ? j0 : 1;
+	int jb1 = j1 < n-1 ? j1 : n-1;
+	for (int j = jb0; j < jb1; j++) {
+		int c = index(1,j);
+		for (int i = 1; i < n-1; i++, c++)
+			divergence[c] = 0.5*(u[c+1] - u[c-1] + v[c+n] - v[c-n]);
+	}
+
+	//get pressure by solving (Laplacian pressure = divergence)
+	last_iterations = solve(pressure, divergence, 4., 0., 1., 1e-8, pressure_iterations);
+
+	//update velocity by (velocity -= gradient of pressure)
+	exchange_halo(&pressure, 1, 1);
+	for (int j = jb0; j < jb1; j++) {
+		int c = index(1,j);
+		for (int i = 1; i < n-1; i++, c++) {
+			u[c] += 0.5*(pressure[c+1] - pressure[c-1]);
+			v[c] += 0.5*(pressure[c+n] - pressure[c-n]);
+		}
+	}
+}
+
+double CDistributedFluidSolver::sample(double* field, double x, double y)
+{
+	int i0 = (int) x;
+	int jj = (int) y;
+	double s = x - i0;
+	double t = y - jj;
+	int c = index(i0,jj);
+	return (1-s)*(1-t)*field[c] + (1-s)*t*field[c+n] + s*(1-t)*field[c+1] + s*t*field[c+n+1];
+}
+
+void CDistributedFluidSolver::advect(double* dst, double* src)
+{
+	//the backtrace may not leave the domain, nor the rows this rank can see
+	double y_min = j0 - halo > 0 ? j0 - halo : 0.5;
+	double y_max = j1 + halo - 2 < n-1.5 ? j1 + halo - 2 : n-1.5;
+	for (int j = j0; j < j1; j++)
+		for (int i = 0; i < n; i++) {
+			int c = index(i,j);
+			if (i == 0 || i == n-1 || j == 0 || j == n-1) {
+				dst[c] = 0.;
+				continue;
+			}
+			//go backwards following the velocity field
+			double x = i - h*u[c];
+			double y = j - h*v[c];
+			if (x < 0.5) x = 0.5;
+			if (x > n-1.5) x = n-1.5;
+			if (y < y_min) y = y_min;
+			if (y > y_max) y = y_max;
+			dst[c] = sample(src, x, y);
+		}
+}
+
+void CDistributedFluidSolver::apply_operator(double* x, double* y, double diag_const, double diag_per_neighbour, double off)
+{
+	exchange_halo(&x, 1, 1);
+	int jb0 = j0 > 1 ? j0 : 1;
+	int jb1 = j1 < n-1 ? j1 : n-1;
+	for (int j = jb0; j < jb1; j++) {
+		int c = index(1,j);
+		int count_j = 2 + (j > 1) + (j < n-2);
+		for (int i = 1; i < n-1; i++, c++) {
+			// neighbours on the wall hold zero, so they drop out of the sum
+			int count = count_j - (i == 1) - (i == n-2);
+			y[c] = (diag_const + diag_per_neighbour*count)*x[c] - off*(x[c-1] + x[c+1] + x[c-n] + x[c+n]);
+		}
+	}
+}
+
+//***************************************
+// Jacobi preconditioned conjugate gradient over all ranks,
+// stopping rule as in CSparseMatrix::solve
+//***************************************
+int CDistributedFluidSolver::solve(double* x, double* b, double diag_const, double diag_per_neighbour, double off, double tol, int iter_max)
+{
+	// the diagonal of an interior cell only depends on its interior neighbour count
+	double inv_diag[5];
+	for (int count = 0; count < 5; count++)
+		inv_diag[count] = 1.0 / (diag_const + diag_per_neighbour*count);
+	int jb0 = j0 > 1 ? j0 : 1;
+	int jb1 = j1 < n-1 ? j1 : n-1;
+
+	apply_operator(x, q, diag_const, diag_per_neighbour, off);
+	double rz = 0., residual0 = 0.;
+	for (int j = jb0; j < jb1; j++) {
+		int c = index(1,j);
+		int count_j = 2 + (j > 1) + (j < n-2);
+		for (int i = 1; i < n-1; i++, c++) {
+			double id = inv_diag[count_j - (i == 1) - (i == n-2)];
+			r[c] = b[c] - q[c];
+			p[c] = r[c]*id;
+			rz += r[c]*p[c];
+			residual0 += b[c]*b[c]*id*id;
+		}
+	}
+	rz = transport->allreduce_sum(rz);
+	residual0 = transport->allreduce_sum(residual0);
+
+	double residual = residual0*100; // Force the first iteration anyway.
+	int iter = 0;
+	while (residual > tol && iter < iter_max) {
+		iter++;
+		apply_operator(p, q, diag_const, diag_per_neighbour, off);
+		double pq = 0.;
+		for (int j = jb0; j < jb1; j++) {
+			int c = index(1,j);
+			for (int i = 1; i < n-1; i++, c++)
+				pq += p[c]*q[c];
+		}
+		pq = transport->allreduce_sum(pq);
+		if (pq == 0.)
+			break;
+		double alpha = rz / pq;
+
+		double rz_new = 0.;
+		residual = 0.;
+		for (int j = jb0; j < jb1; j++) {
+			int c = index(1,j);
+			int count_j = 2 + (j > 1) + (j < n-2);
+			for (int i = 1; i < n-1; i++, c++) {
+				double id = inv_diag[count_j - (i == 1) - (i == n-2)];
+				x[c] += alpha*p[c];
+				r[c] -= alpha*q[c];
+				double z = r[c]*id;
+				rz_new += r[c]*z;
+				residual += z*z;
+			}
+		}
+		rz_new = transport->allreduce_sum(rz_new);
+		residual = transport->allreduce_sum(residual);
+		if (rz == 0.)
+			break;
+		double beta = rz_new / rz;
+		rz = rz_new;
+
+		for (int j = jb0; j < jb1; j++) {
+			int c = index(1,j);
+			int count_j = 2 + (j > 1) + (j < n-2);
+			for (int i = 1; i < n-1; i++, c++)
+				p[c] = r[c]*inv_diag[count_j - (i == 1) - (i == n-2)] + beta*p[c];
+		}
+	}
+	return iter;
+}
+
+#ifndef _WIN32
+bool run_distributed(int num_ranks, int n, int steps, void (*script)(CDistributedFluidSolver &, int),
+	double* density_out, int halo_rows)
+{
+	int halo = halo_rows < n/num_ranks ? halo_rows : n/num_ranks;
+	SShmHeader* header = CShmTransport::create_segment(num_ranks, 3*halo*n);
+	if (!header)
+		return false;
+	// every worker writes its own rows of the result
+	size_t result_bytes = (size_t) n*n*sizeof(double);
+	void* result = mmap(NULL, result_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (result == MAP_FAILED) {
+		CShmTransport::destroy_segment(header);
+		return false;
+	}
+
+	pid_t* workers = new pid_t[num_ranks];
+	int started = 0;
+	for (; started < num_ranks; started++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			CShmTransport transport(header, started);
+			CDistributedFluidSolver solver(n, &transport, halo_rows);
+			for (int step = 0; step < steps; step++) {
+				script(solver, step);
+				solver.update();
+			}
+			solver.copy_owned_rows((double*) result, solver.density);
+			_exit(0);
+		}
+		if (pid < 0)
+			break;
+		workers[started] = pid;
+	}
+
+	// a worker that dies would leave the others waiting at the barrier forever
+	bool ok = started == num_ranks;
+	if (!ok)
+		for (int k = 0; k < started; k++)
+			kill(workers[k], SIGKILL);
+	for (int remaining = started; remaining > 0; remaining--) {
+		int status;
+		if (waitpid(-1, &status, 0) < 0)
+			break;
+		if (ok && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+			ok = false;
+			for (int k = 0; k < started; k++)
+				kill(workers[k], SIGKILL);
+		}
+	}
+	delete[] workers;
+
+	if (ok)
+		memcpy(density_out, result, result_bytes);
+	munmap(result, result_bytes);
+	CShmTransport::destroy_segment(header);
+	return ok;
+}
+#endif
@@ -0,0 +1,96 @@
+// DistributedFluidSolver.h: CFluidSolver split into slabs of rows
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FluidSolver.h"
+#include "HaloTransport.h"
+
+// One rank's share of an n x n CFluidSolver scene. Rank r owns rows
+// [j0, j1) and keeps halo extra rows on each side, filled from its neighbours
+// through the transport. The steps are the same as CFluidSolver:
+//  - density: add source, implicit diffusion, advection;
+//  - velocity: advection, sources, buoyancy, implicit viscosity, projection.
+// Semi-Lagrangian backtraces are clamped to the halo, so the halo must be
+// wider than h * (largest velocity) for the result to match one process.
+// The diffusion and pressure solves are matrix-free Jacobi-preconditioned
+// conjugate gradients (the operators are symmetric): every iteration
+// exchanges one halo row of the search direction and does two global sums.
+// The sums are added in rank order, so a run is repeatable for a given
+// number of ranks, and the iteration count is the same on every rank.
+// Indices passed to the source setters are global (i + j*n); ranks ignore
+// cells they do not own, so every rank can run the same source script.
+class CDistributedFluidSolver
+{
+public:
+	int		n;		// number of grid points along one side of the square domain
+	int		size;	// = n * n, the whole domain
+	double	h;		// time step
+	int		halo;	// ghost rows on each side of the slab
+	int		j0, j1;	// owned rows
+	int		rows;	// = j1 - j0
+	int		local_size;	// = (rows + 2*halo) * n
+
+	CHaloTransport* transport;
+
+	// local arrays, rows j0-halo ... j1+halo-1
+	double*	density;
+	double*	u;		// velocity components
+	double*	v;
+	double*	pressure;
+	double*	divergence;	// also the right hand side scratch of the diffusion solves
+	double*	density_source;
+	double*	u_source;
+	double*	v_source;
+	double*	r;			// solver and advection scratch
+	double*	p;
+	double*	q;
+
+	double*	send_low;	// packed halo rows, 3 fields x halo rows
+	double*	send_high;
+	double*	recv_low;
+	double*	recv_high;
+
+	double	diffusion_coef;
+	double	viscosity_coef;
+	int		pressure_iterations;
+	int		last_iterations;	// CG iterations of the last solve
+
+public:
+	void reset();
+	void update();
+	void updateDensity();
+	void updateVelocity();
+	void projection();
+	void set_density_source(int index, double value);
+	void set_velocity_source(int index, vec2 value);
+
+	bool owns(int j) {return j >= j0 && j < j1;};
+	int index(int i, int j) {return i + (j - j0 + halo)*n;};	// j is a global row
+
+	// copy the owned rows of a local field into a global n x n array
+	void copy_owned_rows(double* global, double* field);
+
+	// refresh width halo rows of each field from the neighbours
+	void exchange_halo(double** fields, int num_fields, int width);
+
+	double sample(double* field, double x, double y);
+	void advect(double* dst, double* src);
+
+	// y = (diag_const + diag_per_neighbour * count) x - off * sum(x of interior neighbours),
+	// on the owned interior cells; reads one halo row of x
+	void apply_operator(double* x, double* y, double diag_const, double diag_per_neighbour, double off);
+	int solve(double* x, double* b, double diag_const, double diag_per_neighbour, double off, double tol, int iter_max);
+
+	CDistributedFluidSolver(int grid_n, CHaloTransport* t, int halo_rows = 8);
+	~CDistributedFluidSolver(void);
+};
+
+#ifndef _WIN32
+// Run the scene on num_ranks forked worker processes that talk through a
+// CShmTransport. script(solver, step) is called on every rank before each
+// step to set the sources. The final density is gathered into density_out
+// (n * n). Returns false if a worker process failed.
+bool run_distributed(int num_ranks, int n, int steps, void (*script)(CDistributedFluidSolver &, int),
+	double* density_out, int halo_rows = 8);
+#endif
@@ -0,0 +1,363 @@
+// EnsembleFluidSolver.h: K independent CFluidSolver scenes stepped together
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FluidSolver.h"
+
+// K simulations on the same n x n grid, stored lane-wise: the value of lane l
+// at cell c is field[c*K + l]. Every stage loops over cells and then over
+// the K lanes, so the inner loop has a fixed trip count and contiguous loads
+// and the compiler turns it into SIMD instructions. One ensemble replaces K
+// separate CFluidSolver objects in a parameter sweep.
+//  - viscosity and buoyancy can differ per lane, and so can the sources;
+//  - the operators are applied matrix-free, as in CFluidSolver3D, so the
+//    lanes share one stencil instead of holding three matrices each;
+//  - the solves are Jacobi-preconditioned conjugate gradients with one
+//    alpha, beta and residual per lane. A lane that has converged (or broken
+//    down) is masked out: its step length is zero, so its solution stays put
+//    while the other lanes keep iterating, and the loop ends when every lane
+//    is done. lane_iterations records how long each lane iterated.
+// As in CFluidSolver3D, every array keeps zeros on the wall cells.
+template <int K>
+class CEnsembleFluidSolver
+{
+public:
+	int		n;		// number of grid points along one side of the square domain
+	int		size;	// = n * n
+	double	h;		// time step
+
+	double*	density;
+	double*	u;		// velocity components
+	double*	v;
+	double*	pressure;
+	double*	divergence;	// also the right hand side scratch of the diffusion solves
+	double*	density_source;
+	double*	u_source;
+	double*	v_source;
+	double*	r;			// solver and advection scratch
+	double*	p;
+	double*	q;
+
+	double	diffusion_coef;
+	double	viscosity_coef[K];
+	double	buoyancy_coef[K];
+	int		pressure_iterations;
+	int		lane_iterations[K];	// CG iterations of each lane in the last solve
+
+public:
+	CEnsembleFluidSolver(int grid_n = 60):
+	n(grid_n), size(grid_n*grid_n), h(0.1)
+	{
+		density = new double[size*K];
+		u = new double[size*K];
+		v = new double[size*K];
+		pressure = new double[size*K];
+		divergence = new double[size*K];
+		density_source = new double[size*K];
+		u_source = new double[size*K];
+		v_source = new double[size*K];
+		r = new double[size*K];
+		p = new double[size*K];
+		q = new double[size*K];
+		diffusion_coef = 0.3*h;
+		pressure_iterations = 10;
+		reset();
+	};
+
+	~CEnsembleFluidSolver(void)
+	{
+		delete[] density;
+		delete[] u;
+		delete[] v;
+		delete[] pressure;
+		delete[] divergence;
+		delete[] density_source;
+		delete[] u_source;
+		delete[] v_source;
+		delete[] r;
+		delete[] p;
+		delete[] q;
+	};
+
+	void reset()
+	{
+		for (int c = 0; c < size*K; c++) {
+			density[c] = 0.;
+			u[c] = v[c] = 0.;
+			pressure[c] = 0.;
+			divergence[c] = 0.;
+			density_source[c] = 0.;
+			u_source[c] = v_source[c] = 0.;
+			r[c] = p[c] = q[c] = 0.;
+		}
+		for (int l = 0; l < K; l++) {
+			viscosity_coef[l] = 0.1;
+			buoyancy_coef[l] = 0.1;
+			lane_iterations[l] = 0;
+		}
+	};
+
+	bool interior(int index) {int i = index % n, j = index / n; return i>0 && i<n-1 && j>0 && j<n-1;};
+
+	void set_density_source(int lane, int index, double value)
+	{
+		if (interior(index))
+			density_source[index*K + lane] = value;
+	};
+
+	void set_velocity_source(int lane, int index, vec2 value)
+	{
+		if (interior(index)) {
+			u_source[index*K + lane] = value.x;
+			v_source[index*K + lane] = value.y;
+		}
+	};
+
+	// same source in every lane
+	void set_density_source(int index, double value)
+	{
+		for (int l = 0; l < K; l++)
+			set_density_source(l, index, value);
+	};
+
+	void set_velocity_source(int index, vec2 value)
+	{
+		for (int l = 0; l < K; l++)
+			set_velocity_source(l, index, value);
+	};
+
+	void update()
+	{
+		updateDensity();
+		updateVelocity();
+		for (int c = 0; c < size*K; c++)
+			density_source[c] = u_source[c] = v_source[c] = 0.;
+	};
+
+	void updateDensity()
+	{
+		for (int c = 0; c < size*K; c++)
+			density[c] += density_source[c];
+
+		//Diffusion process: (I + c L) density_new = density_old
+		double diag_const[K], diag_per_neighbour[K];
+		for (int l = 0; l < K; l++) {
+			diag_const[l] = 1.;
+			diag_per_neighbour[l] = diffusion_coef;
+		}
+		for (int c = 0; c < size*K; c++)
+			divergence[c] = density[c];
+		solve(density, divergence, diag_const, diag_per_neighbour, diag_per_neighbour, 1e-8, 30);
+
+		advect(r, density);
+		double* swap = density; density = r; r = swap;
+	};
+
+	void updateVelocity()
+	{
+		advect(r, u);
+		advect(q, v);
+		double* swap;
+		swap = u; u = r; r = swap;
+		swap = v; v = q; q = swap;
+
+		// Sources, and buoyancy force (proportional to density, acts upwards)
+		for (int c = 0; c < size; c++)
+			for (int l = 0; l < K; l++) {
+				int k = c*K + l;
+				double d = density[k] > 0 ? density[k] : 0.;
+				u[k] += u_source[k];
+				v[k] += v_source[k];
+				v[k] -= buoyancy_coef[l]*d;
+			}
+
+		// Velocity Diffusion step, one component at a time; a lane without
+		// viscosity solves the identity and leaves after one iteration
+		double diag_const[K], coef[K];
+		for (int l = 0; l < K; l++) {
+			diag_const[l] = 1.;
+			coef[l] = viscosity_coef[l] > 0 ? viscosity_coef[l]*h : 0.;
+		}
+		double* components[2] = {u, v};
+		for (int d = 0; d < 2; d++) {
+			for (int c = 0; c < size*K; c++)
+				divergence[c] = components[d][c];
+			solve(components[d], divergence, diag_const, coef, coef, 1e-8, 30);
+		}
+
+		projection();
+	};
+
+	void projection()
+	{
+		//compute divergence
+		for (int j = 1; j < n-1; j++)
+			for (int i = 1; i < n-1; i++) {
+				int c = (i + j*n)*K;
+				for (int l = 0; l < K; l++, c++)
+					divergence[c] = 0.5*(u[c+K] - u[c-K] + v[c+n*K] - v[c-n*K]);
+			}
+
+		//get pressure by solving (Laplacian pressure = divergence)
+		double diag_const[K], diag_per_neighbour[K], off[K];
+		for (int l = 0; l < K; l++) {
+			diag_const[l] = 4.;
+			diag_per_neighbour[l] = 0.;
+			off[l] = 1.;
+		}
+		solve(pressure, divergence, diag_const, diag_per_neighbour, off, 1e-8, pressure_iterations);
+
+		//update velocity by (velocity -= gradient of pressure)
+		for (int j = 1; j < n-1; j++)
+			for (int i = 1; i < n-1; i++) {
+				int c = (i + j*n)*K;
+				for (int l = 0; l < K; l++, c++) {
+					u[c] += 0.5*(pressure[c+K] - pressure[c-K]);
+					v[c] += 0.5*(pressure[c+n*K] - pressure[c-n*K]);
+				}
+			}
+	};
+
+	// every lane backtraces along its own velocity
+	void advect(double* dst, double* src)
+	{
+		for (int j = 1; j < n-1; j++)
+			for (int i = 1; i < n-1; i++) {
+				int c = (i + j*n)*K;
+				for (int l = 0; l < K; l++) {
+					//go backwards following the velocity field
+					double x = i - h*u[c+l];
+					double y = j - h*v[c+l];
+					if (x < 0.5) x = 0.5;
+					if (x > n-1.5) x = n-1.5;
+					if (y < 0.5) y = 0.5;
+					if (y > n-1.5) y = n-1.5;
+
+					//bilinear interpolation
+					int i0 = (int) x;
+					int j0 = (int) y;
+					double s = x - i0;
+					double t = y - j0;
+					int k = (i0 + j0*n)*K + l;
+					dst[c+l] = (1-s)*(1-t)*src[k] + (1-s)*t*src[k+n*K] + s*(1-t)*src[k+K] + s*t*src[k+n*K+K];
+				}
+			}
+	};
+
+	// y = (diag_const + diag_per_neighbour * count) x - off * sum(x of interior neighbours),
+	// on the interior cells, with one set of coefficients per lane
+	void apply_operator(double* x, double* y, const double* diag_const, const double* diag_per_neighbour, const double* off)
+	{
+		for (int j = 1; j < n-1; j++) {
+			int count_j = 2 + (j > 1) + (j < n-2);
+			for (int i = 1; i < n-1; i++) {
+				// neighbours on the wall hold zero, so they drop out of the sum
+				int count = count_j - (i == 1) - (i == n-2);
+				int c = (i + j*n)*K;
+				for (int l = 0; l < K; l++, c++)
+					y[c] = (diag_const[l] + diag_per_neighbour[l]*count)*x[c]
+						- off[l]*(x[c-K] + x[c+K] + x[c-n*K] + x[c+n*K]);
+			}
+		}
+	};
+
+	//***************************************
+	// Jacobi preconditioned conjugate gradient, lane by lane,
+	// stopping rule as in CSparseMatrix::solve
+	//***************************************
+	int solve(double* x, double* b, const double* diag_const, const double* diag_per_neighbour, const double* off, double tol, int iter_max)
+	{
+		// the diagonal of an interior cell only depends on its interior neighbour count
+		double inv_diag[5][K];
+		for (int count = 0; count < 5; count++)
+			for (int l = 0; l < K; l++)
+				inv_diag[count][l] = 1.0 / (diag_const[l] + diag_per_neighbour[l]*count);
+
+		double rz[K], rz_new[K], residual[K], pq[K], alpha[K], beta[K];
+		bool active[K];
+		for (int l = 0; l < K; l++) {
+			rz[l] = residual[l] = 0.;
+			lane_iterations[l] = 0;
+		}
+
+		apply_operator(x, q, diag_const, diag_per_neighbour, off);
+		for (int j = 1; j < n-1; j++) {
+			int count_j = 2 + (j > 1) + (j < n-2);
+			for (int i = 1; i < n-1; i++) {
+				const double* id = inv_diag[count_j - (i == 1) - (i == n-2)];
+				int c = (i + j*n)*K;
+				for (int l = 0; l < K; l++, c++) {
+					r[c] = b[c] - q[c];
+					p[c] = r[c]*id[l];
+					rz[l] += r[c]*p[c];
+					residual[l] += b[c]*b[c]*id[l]*id[l];
+				}
+			}
+		}
+		for (int l = 0; l < K; l++) {
+			residual[l] *= 100; // Force the first iteration anyway.
+			active[l] = true;
+		}
+
+		int iter = 0;
+		while (iter < iter_max) {
+			bool any = false;
+			for (int l = 0; l < K; l++) {
+				active[l] = active[l] && residual[l] > tol;
+				lane_iterations[l] += active[l];
+				any = any || active[l];
+			}
+			if (!any)
+				break;
+			iter++;
+
+			apply_operator(p, q, diag_const, diag_per_neighbour, off);
+			for (int l = 0; l < K; l++)
+				pq[l] = 0.;
+			for (int j = 1; j < n-1; j++)
+				for (int i = 1; i < n-1; i++) {
+					int c = (i + j*n)*K;
+					for (int l = 0; l < K; l++, c++)
+						pq[l] += p[c]*q[c];
+				}
+			// a masked lane moves by zero
+			for (int l = 0; l < K; l++) {
+				active[l] = active[l] && pq[l] != 0.;
+				alpha[l] = active[l] ? rz[l] / pq[l] : 0.;
+				rz_new[l] = residual[l] = 0.;
+			}
+
+			for (int j = 1; j < n-1; j++) {
+				int count_j = 2 + (j > 1) + (j < n-2);
+				for (int i = 1; i < n-1; i++) {
+					const double* id = inv_diag[count_j - (i == 1) - (i == n-2)];
+					int c = (i + j*n)*K;
+					for (int l = 0; l < K; l++, c++) {
+						x[c] += alpha[l]*p[c];
+						r[c] -= alpha[l]*q[c];
+						double z = r[c]*id[l];
+						rz_new[l] += r[c]*z;
+						residual[l] += z*z;
+					}
+				}
+			}
+			for (int l = 0; l < K; l++) {
+				active[l] = active[l] && rz[l] != 0.;
+				beta[l] = active[l] ? rz_new[l] / rz[l] : 0.;
+				rz[l] = rz_new[l];
+			}
+
+			for (int j = 1; j < n-1; j++) {
+				int count_j = 2 + (j > 1) + (j < n-2);
+				for (int i = 1; i < n-1; i++) {
+					const double* id = inv_diag[count_j - (i == 1) - (i == n-2)];
+					int c = (i + j*n)*K;
+					for (int l = 0; l < K; l++, c++)
+						p[c] = r[c]*id[l] + beta[l]*p[c];
+				}
+			}
+		}
+		return iter;
+	};
+};
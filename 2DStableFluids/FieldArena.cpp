@@ -0,0 +1,137 @@
+#include "FieldArena.h"
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static size_t round_up(size_t bytes, size_t to)
+{
+	return (bytes + to - 1) / to * to;
+}
+
+CFieldArena::CFieldArena()
+{
+	huge_pages = false;
+	allocations = 0;
+	top = 0;
+	block = NULL;
+	block_size = 0;
+	block_huge = false;
+	block_mapped = false;
+	block_wants_huge = false;
+}
+
+CFieldArena::~CFieldArena(void)
+{
+	release();
+}
+
+void CFieldArena::clear()
+{
+	fields.clear();
+	top = 0;
+}
+
+void CFieldArena::add_field(void** field, size_t bytes)
+{
+	SField f = {field, top};
+	fields.push_back(f);
+	top += footprint(bytes);
+}
+
+size_t CFieldArena::footprint(size_t bytes)
+{
+	return round_up(bytes > 0 ? bytes : 1, ARENA_ALIGN);
+}
+
+bool CFieldArena::commit()
+{
+	if (block == NULL || top > block_size || huge_pages != block_wants_huge) {
+		release();
+		if (!allocate(top > 0 ? top : ARENA_ALIGN)) {
+			for (size_t k = 0; k < fields.size(); k++)
+				*fields[k].field = NULL;
+			return false;
+		}
+	}
+	for (size_t k = 0; k < fields.size(); k++)
+		*fields[k].field = block + fields[k].offset;
+	return true;
+}
+
+bool CFieldArena::allocate(size_t bytes)
+{
+	allocations++;
+	block_wants_huge = huge_pages;
+	block_huge = false;
+	block_mapped = false;
+	void* p = NULL;
+#ifdef _WIN32
+	if (huge_pages) {
+		SIZE_T large = GetLargePageMinimum();
+		if (large > 0) {
+			size_t rounded = round_up(bytes, large);
+			p = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p) {
+				bytes = rounded;
+				block_huge = true;
+				block_mapped = true;
+			}
+		}
+	}
+	if (!p)
+		p = _aligned_malloc(bytes, ARENA_ALIGN);
+#else
+	if (huge_pages) {
+		size_t rounded = round_up(bytes, HUGE_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		block_huge = p != MAP_FAILED;
+#endif
+		if (!block_huge) {
+			p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+			block_huge = p != MAP_FAILED && madvise(p, rounded, MADV_HUGEPAGE) == 0;
+#endif
+		}
+		if (p == MAP_FAILED)
+			p = NULL;
+		else {
+			bytes = rounded;
+			block_mapped = true;
+		}
+	}
+	if (!p && posix_memalign(&p, ARENA_ALIGN, bytes) != 0)
+		p = NULL;
+#endif
+	block = (char*) p;
+	block_size = p ? bytes : 0;
+	return p != NULL;
+}
+
+void CFieldArena::release()
+{
+	if (!block)
+		return;
+#ifdef _WIN32
+	if (block_mapped)
+		VirtualFree(block, 0, MEM_RELEASE);
+	else
+		_aligned_free(block);
+#else
+	if (block_mapped)
+		munmap(block, block_size);
+	else
+		free(block);
+#endif
+	block = NULL;
+	block_size = 0;
+	block_huge = false;
+	block_mapped = false;
+}
@@ -0,0 +1,63 @@
+// FieldArena.h: one aligned allocation for all the arrays of a solver
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+#define ARENA_ALIGN 64	// cache line; every field starts on its own line
+
+// Lays out a set of arrays in one block. Register every field with add(),
+// then commit() places them, each on a fresh cache line and padded to a
+// whole number of lines, so no two fields (or two threads working on
+// different fields) ever share a line. The block is only replaced when it
+// is too small or of the wrong page kind: a new layout that fits, a
+// reset or a shrink makes no allocator call at all.
+//
+// With huge_pages the block is asked for on 2 MB pages: explicit ones
+// (MAP_HUGETLB, MEM_LARGE_PAGES) if the system has them to give,
+// otherwise transparent huge pages where the OS offers them. Both fall
+// back to normal pages.
+class CFieldArena
+{
+public:
+	bool huge_pages;		// for the next allocation
+	long long allocations;	// allocator calls so far
+
+	CFieldArena();
+	~CFieldArena(void);
+
+	void clear();	// forget the fields, keep the block
+	template <class T> void add(T* & field, size_t count)
+	{
+		add_field((void**) &field, count*sizeof(T));
+	};
+	// point every field into the block; false (and every field NULL) if the
+	// allocation failed
+	bool commit();
+
+	size_t used() {return top;};
+	static size_t footprint(size_t bytes);	// what a field of that many bytes takes of the block
+	size_t capacity() {return block_size;};
+	bool on_huge_pages() {return block_huge;};	// explicit or advised
+
+protected:
+	struct SField
+	{
+		void** field;
+		size_t offset;
+	};
+	std::vector<SField> fields;
+	size_t top;
+
+	char* block;
+	size_t block_size;
+	bool block_huge;
+	bool block_mapped;	// from mmap / VirtualAlloc rather than the aligned heap
+	bool block_wants_huge;
+
+	void add_field(void** field, size_t bytes);
+	bool allocate(size_t bytes);
+	void release();
+};
@@ -0,0 +1,198 @@
+#include "FieldRaster.h"
+#include "FluidSolver.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+void CColormap::set_gradient(const unsigned char (*stops)[3], int count)
+{
+	for (int k = 0; k < 256; k++) {
+		double position = k*(count - 1)/255.;
+		int s = (int) position;
+		if (s > count - 2)
+			s = count - 2;
+		double t = position - s;
+		for (int c = 0; c < 3; c++)
+			rgb[k][c] = (unsigned char) (stops[s][c] + t*(stops[s+1][c] - stops[s][c]) + 0.5);
+	}
+}
+
+void CColormap::set_preset(int preset)
+{
+	static const unsigned char grey[2][3] = {{255, 255, 255}, {0, 0, 0}};
+	static const unsigned char heat[4][3] = {{0, 0, 0}, {200, 30, 0}, {255, 200, 0}, {255, 255, 255}};
+	static const unsigned char ice[4][3] = {{0, 0, 0}, {0, 40, 160}, {0, 200, 255}, {255, 255, 255}};
+	if (preset == COLORMAP_HEAT)
+		set_gradient(heat, 4);
+	else if (preset == COLORMAP_ICE)
+		set_gradient(ice, 4);
+	else
+		set_gradient(grey, 2);
+}
+
+const char* CColormap::preset_name(int preset)
+{
+	static const char* names[NUM_COLORMAPS] = {"grey", "heat", "ice"};
+	return preset >= 0 && preset < NUM_COLORMAPS ? names[preset] : "custom";
+}
+
+CFieldRaster::CFieldRaster()
+{
+	width = height = 0;
+	bilinear = true;
+	bgra = false;
+	auto_range = false;
+	lo = 0.;
+	hi = 1.;
+	column_n = -1;
+	column_bilinear = false;
+}
+
+void CFieldRaster::resize(int w, int h)
+{
+	width = w > 0 ? w : 0;
+	height = h > 0 ? h : 0;
+	pixels.assign((size_t) width*height, 0);
+	column_n = -1;
+}
+
+void CFieldRaster::draw(const double* field, int n)
+{
+	values.resize((size_t) n*n);
+	for (int k = 0; k < n*n; k++)
+		values[k] = (float) field[k];
+	render(n);
+}
+
+void CFieldRaster::draw_speed(const vec2* velocity, int n)
+{
+	values.resize((size_t) n*n);
+	for (int k = 0; k < n*n; k++)
+		values[k] = (float) sqrt(velocity[k].x*velocity[k].x + velocity[k].y*velocity[k].y);
+	render(n);
+}
+
+void CFieldRaster::map_columns(int n)
+{
+	column.resize(width);
+	column_weight.resize(width);
+	for (int x = 0; x < width; x++) {
+		double position = (x + 0.5)*n/width;
+		if (bilinear) {
+			//between the centres of the cells on either side
+			position -= 0.5;
+			if (position < 0.)
+				position = 0.;
+			if (position > n - 1)
+				position = n - 1;
+			column[x] = (int) position;
+			column_weight[x] = (float) (position - column[x]);
+		} else {
+			column[x] = (int) position < n ? (int) position : n - 1;
+			column_weight[x] = 0.f;
+		}
+	}
+	column_n = n;
+	column_bilinear = bilinear;
+}
+
+void CFieldRaster::render(int n)
+{
+	if (width == 0 || height == 0 || n <= 0)
+		return;
+	if (column_n != n || column_bilinear != bilinear)
+		map_columns(n);
+
+	float low = (float) lo, high = (float) hi;
+	if (auto_range) {
+		low = high = values[0];
+		for (int k = 1; k < n*n; k++) {
+			low = values[k] < low ? values[k] : low;
+			high = values[k] > high ? values[k] : high;
+		}
+	}
+	float scale = high > low ? 255.f/(high - low) : 0.f;
+
+	//the colormap in the pixel byte order
+	for (int k = 0; k < 256; k++) {
+		unsigned char* p = (unsigned char*) &packed[k];
+		p[0] = colormap.rgb[k][bgra ? 2 : 0];
+		p[1] = colormap.rgb[k][1];
+		p[2] = colormap.rgb[k][bgra ? 0 : 2];
+		p[3] = 255;
+	}
+
+	if (!bilinear) {
+		indices.resize(n);
+		int previous = -1;
+		for (int y = 0; y < height; y++) {
+			int j = (int) ((y + 0.5)*n/height);
+			j = j < n ? j : n - 1;
+			uint32_t* out = &pixels[(size_t) y*width];
+			if (j == previous) {
+				memcpy(out, out - width, width*sizeof(uint32_t));
+				continue;
+			}
+			//quantize the cell row; the clamps are selects, so NaN goes to 0
+			const float* source = &values[(size_t) j*n];
+			for (int i = 0; i < n; i++) {
+				float t = (source[i] - low)*scale;
+				t = t > 0.f ? t : 0.f;
+				t = t < 255.f ? t : 255.f;
+				indices[i] = (unsigned char) (t + 0.5f);
+			}
+			for (int x = 0; x < width; x++)
+				out[x] = packed[indices[column[x]]];
+			previous = j;
+		}
+		return;
+	}
+
+	//one extra entry, so the right neighbour of the last cell is itself
+	row.resize(n + 1);
+	for (int y = 0; y < height; y++) {
+		double position = (y + 0.5)*n/height - 0.5;
+		if (position < 0.)
+			position = 0.;
+		if (position > n - 1)
+			position = n - 1;
+		int j = (int) position;
+		float wy = (float) (position - j);
+		const float* a = &values[(size_t) j*n];
+		const float* b = j + 1 < n ? a + n : a;
+		for (int i = 0; i < n; i++)
+			row[i] = a[i] + wy*(b[i] - a[i]);
+		row[n] = row[n-1];
+
+		uint32_t* out = &pixels[(size_t) y*width];
+		for (int x = 0; x < width; x++) {
+			int i = column[x];
+			float t = (row[i] + column_weight[x]*(row[i+1] - row[i]) - low)*scale;
+			t = t > 0.f ? t : 0.f;
+			t = t < 255.f ? t : 255.f;
+			out[x] = packed[(int) (t + 0.5f)];
+		}
+	}
+}
+
+bool CFieldRaster::write_ppm(const char* path)
+{
+	FILE* fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	fprintf(fp, "P6\n%d %d\n255\n", width, height);
+	std::vector<unsigned char> line((size_t) 3*width);
+	bool ok = true;
+	for (int y = 0; y < height && ok; y++) {
+		const unsigned char* p = (const unsigned char*) &pixels[(size_t) y*width];
+		for (int x = 0; x < width; x++) {
+			line[3*x] = p[4*x + (bgra ? 2 : 0)];
+			line[3*x+1] = p[4*x + 1];
+			line[3*x+2] = p[4*x + (bgra ? 0 : 2)];
+		}
+		ok = fwrite(line.data(), 1, line.size(), fp) == line.size();
+	}
+	if (fclose(fp) != 0)
+		ok = false;
+	return ok;
+}
@@ -0,0 +1,71 @@
+// FieldRaster.h: density and speed fields shaded into an RGBA8 image
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class vec2;
+
+// presets for CColormap::set_preset()
+enum { COLORMAP_GREY, COLORMAP_HEAT, COLORMAP_ICE, NUM_COLORMAPS };
+
+// 256 colours, from the lowest field value to the highest
+class CColormap
+{
+public:
+	unsigned char rgb[256][3];
+
+	CColormap() {set_preset(COLORMAP_GREY);};
+
+	// count >= 2 colours, spread evenly from the first entry to the last
+	void set_gradient(const unsigned char (*stops)[3], int count);
+	// GREY is the view's original white to black
+	void set_preset(int preset);
+	static const char* preset_name(int preset);
+};
+
+// Shades a scalar field of n x n cells into width x height pixels, top row
+// first, with cell (i, j) at column i and row j as the view draws it. The
+// field is turned into colormap indices by loops without branches, so the
+// compiler can vectorize them, and every output row then gathers from the
+// colormap, packed once per draw into the pixel byte order:
+//  - nearest: a pixel takes the cell it falls in. Only the cell rows that
+//    are shown get quantized, and a pixel row showing the same cells as the
+//    one above it is copied.
+//  - bilinear: a pixel centre maps to a continuous cell position. The value
+//    is interpolated between the four cell centres around it before
+//    quantizing, so the gradients stay smooth at any scale.
+// The source column of every output column is worked out once per size.
+class CFieldRaster
+{
+public:
+	int width, height;
+	std::vector<uint32_t> pixels;	// width*height, top row first
+	bool bilinear;
+	bool bgra;			// bytes B, G, R, A (a Windows DIB) instead of R, G, B, A
+	bool auto_range;	// lo and hi from the field's minimum and maximum at every draw
+	double lo, hi;		// field values at the first and the last colour
+	CColormap colormap;
+
+	CFieldRaster();
+
+	void resize(int w, int h);
+	void draw(const double* field, int n);
+	void draw_speed(const vec2* velocity, int n);	// |velocity|
+	bool write_ppm(const char* path);	// binary PPM (P6)
+
+protected:
+	std::vector<float> values;			// the field being drawn
+	std::vector<unsigned char> indices;	// nearest: one quantized cell row
+	std::vector<float> row;				// bilinear: one row interpolated between two cell rows
+	std::vector<int> column;			// per output column: the cell, or the left one for bilinear
+	std::vector<float> column_weight;	// bilinear: of the right cell
+	int column_n;						// the field size and mode column was made for
+	bool column_bilinear;
+	uint32_t packed[256];
+
+	void render(int n);
+	void map_columns(int n);
+};
@@ -1,24 +1,86 @@
-#include "StdAfx.h"
 #include "FluidSolver.h"
+#include <new>
 
 //Loosely following Jos Stam's Stable Fluids
 
-CFluidSolver::CFluidSolver(void):
-n(60), size(60*60), h(0.1), laplacian(size,size), diffusion(size,size), velocity_diffusion(size, size)
+static double min4(double a, double b, double c, double d)
+{
+	double ab = a < b ? a : b, cd = c < d ? c : d;
+	return ab < cd ? ab : cd;
+}
+
+static double max4(double a, double b, double c, double d)
+{
+	double ab = a > b ? a : b, cd = c > d ? c : d;
+	return ab > cd ? ab : cd;
+}
+
+CFluidSolver::CFluidSolver(int grid_n):
+n(grid_n), size(grid_n*grid_n), h(0.1), laplacian(0,0), diffusion(0,0), velocity_diffusion(0,0)
 {
 	//default size is set to 60^2
-	velocity = new vec2[size];
-	velocity_source = new vec2[size];
-	advected_velocity = new vec2[size];
-	density = new double[size];
-	density_source = new double[size];
-	pressure = new double[size];
-	divergence = new double[size];
-	temp_x = new double[size]; // Allocate temp array for x-velocity
-	temp_y = new double[size]; // Allocate temp array for y-velocity
+	viscosity_coef = 0.1; // Default viscosity
+	pressure_iterations = 10;
+	advection_mode = ADVECT_SEMI_LAGRANGIAN;
+	frame_time = h;
+	adaptive_step = false;
+	cfl_target = 2.;
+	max_substeps = 8;
+	fixed_substeps = 1;
+	last_substeps = 1;
+	last_cfl = 0.;
+	direct_solve = false;
+	fused_velocity = true;
+	velocity_bytes = 0;
+	task_graph = true;
+
+	layout_fields();
+	build_operators();
+	reset();
+}
+
+void CFluidSolver::layout_fields()
+{
+	//every field and solve work vector in one block; the old contents are not kept
+	arena.clear();
+	arena.add(velocity, size);
+	arena.add(velocity_source, size);
+	arena.add(advected_velocity, size);
+	arena.add(density, size);
+	arena.add(density_source, size);
+	arena.add(diffused_density, size);
+	arena.add(pressure, size);
+	arena.add(divergence, size);
+	arena.add(temp_x, size);
+	arena.add(temp_y, size);
+	for (int k = 0; k < 2; k++) {
+		arena.add(scalar_scratch[k], size);
+		arena.add(vector_scratch[k], size);
+	}
+	arena.add(source_mark, size);
+	arena.add(dissection_order, size);
+	for (int m = 0; m < 4; m++)
+		for (int k = 0; k < 8; k++)
+			arena.add(solve_work[m][k], size);
+	arena.add(solve_sums, sum_blocks(size) + 1);
+	bricks.add_fields(arena, n);
+	obstacles.add_fields(arena, n);
+	if (!arena.commit())
+		throw std::bad_alloc();
+	obstacles.clear();
+
+	laplacian.setWorkBuffers(solve_work[0]);
+	diffusion.setWorkBuffers(solve_work[1]);
+	velocity_diffusion.setWorkBuffers(solve_work[2]);
+	nested_dissection_order(n, dissection_order);
+	invalidate_factors();
+}
 
+void CFluidSolver::build_operators()
+{
 	double diffusion_coef = 0.3*h;
-	viscosity_coef = 0.1; // Default viscosity
+	laplacian.setDimensions(size);
+	diffusion.setDimensions(size);
 
 	//Set up the Laplacian matrix and diffusion matrix
 	for (int i = 0; i < n; i++) {
@@ -63,7 +125,19 @@ n(60), size(60*60), h(0.1), laplacian(size,size), diffusion(size,size), velocity
 	}
 
     setup_velocity_diffusion_matrix(viscosity_coef); // Build initial velocity diffusion matrix
+	laplacian_factor.invalidate();
+	diffusion_factor.invalidate();
+}
+
+void CFluidSolver::resize(int grid_n)
+{
+	n = grid_n;
+	size = n*n;
+	layout_fields();
+	double viscosity = viscosity_coef; // reset() goes back to the default
 	reset();
+	viscosity_coef = viscosity;
+	build_operators();
 }
 
 void CFluidSolver::reset()
@@ -75,81 +149,503 @@ void CFluidSolver::reset()
 		divergence[i] = 0.;
 		pressure[i] = 0.;
 		velocity_source[i] = vec2(0.,0.);
+		diffused_density[i] = 0.;
+		temp_x[i] = 0.;
+		temp_y[i] = 0.;
+		source_mark[i] = 0;
 		viscosity_coef = 0.1;
 	}
-
+	density_source_cells.clear();
+	velocity_source_cells.clear();
+	bricks.reset();
+	solve_count = 0;
+	simulated_time = 0.;
+	stats.reset();
 }
 
 CFluidSolver::~CFluidSolver(void)
 {
-	delete[] velocity;
-	delete[] density;
-	delete[] pressure;
-	delete[] divergence;
-
-	delete[] density_source;
-	delete[] velocity_source;
-	delete[] advected_velocity;
-	delete[] temp_x; // Deallocate temp array for x-velocity
-	delete[] temp_y; // Deallocate temp array for y-velocity
-	// velocity_diffusion is cleaned up by its destructor
+	// the fields go with the arena, the operators with their destructors
 }
 
 void CFluidSolver::update()
 {
-	updateDensity();
-	updateVelocity();
+	//the sources are velocity too, they take effect in the first sub-step
+	double speed = max_speed();
+	last_cfl = speed*frame_time;
+	int substeps = fixed_substeps;
+	if (adaptive_step) {
+		substeps = (int) ceil(last_cfl / cfl_target);
+		if (substeps < 1)
+			substeps = 1;
+		if (substeps > max_substeps)
+			substeps = max_substeps;
+	}
+	last_cfl /= substeps;
+	last_substeps = substeps;
+
+	if (h != frame_time/substeps)
+		set_time_step(frame_time/substeps);
+	for (int s = 0; s < substeps; s++)
+		step();
 }
 
-void CFluidSolver::updateDensity()
+void CFluidSolver::step()
 {
-	add(density, density, density_source); // density += density_source;
+	stats.begin_step();
+	if (task_graph && fused_velocity)
+		run_step_graph();
+	else {
+		updateDensity();
+		updateVelocity();
+	}
 
-	//Diffusion process
-	diffusion.solve(density_source, density, 1e-8, 30); // Diffusion_matrix density_new = density_old
+	double* scalars[] = {pressure, divergence, diffused_density, temp_x, temp_y, scalar_scratch[0], scalar_scratch[1]};
+	vec2* vectors[] = {advected_velocity, velocity_source, vector_scratch[0], vector_scratch[1]};
+	bricks.update_activity(density, velocity, scalars, 7, vectors, 4);
+	simulated_time += h;
+	stats.lap(STAGE_ACTIVITY);
+	stats.end_step();
+}
+
+void CFluidSolver::set_time_step(double new_h)
+{
+	//both diffusion operators are I + h L, so only h needs to change
+	double ratio = new_h / h;
+	diffusion.rescaleImplicitStep(ratio);
+	velocity_diffusion.rescaleImplicitStep(ratio);
+	diffusion_factor.invalidate();
+	velocity_diffusion_factor.invalidate();
+	h = new_h;
+}
+
+double CFluidSolver::max_speed()
+{
+	double max2 = 0.;
+	for (int c = 0; c < bricks.num_active_cells; c++) {
+		int k = bricks.active_cells[c];
+		double x = velocity[k].x + velocity_source[k].x;
+		double y = velocity[k].y + velocity_source[k].y;
+		if (x*x + y*y > max2)
+			max2 = x*x + y*y;
+	}
+	return sqrt(max2);
+}
+
+void CFluidSolver::set_sparse(bool enable)
+{
+	//every tile starts active and the next update_activity() drops the empty
+	//ones; only a grid without density, velocity or sources may start with
+	//none, as after reset()
+	bricks.set_sparse(enable);
+	if (!enable || !density_source_cells.empty() || !velocity_source_cells.empty())
+		return;
+	for (int k = 0; k < size; k++)
+		if (density[k] != 0. || velocity[k].x != 0. || velocity[k].y != 0.)
+			return;
+	bricks.reset();
+}
+
+void CFluidSolver::set_density_source(int index, double value)
+{
+	density_source[index] = value;
+	if (!(source_mark[index] & 1)) {
+		source_mark[index] |= 1;
+		density_source_cells.push_back(index);
+	}
+	bricks.touch(index);
+}
+
+void CFluidSolver::set_velocity_source(int index, vec2 value)
+{
+	velocity_source[index] = value;
+	if (!(source_mark[index] & 2)) {
+		source_mark[index] |= 2;
+		velocity_source_cells.push_back(index);
+	}
+	bricks.touch(index);
+}
+
+void CFluidSolver::add_splats(const SSplat* splats, int count)
+{
+	for (int s = 0; s < count; s++) {
+		const SSplat & splat = splats[s];
+		bool has_density = splat.density != 0.;
+		bool has_velocity = splat.velocity.x != 0. || splat.velocity.y != 0.;
+		if (splat.radius <= 0.) {
+			int i = (int) floor(splat.x + 0.5), j = (int) floor(splat.y + 0.5);
+			if (i < 0 || i >= n || j < 0 || j >= n)
+				continue;
+			int index = i + j*n;
+			if (has_density)
+				set_density_source(index, density_source[index] + splat.density);
+			if (has_velocity)
+				set_velocity_source(index, velocity_source[index] + splat.velocity);
+			continue;
+		}
+		double reach = 3.*splat.radius;
+		int i0 = (int) ceil(splat.x - reach), i1 = (int) floor(splat.x + reach);
+		int j0 = (int) ceil(splat.y - reach), j1 = (int) floor(splat.y + reach);
+		i0 = i0 < 0 ? 0 : i0;
+		j0 = j0 < 0 ? 0 : j0;
+		i1 = i1 > n-1 ? n-1 : i1;
+		j1 = j1 > n-1 ? n-1 : j1;
+		double scale = -1./(splat.radius*splat.radius);
+		for (int j = j0; j <= j1; j++)
+			for (int i = i0; i <= i1; i++) {
+				double dx = i - splat.x, dy = j - splat.y;
+				if (dx*dx + dy*dy > reach*reach)
+					continue;
+				double w = exp((dx*dx + dy*dy)*scale);
+				int index = i + j*n;
+				if (has_density)
+					set_density_source(index, density_source[index] + w*splat.density);
+				if (has_velocity)
+					set_velocity_source(index, velocity_source[index] + splat.velocity*w);
+			}
+	}
+}
+
+void CFluidSolver::rebuild_source_cells()
+{
+	density_source_cells.clear();
+	velocity_source_cells.clear();
+	for (int i = 0; i < size; i++) {
+		source_mark[i] = 0;
+		if (density_source[i] != 0.)
+			set_density_source(i, density_source[i]);
+		if (velocity_source[i].x != 0. || velocity_source[i].y != 0.)
+			set_velocity_source(i, velocity_source[i]);
+	}
+}
+
+void CFluidSolver::apply_density_sources()
+{
+	for (size_t c = 0; c < density_source_cells.size(); c++) {
+		int i = density_source_cells[c];
+		density[i] += density_source[i];
+	}
+}
+
+void CFluidSolver::apply_velocity_sources()
+{
+	for (size_t c = 0; c < velocity_source_cells.size(); c++) {
+		int i = velocity_source_cells[c];
+		velocity[i] = velocity[i] + velocity_source[i];
+	}
+}
+
+unsigned int CFluidSolver::solve_active(int which, CSparseMatrix & m, double* x, double* b, double tol, unsigned int iter_max)
+{
+	unsigned int iterations;
+	double residual;
+	CSparseCholesky* factor = &m == &laplacian ? &laplacian_factor :
+		&m == &diffusion ? &diffusion_factor : &m == &velocity_diffusion ? &velocity_diffusion_factor : NULL;
+	bool direct;
+	{
+		std::lock_guard<std::mutex> lock(solve_mutex);
+		solve_count++;
+		direct = direct_solve && factor && bricks.all_active() &&
+			(factor->valid || factor->factorize(m, dissection_order));
+	}
+
+	//the y velocity solve has work of its own, so it can run beside the x
+	//solve on the same operator and factor (see run_step_graph())
+	double* work[9] = {m.dr, m.drb, m.dp, m.dpb, m.dz, m.dzb, m.dAp, m.dATpb, m.partials};
+	if (which == SOLVE_VELOCITY_Y) {
+		for (int k = 0; k < 8; k++)
+			work[k] = solve_work[3][k];
+		work[8] = solve_sums;
+	}
+	if (direct) {
+		factor->solve(x, b, work[0]);
+		stats.record_solve(which, 0, 0.);
+		return 0;
+	}
+	if (bricks.all_active())
+		iterations = m.solve(x, b, tol, iter_max, work, residual);
+	else
+		iterations = m.solve(x, b, tol, iter_max, bricks.active_cells, bricks.num_active_cells, bricks.cell_mask, work, residual);
+	stats.record_solve(which, iterations, residual);
+	return iterations;
+}
+
+void CFluidSolver::solve_pressure()
+{
+	if (!obstacles.any()) {
+		solve_active(SOLVE_PRESSURE, laplacian, pressure, divergence, 1e-8, pressure_iterations);
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(solve_mutex);
+		solve_count++;
+	}
+	//the operator follows the mask, which may have changed since the last
+	//step; laplacian's work vectors are free while it is not used
+	double* work[5] = {solve_work[0][0], solve_work[0][1], solve_work[0][2], solve_work[0][3], solve_work[0][4]};
+	double residual;
+	unsigned int iterations = obstacles.poisson_solve(pressure, divergence, 1e-8, pressure_iterations, work, residual);
+	if (!bricks.all_active())
+		for (int k = 0; k < size; k++)
+			if (!bricks.cell_mask[k])
+				pressure[k] = 0.;
+	stats.record_solve(SOLVE_PRESSURE, iterations, residual);
+}
+
+void CFluidSolver::invalidate_factors()
+{
+	laplacian_factor.invalidate();
+	diffusion_factor.invalidate();
+	velocity_diffusion_factor.invalidate();
+}
+
+void CFluidSolver::updateDensity()
+{
+	density_diffusion();
+	stats.lap(STAGE_DENSITY_DIFFUSION);
 
 	density_advection();
 	clean_density_source();
+	stats.lap(STAGE_DENSITY_ADVECTION);
+}
+
+void CFluidSolver::density_diffusion()
+{
+	apply_density_sources();
+
+	//Diffusion process
+	solve_active(SOLVE_DENSITY, diffusion, diffused_density, density, 1e-8, 30); // Diffusion_matrix density_new = density_old
 }
 
 void CFluidSolver::updateVelocity()
 {
 	velocity_advection();
-	add(velocity, advected_velocity, velocity_source);
-
-	// Add buoyancy force (proportional to density, acts upwards)
-	double buoyancy_coef = 0.1;
-	for (int i = 1; i < n - 1; i++) {
-		for (int j = 1; j < n - 1; j++) {
-			int index = i + j * n;
-			if (density[index] > 0) { // Apply force only where there's density
-				vec2 buoyancy_force = vec2(0.0, -buoyancy_coef * density[index]);
-				velocity[index] = velocity[index] + buoyancy_force; 
+	if (fused_velocity)
+		fused_velocity_passes();
+	else
+		separate_velocity_passes();
+	clean_velocity_source();
+	stats.lap(STAGE_PROJECTION);
+}
+
+// The same sums as separate_velocity_passes(), in two sweeps over the
+// active tiles around the diffusion solves instead of five
+void CFluidSolver::fused_velocity_passes()
+{
+	fused_source_pass();
+	stats.lap(STAGE_VELOCITY_ADVECTION);
+
+	fused_forces_pass();
+	stats.lap(STAGE_FORCES);
+
+	if (viscosity_coef > 0) {
+		solve_active(SOLVE_VELOCITY_X, velocity_diffusion, temp_x, temp_x, 1e-8, 30);
+		solve_active(SOLVE_VELOCITY_Y, velocity_diffusion, temp_y, temp_y, 1e-8, 30);
+	}
+	stats.lap(STAGE_VELOCITY_DIFFUSION);
+
+	fused_projection_pass();
+}
+
+void CFluidSolver::fused_source_pass()
+{
+	//the sources go into the advected field first, so every sum is formed
+	//in the same order as in the separate passes
+	for (size_t c = 0; c < velocity_source_cells.size(); c++) {
+		int k = velocity_source_cells[c];
+		advected_velocity[k] = advected_velocity[k] + velocity_source[k];
+	}
+}
+
+void CFluidSolver::fused_forces_pass()
+{
+	bool diffuse = viscosity_coef > 0;
+	//advected velocity plus buoyancy, straight into the diffusion right-hand sides
+	double buoyancy_coef = 1.0;
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int j = bj0; j < bj1; j++) {
+			bool interior_row = j > 0 && j < n-1;
+			for (int i = bi0; i < bi1; i++) {
+				int index = i + j*n;
+				vec2 u = advected_velocity[index];
+				if (interior_row && i > 0 && i < n-1 && density[index] > 0)
+					u = u + vec2(0.0, -buoyancy_coef * h * density[index]);
+				if (diffuse) {
+					temp_x[index] = u.x;
+					temp_y[index] = u.y;
+				} else
+					velocity[index] = u;
+			}
+		}
+	}
+}
+
+void CFluidSolver::fused_projection_pass()
+{
+	bool diffuse = viscosity_coef > 0;
+	//the walls, then the diffused components back into velocity together
+	//with the divergence, which reads them from temp_x and temp_y
+	double* vx = temp_x;
+	double* vy = temp_y;
+	for (int i = 0; i < n; i++) {
+		int walls[4] = {i*n, n-1 + i*n, i, i + (n-1)*n};
+		for (int w = 0; w < 4; w++) {
+			velocity[walls[w]] = vec2(0.,0.);
+			if (diffuse)
+				vx[walls[w]] = vy[walls[w]] = 0.;
+		}
+	}
+	fill_solid(velocity, obstacle_velocity);
+	if (diffuse) {
+		fill_solid(vx, obstacle_velocity.x);
+		fill_solid(vy, obstacle_velocity.y);
+	}
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int j = bj0; j < bj1; j++) {
+			bool interior_row = j > 0 && j < n-1;
+			for (int i = bi0; i < bi1; i++) {
+				int index = i + j*n;
+				if (!diffuse) {
+					if (interior_row && i > 0 && i < n-1)
+						divergence[index] = 0.5*(velocity[index+1].x-velocity[index-1].x
+							+ velocity[index+n].y - velocity[index-n].y);
+					continue;
+				}
+				velocity[index] = vec2(vx[index], vy[index]);
+				if (interior_row && i > 0 && i < n-1)
+					divergence[index] = 0.5*(vx[index+1]-vx[index-1] + vy[index+n] - vy[index-n]);
+			}
+		}
+	}
+	pressure_correction();
+
+	//sources; advected velocity and density in, right-hand sides out; walls;
+	//components in, velocity and divergence out
+	long long cells = bricks.num_active_cells;
+	long long sources = (long long) velocity_source_cells.size();
+	velocity_bytes = sources*48 + cells*40 + 4LL*n*(diffuse ? 32 : 16) + cells*(diffuse ? 32 : 16) + active_interior_cells()*8;
+}
+
+void CFluidSolver::separate_velocity_passes()
+{
+	for (int c = 0; c < bricks.num_active_cells; c++) {
+		int k = bricks.active_cells[c];
+		velocity[k] = advected_velocity[k];
+	}
+	apply_velocity_sources();
+	stats.lap(STAGE_VELOCITY_ADVECTION);
+
+	// Add buoyancy force (proportional to density, acts upwards), per unit time
+	double buoyancy_coef = 1.0;
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++) {
+			for (int j = bj0; j < bj1; j++) {
+				int index = i + j * n;
+				if (density[index] > 0) { // Apply force only where there's density
+					vec2 buoyancy_force = vec2(0.0, -buoyancy_coef * h * density[index]);
+					velocity[index] = velocity[index] + buoyancy_force; 
+				}
 			}
 		}
 	}
+	stats.lap(STAGE_FORCES);
 
     // Velocity Diffusion step
     if (viscosity_coef > 0) { // Only solve if viscosity is positive
         // Extract components
-        for (int k = 0; k < size; k++) {
+        for (int c = 0; c < bricks.num_active_cells; c++) {
+            int k = bricks.active_cells[c];
             temp_x[k] = velocity[k].x;
             temp_y[k] = velocity[k].y;
         }
 
         // Solve diffusion implicitly for each component
-        velocity_diffusion.solve(temp_x, temp_x, 1e-8, 30);
-        velocity_diffusion.solve(temp_y, temp_y, 1e-8, 30);
+        solve_active(SOLVE_VELOCITY_X, velocity_diffusion, temp_x, temp_x, 1e-8, 30);
+        solve_active(SOLVE_VELOCITY_Y, velocity_diffusion, temp_y, temp_y, 1e-8, 30);
 
         // Combine components back
-        for (int k = 0; k < size; k++) {
+        for (int c = 0; c < bricks.num_active_cells; c++) {
+            int k = bricks.active_cells[c];
             velocity[k].x = temp_x[k];
             velocity[k].y = temp_y[k];
         }
     }
+	stats.lap(STAGE_VELOCITY_DIFFUSION);
 
 	projection();
-	clean_velocity_source();
+
+	//copy; sources; buoyancy (density in, velocity in and out); split and
+	//combine; walls; divergence (velocity in, divergence out)
+	long long cells = bricks.num_active_cells;
+	long long sources = (long long) velocity_source_cells.size();
+	long long interior = active_interior_cells();
+	velocity_bytes = cells*32 + sources*48 + interior*40 + (viscosity_coef > 0 ? cells*64 : 0) + 4LL*n*16 + interior*24;
+}
+
+// The step of updateDensity() and the fused updateVelocity() as tasks. The
+// density diffusion and advection and the velocity advection only read the
+// old velocity, so they run side by side; the forces need the new density
+// and the advected velocity; the x and y solves only share the operator,
+// which neither writes; the projection needs both components.
+void CFluidSolver::run_step_graph()
+{
+	step_graph.clear();
+	int diffuse_density = step_graph.add("density diffusion", STAGE_DENSITY_DIFFUSION, [this] {density_diffusion();});
+	int advect_velocity = step_graph.add("velocity advection", STAGE_VELOCITY_ADVECTION, [this] {
+		velocity_advection();
+		fused_source_pass();
+	});
+	int advect_density = step_graph.add("density advection", STAGE_DENSITY_ADVECTION, [this] {
+		density_advection();
+		clean_density_source();
+	});
+	step_graph.depends(advect_density, diffuse_density);
+	int forces = step_graph.add("forces", STAGE_FORCES, [this] {fused_forces_pass();});
+	step_graph.depends(forces, advect_density);
+	step_graph.depends(forces, advect_velocity);
+	int solves[2];
+	int num_solves = 0;
+	if (viscosity_coef > 0) {
+		solves[num_solves++] = step_graph.add("velocity x solve", STAGE_VELOCITY_DIFFUSION, [this] {
+			solve_active(SOLVE_VELOCITY_X, velocity_diffusion, temp_x, temp_x, 1e-8, 30);
+		});
+		solves[num_solves++] = step_graph.add("velocity y solve", STAGE_VELOCITY_DIFFUSION, [this] {
+			solve_active(SOLVE_VELOCITY_Y, velocity_diffusion, temp_y, temp_y, 1e-8, 30);
+		});
+	}
+	int project = step_graph.add("projection", STAGE_PROJECTION, [this] {
+		fused_projection_pass();
+		clean_velocity_source();
+	});
+	if (num_solves == 0)
+		step_graph.depends(project, forces);
+	for (int k = 0; k < num_solves; k++) {
+		step_graph.depends(solves[k], forces);
+		step_graph.depends(project, solves[k]);
+	}
+
+	step_graph.run();
+	for (size_t k = 0; k < step_graph.tasks.size(); k++)
+		stats.add_stage(step_graph.tasks[k].stage, step_graph.tasks[k].end_ns - step_graph.tasks[k].start_ns);
+	stats.critical_ns = step_graph.critical_ns;
+}
+
+long long CFluidSolver::active_interior_cells()
+{
+	long long cells = 0;
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		if (bi1 > bi0 && bj1 > bj0)
+			cells += (long long) (bi1 - bi0)*(bj1 - bj0);
+	}
+	return cells;
 }
 
 void CFluidSolver::projection()
@@ -161,52 +657,111 @@ void CFluidSolver::projection()
 		*v(i, 0)=vec2(0.,0.);
 		*v(i, n-1)=vec2(0.,0.);
 	}
+	fill_solid(velocity, obstacle_velocity);
 
 	//compute divergence
-	for (int i = 1; i < n-1; i++)
+	for (int b = 0; b < bricks.num_active; b++)
 	{
-		for (int j = 1; j < n-1; j++)
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++)
 		{
-			divergence[i+n*j] = 0.5*(v(i+1,j)->x-v(i-1,j)->x
-				+ v(i, j+1)->y - v(i, j-1)->y);
+			for (int j = bj0; j < bj1; j++)
+			{
+				divergence[i+n*j] = 0.5*(v(i+1,j)->x-v(i-1,j)->x
+					+ v(i, j+1)->y - v(i, j-1)->y);
+			}
 		}
 	}
 
+	pressure_correction();
+}
+
+void CFluidSolver::pressure_correction()
+{
 	//get pressure by solving (Laplacian pressure = divergence)
-	laplacian.solve(pressure, divergence, 1e-8, 10);
+	//in sparse mode the pressure outside the active tiles is held at zero
+	solve_pressure();
 
 	//update velocity by (velocity -= gradient of pressure)
-	for (int i = 1; i < n-1; i++)
+	if (obstacles.any()) {
+		//solid cells keep the obstacle velocity, and a solid neighbour
+		//reads as the cell's own pressure
+		for (int b = 0; b < bricks.num_active; b++) {
+			int bi0, bi1, bj0, bj1;
+			bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+			for (int j = bj0; j < bj1; j++)
+				for (int i = bi0; i < bi1; i++) {
+					if (obstacles.solid(i, j))
+						continue;
+					double here = p(i, j);
+					double left = obstacles.solid(i-1, j) ? here : p(i-1, j);
+					double right = obstacles.solid(i+1, j) ? here : p(i+1, j);
+					double below = obstacles.solid(i, j-1) ? here : p(i, j-1);
+					double above = obstacles.solid(i, j+1) ? here : p(i, j+1);
+					v(i, j)->x += 0.5 * (right - left);
+					v(i, j)->y += 0.5 * (above - below);
+				}
+		}
+		return;
+	}
+	for (int b = 0; b < bricks.num_active; b++)
 	{
-		for (int j = 1; j < n-1; j++)
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++)
 		{
-			v(i, j)->x += 0.5 * (p(i+1, j) - p(i-1, j));
-			v(i, j)->y += 0.5 * (p(i, j+1) - p(i, j-1));
-			*v(i,j) = *v(i,j)*1.;
+			for (int j = bj0; j < bj1; j++)
+			{
+				v(i, j)->x += 0.5 * (p(i+1, j) - p(i-1, j));
+				v(i, j)->y += 0.5 * (p(i, j+1) - p(i, j-1));
+			}
 		}
 	}
 
 }
 
+double CFluidSolver::divergence_residual()
+{
+	//RMS of the discrete (central difference) divergence over the interior cells
+	double sum = 0.;
+	int cells = 0;
+	for (int i = 1; i < n-1; i++)
+		for (int j = 1; j < n-1; j++) {
+			if (obstacles.any() && obstacles.solid(i, j))
+				continue;
+			cells++;
+			double div = 0.5*(v(i+1,j)->x-v(i-1,j)->x + v(i, j+1)->y - v(i, j-1)->y);
+			sum += div*div;
+		}
+	return cells > 0 ? sqrt(sum/cells) : 0.;
+}
+
 void CFluidSolver::clean_density_source()
 {
-	for (int i=0; i < size; i++) {
+	for (size_t c = 0; c < density_source_cells.size(); c++) {
+		int i = density_source_cells[c];
 		density_source[i] = 0.;
+		source_mark[i] &= ~1;
 	}
+	density_source_cells.clear();
 }
 
 void CFluidSolver::clean_velocity_source()
 {
-	for (int i=0; i < size; i++) {
+	for (size_t c = 0; c < velocity_source_cells.size(); c++) {
+		int i = velocity_source_cells[c];
 		velocity_source[i] = vec2(0.,0.);
+		source_mark[i] &= ~2;
 	}
+	velocity_source_cells.clear();
 }
 
 void CFluidSolver::density_advection()
 {
-//	for (int i=0; i<size; i++)
-//		density[i]=density_source[i];
-//	return;
+	//the diffusion does not know the obstacles and spreads into them
+	fill_solid(diffused_density, 0.);
+	advect(density, diffused_density);
 
 	//set boundary condition
 	for (int i=0; i< n; i++) {
@@ -215,35 +770,13 @@ void CFluidSolver::density_advection()
 		*d(i, 0)=0;
 		*d(i, n-1)=0;
 	}
-
-	vec2 backtraced_position;
-	//Density advection
-	for (int i = 1; i < n-1; i++)
-		for (int j=1; j < n-1; j++) {
-			//go backwards following the velocity field
-			backtraced_position = vec2(i,j);
-			backtraced_position = backtraced_position + velocity[i+n*j]*(-h); 
-			if (backtraced_position.x < 0.5)
-				backtraced_position.x = 0.5;
-			if (backtraced_position.x > n-1.5)
-				backtraced_position.x = n-1.5;
-			if (backtraced_position.y < 0.5)
-				backtraced_position.y = 0.5;
-			if (backtraced_position.y > n-1.5)
-				backtraced_position.y = n-1.5;
-
-			//bilinear interpolation
-			int i0 = (int) backtraced_position.x;
-			int j0 = (int) backtraced_position.y;
-
-			double s = backtraced_position.x - i0;
-			double t = backtraced_position.y - j0;
-			density[i+j*n] = (1-s)*(1-t)* density_source[i0+j0*n] + (1-s)*t* density_source[i0+(j0+1)*n] + s*(1-t)* density_source[i0+1+j0*n] + s*t* density_source[i0+1+(j0+1)*n];
-		}
+	fill_solid(density, 0.);
 }
 
 void CFluidSolver::velocity_advection()
 {
+	advect(advected_velocity, velocity);
+
 	//set boundary condition
 	for (int i = 0; i < n; i++) {
 		advected_velocity[0 + i * n] = vec2(0., 0.);
@@ -251,51 +784,187 @@ void CFluidSolver::velocity_advection()
 		advected_velocity[i + 0 * n] = vec2(0., 0.);
 		advected_velocity[i + (n - 1) * n] = vec2(0., 0.);
 	}
+	fill_solid(advected_velocity, obstacle_velocity);
+}
+
+void CFluidSolver::backtrace(int i, int j, double dt, int & i0, int & j0, double & s, double & t)
+{
+	//go backwards following the velocity field
+	vec2 backtraced_position = vec2(i, j) + velocity[i + j * n] * (-dt);
+	if (backtraced_position.x < 0.5)
+		backtraced_position.x = 0.5;
+	if (backtraced_position.x > n-1.5)
+		backtraced_position.x = n-1.5;
+	if (backtraced_position.y < 0.5)
+		backtraced_position.y = 0.5;
+	if (backtraced_position.y > n-1.5)
+		backtraced_position.y = n-1.5;
+
+	i0 = (int) backtraced_position.x;
+	j0 = (int) backtraced_position.y;
+	s = backtraced_position.x - i0;
+	t = backtraced_position.y - j0;
+}
+
+void CFluidSolver::semi_lagrangian(double* dst, double* src, double dt)
+{
+	bool masked = obstacles.any();
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++)
+		for (int j = bj0; j < bj1; j++) {
+			//wall and solid cells keep their value, so intermediate fields are defined everywhere
+			if (i == 0 || i == n-1 || j == 0 || j == n-1 || (masked && obstacles.solid(i, j))) {
+				dst[i+j*n] = src[i+j*n];
+				continue;
+			}
+			int i0, j0;
+			double s, t;
+			backtrace(i, j, dt, i0, j0, s, t);
+
+			//bilinear interpolation
+			dst[i+j*n] = (1-s)*(1-t)* src[i0+j0*n] + (1-s)*t* src[i0+(j0+1)*n] + s*(1-t)* src[i0+1+j0*n] + s*t* src[i0+1+(j0+1)*n];
+		}
+	}
+}
+
+void CFluidSolver::semi_lagrangian(vec2* dst, vec2* src, double dt)
+{
+	bool masked = obstacles.any();
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++) {
+			for (int j = bj0; j < bj1; j++) {
+				if (i == 0 || i == n-1 || j == 0 || j == n-1 || (masked && obstacles.solid(i, j))) {
+					dst[i + j * n] = src[i + j * n];
+					continue;
+				}
+				int i0, j0;
+				double s, t;
+				backtrace(i, j, dt, i0, j0, s, t);
+
+				// Bilinear interpolation
+				vec2 v00 = src[i0 + j0 * n];
+				vec2 v01 = src[i0 + (j0 + 1) * n];
+				vec2 v10 = src[i0 + 1 + j0 * n];
+				vec2 v11 = src[i0 + 1 + (j0 + 1) * n];
+
+				// Compute each term separately to avoid chained expressions
+				vec2 term1 = v00 * ((1 - s) * (1 - t));
+				vec2 term2 = v01 * ((1 - s) * t);
+				vec2 term3 = v10 * (s * (1 - t));
+				vec2 term4 = v11 * (s * t);
+				vec2 result = term1 + term2;
+				result = result + term3;
+				result = result + term4;
+
+				dst[i + j * n] = result;
+			}
+		}
+	}
+}
+
+void CFluidSolver::limit(double* dst, double* src)
+{
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++)
+		for (int j = bj0; j < bj1; j++) {
+			int i0, j0;
+			double s, t;
+			backtrace(i, j, h, i0, j0, s, t);
+			double* p = src + i0+j0*n;
+			double lo = min4(p[0], p[1], p[n], p[n+1]);
+			double hi = max4(p[0], p[1], p[n], p[n+1]);
+			double & x = dst[i+j*n];
+			if (x < lo) x = lo;
+			if (x > hi) x = hi;
+		}
+	}
+}
 
-	vec2 backtraced_position;
-	for (int i = 1; i < n - 1; i++) {
-		for (int j = 1; j < n - 1; j++) {
-			// Backtrace
-			backtraced_position = vec2(i, j) + velocity[i + j * n] * (-h);
-			// Clamp to valid range
-			if (backtraced_position.x < 0.5)
-				backtraced_position.x = 0.5;
-			if (backtraced_position.x > n - 1.5)
-				backtraced_position.x = n - 1.5;
-			if (backtraced_position.y < 0.5)
-				backtraced_position.y = 0.5;
-			if (backtraced_position.y > n - 1.5)
-				backtraced_position.y = n - 1.5;
-
-			// Bilinear interpolation
-			int i0 = (int)backtraced_position.x;
-			int j0 = (int)backtraced_position.y;
-			double s = backtraced_position.x - i0;
-			double t = backtraced_position.y - j0;
-
-			vec2 v00 = velocity[i0 + j0 * n];
-			vec2 v01 = velocity[i0 + (j0 + 1) * n];
-			vec2 v10 = velocity[i0 + 1 + j0 * n];
-			vec2 v11 = velocity[i0 + 1 + (j0 + 1) * n];
-
-			// Compute each term separately to avoid chained expressions
-			vec2 term1 = v00 * ((1 - s) * (1 - t));
-			vec2 term2 = v01 * ((1 - s) * t);
-			vec2 term3 = v10 * (s * (1 - t));
-			vec2 term4 = v11 * (s * t);
-			vec2 result = term1 + term2;
-			result = result + term3;
-			result = result + term4;
-
-			advected_velocity[i + j * n] = result;
+void CFluidSolver::limit(vec2* dst, vec2* src)
+{
+	for (int b = 0; b < bricks.num_active; b++) {
+		int bi0, bi1, bj0, bj1;
+		bricks.interior_bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+		for (int i = bi0; i < bi1; i++)
+		for (int j = bj0; j < bj1; j++) {
+			int i0, j0;
+			double s, t;
+			backtrace(i, j, h, i0, j0, s, t);
+			vec2* p = src + i0+j0*n;
+			vec2 lo = vec2(min4(p[0].x, p[1].x, p[n].x, p[n+1].x), min4(p[0].y, p[1].y, p[n].y, p[n+1].y));
+			vec2 hi = vec2(max4(p[0].x, p[1].x, p[n].x, p[n+1].x), max4(p[0].y, p[1].y, p[n].y, p[n+1].y));
+			vec2 & x = dst[i+j*n];
+			if (x.x < lo.x) x.x = lo.x;
+			if (x.x > hi.x) x.x = hi.x;
+			if (x.y < lo.y) x.y = lo.y;
+			if (x.y > hi.y) x.y = hi.y;
 		}
 	}
 }
 
+//***************************************
+// advect src into dst over one step h, with the scheme in advection_mode.
+// MacCormack: forward step, backward step from its result, and half the
+// round trip error added back. BFECC: the same error estimate is taken off
+// src before one more forward step. Both are then clamped to the values
+// the plain backtrace interpolated between, so they cannot overshoot.
+//***************************************
+void CFluidSolver::advect(double* dst, double* src)
+{
+	if (advection_mode == ADVECT_SEMI_LAGRANGIAN) {
+		semi_lagrangian(dst, src, h);
+		return;
+	}
+	double* forward = scalar_scratch[0];
+	double* back = scalar_scratch[1];
+	semi_lagrangian(forward, src, h);
+	semi_lagrangian(back, forward, -h);
+	for (int c = 0; c < bricks.num_active_cells; c++) {
+		int k = bricks.active_cells[c];
+		if (advection_mode == ADVECT_MACCORMACK)
+			dst[k] = forward[k] + 0.5*(src[k] - back[k]);
+		else
+			back[k] = src[k] + 0.5*(src[k] - back[k]);
+	}
+	if (advection_mode == ADVECT_BFECC)
+		semi_lagrangian(dst, back, h);
+	limit(dst, src);
+}
+
+void CFluidSolver::advect(vec2* dst, vec2* src)
+{
+	if (advection_mode == ADVECT_SEMI_LAGRANGIAN) {
+		semi_lagrangian(dst, src, h);
+		return;
+	}
+	vec2* forward = vector_scratch[0];
+	vec2* back = vector_scratch[1];
+	semi_lagrangian(forward, src, h);
+	semi_lagrangian(back, forward, -h);
+	for (int c = 0; c < bricks.num_active_cells; c++) {
+		int k = bricks.active_cells[c];
+		vec2 error = vec2(src[k].x - back[k].x, src[k].y - back[k].y) * 0.5;
+		if (advection_mode == ADVECT_MACCORMACK)
+			dst[k] = forward[k] + error;
+		else
+			back[k] = src[k] + error;
+	}
+	if (advection_mode == ADVECT_BFECC)
+		semi_lagrangian(dst, back, h);
+	limit(dst, src);
+}
+
 
 void CFluidSolver::setup_velocity_diffusion_matrix(double viscosity)
 {
     velocity_diffusion.setDimensions(size); // Resets rowList, colList, diagonal, and solver arrays
+    velocity_diffusion_factor.invalidate();
 
     double coef = viscosity * h;
     if (coef <= 0) { // If viscosity is non-positive, just set identity matrix
@@ -1,4 +1,12 @@
 #include "SparseMatrix.h"
+#include "BrickGrid.h"
+#include "ObstacleMask.h"
+#include "SolverStats.h"
+#include "FieldArena.h"
+#include "SparseCholesky.h"
+#include "TaskGraph.h"
+#include <mutex>
+#include <vector>
 
 #pragma once
 class vec2
@@ -7,11 +15,24 @@ public:
 	double x, y;
 	vec2():x(0.),y(0.){};
 	vec2(double a, double b):x(a),y(b){};
-	vec2 operator*(double s) {return vec2(s*x,s*y);};
-	vec2 operator+(vec2 & v) {return vec2(x+v.x,y+v.y);};
-	vec2& operator=(vec2 & v) {x=v.x; y=v.y; return *this;};
+	vec2 operator*(double s) const {return vec2(s*x,s*y);};
+	vec2 operator+(const vec2 & v) const {return vec2(x+v.x,y+v.y);};
 };
 
+// A source for the next step, added to what is already there. With radius 0
+// it all goes to the cell nearest (x, y); otherwise every cell within three
+// radii gets amount * exp(-d^2 / radius^2), d its distance to (x, y).
+struct SSplat
+{
+	double x, y;		// in cells: cell (i, j) is at (i, j)
+	double radius;		// in cells
+	double density;
+	vec2 velocity;
+};
+
+// schemes for CFluidSolver::advection_mode
+enum { ADVECT_SEMI_LAGRANGIAN, ADVECT_MACCORMACK, ADVECT_BFECC };
+
 class CFluidSolver
 {
 public:
@@ -19,6 +40,12 @@ public:
 	int		size;	// = n * n
 	double	h;		// time step
 
+	// Every array below, the operators' solve work vectors and the tile
+	// lists are carved from this one block (see layout_fields()).
+	CFieldArena arena;
+	double* solve_work[4][8];	// CSparseMatrix work vectors of laplacian, diffusion, velocity_diffusion, and the y velocity solve
+	double* solve_sums;			// block sums of the y velocity solve
+
 	double*	density;
 	vec2*	velocity;
 	double* pressure;
@@ -27,45 +54,153 @@ public:
 	double* density_source;
 	vec2*	velocity_source;
 	vec2*	advected_velocity; //temp variable
+	double* diffused_density;	// the density diffusion result, read by the advection
+
+	// The cells with a nonzero source, so applying and clearing the sources
+	// costs as much as the splats did, not a sweep of the grid. Every write
+	// to density_source or velocity_source has to go through set_*_source()
+	// or add_splats(), or be followed by rebuild_source_cells().
+	std::vector<int> density_source_cells;
+	std::vector<int> velocity_source_cells;
+	unsigned char* source_mark;	// bit 0: in density_source_cells, bit 1: in velocity_source_cells
 	
 	CSparseMatrix laplacian;
 	CSparseMatrix diffusion;
 	CSparseMatrix velocity_diffusion; // Matrix for velocity diffusion
+	CBrickGrid bricks; // Active tiles; every stage only visits these
+	// Solid cells inside the domain (see ObstacleMask.h). They may be redrawn
+	// between any two steps; reset() keeps them. Every solid cell moves at
+	// obstacle_velocity, so an obstacle dragged along each frame pushes the
+	// fluid. With obstacles the pressure is solved by the mask's own
+	// conjugate gradients over the whole grid, never by laplacian.
+	CObstacleMask obstacles;
+	vec2 obstacle_velocity;
 
 	double viscosity_coef; // Viscosity coefficient
 	double* temp_x;         // Temporary array for x-velocity component
 	double* temp_y;         // Temporary array for y-velocity component
+	int pressure_iterations; // BiCG iterations allowed for the pressure solve
+	int advection_mode;      // ADVECT_SEMI_LAGRANGIAN, ADVECT_MACCORMACK or ADVECT_BFECC
+	double* scalar_scratch[2]; // forward and backward passes of the corrected schemes
+	vec2* vector_scratch[2];
+
+	// Time stepping: every update() advances frame_time. With adaptive_step
+	// the frame is cut into sub-steps so that no backtrace travels more than
+	// cfl_target cells; otherwise it is cut into fixed_substeps equal steps.
+	// h is the current sub-step; the implicit operators are rescaled in
+	// place when it changes.
+	double frame_time;
+	bool adaptive_step;
+	double cfl_target;
+	int max_substeps;
+	int fixed_substeps;
+	int last_substeps;	// sub-steps taken by the last update()
+	double last_cfl;	// largest velocity * h in cells, at the start of the last update()
+	long long solve_count;	// linear solves since reset()
+	double simulated_time;	// since reset()
+	CSolverStats stats;	// stage timings and solve statistics, filled by every step()
+
+	// With direct_solve the three operators are factorized once (at the
+	// first solve after they change) and every later solve is two triangular
+	// solves. Only used while every tile is active; a sparse step and a
+	// failed factorization fall back to BiCG.
+	bool direct_solve;
+	// fused_velocity: the velocity update runs as two sweeps over the active
+	// tiles (see fused_velocity_passes()) instead of five; the results are the same.
+	bool fused_velocity;
+	long long velocity_bytes;	// field bytes the velocity passes of the last step read and wrote
+	// task_graph: step() runs as a graph of tasks (see run_step_graph()), so
+	// the density diffusion and advection overlap the velocity advection and
+	// the x and y velocity solves overlap each other. Only with
+	// fused_velocity; the results are the same as in sequence.
+	bool task_graph;
+	CTaskGraph step_graph;	// the tasks of the last step, with their times and critical path
+	std::mutex solve_mutex;	// solve_count and the lazy factorizations, shared by concurrent solves
+	CSparseCholesky laplacian_factor;
+	CSparseCholesky diffusion_factor;
+	CSparseCholesky velocity_diffusion_factor;
+	int* dissection_order;	// fill-reducing order of the grid cells, shared by the factorizations
 
 public:
 	void reset();
+	void resize(int grid_n); // new grid, fields and operators; at most one allocation for the fields
+	void layout_fields();
+	void build_operators(); // laplacian, diffusion and velocity_diffusion at the current h
 	void update();
+	void step(); // one sub-step of length h
+	void set_time_step(double new_h);
+	double max_speed();
 	void updateVelocity();
 	void updateDensity();
+	void run_step_graph(); // updateDensity() and updateVelocity() as a task graph
+	void density_diffusion(); // sources in, diffusion solve
 	void setup_velocity_diffusion_matrix(double viscosity); // Function to build the velocity diffusion matrix
 	void clean_density_source();
 	void clean_velocity_source();
+	void fused_velocity_passes();
+	void fused_source_pass();
+	void fused_forces_pass();
+	void fused_projection_pass();
+	void separate_velocity_passes();
 	void projection();
+	void pressure_correction(); // pressure solve and gradient subtraction, given the divergence
+	long long active_interior_cells();
 	void density_advection();
 	void velocity_advection();
+	void advect(double* dst, double* src);
+	void advect(vec2* dst, vec2* src);
+	void backtrace(int i, int j, double dt, int & i0, int & j0, double & s, double & t);
+	void semi_lagrangian(double* dst, double* src, double dt);
+	void semi_lagrangian(vec2* dst, vec2* src, double dt);
+	void limit(double* dst, double* src); // clamp to the four values the backtrace of h lands between
+	void limit(vec2* dst, vec2* src);
+	double divergence_residual();
+	void set_sparse(bool enable); // Skip empty tiles in every stage
+	void set_density_source(int index, double value);
+	void set_velocity_source(int index, vec2 value);
+	void add_splats(const SSplat* splats, int count);
+	void rebuild_source_cells();
+	void apply_density_sources();	// density += density_source
+	void apply_velocity_sources();	// velocity += velocity_source
+	unsigned int solve_active(int which, CSparseMatrix & m, double* x, double* b, double tol, unsigned int iter_max); // which: SOLVE_*
+	void invalidate_factors(); // after the operators were changed from outside
+	void solve_pressure(); // laplacian, or the obstacle mask's operator
 
 	vec2* v(int i, int j) {return velocity+i+j*n;};
 	double* d(int i, int j) {return density+i+j*n;};
 	double p(int i, int j) {return pressure[i+j*n];};
 	void add(double* c, double* a, double* b)
 	{
-		for(int i = 0; i < size; i++) {
+		for(int k = 0; k < bricks.num_active_cells; k++) {
+			int i = bricks.active_cells[k];
 			c[i] = a[i] + b[i];
 		}
 	};
 
+	// value into field at the solid cells of the active tiles
+	template <class T> void fill_solid(T* field, T value)
+	{
+		if (!obstacles.any())
+			return;
+		for (int b = 0; b < bricks.num_active; b++) {
+			int bi0, bi1, bj0, bj1;
+			bricks.bounds(bricks.active_tiles[b], bi0, bi1, bj0, bj1);
+			for (int j = bj0; j < bj1; j++)
+				for (int i = bi0; i < bi1; i++)
+					if (obstacles.solid(i, j))
+						field[i + j*n] = value;
+		}
+	};
+
 	void add(vec2* c, vec2* a, vec2* b)
 	{
-		for(int i = 0; i < size; i++) {
+		for(int k = 0; k < bricks.num_active_cells; k++) {
+			int i = bricks.active_cells[k];
 			c[i] = a[i] + b[i];
 		}
 	};
 
-	CFluidSolver(void);
+	CFluidSolver(int grid_n = 60);
 	~CFluidSolver(void);
 };
 
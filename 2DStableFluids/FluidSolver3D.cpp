@@ -0,0 +1,296 @@
+#include "FluidSolver3D.h"
+
+//3D counterpart of CFluidSolver, see FluidSolver3D.h
+
+CFluidSolver3D::CFluidSolver3D(int grid_n):
+n(grid_n), size(grid_n*grid_n*grid_n), h(0.1)
+{
+	density = new float[size];
+	u = new float[size];
+	v = new float[size];
+	w = new float[size];
+	pressure = new float[size];
+	divergence = new float[size];
+	r = new float[size];
+	p = new float[size];
+	q = new float[size];
+
+	diffusion_coef = 0.3*h;
+	pressure_iterations = 10;
+	last_iterations = 0;
+	reset();
+}
+
+CFluidSolver3D::~CFluidSolver3D(void)
+{
+	delete[] density;
+	delete[] u;
+	delete[] v;
+	delete[] w;
+	delete[] pressure;
+	delete[] divergence;
+	delete[] r;
+	delete[] p;
+	delete[] q;
+}
+
+void CFluidSolver3D::reset()
+{
+	#pragma omp parallel for schedule(static)
+	for (int c = 0; c < size; c++) {
+		density[c] = 0.f;
+		u[c] = v[c] = w[c] = 0.f;
+		pressure[c] = 0.f;
+		divergence[c] = 0.f;
+		r[c] = p[c] = q[c] = 0.f;
+	}
+	num_sources = 0;
+	viscosity_coef = 0.1;
+}
+
+void CFluidSolver3D::set_density_source(int i, int j, int k, double value)
+{
+	if (num_sources == MAX_SOURCES_3D || !interior(i,j,k))
+		return;
+	source_index[num_sources] = index(i,j,k);
+	source_density[num_sources] = (float) value;
+	source_velocity[num_sources] = vec3(0.,0.,0.);
+	num_sources++;
+}
+
+void CFluidSolver3D::set_velocity_source(int i, int j, int k, vec3 value)
+{
+	if (num_sources == MAX_SOURCES_3D || !interior(i,j,k))
+		return;
+	source_index[num_sources] = index(i,j,k);
+	source_density[num_sources] = 0.f;
+	source_velocity[num_sources] = value;
+	num_sources++;
+}
+
+void CFluidSolver3D::update()
+{
+	updateDensity();
+	updateVelocity();
+	num_sources = 0;
+}
+
+void CFluidSolver3D::updateDensity()
+{
+	for (int s = 0; s < num_sources; s++)
+		density[source_index[s]] += source_density[s];
+
+	//Diffusion process: (I + c L) density_new = density_old
+	#pragma omp parallel for schedule(static)
+	for (int c = 0; c < size; c++)
+		divergence[c] = density[c];
+	last_iterations = solve(density, divergence, 1., diffusion_coef, diffusion_coef, 1e-8, 30);
+
+	advect(r, density);
+	float* swap = density; density = r; r = swap;
+}
+
+void CFluidSolver3D::updateVelocity()
+{
+	//advect all three components with the old velocity, into the scratch arrays
+	advect(r, u);
+	advect(p, v);
+	advect(q, w);
+	float* swap;
+	swap = u; u = r; r = swap;
+	swap = v; v = p; p = swap;
+	swap = w; w = q; q = swap;
+
+	for (int s = 0; s < num_sources; s++) {
+		int c = source_index[s];
+		u[c] += (float) source_velocity[s].x;
+		v[c] += (float) source_velocity[s].y;
+		w[c] += (float) source_velocity[s].z;
+	}
+
+	// Add buoyancy force (proportional to density, acts upwards)
+	float buoyancy_coef = 0.1f;
+	#pragma omp parallel for schedule(static)
+	for (int c = 0; c < size; c++)
+		if (density[c] > 0)
+			v[c] -= buoyancy_coef * density[c];
+
+	// Velocity Diffusion step, one component at a time
+	double coef = viscosity_coef * h;
+	if (coef > 0) {
+		float* components[3] = {u, v, w};
+		for (int d = 0; d < 3; d++) {
+			float* x = components[d];
+			#pragma omp parallel for schedule(static)
+			for (int c = 0; c < size; c++)
+				divergence[c] = x[c];
+			solve(x, divergence, 1., coef, coef, 1e-8, 30);
+		}
+	}
+
+	projection();
+}
+
+void CFluidSolver3D::projection()
+{
+	int nn = n*n;
+
+	//compute divergence
+	#pragma omp parallel for schedule(static)
+	for (int k = 1; k < n-1; k++)
+		for (int j = 1; j < n-1; j++) {
+			int c = index(1,j,k);
+			for (int i = 1; i < n-1; i++, c++)
+				divergence[c] = 0.5f*(u[c+1] - u[c-1] + v[c+n] - v[c-n] + w[c+nn] - w[c-nn]);
+		}
+
+	//get pressure by solving (Laplacian pressure = divergence), 7-point stencil
+	last_iterations = solve(pressure, divergence, 6., 0., 1., 1e-8, pressure_iterations);
+
+	//update velocity by (velocity -= gradient of pressure)
+	#pragma omp parallel for schedule(static)
+	for (int k = 1; k < n-1; k++)
+		for (int j = 1; j < n-1; j++) {
+			int c = index(1,j,k);
+			for (int i = 1; i < n-1; i++, c++) {
+				u[c] += 0.5f*(pressure[c+1] - pressure[c-1]);
+				v[c] += 0.5f*(pressure[c+n] - pressure[c-n]);
+				w[c] += 0.5f*(pressure[c+nn] - pressure[c-nn]);
+			}
+		}
+}
+
+float CFluidSolver3D::sample(float* field, double x, double y, double z)
+{
+	int i0 = (int) x;
+	int j0 = (int) y;
+	int k0 = (int) z;
+	float s = (float) (x - i0);
+	float t = (float) (y - j0);
+	float m = (float) (z - k0);
+	int c = index(i0,j0,k0);
+	int nn = n*n;
+	float c00 = field[c]*(1-s) + field[c+1]*s;
+	float c10 = field[c+n]*(1-s) + field[c+n+1]*s;
+	float c01 = field[c+nn]*(1-s) + field[c+nn+1]*s;
+	float c11 = field[c+nn+n]*(1-s) + field[c+nn+n+1]*s;
+	return (c00*(1-t) + c10*t)*(1-m) + (c01*(1-t) + c11*t)*m;
+}
+
+void CFluidSolver3D::advect(float* dst, float* src)
+{
+	#pragma omp parallel for schedule(static)
+	for (int k = 1; k < n-1; k++)
+		for (int j = 1; j < n-1; j++)
+			for (int i = 1; i < n-1; i++) {
+				int c = index(i,j,k);
+				//go backwards following the velocity field
+				double x = i - h*u[c];
+				double y = j - h*v[c];
+				double z = k - h*w[c];
+				if (x < 0.5) x = 0.5;
+				if (x > n-1.5) x = n-1.5;
+				if (y < 0.5) y = 0.5;
+				if (y > n-1.5) y = n-1.5;
+				if (z < 0.5) z = 0.5;
+				if (z > n-1.5) z = n-1.5;
+				dst[c] = sample(src, x, y, z);
+			}
+}
+
+void CFluidSolver3D::apply_operator(float* x, float* y, double diag_const, double diag_per_neighbour, double off)
+{
+	int nn = n*n;
+	float a = (float) diag_const;
+	float b = (float) diag_per_neighbour;
+	float o = (float) off;
+	#pragma omp parallel for schedule(static)
+	for (int k = 1; k < n-1; k++)
+		for (int j = 1; j < n-1; j++) {
+			int c = index(1,j,k);
+			int count_jk = 2 + (j > 1) + (j < n-2) + (k > 1) + (k < n-2);
+			for (int i = 1; i < n-1; i++, c++) {
+				// neighbours on the wall layer hold zero, so they drop out of the sum
+				int count = count_jk - (i == 1) - (i == n-2);
+				float sum = x[c-1] + x[c+1] + x[c-n] + x[c+n] + x[c-nn] + x[c+nn];
+				y[c] = (a + b*count)*x[c] - o*sum;
+			}
+		}
+}
+
+//***************************************
+// Jacobi preconditioned conjugate gradient on the interior cells,
+// stopping rule as in CSparseMatrix::solve
+//***************************************
+int CFluidSolver3D::solve(float* x, float* b, double diag_const, double diag_per_neighbour, double off, double tol, int iter_max)
+{
+	// the diagonal of an interior cell only depends on its interior neighbour count
+	float inv_diag[7];
+	for (int count = 0; count < 7; count++)
+		inv_diag[count] = (float) (1.0 / (diag_const + diag_per_neighbour*count));
+
+	apply_operator(x, q, diag_const, diag_per_neighbour, off);
+	double rz = 0., residual0 = 0.;
+	#pragma omp parallel for schedule(static) reduction(+:rz,residual0)
+	for (int k = 1; k < n-1; k++)
+		for (int j = 1; j < n-1; j++) {
+			int c = index(1,j,k);
+			int count_jk = 2 + (j > 1) + (j < n-2) + (k > 1) + (k < n-2);
+			for (int i = 1; i < n-1; i++, c++) {
+				float id = inv_diag[count_jk - (i == 1) - (i == n-2)];
+				r[c] = b[c] - q[c];
+				p[c] = r[c]*id;
+				rz += (double) r[c]*p[c];
+				residual0 += (double) b[c]*b[c]*id*id;
+			}
+		}
+
+	double residual = residual0*100; // Force the first iteration anyway.
+	int iter = 0;
+	while (residual > tol && iter < iter_max) {
+		iter++;
+		apply_operator(p, q, diag_const, diag_per_neighbour, off);
+		double pq = 0.;
+		#pragma omp parallel for schedule(static) reduction(+:pq)
+		for (int k = 1; k < n-1; k++)
+			for (int j = 1; j < n-1; j++) {
+				int c = index(1,j,k);
+				for (int i = 1; i < n-1; i++, c++)
+					pq += (double) p[c]*q[c];
+			}
+		if (pq == 0.)
+			break;
+		float alpha = (float) (rz / pq);
+
+		double rz_new = 0.;
+		residual = 0.;
+		#pragma omp parallel for schedule(static) reduction(+:rz_new,residual)
+		for (int k = 1; k < n-1; k++)
+			for (int j = 1; j < n-1; j++) {
+				int c = index(1,j,k);
+				int count_jk = 2 + (j > 1) + (j < n-2) + (k > 1) + (k < n-2);
+				for (int i = 1; i < n-1; i++, c++) {
+					float id = inv_diag[count_jk - (i == 1) - (i == n-2)];
+					x[c] += alpha*p[c];
+					r[c] -= alpha*q[c];
+					float z = r[c]*id;
+					rz_new += (double) r[c]*z;
+					residual += (double) z*z;
+				}
+			}
+		if (rz == 0.)
+			break;
+		float beta = (float) (rz_new / rz);
+		rz = rz_new;
+
+		#pragma omp parallel for schedule(static)
+		for (int k = 1; k < n-1; k++)
+			for (int j = 1; j < n-1; j++) {
+				int c = index(1,j,k);
+				int count_jk = 2 + (j > 1) + (j < n-2) + (k > 1) + (k < n-2);
+				for (int i = 1; i < n-1; i++, c++)
+					p[c] = r[c]*inv_diag[count_jk - (i == 1) - (i == n-2)] + beta*p[c];
+			}
+	}
+	return iter;
+}
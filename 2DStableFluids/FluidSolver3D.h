@@ -0,0 +1,82 @@
+#pragma once
+
+#include <math.h>
+
+class vec3
+{
+public:
+	double x, y, z;
+	vec3():x(0.),y(0.),z(0.){};
+	vec3(double a, double b, double c):x(a),y(b),z(c){};
+	vec3 operator*(double s) const {return vec3(s*x,s*y,s*z);};
+	vec3 operator+(const vec3 & v) const {return vec3(x+v.x,y+v.y,z+v.z);};
+};
+
+#define MAX_SOURCES_3D 4096
+
+// 3D version of CFluidSolver on an n x n x n grid.
+// Designed for 128^3 to 256^3:
+//  - fields are single precision and stored as separate arrays (u, v, w
+//    rather than an array of vec3), so every kernel streams contiguous floats;
+//  - the 7-point diffusion and pressure operators are applied matrix-free,
+//    so there is no per-element storage like CSparseMatrix would need;
+//  - the solves use Jacobi-preconditioned conjugate gradients, since both
+//    operators are symmetric, with the same tolerance/iteration limits as 2D;
+//  - sources are kept in a short list instead of dense arrays;
+//  - scratch arrays are shared between stages, 9 floats per cell in total;
+//  - loops over z slices run in parallel with OpenMP when it is enabled.
+// As in 2D, the outer layer of cells is a wall and y points down. Every
+// array, scratch included, keeps zeros on the wall layer, so the kernels
+// only loop over interior cells and read neighbours without bounds checks.
+class CFluidSolver3D
+{
+public:
+	int		n;		// number of grid points along one side of the cubic domain
+	int		size;	// = n * n * n
+	double	h;		// time step
+
+	float*	density;
+	float*	u;		// velocity components
+	float*	v;
+	float*	w;
+	float*	pressure;
+	float*	divergence;	// also the right hand side scratch of the diffusion solves
+	float*	r;			// solver and advection scratch
+	float*	p;
+	float*	q;
+
+	int		num_sources;
+	int		source_index[MAX_SOURCES_3D];
+	float	source_density[MAX_SOURCES_3D];
+	vec3	source_velocity[MAX_SOURCES_3D];
+
+	double	diffusion_coef;
+	double	viscosity_coef;
+	int		pressure_iterations;
+	int		last_iterations;	// CG iterations of the last solve
+
+public:
+	void reset();
+	void update();
+	void updateDensity();
+	void updateVelocity();
+	void projection();
+	void set_density_source(int i, int j, int k, double value);
+	void set_velocity_source(int i, int j, int k, vec3 value);
+
+	int index(int i, int j, int k) {return i + n*(j + n*k);};
+	bool interior(int i, int j, int k) {return i>0 && i<n-1 && j>0 && j<n-1 && k>0 && k<n-1;};
+	vec3 velocity(int i, int j, int k) {int c = index(i,j,k); return vec3(u[c], v[c], w[c]);};
+
+	// trilinear sample of a cell-centred field at (x,y,z) in cell coordinates
+	float sample(float* field, double x, double y, double z);
+	void advect(float* dst, float* src);
+
+	// y = (diag_const + diag_per_neighbour * count) x - off * sum(x of interior neighbours),
+	// on the interior cells; count is the number of interior neighbours
+	void apply_operator(float* x, float* y, double diag_const, double diag_per_neighbour, double off);
+	int solve(float* x, float* b, double diag_const, double diag_per_neighbour, double off, double tol, int iter_max);
+
+	CFluidSolver3D(int grid_n = 64);
+	~CFluidSolver3D(void);
+};
@@ -0,0 +1,367 @@
+#include "FrameRecorder.h"
+#include "FluidSolver.h"
+#include "StopWatch.h"
+#include <string.h>
+#include <math.h>
+
+static const char recording_magic[8] = {'S','F','R','E','C','O','R','D'};
+static const char chunk_magic[4] = {'C','H','N','K'};
+static const char index_magic[8] = {'S','F','R','I','N','D','E','X'};
+
+static int seek_to(FILE* fp, uint64_t offset)
+{
+#ifdef _WIN32
+	return _fseeki64(fp, (long long) offset, SEEK_SET);
+#else
+	return fseeko(fp, (off_t) offset, SEEK_SET);
+#endif
+}
+
+static void put_varint(std::vector<unsigned char> & out, uint64_t v)
+{
+	while (v >= 0x80) {
+		out.push_back((unsigned char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char) v);
+}
+
+static bool get_varint(const unsigned char* & p, const unsigned char* end, uint64_t & v)
+{
+	v = 0;
+	for (int shift = 0; shift < 64 && p < end; shift += 7) {
+		unsigned char byte = *p++;
+		v |= (uint64_t) (byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// differences to previous (to zero if previous is NULL)
+static void encode_channel(std::vector<unsigned char> & out, const int64_t* values, const int64_t* previous, int count)
+{
+	int k = 0;
+	while (k < count) {
+		int64_t d = previous ? values[k] - previous[k] : values[k];
+		if (d == 0) {
+			int run = 1;
+			while (k + run < count && values[k+run] == (previous ? previous[k+run] : 0))
+				run++;
+			out.push_back(0);
+			put_varint(out, run);
+			k += run;
+		} else {
+			put_varint(out, ((uint64_t) d << 1) ^ (uint64_t) (d >> 63));
+			k++;
+		}
+	}
+}
+
+// adds the differences to values, which holds the previous frame (zeros for a keyframe)
+static bool decode_channel(const unsigned char* & p, const unsigned char* end, int64_t* values, int count)
+{
+	int k = 0;
+	while (k < count) {
+		uint64_t v;
+		if (!get_varint(p, end, v))
+			return false;
+		if (v == 0) {
+			if (!get_varint(p, end, v) || v == 0 || v > (uint64_t) (count - k))
+				return false;
+			k += (int) v;
+		} else
+			values[k++] += (int64_t) ((v >> 1) ^ (~(v & 1) + 1));
+	}
+	return true;
+}
+
+static int64_t quantize(double v, double quantum)
+{
+	double q = v / quantum;
+	if (!(fabs(q) < 4e18))	// also NaN
+		return 0;
+	return (int64_t) floor(q + 0.5);
+}
+
+CFrameRecorder::CFrameRecorder():
+frames_captured(0), frames_dropped(0), frames_written(0), bytes_written(0), raw_bytes(0), encode_ns(0)
+{
+	fp = NULL;
+	size = 0;
+	steps = 0;
+	stopping = false;
+	write_failed = false;
+}
+
+CFrameRecorder::~CFrameRecorder(void)
+{
+	close();
+}
+
+bool CFrameRecorder::open(const char* path, int grid_n, int every, bool with_velocity,
+	double quantum, int keyframe_interval, int queue_frames)
+{
+	close();
+	if (grid_n < 1 || every < 1 || quantum <= 0 || keyframe_interval < 1 || queue_frames < 1)
+		return false;
+	fp = fopen(path, "wb");
+	if (!fp)
+		return false;
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, recording_magic, sizeof(header.magic));
+	header.version = RECORDING_VERSION;
+	header.n = grid_n;
+	header.channels = with_velocity ? 3 : 1;
+	header.every = every;
+	header.keyframe_interval = keyframe_interval;
+	header.quantum = quantum;
+	write_failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+
+	size = grid_n*grid_n;
+	steps = 0;
+	frames_captured = frames_dropped = frames_written = raw_bytes = encode_ns = 0;
+	bytes_written = sizeof(header);
+	for (int k = 0; k < queue_frames; k++) {
+		buffers.push_back(new double[header.channels*size]);
+		buffer_steps.push_back(0);
+		free_buffers.push_back(k);
+	}
+	previous.assign(header.channels*size, 0);
+	current.assign(header.channels*size, 0);
+	index.clear();
+	stopping = false;
+	writer = std::thread(&CFrameRecorder::run, this);
+	return true;
+}
+
+void CFrameRecorder::capture(CFluidSolver & solver)
+{
+	if (!fp || solver.size != size)
+		return;
+	long long step = steps++;
+	if (step % header.every != 0)
+		return;
+
+	int buffer;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		if (free_buffers.empty()) {
+			frames_dropped++;
+			return;
+		}
+		buffer = free_buffers.back();
+		free_buffers.pop_back();
+	}
+	double* data = buffers[buffer];
+	memcpy(data, solver.density, size*sizeof(double));
+	if (header.channels == 3)
+		for (int i = 0; i < size; i++) {
+			data[size + i] = solver.velocity[i].x;
+			data[2*size + i] = solver.velocity[i].y;
+		}
+	buffer_steps[buffer] = step;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		queued.push_back(buffer);
+	}
+	queue_changed.notify_one();
+	frames_captured++;
+}
+
+void CFrameRecorder::run()
+{
+	std::unique_lock<std::mutex> lock(queue_mutex);
+	for (;;) {
+		queue_changed.wait(lock, [this] {return stopping || !queued.empty();});
+		if (queued.empty())
+			return;	// stopping, and everything is written
+		int buffer = queued.front();
+		queued.pop_front();
+		lock.unlock();
+		write_frame(buffer);
+		lock.lock();
+		free_buffers.push_back(buffer);
+	}
+}
+
+void CFrameRecorder::write_frame(int buffer)
+{
+	CStopWatch timer;
+	int count = header.channels*size;
+	const double* data = buffers[buffer];
+	for (int i = 0; i < count; i++)
+		current[i] = quantize(data[i], header.quantum);
+
+	bool keyframe = index.size() % header.keyframe_interval == 0;
+	payload.clear();
+	encode_channel(payload, current.data(), keyframe ? NULL : previous.data(), count);
+	previous.swap(current);
+
+	SRecordingChunk chunk;
+	memcpy(chunk.magic, chunk_magic, sizeof(chunk.magic));
+	chunk.keyframe = keyframe;
+	chunk.step = buffer_steps[buffer];
+	chunk.bytes = payload.size();
+	SRecordingIndexEntry entry = {(uint64_t) bytes_written, chunk.step, chunk.keyframe, 0};
+	if (fwrite(&chunk, sizeof(chunk), 1, fp) != 1 || fwrite(payload.data(), 1, payload.size(), fp) != payload.size())
+		write_failed = true;
+	index.push_back(entry);
+	bytes_written += sizeof(chunk) + payload.size();
+	raw_bytes += count*sizeof(double);
+	frames_written++;
+	encode_ns += timer.nanoseconds();
+}
+
+bool CFrameRecorder::close()
+{
+	if (!fp)
+		return true;
+	{
+		std::lock_guard<std::mutex> lock(queue_mutex);
+		stopping = true;
+	}
+	queue_changed.notify_one();
+	writer.join();
+
+	SRecordingTrailer trailer;
+	trailer.index_offset = bytes_written;
+	trailer.num_frames = index.size();
+	memcpy(trailer.magic, index_magic, sizeof(trailer.magic));
+	if (!index.empty() && fwrite(index.data(), sizeof(SRecordingIndexEntry), index.size(), fp) != index.size())
+		write_failed = true;
+	if (fwrite(&trailer, sizeof(trailer), 1, fp) != 1)
+		write_failed = true;
+	bytes_written += index.size()*sizeof(SRecordingIndexEntry) + sizeof(trailer);
+	if (fclose(fp) != 0)
+		write_failed = true;
+	fp = NULL;
+
+	for (size_t k = 0; k < buffers.size(); k++)
+		delete[] buffers[k];
+	buffers.clear();
+	buffer_steps.clear();
+	free_buffers.clear();
+	queued.clear();
+	return !write_failed;
+}
+
+CFrameReader::CFrameReader()
+{
+	fp = NULL;
+	size = 0;
+	indexed = false;
+	current = -1;
+}
+
+CFrameReader::~CFrameReader(void)
+{
+	close();
+}
+
+bool CFrameReader::open(const char* path)
+{
+	close();
+	fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+	if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, recording_magic, sizeof(header.magic)) != 0 ||
+		header.version != RECORDING_VERSION || header.n < 1 || (header.channels != 1 && header.channels != 3) ||
+		header.keyframe_interval < 1) {
+		close();
+		return false;
+	}
+	size = header.n*header.n;
+	state.assign(header.channels*size, 0);
+
+	// the index at the end, if the writer got to close()
+	SRecordingTrailer trailer;
+	indexed = false;
+#ifdef _WIN32
+	bool at_end = _fseeki64(fp, -(long long) sizeof(trailer), SEEK_END) == 0;
+#else
+	bool at_end = fseeko(fp, -(off_t) sizeof(trailer), SEEK_END) == 0;
+#endif
+	if (at_end && fread(&trailer, sizeof(trailer), 1, fp) == 1 && memcmp(trailer.magic, index_magic, sizeof(trailer.magic)) == 0 &&
+		seek_to(fp, trailer.index_offset) == 0) {
+		index.resize((size_t) trailer.num_frames);
+		indexed = index.empty() || fread(index.data(), sizeof(SRecordingIndexEntry), index.size(), fp) == index.size();
+	}
+
+	// otherwise walk the chunks; a torn last chunk is left out
+	if (!indexed) {
+		index.clear();
+		uint64_t offset = sizeof(header);
+		SRecordingChunk chunk;
+		while (seek_to(fp, offset) == 0 && fread(&chunk, sizeof(chunk), 1, fp) == 1 &&
+			memcmp(chunk.magic, chunk_magic, sizeof(chunk.magic)) == 0) {
+			uint64_t next = offset + sizeof(chunk) + chunk.bytes;
+			if (seek_to(fp, next - 1) != 0 || fgetc(fp) == EOF)
+				break;
+			SRecordingIndexEntry entry = {offset, chunk.step, chunk.keyframe, 0};
+			index.push_back(entry);
+			offset = next;
+		}
+	}
+	if (!index.empty() && !index[0].keyframe) {
+		close();
+		return false;
+	}
+	current = -1;
+	return true;
+}
+
+void CFrameReader::close()
+{
+	if (fp)
+		fclose(fp);
+	fp = NULL;
+	index.clear();
+	current = -1;
+}
+
+bool CFrameReader::decode(int frame)
+{
+	SRecordingChunk chunk;
+	if (seek_to(fp, index[frame].offset) != 0 || fread(&chunk, sizeof(chunk), 1, fp) != 1 ||
+		memcmp(chunk.magic, chunk_magic, sizeof(chunk.magic)) != 0)
+		return false;
+	payload.resize((size_t) chunk.bytes);
+	if (chunk.bytes > 0 && fread(payload.data(), 1, payload.size(), fp) != payload.size())
+		return false;
+	if (chunk.keyframe)
+		for (size_t i = 0; i < state.size(); i++)
+			state[i] = 0;
+	const unsigned char* p = payload.data();
+	if (!decode_channel(p, p + payload.size(), state.data(), (int) state.size()))
+		return false;
+	current = frame;
+	return true;
+}
+
+bool CFrameReader::read(int frame, double* density, vec2* velocity)
+{
+	if (!fp || frame < 0 || frame >= num_frames())
+		return false;
+	int key = frame;
+	while (!index[key].keyframe)
+		key--;
+	// go on from the frame in state if it lies between the keyframe and frame
+	int first = current >= key && current <= frame ? current + 1 : key;
+	for (int f = first; f <= frame; f++)
+		if (!decode(f)) {
+			current = -1;
+			return false;
+		}
+
+	double quantum = header.quantum;
+	for (int i = 0; i < size; i++)
+		density[i] = state[i]*quantum;
+	if (velocity) {
+		for (int i = 0; i < size; i++)
+			velocity[i] = header.channels == 3 ? vec2(state[size+i]*quantum, state[2*size+i]*quantum) : vec2(0., 0.);
+	}
+	return true;
+}
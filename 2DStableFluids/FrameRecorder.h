@@ -0,0 +1,145 @@
+// FrameRecorder.h: records solver frames to a compressed file on a background thread
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CFluidSolver;
+class vec2;
+
+#define RECORDING_VERSION 1
+
+// File layout:
+//   SRecordingHeader
+//   one chunk per frame: SRecordingChunk, then the encoded channels
+//   the index: one SRecordingIndexEntry per frame
+//   SRecordingTrailer
+// Every value is quantized to a multiple of quantum. A channel is stored as
+// the difference of those integers to the previous frame (to zero on a
+// keyframe), zigzag varint coded, with runs of zero differences written as a
+// 0 followed by the run length. A file whose writer never finished has no
+// index; the reader rebuilds it from the chunk headers.
+struct SRecordingHeader
+{
+	char magic[8];		// "SFRECORD"
+	uint32_t version;
+	int32_t n;
+	int32_t channels;	// 1: density, 3: density, velocity x, velocity y
+	int32_t every;		// solver steps per recorded frame
+	int32_t keyframe_interval;
+	int32_t reserved;
+	double quantum;
+};
+
+struct SRecordingChunk
+{
+	char magic[4];		// "CHNK"
+	int32_t keyframe;
+	int64_t step;
+	uint64_t bytes;		// of the encoded channels that follow
+};
+
+struct SRecordingIndexEntry
+{
+	uint64_t offset;	// of the SRecordingChunk
+	int64_t step;
+	int32_t keyframe;
+	int32_t reserved;
+};
+
+struct SRecordingTrailer
+{
+	uint64_t index_offset;
+	uint64_t num_frames;
+	char magic[8];		// "SFRINDEX"
+};
+
+// Copies density (and velocity) every few steps into one of a fixed number
+// of buffers; a writer thread encodes and writes them. capture() never
+// waits for the disk: when every buffer is still queued the frame is
+// dropped and counted.
+class CFrameRecorder
+{
+public:
+	// statistics, safe to read while recording
+	std::atomic<long long> frames_captured;
+	std::atomic<long long> frames_dropped;
+	std::atomic<long long> frames_written;
+	std::atomic<long long> bytes_written;	// file size so far
+	std::atomic<long long> raw_bytes;		// the frames written, as doubles
+	std::atomic<long long> encode_ns;		// writer time spent encoding and writing
+
+	CFrameRecorder();
+	~CFrameRecorder(void);
+
+	bool open(const char* path, int grid_n, int every = 1, bool with_velocity = false,
+		double quantum = 1e-6, int keyframe_interval = 32, int queue_frames = 8);
+	// call after every solver step; records every every-th call
+	void capture(CFluidSolver & solver);
+	// drain the queue and write the index; false if any write failed
+	bool close();
+	bool recording() {return fp != NULL;};
+
+protected:
+	SRecordingHeader header;
+	FILE* fp;
+	int size;
+	long long steps;
+	std::vector<double*> buffers;
+	std::vector<long long> buffer_steps;
+	std::vector<int> free_buffers;
+	std::deque<int> queued;
+	std::mutex queue_mutex;
+	std::condition_variable queue_changed;
+	bool stopping;
+	bool write_failed;
+	std::thread writer;
+
+	// writer state
+	std::vector<int64_t> previous, current;
+	std::vector<unsigned char> payload;
+	std::vector<SRecordingIndexEntry> index;
+
+	void run();
+	void write_frame(int buffer);
+};
+
+// Random access to a recording. read() decodes from the nearest keyframe
+// at or before the frame, or goes on from the frame decoded last if that is
+// on the way, so a sequential read decodes every chunk once.
+class CFrameReader
+{
+public:
+	SRecordingHeader header;
+
+	CFrameReader();
+	~CFrameReader(void);
+
+	bool open(const char* path);
+	void close();
+	int num_frames() {return (int) index.size();};
+	long long step(int frame) {return index[frame].step;};
+	bool complete() {return indexed;};	// false if the index was rebuilt by scanning
+
+	// density needs n*n values, velocity (optional) n*n too
+	bool read(int frame, double* density, vec2* velocity = NULL);
+
+protected:
+	FILE* fp;
+	int size;
+	bool indexed;
+	std::vector<SRecordingIndexEntry> index;
+	std::vector<int64_t> state;
+	std::vector<unsigned char> payload;
+	int current;	// frame held in state, -1 if none
+
+	bool decode(int frame);
+};
@@ -0,0 +1,41 @@
+// HaloTransport.h: communication interface for the domain-decomposed solver
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+// Ranks are ordered along y. Rank r owns a slab of rows and talks to rank r-1
+// (below, lower rows) and rank r+1 (above, higher rows). The first and last
+// rank have no neighbour on one side; their receive buffers are left alone.
+//
+// Any backend (shared memory, sockets, MPI) only has to provide these calls.
+// All of them are collective: every rank must call them in the same order.
+class CHaloTransport
+{
+public:
+	virtual ~CHaloTransport() {}
+
+	virtual int rank() = 0;
+	virtual int num_ranks() = 0;
+
+	// Send count doubles to each neighbour and receive count doubles from each.
+	// send_low goes to rank-1, which receives it in its recv_high, and
+	// send_high goes to rank+1, which receives it in its recv_low.
+	virtual void exchange(const double* send_low, const double* send_high, double* recv_low, double* recv_high, int count) = 0;
+
+	// Global sum; the partial sums are added in rank order so every rank gets
+	// the bitwise same result.
+	virtual double allreduce_sum(double value) = 0;
+
+	virtual void barrier() = 0;
+};
+
+// Single process: no neighbours, reductions are the identity.
+class CLocalTransport : public CHaloTransport
+{
+public:
+	int rank() {return 0;};
+	int num_ranks() {return 1;};
+	void exchange(const double*, const double*, double*, double*, int) {};
+	double allreduce_sum(double value) {return value;};
+	void barrier() {};
+};
@@ -0,0 +1,374 @@
+#include "MACFluidSolver.h"
+
+//Staggered-grid version of CFluidSolver, see MACFluidSolver.h
+
+CMACFluidSolver::CMACFluidSolver(void):
+n(60), size(60*60), h(0.1), laplacian(size,size), diffusion(size,size),
+u_diffusion(61*60,61*60), w_diffusion(60*61,60*61)
+{
+	velocity = new vec2[size];
+	velocity_source = new vec2[size];
+	density = new double[size];
+	density_source = new double[size];
+	pressure = new double[size];
+	divergence = new double[size];
+	u_face = new double[(n+1)*n];
+	w_face = new double[n*(n+1)];
+	advected_u = new double[(n+1)*n];
+	advected_w = new double[n*(n+1)];
+
+	double diffusion_coef = 0.3*h;
+	viscosity_coef = 0.1;
+	pressure_iterations = 10;
+
+	//Pressure Poisson matrix with the compact 5-point stencil.
+	//Walls are handled by dropping the coupling to solid cells (zero normal flux).
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			int index = i + j*n;
+			if (fluid(i,j)) {
+				int count = 0;
+				if (fluid(i-1,j)) {
+					laplacian.set1Value(index, index-1, -1.0);
+					count++;
+				}
+				if (fluid(i+1,j)) {
+					laplacian.set1Value(index, index+1, -1.0);
+					count++;
+				}
+				if (fluid(i,j-1)) {
+					laplacian.set1Value(index, index-n, -1.0);
+					count++;
+				}
+				if (fluid(i,j+1)) {
+					laplacian.set1Value(index, index+n, -1.0);
+					count++;
+				}
+				laplacian.set1Value(index, index, count);
+			} else {
+				laplacian.set1Value(index, index, 1.);
+			}
+		}
+	}
+
+	//Density diffusion is identical to the collocated solver
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < n; j++) {
+			int index = i + j*n;
+			int count = 0;
+			if (i-1>0) {
+				diffusion.set1Value(index, index-1, -1.0*diffusion_coef);
+				count++;
+			}
+			if (i+1<n-1) {
+				diffusion.set1Value(index, index+1, -1.0*diffusion_coef);
+				count++;
+			}
+			if (j-1>0) {
+				diffusion.set1Value(index, index-n, -1.0*diffusion_coef);
+				count++;
+			}
+			if (j+1<n-1) {
+				diffusion.set1Value(index, index+n, -1.0*diffusion_coef);
+				count++;
+			}
+			diffusion.set1Value(index, index, 1.+count*diffusion_coef);
+		}
+	}
+
+	setup_velocity_diffusion_matrix(viscosity_coef);
+	reset();
+}
+
+CMACFluidSolver::~CMACFluidSolver(void)
+{
+	delete[] velocity;
+	delete[] density;
+	delete[] pressure;
+	delete[] divergence;
+
+	delete[] density_source;
+	delete[] velocity_source;
+	delete[] u_face;
+	delete[] w_face;
+	delete[] advected_u;
+	delete[] advected_w;
+}
+
+void CMACFluidSolver::reset()
+{
+	for (int i = 0; i < size; i++) {
+		density[i] = 0.;
+		density_source[i] = 0.;
+		velocity[i] = vec2(0.,0.);
+		divergence[i] = 0.;
+		pressure[i] = 0.;
+		velocity_source[i] = vec2(0.,0.);
+	}
+	for (int i = 0; i < (n+1)*n; i++) {
+		u_face[i] = 0.;
+		w_face[i] = 0.;
+		advected_u[i] = 0.;
+		advected_w[i] = 0.;
+	}
+	viscosity_coef = 0.1;
+}
+
+void CMACFluidSolver::update()
+{
+	updateDensity();
+	updateVelocity();
+}
+
+void CMACFluidSolver::updateDensity()
+{
+	for (int i = 0; i < size; i++)
+		density[i] += density_source[i];
+
+	//Diffusion process
+	diffusion.solve(density_source, density, 1e-8, 30);
+
+	density_advection();
+	clean_density_source();
+}
+
+void CMACFluidSolver::updateVelocity()
+{
+	velocity_advection();
+
+	//Sources are given per cell, split them onto the two faces of each cell
+	for (int i = 1; i < n-1; i++) {
+		for (int j = 1; j < n-1; j++) {
+			vec2 s = velocity_source[i+j*n];
+			u(i,j) += 0.5*s.x;
+			u(i+1,j) += 0.5*s.x;
+			w(i,j) += 0.5*s.y;
+			w(i,j+1) += 0.5*s.y;
+		}
+	}
+
+	// Add buoyancy force on the horizontal faces, using the density of the two adjacent cells
+	double buoyancy_coef = 0.1;
+	for (int i = 1; i < n - 1; i++) {
+		for (int j = 2; j < n - 1; j++) {
+			double face_density = 0.5*(density[i+(j-1)*n] + density[i+j*n]);
+			if (face_density > 0)
+				w(i,j) -= buoyancy_coef * face_density;
+		}
+	}
+
+	// Velocity Diffusion step, each component on its own face grid
+	if (viscosity_coef > 0) {
+		u_diffusion.solve(u_face, u_face, 1e-8, 30);
+		w_diffusion.solve(w_face, w_face, 1e-8, 30);
+	}
+
+	projection();
+	update_cell_velocity();
+	clean_velocity_source();
+}
+
+void CMACFluidSolver::projection()
+{
+	//set boundary condition: no flow through faces touching a wall cell
+	for (int j = 0; j < n; j++)
+		for (int i = 0; i <= n; i++)
+			if (!fluid(i-1,j) || !fluid(i,j))
+				u(i,j) = 0.;
+	for (int j = 0; j <= n; j++)
+		for (int i = 0; i < n; i++)
+			if (!fluid(i,j-1) || !fluid(i,j))
+				w(i,j) = 0.;
+
+	//compute divergence with the compact stencil
+	for (int i = 0; i < size; i++)
+		divergence[i] = 0.;
+	for (int i = 1; i < n-1; i++)
+		for (int j = 1; j < n-1; j++)
+			divergence[i+n*j] = u(i+1,j) - u(i,j) + w(i,j+1) - w(i,j);
+
+	//get pressure by solving (Laplacian pressure = divergence)
+	laplacian.solve(pressure, divergence, 1e-8, pressure_iterations);
+
+	//update face velocity by (velocity += gradient of pressure)
+	for (int j = 1; j < n-1; j++)
+		for (int i = 2; i < n-1; i++)
+			u(i,j) += p(i,j) - p(i-1,j);
+	for (int j = 2; j < n-1; j++)
+		for (int i = 1; i < n-1; i++)
+			w(i,j) += p(i,j) - p(i,j-1);
+}
+
+double CMACFluidSolver::divergence_residual()
+{
+	//RMS of the discrete divergence over the fluid cells
+	double sum = 0.;
+	for (int i = 1; i < n-1; i++)
+		for (int j = 1; j < n-1; j++) {
+			double div = u(i+1,j) - u(i,j) + w(i,j+1) - w(i,j);
+			sum += div*div;
+		}
+	return sqrt(sum/((n-2)*(n-2)));
+}
+
+void CMACFluidSolver::update_cell_velocity()
+{
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+			*v(i,j) = vec2(0.5*(u(i,j)+u(i+1,j)), 0.5*(w(i,j)+w(i,j+1)));
+}
+
+void CMACFluidSolver::clean_density_source()
+{
+	for (int i=0; i < size; i++) {
+		density_source[i] = 0.;
+	}
+}
+
+void CMACFluidSolver::clean_velocity_source()
+{
+	for (int i=0; i < size; i++) {
+		velocity_source[i] = vec2(0.,0.);
+	}
+}
+
+double CMACFluidSolver::sample_u(double* field, double x, double y)
+{
+	//u(i,j) is located at (i-0.5, j)
+	double gx = x + 0.5;
+	double gy = y;
+	if (gx < 0) gx = 0;
+	if (gx > n - 1e-9) gx = n - 1e-9;
+	if (gy < 0) gy = 0;
+	if (gy > n - 1 - 1e-9) gy = n - 1 - 1e-9;
+	int i0 = (int) gx;
+	int j0 = (int) gy;
+	double s = gx - i0;
+	double t = gy - j0;
+	return (1-s)*(1-t)*field[i0+j0*(n+1)] + (1-s)*t*field[i0+(j0+1)*(n+1)]
+		+ s*(1-t)*field[i0+1+j0*(n+1)] + s*t*field[i0+1+(j0+1)*(n+1)];
+}
+
+double CMACFluidSolver::sample_w(double* field, double x, double y)
+{
+	//w(i,j) is located at (i, j-0.5)
+	double gx = x;
+	double gy = y + 0.5;
+	if (gx < 0) gx = 0;
+	if (gx > n - 1 - 1e-9) gx = n - 1 - 1e-9;
+	if (gy < 0) gy = 0;
+	if (gy > n - 1e-9) gy = n - 1e-9;
+	int i0 = (int) gx;
+	int j0 = (int) gy;
+	double s = gx - i0;
+	double t = gy - j0;
+	return (1-s)*(1-t)*field[i0+j0*n] + (1-s)*t*field[i0+(j0+1)*n]
+		+ s*(1-t)*field[i0+1+j0*n] + s*t*field[i0+1+(j0+1)*n];
+}
+
+void CMACFluidSolver::density_advection()
+{
+	//set boundary condition
+	for (int i=0; i< n; i++) {
+		*d(0,i)= 0;
+		*d(n-1,i)=0;
+		*d(i, 0)=0;
+		*d(i, n-1)=0;
+	}
+
+	for (int i = 1; i < n-1; i++)
+		for (int j = 1; j < n-1; j++) {
+			//go backwards following the velocity at the cell centre
+			double x = i - h*0.5*(u(i,j)+u(i+1,j));
+			double y = j - h*0.5*(w(i,j)+w(i,j+1));
+			if (x < 0.5) x = 0.5;
+			if (x > n-1.5) x = n-1.5;
+			if (y < 0.5) y = 0.5;
+			if (y > n-1.5) y = n-1.5;
+
+			//bilinear interpolation
+			int i0 = (int) x;
+			int j0 = (int) y;
+			double s = x - i0;
+			double t = y - j0;
+			density[i+j*n] = (1-s)*(1-t)* density_source[i0+j0*n] + (1-s)*t* density_source[i0+(j0+1)*n] + s*(1-t)* density_source[i0+1+j0*n] + s*t* density_source[i0+1+(j0+1)*n];
+		}
+}
+
+void CMACFluidSolver::velocity_advection()
+{
+	for (int i = 0; i < (n+1)*n; i++) {
+		advected_u[i] = 0.;
+		advected_w[i] = 0.;
+	}
+
+	//Each face is traced back from its own position
+	for (int j = 1; j < n-1; j++)
+		for (int i = 2; i < n-1; i++) {
+			double x = i - 0.5;
+			double y = j;
+			double bx = x - h*u(i,j);
+			double by = y - h*sample_w(w_face, x, y);
+			if (bx < 0.5) bx = 0.5;
+			if (bx > n-1.5) bx = n-1.5;
+			if (by < 0.5) by = 0.5;
+			if (by > n-1.5) by = n-1.5;
+			advected_u[i+j*(n+1)] = sample_u(u_face, bx, by);
+		}
+
+	for (int j = 2; j < n-1; j++)
+		for (int i = 1; i < n-1; i++) {
+			double x = i;
+			double y = j - 0.5;
+			double bx = x - h*sample_u(u_face, x, y);
+			double by = y - h*w(i,j);
+			if (bx < 0.5) bx = 0.5;
+			if (bx > n-1.5) bx = n-1.5;
+			if (by < 0.5) by = 0.5;
+			if (by > n-1.5) by = n-1.5;
+			advected_w[i+j*n] = sample_w(w_face, bx, by);
+		}
+
+	double* swap = u_face; u_face = advected_u; advected_u = swap;
+	swap = w_face; w_face = advected_w; advected_w = swap;
+}
+
+static void build_face_diffusion(CSparseMatrix & m, int nx, int ny, int i0, int i1, int j0, int j1, double coef)
+{
+	//faces (i,j) with i0<=i<=i1 and j0<=j<=j1 are free, the others are fixed by the walls
+	m.setDimensions(nx*ny);
+	for (int i = 0; i < nx; i++) {
+		for (int j = 0; j < ny; j++) {
+			int index = i + j*nx;
+			if (coef <= 0 || i < i0 || i > i1 || j < j0 || j > j1) {
+				m.set1Value(index, index, 1.0);
+				continue;
+			}
+			int count = 0;
+			if (i-1 >= i0) {
+				m.set1Value(index, index-1, -coef);
+				count++;
+			}
+			if (i+1 <= i1) {
+				m.set1Value(index, index+1, -coef);
+				count++;
+			}
+			if (j-1 >= j0) {
+				m.set1Value(index, index-nx, -coef);
+				count++;
+			}
+			if (j+1 <= j1) {
+				m.set1Value(index, index+nx, -coef);
+				count++;
+			}
+			m.set1Value(index, index, 1.0 + count*coef);
+		}
+	}
+}
+
+void CMACFluidSolver::setup_velocity_diffusion_matrix(double viscosity)
+{
+	double coef = viscosity * h;
+	build_face_diffusion(u_diffusion, n+1, n, 2, n-2, 1, n-2, coef);
+	build_face_diffusion(w_diffusion, n, n+1, 1, n-2, 2, n-2, coef);
+}
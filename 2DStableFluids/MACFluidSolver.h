@@ -0,0 +1,72 @@
+#include "FluidSolver.h"
+
+#pragma once
+
+// Staggered (MAC) variant of CFluidSolver.
+// The x-component of the velocity lives on vertical cell faces and the
+// y-component on horizontal cell faces, so divergence and pressure gradient
+// use the compact one-cell stencil instead of the collocated 0.5*(v(i+1)-v(i-1)).
+// Density, pressure and the sources stay cell-centred, and a cell-centred copy
+// of the velocity is rebuilt after each step so callers can keep using v(i,j).
+class CMACFluidSolver
+{
+public:
+	int		n;		// number of cells along one side of the square domain
+	int		size;	// = n * n
+	double	h;		// time step
+
+	double*	density;
+	vec2*	velocity;	// cell-centred velocity, averaged from the faces
+	double* pressure;
+	double* divergence;
+
+	double* density_source;
+	vec2*	velocity_source;
+
+	// u(i,j) sits on the face between cells (i-1,j) and (i,j): (n+1) x n values
+	// w(i,j) sits on the face between cells (i,j-1) and (i,j): n x (n+1) values
+	double* u_face;
+	double* w_face;
+	double* advected_u; //temp variable
+	double* advected_w; //temp variable
+
+	CSparseMatrix laplacian;
+	CSparseMatrix diffusion;
+	CSparseMatrix u_diffusion; // Matrix for x-velocity diffusion on the u faces
+	CSparseMatrix w_diffusion; // Matrix for y-velocity diffusion on the w faces
+
+	double viscosity_coef;
+	int pressure_iterations;
+
+public:
+	void reset();
+	void update();
+	void updateVelocity();
+	void updateDensity();
+	void setup_velocity_diffusion_matrix(double viscosity);
+	void clean_density_source();
+	void clean_velocity_source();
+	void projection();
+	void density_advection();
+	void velocity_advection();
+	void update_cell_velocity();
+	double divergence_residual();
+	void set_density_source(int index, double value) {density_source[index] = value;};
+	void set_velocity_source(int index, vec2 value) {velocity_source[index] = value;};
+
+	vec2* v(int i, int j) {return velocity+i+j*n;};
+	double* d(int i, int j) {return density+i+j*n;};
+	double p(int i, int j) {return pressure[i+j*n];};
+	double& u(int i, int j) {return u_face[i+j*(n+1)];};
+	double& w(int i, int j) {return w_face[i+j*n];};
+
+	// fluid cells are the interior ones, the outer ring of cells is solid wall
+	bool fluid(int i, int j) {return i>0 && i<n-1 && j>0 && j<n-1;};
+
+	// bilinear samples of the face grids at a point given in cell-centre coordinates
+	double sample_u(double* field, double x, double y);
+	double sample_w(double* field, double x, double y);
+
+	CMACFluidSolver(void);
+	~CMACFluidSolver(void);
+};
@@ -0,0 +1,207 @@
+#include "MemoryUsage.h"
+#include "FluidSolver.h"
+#include "BlockedSum.h"
+
+#ifdef FLUID_COUNT_ALLOCATIONS
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+static std::atomic<long long> heap_allocations(0), heap_frees(0), heap_live(0), heap_peak(0);
+
+// every block is headed by its size, in a header that keeps the alignment malloc gives
+#define HEAP_HEADER 16
+
+static void* counted_alloc(size_t bytes)
+{
+	char* block = (char*) malloc(bytes + HEAP_HEADER);
+	if (block == NULL)
+		return NULL;
+	*(size_t*) block = bytes;
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	long long live = heap_live.fetch_add((long long) bytes, std::memory_order_relaxed) + (long long) bytes;
+	long long peak = heap_peak.load(std::memory_order_relaxed);
+	while (live > peak && !heap_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+		;
+	return block + HEAP_HEADER;
+}
+
+static void counted_free(void* p)
+{
+	if (p == NULL)
+		return;
+	char* block = (char*) p - HEAP_HEADER;
+	heap_frees.fetch_add(1, std::memory_order_relaxed);
+	heap_live.fetch_sub((long long) *(size_t*) block, std::memory_order_relaxed);
+	free(block);
+}
+
+void* operator new(size_t bytes)
+{
+	void* p;
+	while ((p = counted_alloc(bytes > 0 ? bytes : 1)) == NULL) {
+		std::new_handler handler = std::get_new_handler();
+		if (handler == NULL)
+			throw std::bad_alloc();
+		handler();
+	}
+	return p;
+}
+
+void* operator new[](size_t bytes)
+{
+	return operator new(bytes);
+}
+
+void* operator new(size_t bytes, const std::nothrow_t &) noexcept
+{
+	try {
+		return operator new(bytes);
+	} catch (...) {
+		return NULL;
+	}
+}
+
+void* operator new[](size_t bytes, const std::nothrow_t &) noexcept
+{
+	return operator new(bytes, std::nothrow);
+}
+
+void operator delete(void* p) noexcept {counted_free(p);}
+void operator delete[](void* p) noexcept {counted_free(p);}
+void operator delete(void* p, const std::nothrow_t &) noexcept {counted_free(p);}
+void operator delete[](void* p, const std::nothrow_t &) noexcept {counted_free(p);}
+void operator delete(void* p, size_t) noexcept {counted_free(p);}
+void operator delete[](void* p, size_t) noexcept {counted_free(p);}
+
+bool heap_counting()
+{
+	return true;
+}
+
+SHeapCounts heap_counts()
+{
+	SHeapCounts c;
+	c.allocations = heap_allocations.load(std::memory_order_relaxed);
+	c.frees = heap_frees.load(std::memory_order_relaxed);
+	c.live_bytes = heap_live.load(std::memory_order_relaxed);
+	c.peak_bytes = heap_peak.load(std::memory_order_relaxed);
+	return c;
+}
+
+void reset_heap_peak()
+{
+	heap_peak.store(heap_live.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+#else
+
+bool heap_counting()
+{
+	return false;
+}
+
+SHeapCounts heap_counts()
+{
+	SHeapCounts c = {0, 0, 0, 0};
+	return c;
+}
+
+void reset_heap_peak()
+{
+}
+
+#endif
+
+void matrix_memory(CSparseMatrix & A, SMatrixMemory & m)
+{
+	m.elements = 0;
+	for (int i = 0; i < A.numRows; i++)
+		for (CMatrixElement* e = A.rowList[i]; e != NULL; e = e->rowNext)
+			m.elements++;
+	m.element_bytes = (size_t) m.elements*(sizeof(CMatrixElement) + HEAP_BLOCK_OVERHEAD);
+	m.index_bytes = A.rowList != NULL ? (size_t) (A.numRows + A.numCols)*sizeof(CMatrixElement*) : 0;
+	m.vector_bytes = A.diagonal != NULL ? (size_t) (A.numRows + sum_blocks(A.numRows) + 1)*sizeof(double) : 0;
+	m.work_bytes = A.dr != NULL && !A.externalWork ? (size_t) 8*A.numRows*sizeof(double) : 0;
+	m.blocks = m.elements + (A.rowList != NULL ? 4 : 0) + (m.work_bytes > 0 ? 8 : 0);
+}
+
+CMemoryReport::CMemoryReport()
+{
+	field_bytes = work_bytes = tile_bytes = arena_capacity = 0;
+	arena_allocations = 0;
+	for (int op = 0; op < NUM_OPERATORS; op++) {
+		SMatrixMemory none = {0, 0, 0, 0, 0, 0};
+		operators[op] = none;
+		factor_bytes[op] = 0;
+	}
+	list_bytes = object_bytes = 0;
+}
+
+void CMemoryReport::measure(CFluidSolver & s)
+{
+	//the fields of CFluidSolver::layout_fields(); what else the block holds is tiles and masks
+	const double* scalars[] = {s.density, s.density_source, s.diffused_density, s.pressure, s.divergence,
+		s.temp_x, s.temp_y, s.scalar_scratch[0], s.scalar_scratch[1]};
+	const vec2* vectors[] = {s.velocity, s.velocity_source, s.advected_velocity, s.vector_scratch[0], s.vector_scratch[1]};
+	size_t scalar = CFieldArena::footprint(s.size*sizeof(double));
+	field_bytes = sizeof(scalars)/sizeof(scalars[0])*scalar
+		+ sizeof(vectors)/sizeof(vectors[0])*CFieldArena::footprint(s.size*sizeof(vec2));
+	work_bytes = sizeof(s.solve_work)/sizeof(s.solve_work[0][0])*scalar
+		+ CFieldArena::footprint((sum_blocks(s.size) + 1)*sizeof(double));
+	size_t used = s.arena.used();
+	tile_bytes = used > field_bytes + work_bytes ? used - field_bytes - work_bytes : 0;
+	arena_capacity = s.arena.capacity();
+	arena_allocations = s.arena.allocations;
+
+	CSparseMatrix* matrices[NUM_OPERATORS] = {&s.laplacian, &s.diffusion, &s.velocity_diffusion};
+	CSparseCholesky* factors[NUM_OPERATORS] = {&s.laplacian_factor, &s.diffusion_factor, &s.velocity_diffusion_factor};
+	for (int op = 0; op < NUM_OPERATORS; op++) {
+		matrix_memory(*matrices[op], operators[op]);
+		factor_bytes[op] = factors[op]->bytes();
+	}
+
+	list_bytes = (s.density_source_cells.capacity() + s.velocity_source_cells.capacity())*sizeof(int)
+		+ s.step_graph.tasks.capacity()*sizeof(STask);
+	for (size_t t = 0; t < s.step_graph.tasks.size(); t++)
+		list_bytes += (s.step_graph.tasks[t].after.capacity() + s.step_graph.tasks[t].before.capacity())*sizeof(int);
+	object_bytes = sizeof(CFluidSolver);
+}
+
+size_t CMemoryReport::operator_bytes() const
+{
+	size_t bytes = 0;
+	for (int op = 0; op < NUM_OPERATORS; op++)
+		bytes += operators[op].total() + factor_bytes[op];
+	return bytes;
+}
+
+size_t CMemoryReport::total() const
+{
+	return arena_capacity + operator_bytes() + list_bytes + object_bytes;
+}
+
+const char* CMemoryReport::operator_name(int op)
+{
+	static const char* names[NUM_OPERATORS] = {"laplacian", "diffusion", "velocity diffusion"};
+	return names[op];
+}
+
+void CMemoryReport::print(FILE* fp) const
+{
+	const double MB = 1./(1 << 20);
+	fprintf(fp, "%-20s %14s %10s\n", "memory", "bytes", "MB");
+	fprintf(fp, "%-20s %14zu %10.2f\n", "fields", field_bytes, field_bytes*MB);
+	fprintf(fp, "%-20s %14zu %10.2f\n", "solve work", work_bytes, work_bytes*MB);
+	fprintf(fp, "%-20s %14zu %10.2f\n", "tiles and masks", tile_bytes, tile_bytes*MB);
+	fprintf(fp, "%-20s %14zu %10.2f   (%lld allocations)\n", "arena block", arena_capacity, arena_capacity*MB, arena_allocations);
+	for (int op = 0; op < NUM_OPERATORS; op++)
+		fprintf(fp, "%-20s %14zu %10.2f   (%lld elements, %zu B element / %zu B index / %zu B vectors / %zu B work, %lld heap blocks)\n",
+			operator_name(op), operators[op].total(), operators[op].total()*MB, operators[op].elements,
+			operators[op].element_bytes, operators[op].index_bytes, operators[op].vector_bytes, operators[op].work_bytes, operators[op].blocks);
+	size_t factors = factor_bytes[0] + factor_bytes[1] + factor_bytes[2];
+	fprintf(fp, "%-20s %14zu %10.2f\n", "cholesky factors", factors, factors*MB);
+	fprintf(fp, "%-20s %14zu %10.2f\n", "lists", list_bytes, list_bytes*MB);
+	fprintf(fp, "%-20s %14zu %10.2f\n", "solver object", object_bytes, object_bytes*MB);
+	fprintf(fp, "%-20s %14zu %10.2f\n", "total", total(), total()*MB);
+}
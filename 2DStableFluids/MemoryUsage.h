@@ -0,0 +1,77 @@
+// MemoryUsage.h: what a CFluidSolver holds, component by component, and heap allocation counts
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+class CSparseMatrix;
+class CFluidSolver;
+
+// Process-wide operator new / delete counters. They only count in a build
+// with FLUID_COUNT_ALLOCATIONS defined (cmake -DFLUID_COUNT_ALLOCATIONS=ON),
+// which replaces the global operators with ones that keep the size of every
+// block; otherwise heap_counting() is false and every figure stays 0.
+// malloc and the arena's block (CFieldArena::allocations) are not in them.
+struct SHeapCounts
+{
+	long long allocations;	// operator new calls
+	long long frees;
+	long long live_bytes;	// asked for and not yet freed
+	long long peak_bytes;	// largest live_bytes since reset_heap_peak()
+};
+
+bool heap_counting();
+SHeapCounts heap_counts();
+void reset_heap_peak();	// peak_bytes = live_bytes
+
+// Extra bytes the allocator spends on every block (header and rounding),
+// an estimate for a 64-bit glibc or MSVC heap.
+#define HEAP_BLOCK_OVERHEAD 16
+
+// The heap behind one CSparseMatrix. Every nonzero is a CMatrixElement of
+// its own: a vtable pointer, i, j, value and the two list pointers, 40 bytes
+// on a 64-bit build, in a block of its own.
+struct SMatrixMemory
+{
+	long long elements;
+	size_t element_bytes;	// elements * (sizeof(CMatrixElement) + HEAP_BLOCK_OVERHEAD)
+	size_t index_bytes;		// the rowList and colList heads
+	size_t vector_bytes;	// diagonal and the block sums
+	size_t work_bytes;		// the eight solve vectors; 0 if they were given by setWorkBuffers()
+	long long blocks;		// heap blocks
+
+	size_t total() const {return element_bytes + index_bytes + vector_bytes + work_bytes;};
+};
+
+void matrix_memory(CSparseMatrix & A, SMatrixMemory & m);
+
+// Everything a CFluidSolver holds. The arena part is the block itself, split
+// by what its fields are for; the rest is heap the solver reaches through
+// its operators, factors and lists. Vectors count by capacity.
+class CMemoryReport
+{
+public:
+	// the arena
+	size_t field_bytes;		// velocity, density, pressure, the sources and the scratch fields
+	size_t work_bytes;		// the solve work vectors and block sums
+	size_t tile_bytes;		// tile lists and flags, source marks, obstacle mask, dissection order
+	size_t arena_capacity;	// the block, which may be larger than the three above
+	long long arena_allocations;
+
+	enum { NUM_OPERATORS = 3 };
+	SMatrixMemory operators[NUM_OPERATORS];	// laplacian, diffusion, velocity_diffusion
+	size_t factor_bytes[NUM_OPERATORS];		// their Cholesky factors; 0 until direct_solve built one
+	size_t list_bytes;		// source cell lists and the step's task graph
+	size_t object_bytes;	// the CFluidSolver object, stats history included
+
+	CMemoryReport();
+	void measure(CFluidSolver & solver);
+
+	size_t operator_bytes() const;
+	size_t total() const;	// arena_capacity and everything outside it
+	static const char* operator_name(int op);
+
+	void print(FILE* fp) const;
+};
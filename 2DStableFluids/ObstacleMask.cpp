@@ -0,0 +1,207 @@
+#include "ObstacleMask.h"
+#include "BlockedSum.h"
+#include <math.h>
+#include <string.h>
+
+// Sum of row(j) over the interior rows. Every row is added up in order by
+// one thread and the row sums go through tree_sum(), so the result does
+// not depend on the number of threads. partials needs n doubles.
+template <class Row>
+static double row_sum(int n, double* partials, Row row)
+{
+	#pragma omp parallel for schedule(static) if (n*n >= SUM_PARALLEL_MIN)
+	for (int j = 0; j < n; j++)
+		partials[j] = j > 0 && j < n-1 ? row(j) : 0.;
+	return tree_sum(partials, n);
+}
+
+CObstacleMask::CObstacleMask()
+{
+	n = words = 0;
+	bits = NULL;
+	solid_cells = 0;
+}
+
+void CObstacleMask::add_fields(CFieldArena & arena, int grid_n)
+{
+	n = grid_n;
+	words = (n + 63)/64;
+	arena.add(bits, (size_t) n*words);
+}
+
+void CObstacleMask::clear()
+{
+	memset(bits, 0, (size_t) n*words*sizeof(uint64_t));
+	solid_cells = 0;
+}
+
+void CObstacleMask::recount()
+{
+	//only interior cells may be set; whatever was written elsewhere goes
+	solid_cells = 0;
+	for (int j = 0; j < n; j++) {
+		uint64_t* row = bits + j*words;
+		if (j == 0 || j == n-1) {
+			memset(row, 0, words*sizeof(uint64_t));
+			continue;
+		}
+		row[0] &= ~(uint64_t) 1;
+		row[(n-1) >> 6] &= ~((uint64_t) 1 << ((n-1) & 63));
+		if (n & 63)
+			row[words-1] &= ((uint64_t) 1 << (n & 63)) - 1;
+		for (int w = 0; w < words; w++)
+			for (uint64_t word = row[w]; word; word &= word - 1)
+				solid_cells++;
+	}
+}
+
+void CObstacleMask::set(int i, int j, bool is_solid)
+{
+	if (i < 1 || i > n-2 || j < 1 || j > n-2)
+		return;
+	uint64_t & word = bits[j*words + (i >> 6)];
+	uint64_t bit = (uint64_t) 1 << (i & 63);
+	if (((word & bit) != 0) != is_solid) {
+		word ^= bit;
+		solid_cells += is_solid ? 1 : -1;
+	}
+}
+
+void CObstacleMask::fill_disk(double cx, double cy, double radius, bool is_solid)
+{
+	int i0 = (int) ceil(cx - radius), i1 = (int) floor(cx + radius);
+	int j0 = (int) ceil(cy - radius), j1 = (int) floor(cy + radius);
+	i0 = i0 < 1 ? 1 : i0;
+	j0 = j0 < 1 ? 1 : j0;
+	i1 = i1 > n-2 ? n-2 : i1;
+	j1 = j1 > n-2 ? n-2 : j1;
+	for (int j = j0; j <= j1; j++)
+		for (int i = i0; i <= i1; i++)
+			if ((i - cx)*(i - cx) + (j - cy)*(j - cy) <= radius*radius)
+				set(i, j, is_solid);
+}
+
+void CObstacleMask::fill_box(int i0, int j0, int i1, int j1, bool is_solid)
+{
+	i0 = i0 < 1 ? 1 : i0;
+	j0 = j0 < 1 ? 1 : j0;
+	i1 = i1 > n-2 ? n-2 : i1;
+	j1 = j1 > n-2 ? n-2 : j1;
+	for (int j = j0; j <= j1; j++)
+		for (int i = i0; i <= i1; i++)
+			set(i, j, is_solid);
+}
+
+bool CObstacleMask::clear_rows(int j) const
+{
+	const uint64_t* rows = bits + (j-1)*words;
+	uint64_t any_bit = 0;
+	for (int w = 0; w < 3*words; w++)
+		any_bit |= rows[w];
+	return any_bit == 0;
+}
+
+void CObstacleMask::poisson_apply(double* y, const double* x)
+{
+	#pragma omp parallel for schedule(static) if (n*n >= SUM_PARALLEL_MIN)
+	for (int j = 0; j < n; j++) {
+		double* out = y + j*n;
+		const double* in = x + j*n;
+		if (j == 0 || j == n-1) {
+			memset(out, 0, n*sizeof(double));
+			continue;
+		}
+		out[0] = out[n-1] = 0.;
+		//the neighbours that are not unknowns hold 0, so only the diagonal needs the mask
+		if (clear_rows(j)) {
+			for (int i = 1; i < n-1; i++)
+				out[i] = 4.*in[i] - in[i-1] - in[i+1] - in[i-n] - in[i+n];
+			continue;
+		}
+		const uint64_t* mid = bits + j*words;
+		for (int i = 1; i < n-1; i++) {
+			int d = diagonal(mid - words, mid, mid + words, i);
+			out[i] = d ? d*in[i] - in[i-1] - in[i+1] - in[i-n] - in[i+n] : 0.;
+		}
+	}
+}
+
+unsigned int CObstacleMask::poisson_solve(double* x, const double* b, double tol, unsigned int iter_max, double* work[5], double & residual)
+{
+	double *r = work[0], *z = work[1], *p = work[2], *Ap = work[3], *partials = work[4];
+
+	//wall and solid cells are fixed zeros in every vector
+	#pragma omp parallel for schedule(static) if (n*n >= SUM_PARALLEL_MIN)
+	for (int j = 0; j < n; j++) {
+		const uint64_t* mid = bits + j*words;
+		for (int i = 0; i < n; i++)
+			if (j == 0 || j == n-1 || i == 0 || i == n-1 || diagonal(mid - words, mid, mid + words, i) == 0) {
+				int k = i + j*n;
+				x[k] = r[k] = z[k] = p[k] = 0.;
+			}
+	}
+
+	poisson_apply(Ap, x);
+	double rz = row_sum(n, partials, [&](int j) {
+		bool plain = clear_rows(j);
+		const uint64_t* mid = bits + j*words;
+		double sum = 0.;
+		for (int k = j*n + 1, i = 1; i < n-1; i++, k++) {
+			int d = plain ? 4 : diagonal(mid - words, mid, mid + words, i);
+			if (d == 0)
+				continue;
+			r[k] = b[k] - Ap[k];
+			z[k] = p[k] = r[k]/d;
+			sum += r[k]*z[k];
+		}
+		return sum;
+	});
+	double magnitude = row_sum(n, partials, [&](int j) {
+		double sum = 0.;
+		for (int k = j*n + 1; k < j*n + n-1; k++)
+			sum += z[k]*z[k];
+		return sum;
+	});
+
+	unsigned int iterations = 0;
+	while (magnitude > tol && iterations < iter_max) {
+		iterations++;
+		poisson_apply(Ap, p);
+		double pAp = row_sum(n, partials, [&](int j) {
+			double sum = 0.;
+			for (int k = j*n + 1; k < j*n + n-1; k++)
+				sum += p[k]*Ap[k];
+			return sum;
+		});
+		if (pAp == 0.)
+			break;
+		double alpha = rz/pAp;
+		double rz_new = row_sum(n, partials, [&](int j) {
+			bool plain = clear_rows(j);
+			const uint64_t* mid = bits + j*words;
+			double sum = 0.;
+			for (int k = j*n + 1, i = 1; i < n-1; i++, k++) {
+				int d = plain ? 4 : diagonal(mid - words, mid, mid + words, i);
+				if (d == 0)
+					continue;
+				x[k] += alpha*p[k];
+				r[k] -= alpha*Ap[k];
+				z[k] = r[k]/d;
+				sum += r[k]*z[k];
+			}
+			return sum;
+		});
+		double beta = rz != 0. ? rz_new/rz : 0.;
+		rz = rz_new;
+		magnitude = row_sum(n, partials, [&](int j) {
+			double sum = 0.;
+			for (int k = j*n + 1; k < j*n + n-1; k++) {
+				p[k] = z[k] + beta*p[k];
+				sum += z[k]*z[k];
+			}
+			return sum;
+		});
+	}
+	residual = magnitude;
+	return iterations;
+}
@@ -0,0 +1,69 @@
+// ObstacleMask.h: solid cells inside the CFluidSolver domain, one bit each
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdint.h>
+#include "FieldArena.h"
+
+// Every grid row is a run of 64-bit words, cell (i, j) being bit i % 64 of
+// word i / 64, so the mask of a 1024 x 1024 grid is 128 KB and a kernel
+// that reads it beside a field of doubles moves 1/64 more bytes. Only
+// interior cells can be solid; the outer ring is the wall the solver
+// already has.
+//
+// CFluidSolver reads the mask in its kernels rather than folding it into
+// an operator, so an obstacle can be cleared and drawn again every frame
+// and nothing is rebuilt:
+//  - advection skips the solid cells, which then get density 0 and the
+//    obstacle velocity;
+//  - the divergence sees the obstacle velocity in solid neighbours, and the
+//    gradient takes the cell's own pressure for them (no pressure jump
+//    into the solid, dp/dn = 0);
+//  - the pressure is solved by poisson_solve(), whose stencil drops the
+//    solid neighbours of every fluid cell.
+// Without a single solid cell the solver takes its unmasked paths.
+class CObstacleMask
+{
+public:
+	int n;
+	int words;			// per row
+	uint64_t* bits;		// n rows of words
+	int solid_cells;
+
+	CObstacleMask();
+
+	// The words live in the owner's arena: add them to its layout for an
+	// n x n grid, and call clear() once the layout is committed.
+	void add_fields(CFieldArena & arena, int grid_n);
+	void clear();
+	void recount();	// solid_cells, after bits was written from outside
+
+	bool any() const {return solid_cells > 0;};
+	bool solid(int i, int j) const {return (bits[j*words + (i >> 6)] >> (i & 63)) & 1;};
+	void set(int i, int j, bool is_solid);	// ignored outside the interior
+	void fill_disk(double cx, double cy, double radius, bool is_solid);	// in cells, as SSplat
+	void fill_box(int i0, int j0, int i1, int j1, bool is_solid);		// [i0,i1] x [j0,j1]
+
+	// The pressure operator: 4 minus the solid neighbours on the diagonal of
+	// a fluid cell, -1 for each fluid neighbour. Wall and solid cells are
+	// not unknowns; x must be 0 there and y gets 0.
+	void poisson_apply(double* y, const double* x);
+	// Jacobi preconditioned conjugate gradients on the fluid cells, stopping
+	// like CSparseMatrix::solve(): when the squared preconditioned residual,
+	// also returned in residual, is at most tol. x is set to 0 on wall and
+	// solid cells. work: four vectors of n*n doubles and one of n.
+	unsigned int poisson_solve(double* x, const double* b, double tol, unsigned int iter_max, double* work[5], double & residual);
+
+protected:
+	static int bit(const uint64_t* row, int i) {return (int) (row[i >> 6] >> (i & 63)) & 1;};
+	// 4 minus the solid neighbours of cell i in the row at mid, 0 if it is solid itself
+	int diagonal(const uint64_t* below, const uint64_t* mid, const uint64_t* above, int i) const
+	{
+		if (bit(mid, i))
+			return 0;
+		return 4 - bit(mid, i-1) - bit(mid, i+1) - bit(below, i) - bit(above, i);
+	};
+	// no solid cell in rows j-1, j and j+1, so row j has the plain stencil
+	bool clear_rows(int j) const;
+};
@@ -0,0 +1,180 @@
+#include "ParticleSystem.h"
+#include "FluidSolver.h"
+#include "BrickGrid.h"
+#include <math.h>
+
+// the range the backtrace clamps to, so i0+1 and j0+1 stay on the grid
+static inline float clamp_position(float p, float lo, float hi)
+{
+	p = p > lo ? p : lo;
+	return p < hi ? p : hi;
+}
+
+static inline void sample(const vec2* velocity, int n, float px, float py, double & vx, double & vy)
+{
+	int i0 = (int) px, j0 = (int) py;
+	double s = px - i0, t = py - j0;
+	const vec2* p = velocity + i0 + j0*n;
+	double w00 = (1-s)*(1-t), w10 = s*(1-t), w01 = (1-s)*t, w11 = s*t;
+	vx = w00*p[0].x + w10*p[1].x + w01*p[n].x + w11*p[n+1].x;
+	vy = w00*p[0].y + w10*p[1].y + w01*p[n].y + w11*p[n+1].y;
+}
+
+CParticleSystem::CParticleSystem()
+{
+	integrator = PARTICLE_RK2;
+	sort_interval = 16;
+	particle_steps = 0;
+	random_state = 0x9e3779b97f4a7c15ULL;
+	next_id = 0;
+	steps_since_sort = 0;
+}
+
+void CParticleSystem::clear()
+{
+	resize(0);
+	particle_steps = 0;
+	steps_since_sort = 0;
+}
+
+void CParticleSystem::resize(int number)
+{
+	x.resize(number);
+	y.resize(number);
+	age.resize(number);
+	id.resize(number);
+}
+
+double CParticleSystem::random()
+{
+	//xorshift64*, top 53 bits
+	random_state ^= random_state >> 12;
+	random_state ^= random_state << 25;
+	random_state ^= random_state >> 27;
+	return ((random_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+void CParticleSystem::add(double px, double py)
+{
+	x.push_back((float) px);
+	y.push_back((float) py);
+	age.push_back(0.f);
+	id.push_back(next_id++);
+}
+
+void CParticleSystem::emit(double cx, double cy, double radius, int number)
+{
+	for (int k = 0; k < number; k++) {
+		double r = radius*sqrt(random());
+		double angle = 2.*3.14159265358979323846*random();
+		add(cx + r*cos(angle), cy + r*sin(angle));
+	}
+}
+
+void CParticleSystem::emit_box(double x0, double y0, double x1, double y1, int number)
+{
+	for (int k = 0; k < number; k++) {
+		double px = x0 + (x1 - x0)*random();
+		add(px, y0 + (y1 - y0)*random());
+	}
+}
+
+void CParticleSystem::advect(const vec2* velocity, int n, double dt)
+{
+	if (sort_interval > 0 && ++steps_since_sort >= sort_interval) {
+		sort_by_cell(n);
+		steps_since_sort = 0;
+	}
+
+	int number = count();
+	int chunks = (number + PARTICLE_CHUNK - 1)/PARTICLE_CHUNK;
+	float lo = 0.5f, hi = n - 1.5f;
+	float* px = x.data();
+	float* py = y.data();
+	float* pa = age.data();
+	bool rk2 = integrator == PARTICLE_RK2;
+	#pragma omp parallel for schedule(static)
+	for (int c = 0; c < chunks; c++) {
+		int end = (c + 1)*PARTICLE_CHUNK < number ? (c + 1)*PARTICLE_CHUNK : number;
+		for (int p = c*PARTICLE_CHUNK; p < end; p++) {
+			float x0 = clamp_position(px[p], lo, hi), y0 = clamp_position(py[p], lo, hi);
+			double vx, vy;
+			sample(velocity, n, x0, y0, vx, vy);
+			if (rk2) {
+				//again at the midpoint
+				float xm = clamp_position((float) (x0 + 0.5*dt*vx), lo, hi);
+				float ym = clamp_position((float) (y0 + 0.5*dt*vy), lo, hi);
+				sample(velocity, n, xm, ym, vx, vy);
+			}
+			px[p] = clamp_position((float) (x0 + dt*vx), lo, hi);
+			py[p] = clamp_position((float) (y0 + dt*vy), lo, hi);
+			pa[p] += (float) dt;
+		}
+	}
+	particle_steps += number;
+}
+
+void CParticleSystem::sort_by_cell(int n)
+{
+	//bucket per brick rather than per cell: a few thousand write streams
+	//instead of n*n, and a brick of velocity is only a few cache lines
+	int nb = (n + BRICK_SIZE - 1)/BRICK_SIZE;
+	int number = count();
+	float hi = n - 1.f;
+	cell_start.assign((size_t) nb*nb + 1, 0);
+	for (int p = 0; p < number; p++) {
+		int i = (int) clamp_position(x[p], 0.f, hi)/BRICK_SIZE, j = (int) clamp_position(y[p], 0.f, hi)/BRICK_SIZE;
+		cell_start[i + j*nb + 1]++;
+	}
+	for (int b = 0; b < nb*nb; b++)
+		cell_start[b+1] += cell_start[b];
+
+	spare_x.resize(number);
+	spare_y.resize(number);
+	spare_age.resize(number);
+	spare_id.resize(number);
+	for (int p = 0; p < number; p++) {
+		int i = (int) clamp_position(x[p], 0.f, hi)/BRICK_SIZE, j = (int) clamp_position(y[p], 0.f, hi)/BRICK_SIZE;
+		int to = cell_start[i + j*nb]++;
+		spare_x[to] = x[p];
+		spare_y[to] = y[p];
+		spare_age[to] = age[p];
+		spare_id[to] = id[p];
+	}
+	x.swap(spare_x);
+	y.swap(spare_y);
+	age.swap(spare_age);
+	id.swap(spare_id);
+}
+
+int CParticleSystem::cull_older(double max_age)
+{
+	float limit = (float) max_age;
+	return cull([limit](float, float, float a) {return a > limit;});
+}
+
+void CParticleSystem::splat_density(double* field, int n, double amount)
+{
+	float lo = 0.f, hi = n - 1.001f;
+	for (int p = 0; p < count(); p++) {
+		float px = clamp_position(x[p], lo, hi), py = clamp_position(y[p], lo, hi);
+		int i0 = (int) px, j0 = (int) py;
+		double s = px - i0, t = py - j0;
+		double* f = field + i0 + j0*n;
+		f[0] += amount*(1-s)*(1-t);
+		f[1] += amount*s*(1-t);
+		f[n] += amount*(1-s)*t;
+		f[n+1] += amount*s*t;
+	}
+}
+
+void CParticleSystem::plot(uint32_t* pixels, int width, int height, int n, uint32_t colour)
+{
+	double sx = (double) width/n, sy = (double) height/n;
+	for (int p = 0; p < count(); p++) {
+		//cell i covers [i - 0.5, i + 0.5) in particle coordinates
+		int u = (int) ((x[p] + 0.5)*sx), v = (int) ((y[p] + 0.5)*sy);
+		if (u >= 0 && u < width && v >= 0 && v < height)
+			pixels[(size_t) v*width + u] = colour;
+	}
+}
@@ -0,0 +1,88 @@
+// ParticleSystem.h: passive tracer particles carried by the CFluidSolver velocity
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class vec2;
+
+// schemes for CParticleSystem::integrator
+enum { PARTICLE_EULER, PARTICLE_RK2 };
+
+#define PARTICLE_CHUNK 4096	// particles per OpenMP work item
+
+// Lagrangian tracers: they go where the velocity takes them and do not act
+// on it. Every attribute is an array of its own (structure of arrays), so
+// the advection loop streams through plain float arrays. The velocity is
+// sampled bilinearly, once per step (Euler) or at the start and the
+// midpoint (RK2). Positions are clamped to the cells the semi-Lagrangian
+// backtrace may reach, which keeps every sample inside the grid.
+//
+// advect() works through the particles in chunks of PARTICLE_CHUNK shared
+// out by OpenMP. Emission order scatters the velocity reads over the whole
+// grid; sort_by_cell() groups them by BRICK_SIZE x BRICK_SIZE tile with a
+// counting sort, so neighbouring particles read neighbouring cells again.
+// advect() runs it every sort_interval steps.
+class CParticleSystem
+{
+public:
+	std::vector<float> x, y;	// in cells: cell (i, j) is at (i, j), as for SSplat
+	std::vector<float> age;		// time since emission
+	std::vector<uint32_t> id;	// emission number, kept through sorting and culling
+	int integrator;				// PARTICLE_EULER or PARTICLE_RK2
+	int sort_interval;			// 0: never sort
+	long long particle_steps;	// particles advected, summed over the steps
+
+	CParticleSystem();
+
+	int count() {return (int) x.size();};
+	void clear();
+
+	// number particles uniformly in a disk or a box, from a fixed random sequence
+	void emit(double cx, double cy, double radius, int number);
+	void emit_box(double x0, double y0, double x1, double y1, int number);
+
+	// one step of dt through velocity (n x n cells, in cells per unit time)
+	void advect(const vec2* velocity, int n, double dt);
+	void sort_by_cell(int n);
+
+	// remove the particles for which remove(x, y, age) is true, keeping the
+	// order of the rest; returns how many went
+	template <class F> int cull(F remove)
+	{
+		int kept = 0;
+		for (int p = 0; p < count(); p++)
+			if (!remove(x[p], y[p], age[p])) {
+				x[kept] = x[p];
+				y[kept] = y[p];
+				age[kept] = age[p];
+				id[kept] = id[p];
+				kept++;
+			}
+		int removed = count() - kept;
+		resize(kept);
+		return removed;
+	};
+	int cull_older(double max_age);
+
+	// add amount per particle to an n x n field, shared between the four
+	// cells around it with bilinear weights (cloud in cell)
+	void splat_density(double* field, int n, double amount);
+	// set the pixel under every particle in a width x height image of the
+	// n x n grid, laid out as CFieldRaster draws it
+	void plot(uint32_t* pixels, int width, int height, int n, uint32_t colour);
+
+protected:
+	uint64_t random_state;
+	uint32_t next_id;
+	int steps_since_sort;
+	std::vector<int> cell_start;	// sort_by_cell(): per tile counts, then offsets
+	std::vector<float> spare_x, spare_y, spare_age;
+	std::vector<uint32_t> spare_id;
+
+	double random();	// [0, 1)
+	void resize(int number);
+	void add(double px, double py);
+};
@@ -0,0 +1,566 @@
+#include "QuadtreeFluidSolver.h"
+
+//Quadtree version of CFluidSolver, see QuadtreeFluidSolver.h
+
+CQuadtreeFluidSolver::CQuadtreeFluidSolver(int grid_n):
+n(grid_n), size(grid_n*grid_n), h(0.1), laplacian(1,1), diffusion(1,1), velocity_diffusion(1,1)
+{
+	assert((n & (n-1)) == 0); // the tree needs a power of two
+
+	density = new double[size];
+	velocity = new vec2[size];
+	density_source = new double[size];
+	velocity_source = new vec2[size];
+	touched = new int[size];
+
+	leaf_x = new int[size];
+	leaf_y = new int[size];
+	leaf_size = new int[size];
+	leaf_density = new double[size];
+	leaf_velocity = new vec2[size];
+	leaf_pressure = new double[size];
+	leaf_divergence = new double[size];
+	leaf_temp = new double[size];
+	leaf_temp2 = new double[size];
+	leaf_advected = new vec2[size];
+	leaf_of = new int[size];
+
+	face_a = new int[2*size];
+	face_b = new int[2*size];
+	face_axis = new unsigned char[2*size];
+	face_length = new double[2*size];
+	face_dist = new double[2*size];
+	face_velocity = new double[2*size];
+
+	max_leaf_size = n/8 > 1 ? n/8 : 1;
+	refine_threshold = 0.05;
+	regrid_interval = 4;
+	pressure_iterations = 20;
+
+	reset();
+}
+
+CQuadtreeFluidSolver::~CQuadtreeFluidSolver(void)
+{
+	delete[] density;
+	delete[] velocity;
+	delete[] density_source;
+	delete[] velocity_source;
+	delete[] touched;
+
+	delete[] leaf_x;
+	delete[] leaf_y;
+	delete[] leaf_size;
+	delete[] leaf_density;
+	delete[] leaf_velocity;
+	delete[] leaf_pressure;
+	delete[] leaf_divergence;
+	delete[] leaf_temp;
+	delete[] leaf_temp2;
+	delete[] leaf_advected;
+	delete[] leaf_of;
+
+	delete[] face_a;
+	delete[] face_b;
+	delete[] face_axis;
+	delete[] face_length;
+	delete[] face_dist;
+	delete[] face_velocity;
+}
+
+void CQuadtreeFluidSolver::reset()
+{
+	for (int i = 0; i < size; i++) {
+		density[i] = 0.;
+		velocity[i] = vec2(0.,0.);
+		density_source[i] = 0.;
+		velocity_source[i] = vec2(0.,0.);
+	}
+	num_touched = 0;
+	viscosity_coef = 0.1;
+	step_count = 0;
+
+	//start from the coarsest uniform tree
+	num_leaves = 0;
+	for (int y = 0; y < n; y += max_leaf_size)
+		for (int x = 0; x < n; x += max_leaf_size) {
+			leaf_x[num_leaves] = x;
+			leaf_y[num_leaves] = y;
+			leaf_size[num_leaves] = max_leaf_size;
+			num_leaves++;
+		}
+	for (int l = 0; l < num_leaves; l++) {
+		leaf_density[l] = 0.;
+		leaf_velocity[l] = vec2(0.,0.);
+		leaf_pressure[l] = 0.;
+		for (int j = leaf_y[l]; j < leaf_y[l] + leaf_size[l]; j++)
+			for (int i = leaf_x[l]; i < leaf_x[l] + leaf_size[l]; i++)
+				leaf_of[i+j*n] = l;
+	}
+	build_faces();
+	build_matrices();
+}
+
+void CQuadtreeFluidSolver::set_density_source(int index, double value)
+{
+	if (density_source[index] == 0. && velocity_source[index].x == 0. && velocity_source[index].y == 0.)
+		touched[num_touched++] = index;
+	density_source[index] = value;
+}
+
+void CQuadtreeFluidSolver::set_velocity_source(int index, vec2 value)
+{
+	if (density_source[index] == 0. && velocity_source[index].x == 0. && velocity_source[index].y == 0.)
+		touched[num_touched++] = index;
+	velocity_source[index] = value;
+}
+
+void CQuadtreeFluidSolver::update()
+{
+	if (step_count % regrid_interval == 0)
+		regrid();
+	updateDensity();
+	updateVelocity();
+	num_touched = 0;
+	step_count++;
+}
+
+void CQuadtreeFluidSolver::updateDensity()
+{
+	//sources are spread over the leaf that contains them
+	for (int k = 0; k < num_touched; k++) {
+		int l = leaf_of[touched[k]];
+		leaf_density[l] += density_source[touched[k]] / (leaf_size[l]*leaf_size[l]);
+	}
+
+	//Diffusion process, (area + c K) density_new = area density_old
+	for (int l = 0; l < num_leaves; l++)
+		leaf_temp[l] = leaf_size[l]*leaf_size[l]*leaf_density[l];
+	diffusion.solve(leaf_density, leaf_temp, 1e-8, 30);
+
+	density_advection();
+	clean_density_source();
+}
+
+void CQuadtreeFluidSolver::updateVelocity()
+{
+	velocity_advection();
+
+	for (int k = 0; k < num_touched; k++) {
+		int l = leaf_of[touched[k]];
+		leaf_velocity[l] = leaf_velocity[l] + velocity_source[touched[k]] * (1.0 / (leaf_size[l]*leaf_size[l]));
+	}
+
+	// Add buoyancy force (proportional to density, acts upwards)
+	double buoyancy_coef = 0.1;
+	for (int l = 0; l < num_leaves; l++)
+		if (leaf_density[l] > 0)
+			leaf_velocity[l].y -= buoyancy_coef * leaf_density[l];
+
+	// Velocity Diffusion step, leaf_divergence holds each component while it is solved
+	if (viscosity_coef > 0) {
+		for (int l = 0; l < num_leaves; l++) {
+			double area = leaf_size[l]*leaf_size[l];
+			leaf_temp[l] = area*leaf_velocity[l].x;
+			leaf_temp2[l] = area*leaf_velocity[l].y;
+			leaf_divergence[l] = leaf_velocity[l].x;
+		}
+		velocity_diffusion.solve(leaf_divergence, leaf_temp, 1e-8, 30);
+		for (int l = 0; l < num_leaves; l++) {
+			leaf_velocity[l].x = leaf_divergence[l];
+			leaf_divergence[l] = leaf_velocity[l].y;
+		}
+		velocity_diffusion.solve(leaf_divergence, leaf_temp2, 1e-8, 30);
+		for (int l = 0; l < num_leaves; l++)
+			leaf_velocity[l].y = leaf_divergence[l];
+	}
+
+	projection();
+	clean_velocity_source();
+}
+
+void CQuadtreeFluidSolver::projection()
+{
+	//normal velocity on every face, and the net outflow of each leaf
+	for (int l = 0; l < num_leaves; l++)
+		leaf_divergence[l] = 0.;
+	for (int f = 0; f < num_faces; f++) {
+		vec2 & va = leaf_velocity[face_a[f]];
+		vec2 & vb = leaf_velocity[face_b[f]];
+		face_velocity[f] = face_axis[f] == 0 ? 0.5*(va.x+vb.x) : 0.5*(va.y+vb.y);
+		leaf_divergence[face_a[f]] += face_velocity[f]*face_length[f];
+		leaf_divergence[face_b[f]] -= face_velocity[f]*face_length[f];
+	}
+
+	//get pressure by solving K pressure = -outflow, K couples leaves of any size through their faces
+	for (int l = 0; l < num_leaves; l++)
+		leaf_temp[l] = -leaf_divergence[l];
+	laplacian.solve(leaf_pressure, leaf_temp, 1e-8, pressure_iterations);
+
+	//correct the faces, then move each leaf velocity by the mean correction of its faces
+	for (int l = 0; l < num_leaves; l++)
+		leaf_advected[l] = vec2(0.,0.);
+	for (int f = 0; f < num_faces; f++) {
+		int a = face_a[f], b = face_b[f];
+		double correction = -(leaf_pressure[b] - leaf_pressure[a]) / face_dist[f];
+		face_velocity[f] += correction;
+		double weight = 0.5*correction*face_length[f];
+		if (face_axis[f] == 0) {
+			leaf_advected[a].x += weight / leaf_size[a];
+			leaf_advected[b].x += weight / leaf_size[b];
+		} else {
+			leaf_advected[a].y += weight / leaf_size[a];
+			leaf_advected[b].y += weight / leaf_size[b];
+		}
+	}
+	for (int l = 0; l < num_leaves; l++)
+		leaf_velocity[l] = leaf_velocity[l] + leaf_advected[l];
+}
+
+void CQuadtreeFluidSolver::clean_density_source()
+{
+	for (int k = 0; k < num_touched; k++)
+		density_source[touched[k]] = 0.;
+}
+
+void CQuadtreeFluidSolver::clean_velocity_source()
+{
+	for (int k = 0; k < num_touched; k++)
+		velocity_source[touched[k]] = vec2(0.,0.);
+}
+
+double CQuadtreeFluidSolver::sample_density(double x, double y)
+{
+	//bilinear interpolation between the leaves covering the four nearest fine cells
+	if (x < 0) x = 0;
+	if (x > n-1) x = n-1;
+	if (y < 0) y = 0;
+	if (y > n-1) y = n-1;
+	int i0 = (int) x;
+	int j0 = (int) y;
+	if (i0 > n-2) i0 = n-2;
+	if (j0 > n-2) j0 = n-2;
+	double s = x - i0;
+	double t = y - j0;
+	return (1-s)*(1-t)*leaf_density[leaf_of[i0+j0*n]] + (1-s)*t*leaf_density[leaf_of[i0+(j0+1)*n]]
+		+ s*(1-t)*leaf_density[leaf_of[i0+1+j0*n]] + s*t*leaf_density[leaf_of[i0+1+(j0+1)*n]];
+}
+
+vec2 CQuadtreeFluidSolver::sample_velocity(double x, double y)
+{
+	if (x < 0) x = 0;
+	if (x > n-1) x = n-1;
+	if (y < 0) y = 0;
+	if (y > n-1) y = n-1;
+	int i0 = (int) x;
+	int j0 = (int) y;
+	if (i0 > n-2) i0 = n-2;
+	if (j0 > n-2) j0 = n-2;
+	double s = x - i0;
+	double t = y - j0;
+	vec2 v00 = leaf_velocity[leaf_of[i0+j0*n]];
+	vec2 v01 = leaf_velocity[leaf_of[i0+(j0+1)*n]];
+	vec2 v10 = leaf_velocity[leaf_of[i0+1+j0*n]];
+	vec2 v11 = leaf_velocity[leaf_of[i0+1+(j0+1)*n]];
+	return vec2((1-s)*(1-t)*v00.x + (1-s)*t*v01.x + s*(1-t)*v10.x + s*t*v11.x,
+		(1-s)*(1-t)*v00.y + (1-s)*t*v01.y + s*(1-t)*v10.y + s*t*v11.y);
+}
+
+void CQuadtreeFluidSolver::density_advection()
+{
+	for (int l = 0; l < num_leaves; l++) {
+		//go backwards from the leaf centre following its velocity
+		double x = centre_x(l) - h*leaf_velocity[l].x;
+		double y = centre_y(l) - h*leaf_velocity[l].y;
+		if (x < 0.5) x = 0.5;
+		if (x > n-1.5) x = n-1.5;
+		if (y < 0.5) y = 0.5;
+		if (y > n-1.5) y = n-1.5;
+		leaf_temp[l] = sample_density(x, y);
+	}
+	double* swap = leaf_density; leaf_density = leaf_temp; leaf_temp = swap;
+}
+
+void CQuadtreeFluidSolver::velocity_advection()
+{
+	for (int l = 0; l < num_leaves; l++) {
+		double x = centre_x(l) - h*leaf_velocity[l].x;
+		double y = centre_y(l) - h*leaf_velocity[l].y;
+		if (x < 0.5) x = 0.5;
+		if (x > n-1.5) x = n-1.5;
+		if (y < 0.5) y = 0.5;
+		if (y > n-1.5) y = n-1.5;
+		leaf_advected[l] = sample_velocity(x, y);
+	}
+	vec2* swap = leaf_velocity; leaf_velocity = leaf_advected; leaf_advected = swap;
+}
+
+void CQuadtreeFluidSolver::build_faces()
+{
+	//walk the high-x and high-y edge of every leaf, one face per run of the same neighbour
+	num_faces = 0;
+	for (int l = 0; l < num_leaves; l++) {
+		int x = leaf_x[l], y = leaf_y[l], s = leaf_size[l];
+		for (int axis = 0; axis < 2; axis++) {
+			if ((axis == 0 ? x : y) + s >= n)
+				continue; // domain wall
+			int k = 0;
+			while (k < s) {
+				int fine = axis == 0 ? (x+s) + (y+k)*n : (x+k) + (y+s)*n;
+				int b = leaf_of[fine];
+				int run = 1;
+				while (k + run < s && leaf_of[axis == 0 ? (x+s) + (y+k+run)*n : (x+k+run) + (y+s)*n] == b)
+					run++;
+				face_a[num_faces] = l;
+				face_b[num_faces] = b;
+				face_axis[num_faces] = (unsigned char) axis;
+				face_length[num_faces] = run;
+				face_dist[num_faces] = 0.5*(s + leaf_size[b]);
+				num_faces++;
+				k += run;
+			}
+		}
+	}
+}
+
+void CQuadtreeFluidSolver::build_matrices()
+{
+	// K: sum over faces of length/dist (pressure difference), then
+	// diffusion = area + c K, velocity_diffusion = area + viscosity h K
+	laplacian.setDimensions(num_leaves);
+	diffusion.setDimensions(num_leaves);
+	double diffusion_coef = 0.3*h;
+	for (int l = 0; l < num_leaves; l++)
+		leaf_temp[l] = 0.;
+	for (int f = 0; f < num_faces; f++) {
+		double k = face_length[f] / face_dist[f];
+		laplacian.set1Value(face_a[f], face_b[f], -k);
+		laplacian.set1Value(face_b[f], face_a[f], -k);
+		diffusion.set1Value(face_a[f], face_b[f], -k*diffusion_coef);
+		diffusion.set1Value(face_b[f], face_a[f], -k*diffusion_coef);
+		leaf_temp[face_a[f]] += k;
+		leaf_temp[face_b[f]] += k;
+	}
+	for (int l = 0; l < num_leaves; l++) {
+		laplacian.set1Value(l, l, leaf_temp[l] > 0 ? leaf_temp[l] : 1.);
+		diffusion.set1Value(l, l, leaf_size[l]*leaf_size[l] + leaf_temp[l]*diffusion_coef);
+	}
+	setup_velocity_diffusion_matrix(viscosity_coef);
+}
+
+void CQuadtreeFluidSolver::setup_velocity_diffusion_matrix(double viscosity)
+{
+	velocity_diffusion.setDimensions(num_leaves);
+	double coef = viscosity * h;
+	for (int l = 0; l < num_leaves; l++)
+		leaf_temp2[l] = 0.;
+	if (coef > 0) {
+		for (int f = 0; f < num_faces; f++) {
+			double k = face_length[f] / face_dist[f];
+			velocity_diffusion.set1Value(face_a[f], face_b[f], -k*coef);
+			velocity_diffusion.set1Value(face_b[f], face_a[f], -k*coef);
+			leaf_temp2[face_a[f]] += k;
+			leaf_temp2[face_b[f]] += k;
+		}
+	}
+	for (int l = 0; l < num_leaves; l++)
+		velocity_diffusion.set1Value(l, l, leaf_size[l]*leaf_size[l] + leaf_temp2[l]*(coef > 0 ? coef : 0.));
+}
+
+void CQuadtreeFluidSolver::regrid()
+{
+	//refinement indicator: leaf size times the density and velocity jumps across its faces
+	double* indicator = leaf_temp;
+	for (int l = 0; l < num_leaves; l++)
+		indicator[l] = 0.;
+	for (int f = 0; f < num_faces; f++) {
+		int a = face_a[f], b = face_b[f];
+		double jump = fabs(leaf_density[b] - leaf_density[a]);
+		if (face_axis[f] == 0)
+			jump += fabs(leaf_velocity[b].y - leaf_velocity[a].y); // vorticity across an x face
+		else
+			jump += fabs(leaf_velocity[b].x - leaf_velocity[a].x);
+		jump /= face_dist[f];
+		if (jump*leaf_size[a] > indicator[a]) indicator[a] = jump*leaf_size[a];
+		if (jump*leaf_size[b] > indicator[b]) indicator[b] = jump*leaf_size[b];
+	}
+	//desired leaf size: one level finer or coarser per regrid, the finest size where sources land
+	int* want = new int[num_leaves];
+	for (int l = 0; l < num_leaves; l++) {
+		int s = leaf_size[l];
+		want[l] = s;
+		if (indicator[l] > refine_threshold && s > 1)
+			want[l] = s/2;
+		else if (indicator[l] < 0.25*refine_threshold && s < max_leaf_size)
+			want[l] = 2*s;
+	}
+	for (int k = 0; k < num_touched; k++)
+		want[leaf_of[touched[k]]] = 1;
+
+	//grade the sizes so touching leaves differ by at most a factor of two,
+	//which also keeps a buffer of fine leaves around refined features
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int f = 0; f < num_faces; f++) {
+			int a = face_a[f], b = face_b[f];
+			if (want[a] > 2*want[b]) {
+				want[a] = 2*want[b];
+				changed = true;
+			}
+			if (want[b] > 2*want[a]) {
+				want[b] = 2*want[a];
+				changed = true;
+			}
+		}
+	}
+
+	int* desired = new int[size];
+	for (int l = 0; l < num_leaves; l++)
+		for (int j = leaf_y[l]; j < leaf_y[l] + leaf_size[l]; j++)
+			for (int i = leaf_x[l]; i < leaf_x[l] + leaf_size[l]; i++)
+				desired[i+j*n] = want[l];
+	delete[] want;
+
+	int* new_x = new int[size];
+	int* new_y = new int[size];
+	int* new_size = new int[size];
+	int count = 0;
+	build_leaves(desired, new_x, new_y, new_size, count);
+	//the blocks of the new layout are aligned, so a leaf can come out finer
+	//than its old one wanted; grade the layout itself: a cell whose leaf is
+	//more than twice as large as a neighbour's caps its desired size, and the
+	//leaves are built again until no two touching leaves break the rule
+	int* cell_size = new int[size];
+	for (changed = true; changed; ) {
+		for (int l = 0; l < count; l++)
+			for (int j = new_y[l]; j < new_y[l] + new_size[l]; j++)
+				for (int i = new_x[l]; i < new_x[l] + new_size[l]; i++)
+					cell_size[i+j*n] = new_size[l];
+		changed = false;
+		for (int j = 0; j < n; j++)
+			for (int i = 0; i < n; i++) {
+				int c = i+j*n;
+				int neighbours[2] = {i+1 < n ? c+1 : -1, j+1 < n ? c+n : -1};
+				for (int k = 0; k < 2; k++) {
+					int d = neighbours[k];
+					if (d < 0)
+						continue;
+					if (cell_size[c] > 2*cell_size[d] && desired[c] > 2*cell_size[d]) {
+						desired[c] = 2*cell_size[d];
+						changed = true;
+					}
+					if (cell_size[d] > 2*cell_size[c] && desired[d] > 2*cell_size[c]) {
+						desired[d] = 2*cell_size[c];
+						changed = true;
+					}
+				}
+			}
+		if (changed)
+			build_leaves(desired, new_x, new_y, new_size, count);
+	}
+	delete[] cell_size;
+
+	//transfer the fields: each new leaf takes the area average of the old leaves it covers
+	double* new_density = leaf_temp2;
+	vec2* new_velocity = leaf_advected;
+	double* new_pressure = leaf_divergence;
+	for (int l = 0; l < count; l++) {
+		double sd = 0., sp = 0.;
+		vec2 sv(0.,0.);
+		for (int j = new_y[l]; j < new_y[l] + new_size[l]; j++)
+			for (int i = new_x[l]; i < new_x[l] + new_size[l]; i++) {
+				int old = leaf_of[i+j*n];
+				sd += leaf_density[old];
+				sp += leaf_pressure[old];
+				sv = sv + leaf_velocity[old];
+			}
+		double inv = 1.0 / (new_size[l]*new_size[l]);
+		new_density[l] = sd*inv;
+		new_pressure[l] = sp*inv;
+		new_velocity[l] = sv*inv;
+	}
+
+	num_leaves = count;
+	for (int l = 0; l < count; l++) {
+		leaf_x[l] = new_x[l];
+		leaf_y[l] = new_y[l];
+		leaf_size[l] = new_size[l];
+		for (int j = new_y[l]; j < new_y[l] + new_size[l]; j++)
+			for (int i = new_x[l]; i < new_x[l] + new_size[l]; i++)
+				leaf_of[i+j*n] = l;
+	}
+	double* swap = leaf_density; leaf_density = new_density; leaf_temp2 = swap;
+	swap = leaf_pressure; leaf_pressure = new_pressure; leaf_divergence = swap;
+	vec2* vswap = leaf_velocity; leaf_velocity = new_velocity; leaf_advected = vswap;
+
+	delete[] desired;
+	delete[] new_x;
+	delete[] new_y;
+	delete[] new_size;
+
+	build_faces();
+	build_matrices();
+}
+
+void CQuadtreeFluidSolver::build_leaves(int* desired, int* new_x, int* new_y, int* new_size, int & count)
+{
+	//min-pyramid of the desired sizes, level k holds blocks of 2^k fine cells
+	int levels = 0;
+	while ((1 << levels) < n)
+		levels++;
+	int** pyramid = new int*[levels+1];
+	pyramid[0] = desired;
+	for (int k = 1; k <= levels; k++) {
+		int m = n >> k;
+		pyramid[k] = new int[m*m];
+		int* below = pyramid[k-1];
+		for (int j = 0; j < m; j++)
+			for (int i = 0; i < m; i++) {
+				int a = below[2*i + 2*j*2*m], b = below[2*i+1 + 2*j*2*m];
+				int c = below[2*i + (2*j+1)*2*m], d = below[2*i+1 + (2*j+1)*2*m];
+				int lo = a < b ? a : b;
+				lo = lo < c ? lo : c;
+				pyramid[k][i+j*m] = lo < d ? lo : d;
+			}
+	}
+
+	//top-down: a block becomes a leaf once it is small enough and nothing inside wants smaller cells
+	int* stack = new int[4*levels*3+3];
+	int top = 0;
+	stack[top++] = 0; stack[top++] = 0; stack[top++] = levels;
+	count = 0;
+	while (top > 0) {
+		int k = stack[--top];
+		int by = stack[--top];
+		int bx = stack[--top];
+		int s = 1 << k;
+		int m = n >> k;
+		if (k == 0 || (s <= max_leaf_size && pyramid[k][bx + by*m] >= s)) {
+			new_x[count] = bx*s;
+			new_y[count] = by*s;
+			new_size[count] = s;
+			count++;
+			continue;
+		}
+		//push the children in reverse so the leaves come out in Z order
+		for (int c = 3; c >= 0; c--) {
+			stack[top++] = 2*bx + (c & 1);
+			stack[top++] = 2*by + (c >> 1);
+			stack[top++] = k-1;
+		}
+	}
+
+	for (int k = 1; k <= levels; k++)
+		delete[] pyramid[k];
+	delete[] pyramid;
+	delete[] stack;
+}
+
+void CQuadtreeFluidSolver::resample()
+{
+	for (int i = 0; i < size; i++) {
+		density[i] = leaf_density[leaf_of[i]];
+		velocity[i] = leaf_velocity[leaf_of[i]];
+	}
+}
@@ -0,0 +1,104 @@
+#include "FluidSolver.h"
+
+#pragma once
+
+// Adaptive quadtree variant of CFluidSolver.
+// The n x n domain (n a power of two) is covered by square leaves of size
+// 1..max_leaf_size fine cells. Leaves are refined where density gradients or
+// vorticity are large and coarsened in quiescent regions every
+// regrid_interval steps.
+//
+// Each leaf stores cell-centred density and velocity. The pressure projection
+// works on the leaf faces: wherever two leaves touch, of any size, the face
+// normal velocity is corrected by the pressure difference across it, so the
+// Poisson operator couples leaves across levels. Leaf velocities are rebuilt
+// from the projected face velocities afterwards.
+//
+// The source interface matches CFluidSolver: sources are written per fine
+// cell through set_density_source/set_velocity_source, and density/velocity
+// hold a fine-resolution copy of the leaf fields after resample().
+class CQuadtreeFluidSolver
+{
+public:
+	int		n;		// fine cells along one side of the square domain
+	int		size;	// = n * n
+	double	h;		// time step
+
+	// fine-resolution view, filled by resample()
+	double*	density;
+	vec2*	velocity;
+
+	double* density_source;
+	vec2*	velocity_source;
+	int*	touched;		// fine cells holding a source this step
+	int		num_touched;
+
+	// leaves, stored up to size entries
+	int		num_leaves;
+	int*	leaf_x;			// lower-left fine cell of the leaf
+	int*	leaf_y;
+	int*	leaf_size;		// side length in fine cells
+	double* leaf_density;
+	vec2*	leaf_velocity;
+	double* leaf_pressure;
+	double* leaf_divergence;
+	double* leaf_temp;		// scratch
+	double* leaf_temp2;		// scratch
+	vec2*	leaf_advected;	// scratch
+	int*	leaf_of;		// n*n map from fine cell to leaf
+
+	// faces between touching leaves; face_a is on the low side, face_b on the high side
+	int		num_faces;
+	int*	face_a;
+	int*	face_b;
+	unsigned char* face_axis;	// 0: normal along x, 1: normal along y
+	double* face_length;
+	double* face_dist;
+	double* face_velocity;		// normal velocity from a to b
+
+	CSparseMatrix laplacian;
+	CSparseMatrix diffusion;
+	CSparseMatrix velocity_diffusion;
+
+	double viscosity_coef;
+	int pressure_iterations;
+
+	// refinement control
+	int max_leaf_size;
+	double refine_threshold;	// refine where leaf_size * (|grad density| + |vorticity|) exceeds this
+	int regrid_interval;
+	int step_count;
+
+public:
+	void reset();
+	void update();
+	void updateDensity();
+	void updateVelocity();
+	void setup_velocity_diffusion_matrix(double viscosity);
+	void clean_density_source();
+	void clean_velocity_source();
+	void projection();
+	void density_advection();
+	void velocity_advection();
+	void regrid();
+	void resample();
+
+	void set_density_source(int index, double value);
+	void set_velocity_source(int index, vec2 value);
+
+	double* d(int i, int j) {return leaf_density + leaf_of[i+j*n];};
+	vec2* v(int i, int j) {return leaf_velocity + leaf_of[i+j*n];};
+
+	double centre_x(int leaf) {return leaf_x[leaf] + 0.5*(leaf_size[leaf]-1);};
+	double centre_y(int leaf) {return leaf_y[leaf] + 0.5*(leaf_size[leaf]-1);};
+	double sample_density(double x, double y);
+	vec2 sample_velocity(double x, double y);
+
+	CQuadtreeFluidSolver(int grid_n = 64);
+	~CQuadtreeFluidSolver(void);
+
+protected:
+	void build_faces();
+	void build_matrices();
+	void build_leaves(int* desired, int* new_x, int* new_y, int* new_size, int & count);
+};
@@ -0,0 +1,74 @@
+#include "ShmTransport.h"
+
+#ifndef _WIN32
+
+#include <string.h>
+#include <sys/mman.h>
+
+SShmHeader* CShmTransport::create_segment(int num_ranks, int capacity)
+{
+	size_t bytes = sizeof(SShmHeader) + (num_ranks + 2*num_ranks*(size_t) capacity)*sizeof(double);
+	void* segment = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (segment == MAP_FAILED)
+		return NULL;
+	SShmHeader* header = (SShmHeader*) segment;
+	header->num_ranks = num_ranks;
+	header->capacity = capacity;
+
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	int error = pthread_barrier_init(&header->barrier, &attr, num_ranks);
+	pthread_barrierattr_destroy(&attr);
+	if (error) {
+		munmap(segment, bytes);
+		return NULL;
+	}
+	return header;
+}
+
+void CShmTransport::destroy_segment(SShmHeader* header)
+{
+	size_t bytes = sizeof(SShmHeader) + (header->num_ranks + 2*header->num_ranks*(size_t) header->capacity)*sizeof(double);
+	pthread_barrier_destroy(&header->barrier);
+	munmap(header, bytes);
+}
+
+CShmTransport::CShmTransport(SShmHeader* shared, int rank):
+header(shared), my_rank(rank)
+{
+}
+
+void CShmTransport::barrier()
+{
+	pthread_barrier_wait(&header->barrier);
+}
+
+void CShmTransport::exchange(const double* send_low, const double* send_high, double* recv_low, double* recv_high, int count)
+{
+	int last = header->num_ranks - 1;
+	if (my_rank > 0)
+		memcpy(mailbox(my_rank, 0), send_low, count*sizeof(double));
+	if (my_rank < last)
+		memcpy(mailbox(my_rank, 1), send_high, count*sizeof(double));
+	barrier();
+	if (my_rank > 0)
+		memcpy(recv_low, mailbox(my_rank-1, 1), count*sizeof(double));
+	if (my_rank < last)
+		memcpy(recv_high, mailbox(my_rank+1, 0), count*sizeof(double));
+	// nobody may refill a mailbox before its readers are done
+	barrier();
+}
+
+double CShmTransport::allreduce_sum(double value)
+{
+	slots()[my_rank] = value;
+	barrier();
+	double sum = 0.;
+	for (int k = 0; k < header->num_ranks; k++)
+		sum += slots()[k];
+	barrier();
+	return sum;
+}
+
+#endif
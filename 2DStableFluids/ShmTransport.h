@@ -0,0 +1,46 @@
+// ShmTransport.h: CHaloTransport over POSIX shared memory
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "HaloTransport.h"
+
+#ifndef _WIN32
+
+#include <pthread.h>
+
+// Layout of the shared segment: a process-shared barrier, one reduction slot
+// per rank, then two mailboxes (low and high boundary) per rank of capacity
+// doubles each.
+struct SShmHeader
+{
+	pthread_barrier_t barrier;
+	int num_ranks;
+	int capacity;
+};
+
+class CShmTransport : public CHaloTransport
+{
+public:
+	SShmHeader* header;
+	int my_rank;
+
+	// Create an anonymous shared segment before forking the workers. The
+	// mapping is inherited across fork(), so nothing is left behind in /dev/shm.
+	static SShmHeader* create_segment(int num_ranks, int capacity);
+	static void destroy_segment(SShmHeader* header);
+
+	CShmTransport(SShmHeader* shared, int rank);
+
+	int rank() {return my_rank;};
+	int num_ranks() {return header->num_ranks;};
+	void exchange(const double* send_low, const double* send_high, double* recv_low, double* recv_high, int count);
+	double allreduce_sum(double value);
+	void barrier();
+
+protected:
+	double* slots() {return (double*) (header + 1);};
+	double* mailbox(int rank, int side) {return slots() + header->num_ranks + (2*rank + side)*header->capacity;};
+};
+
+#endif
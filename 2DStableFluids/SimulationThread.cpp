@@ -0,0 +1,150 @@
+#include "SimulationThread.h"
+#include <chrono>
+
+void CFrameSnapshot::copy_from(CFluidSolver & solver)
+{
+	if (size != solver.size) {
+		delete[] density;
+		delete[] velocity;
+		n = solver.n;
+		size = solver.size;
+		density = new double[size];
+		velocity = new vec2[size];
+	}
+	for (int i = 0; i < size; i++) {
+		density[i] = solver.density[i];
+		velocity[i].x = solver.velocity[i].x;
+		velocity[i].y = solver.velocity[i].y;
+	}
+	active_tiles = solver.bricks.num_active;
+	substeps = solver.last_substeps;
+	cfl = solver.last_cfl;
+	solves_per_second = solver.simulated_time > 0 ? solver.solve_count/solver.simulated_time : 0.;
+	stats = solver.stats;
+}
+
+CSimulationThread::CSimulationThread(CFluidSolver & s):
+solver(s), frames_published(0), last_step_ns(0), keep_running(false)
+{
+	frame_interval_ms = 25;
+	recorder = NULL;
+	frames_displayed = 0;
+	frames_skipped = 0;
+	latency_ms = 0.;
+	max_latency_ms = 0.;
+	started_ns = 0;
+	last_displayed = -1;
+	// every slot starts as a copy of the initial state, so the reader
+	// never sees an empty frame
+	for (int k = 0; k < 3; k++)
+		frames.slots[k].copy_from(solver);
+}
+
+CSimulationThread::~CSimulationThread(void)
+{
+	stop();
+}
+
+void CSimulationThread::start()
+{
+	if (running())
+		return;
+	started_ns = clock.nanoseconds();
+	frames_published = 0;
+	last_displayed = -1;
+	keep_running = true;
+	worker = std::thread(&CSimulationThread::run, this);
+}
+
+void CSimulationThread::stop()
+{
+	if (!running())
+		return;
+	keep_running = false;
+	worker.join();
+}
+
+double CSimulationThread::steps_per_second()
+{
+	long long ns = clock.nanoseconds() - started_ns;
+	return ns > 0 ? frames_published*1e9/ns : 0.;
+}
+
+void CSimulationThread::step_once()
+{
+	if (!running())
+		advance();
+}
+
+void CSimulationThread::add_density_source(int index, double value)
+{
+	SSplat splat = {(double) (index % solver.n), (double) (index / solver.n), 0., value, vec2(0., 0.)};
+	add_splats(&splat, 1);
+}
+
+void CSimulationThread::add_velocity_source(int index, vec2 value)
+{
+	SSplat splat = {(double) (index % solver.n), (double) (index / solver.n), 0., 0., value};
+	add_splats(&splat, 1);
+}
+
+void CSimulationThread::add_splats(const SSplat* splats, int count)
+{
+	std::lock_guard<std::mutex> lock(source_mutex);
+	pending.insert(pending.end(), splats, splats + count);
+}
+
+void CSimulationThread::run()
+{
+	while (keep_running) {
+		long long begin = clock.nanoseconds();
+		advance();
+		long long wait = begin + frame_interval_ms*1000000LL - clock.nanoseconds();
+		if (wait > 0)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+	}
+}
+
+void CSimulationThread::advance()
+{
+	{
+		std::lock_guard<std::mutex> lock(source_mutex);
+		applying.swap(pending);
+	}
+
+	std::lock_guard<std::mutex> lock(solver_mutex);
+	long long begin = clock.nanoseconds();
+	solver.add_splats(applying.data(), (int) applying.size());
+	applying.clear();
+	solver.update();
+	if (recorder)
+		recorder->capture(solver);
+	publish();
+	last_step_ns = clock.nanoseconds() - begin;
+}
+
+void CSimulationThread::publish()
+{
+	CFrameSnapshot & snapshot = frames.write_slot();
+	snapshot.copy_from(solver);
+	snapshot.frame = frames_published;
+	snapshot.published_ns = clock.nanoseconds();
+	frames.publish();
+	frames_published++;
+}
+
+bool CSimulationThread::fetch_frame()
+{
+	if (!frames.fetch())
+		return false;
+	CFrameSnapshot & snapshot = frames.read_slot();
+	double latency = (clock.nanoseconds() - snapshot.published_ns)*1e-6;
+	latency_ms = frames_displayed == 0 ? latency : 0.9*latency_ms + 0.1*latency;
+	if (latency > max_latency_ms)
+		max_latency_ms = latency;
+	if (last_displayed >= 0 && snapshot.frame > last_displayed + 1)
+		frames_skipped += snapshot.frame - last_displayed - 1;
+	last_displayed = snapshot.frame;
+	frames_displayed++;
+	return true;
+}
@@ -0,0 +1,107 @@
+// SimulationThread.h: runs CFluidSolver on its own thread
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "FluidSolver.h"
+#include "TripleBuffer.h"
+#include "StopWatch.h"
+#include "FrameRecorder.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// One finished frame, with everything the view needs to draw it
+class CFrameSnapshot
+{
+public:
+	int		n;
+	int		size;
+	double*	density;
+	vec2*	velocity;
+
+	long long	frame;			// -1 until the first frame is published
+	long long	published_ns;	// CSimulationThread clock time of publish()
+	int		active_tiles;
+	int		substeps;
+	double	cfl;
+	double	solves_per_second;	// solves per simulated second
+	CSolverStats stats;
+
+	CFrameSnapshot(): n(0), size(0), density(NULL), velocity(NULL), frame(-1), published_ns(0),
+		active_tiles(0), substeps(0), cfl(0.), solves_per_second(0.) {};
+	~CFrameSnapshot() {delete[] density; delete[] velocity;};
+
+	void copy_from(CFluidSolver & solver);
+	vec2* v(int i, int j) {return velocity+i+j*n;};
+};
+
+// Steps the solver on a worker thread and publishes every frame through a
+// CTripleBuffer, so the view always draws a complete frame and never waits
+// for a step, and the stepper never waits for a paint.
+//  - sources from the mouse go to a short pending list of splats under
+//    their own mutex, so adding one never waits for a step either; the
+//    splats queued between two steps add up;
+//  - anything else that changes the solver (reset, viscosity, modes) goes
+//    through edit(), which runs between two steps.
+// Only code holding solver_mutex publishes, which keeps the triple buffer's
+// single writer rule when edit() publishes from the UI thread.
+class CSimulationThread
+{
+public:
+	CFluidSolver & solver;
+	CTripleBuffer<CFrameSnapshot> frames;
+	std::mutex solver_mutex;
+	int frame_interval_ms;	// start of one step to the start of the next; 0 runs flat out
+	CFrameRecorder* recorder;	// if set, captures after every step; change it through edit()
+
+	// stepper statistics
+	std::atomic<long long> frames_published;
+	std::atomic<long long> last_step_ns;	// update() and the snapshot copy
+
+	// reader statistics, updated by fetch_frame()
+	long long frames_displayed;
+	long long frames_skipped;	// published but replaced before the reader fetched them
+	double latency_ms;			// publish to fetch, smoothed
+	double max_latency_ms;
+
+	CSimulationThread(CFluidSolver & s);
+	~CSimulationThread(void);
+
+	void start();
+	void stop();
+	bool running() {return worker.joinable();};
+	double steps_per_second();	// since start()
+
+	void step_once();	// a synchronous step on the calling thread; only while stopped
+	void add_density_source(int index, double value);	// a point splat at the cell
+	void add_velocity_source(int index, vec2 value);
+	void add_splats(const SSplat* splats, int count);
+
+	// run f(solver) between two steps; the result is published right away
+	template <class F> void edit(F f)
+	{
+		std::lock_guard<std::mutex> lock(solver_mutex);
+		f(solver);
+		publish();
+	};
+
+	// reader side: take the newest frame if there is one
+	bool fetch_frame();
+	CFrameSnapshot & frame() {return frames.read_slot();};
+
+protected:
+	std::thread worker;
+	std::atomic<bool> keep_running;
+	std::mutex source_mutex;
+	std::vector<SSplat> pending;
+	std::vector<SSplat> applying;
+	CStopWatch clock;
+	long long started_ns;
+	long long last_displayed;
+
+	void run();
+	void advance();		// apply the pending sources, step, publish
+	void publish();		// caller holds solver_mutex
+};
@@ -0,0 +1,122 @@
+#include "SolverStats.h"
+#include <algorithm>
+
+void CSolverStats::reset()
+{
+	for (int s = 0; s < NUM_STAGES; s++)
+		stage_ns[s] = 0;
+	step_ns = 0;
+	critical_ns = 0;
+	for (int s = 0; s < NUM_SOLVES; s++) {
+		solves[s].iterations = 0;
+		solves[s].residual = 0.;
+	}
+	steps = 0;
+	heap_allocations = heap_peak_bytes = total_heap_allocations = 0;
+	count = 0;
+	next = 0;
+	step_start_ns = lap_ns = 0;
+}
+
+void CSolverStats::begin_step()
+{
+	for (int s = 0; s < NUM_STAGES; s++)
+		stage_ns[s] = 0;
+	for (int s = 0; s < NUM_SOLVES; s++) {
+		solves[s].iterations = 0;
+		solves[s].residual = 0.;
+	}
+	critical_ns = 0;
+	reset_heap_peak();
+	step_start_heap = heap_counts();
+	step_start_ns = lap_ns = clock.nanoseconds();
+}
+
+void CSolverStats::lap(int stage)
+{
+	long long now = clock.nanoseconds();
+	stage_ns[stage] += now - lap_ns;
+	lap_ns = now;
+}
+
+void CSolverStats::add_stage(int stage, long long ns)
+{
+	stage_ns[stage] += ns;
+	lap_ns = clock.nanoseconds();
+}
+
+void CSolverStats::record_solve(int solve, int iterations, double residual)
+{
+	solves[solve].iterations = iterations;
+	solves[solve].residual = residual;
+}
+
+void CSolverStats::end_step()
+{
+	step_ns = clock.nanoseconds() - step_start_ns;
+	SHeapCounts heap = heap_counts();
+	heap_allocations = heap.allocations - step_start_heap.allocations;
+	heap_peak_bytes = heap.peak_bytes - step_start_heap.live_bytes;
+	total_heap_allocations += heap_allocations;
+	for (int s = 0; s < NUM_STAGES; s++)
+		history_ns[s][next] = stage_ns[s];
+	history_ns[NUM_STAGES][next] = step_ns;
+	for (int s = 0; s < NUM_SOLVES; s++)
+		history_iterations[s][next] = solves[s].iterations;
+	next = (next + 1) % HISTORY;
+	if (count < HISTORY)
+		count++;
+	steps++;
+}
+
+long long CSolverStats::percentile_ns(int stage, double p) const
+{
+	if (count == 0)
+		return 0;
+	long long sorted[HISTORY];
+	std::copy(history_ns[stage], history_ns[stage] + count, sorted);
+	int k = (int) (p*(count-1) + 0.5);
+	std::nth_element(sorted, sorted + k, sorted + count);
+	return sorted[k];
+}
+
+int CSolverStats::percentile_iterations(int solve, double p) const
+{
+	if (count == 0)
+		return 0;
+	int sorted[HISTORY];
+	std::copy(history_iterations[solve], history_iterations[solve] + count, sorted);
+	int k = (int) (p*(count-1) + 0.5);
+	std::nth_element(sorted, sorted + k, sorted + count);
+	return sorted[k];
+}
+
+const char* CSolverStats::stage_name(int stage)
+{
+	static const char* names[NUM_STAGES+1] = {"density diffusion", "density advection", "velocity advection",
+		"forces", "velocity diffusion", "projection", "activity", "step"};
+	return names[stage];
+}
+
+const char* CSolverStats::solve_name(int solve)
+{
+	static const char* names[NUM_SOLVES] = {"density", "velocity x", "velocity y", "pressure"};
+	return names[solve];
+}
+
+void CSolverStats::print(FILE* fp) const
+{
+	fprintf(fp, "%-20s %10s %10s %10s   (last %d of %lld steps)\n", "stage", "last us", "p50 us", "p99 us", count, steps);
+	for (int s = 0; s <= NUM_STAGES; s++)
+		fprintf(fp, "%-20s %10.1f %10.1f %10.1f\n", stage_name(s),
+			(s < NUM_STAGES ? stage_ns[s] : step_ns)*1e-3, percentile_ns(s, 0.5)*1e-3, percentile_ns(s, 0.99)*1e-3);
+	fprintf(fp, "%-20s %10s %10s %10s %12s\n", "solve", "last it", "p50 it", "p99 it", "residual");
+	for (int s = 0; s < NUM_SOLVES; s++)
+		fprintf(fp, "%-20s %10d %10d %10d %12.3g\n", solve_name(s),
+			solves[s].iterations, percentile_iterations(s, 0.5), percentile_iterations(s, 0.99), solves[s].residual);
+	if (critical_ns > 0)
+		fprintf(fp, "%-20s %10.1f us of the %.1f us step\n", "critical path", critical_ns*1e-3, step_ns*1e-3);
+	if (heap_counting())
+		fprintf(fp, "%-20s %10lld allocations, %lld bytes peak in the last step; %lld since reset\n", "heap",
+			heap_allocations, heap_peak_bytes, total_heap_allocations);
+}
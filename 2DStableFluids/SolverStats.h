@@ -0,0 +1,85 @@
+// SolverStats.h: per-stage timings and linear solve statistics of CFluidSolver
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "MemoryUsage.h"
+#include "StopWatch.h"
+#include <stdio.h>
+
+// stages of one CFluidSolver::step(), in the order they run
+enum {
+	STAGE_DENSITY_DIFFUSION,	// add the sources, implicit diffusion solve
+	STAGE_DENSITY_ADVECTION,	// advection, boundary, clear the sources
+	STAGE_VELOCITY_ADVECTION,	// advection, add the sources
+	STAGE_FORCES,				// buoyancy
+	STAGE_VELOCITY_DIFFUSION,	// the two component solves
+	STAGE_PROJECTION,			// divergence, pressure solve, gradient
+	STAGE_ACTIVITY,				// sparse tile bookkeeping
+	NUM_STAGES
+};
+
+// the linear solves of one step
+enum { SOLVE_DENSITY, SOLVE_VELOCITY_X, SOLVE_VELOCITY_Y, SOLVE_PRESSURE, NUM_SOLVES };
+
+struct SSolveRecord
+{
+	int iterations;		// BiCG iterations; 0 if the solve was skipped or direct
+	double residual;	// CSparseMatrix::lastResidual; 0 for a direct solve
+};
+
+// Filled by every CFluidSolver::step(). The cost is one clock read per stage.
+// The last HISTORY steps are kept so the host can ask for percentiles; the
+// class has no pointers, so a copy (e.g. into a frame snapshot) is a plain
+// assignment.
+class CSolverStats
+{
+public:
+	enum { HISTORY = 128 };
+
+	// the last step
+	long long stage_ns[NUM_STAGES];
+	long long step_ns;
+	SSolveRecord solves[NUM_SOLVES];
+	long long critical_ns;	// critical path of the step's task graph; 0 if it ran in sequence
+	long long steps;	// since reset()
+	// operator new calls and the most heap held above the start, during the
+	// last step, and the calls since reset(). Only counted in a
+	// FLUID_COUNT_ALLOCATIONS build (see MemoryUsage.h); the counters are
+	// process-wide, so solvers stepping at the same time share them.
+	long long heap_allocations;
+	long long heap_peak_bytes;
+	long long total_heap_allocations;
+
+	CSolverStats() {reset();};
+	void reset();
+
+	// called by the solver
+	void begin_step();
+	void lap(int stage);	// time since the previous lap (or begin_step) goes to stage
+	void add_stage(int stage, long long ns);	// timed elsewhere (by a task); the next lap starts now
+	void record_solve(int solve, int iterations, double residual);
+	void end_step();
+
+	// over the last HISTORY steps; p in [0,1], e.g. 0.5 and 0.99.
+	// stage == NUM_STAGES gives the whole step.
+	long long percentile_ns(int stage, double p) const;
+	int percentile_iterations(int solve, double p) const;
+	int window() const {return count;};
+
+	static const char* stage_name(int stage);
+	static const char* solve_name(int solve);
+
+	// a plain-text table of the last step and the percentiles
+	void print(FILE* fp) const;
+
+protected:
+	long long history_ns[NUM_STAGES+1][HISTORY];
+	int history_iterations[NUM_SOLVES][HISTORY];
+	int count;	// filled entries of the history
+	int next;	// where the next step goes
+	CStopWatch clock;
+	long long step_start_ns;
+	long long lap_ns;
+	SHeapCounts step_start_heap;
+};
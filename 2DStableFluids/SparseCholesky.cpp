@@ -0,0 +1,275 @@
+#include "SparseCholesky.h"
+#include "SparseMatrix.h"
+#include <math.h>
+
+// cells of [i0,i1) x [j0,j1), appended to order at k
+static void dissect(int n, int i0, int i1, int j0, int j1, int* order, int & k)
+{
+	int w = i1 - i0, h = j1 - j0;
+	if (w <= 0 || h <= 0)
+		return;
+	if (w <= 3 && h <= 3) {
+		for (int j = j0; j < j1; j++)
+			for (int i = i0; i < i1; i++)
+				order[k++] = i + j*n;
+		return;
+	}
+	if (w >= h) {
+		int m = i0 + w/2;
+		dissect(n, i0, m, j0, j1, order, k);
+		dissect(n, m+1, i1, j0, j1, order, k);
+		for (int j = j0; j < j1; j++)
+			order[k++] = m + j*n;
+	} else {
+		int m = j0 + h/2;
+		dissect(n, i0, i1, j0, m, order, k);
+		dissect(n, i0, i1, m+1, j1, order, k);
+		for (int i = i0; i < i1; i++)
+			order[k++] = i + m*n;
+	}
+}
+
+void nested_dissection_order(int n, int* order)
+{
+	int k = 0;
+	dissect(n, 0, n, 0, n, order, k);
+}
+
+// Strongly connected components of the graph i -> j for every A(i,j) != 0,
+// by Tarjan's algorithm without recursion. A component is only completed
+// after every component it reaches, so component numbers come out in an
+// order where each one only reads from lower numbers.
+static int components(CSparseMatrix & A, std::vector<int> & component)
+{
+	int n = A.numRows;
+	std::vector<int> number(n, -1), low(n, 0), stack, path;
+	std::vector<CMatrixElement*> next(n, NULL);
+	std::vector<unsigned char> on_stack(n, 0);
+	component.assign(n, -1);
+	int counter = 0, count = 0;
+	for (int root = 0; root < n; root++) {
+		if (number[root] >= 0)
+			continue;
+		path.push_back(root);
+		number[root] = low[root] = counter++;
+		next[root] = A.rowList[root];
+		stack.push_back(root);
+		on_stack[root] = 1;
+		while (!path.empty()) {
+			int v = path.back();
+			CMatrixElement* e = next[v];
+			if (e) {
+				next[v] = e->rowNext;
+				int w = e->j;
+				if (number[w] < 0) {
+					number[w] = low[w] = counter++;
+					next[w] = A.rowList[w];
+					stack.push_back(w);
+					on_stack[w] = 1;
+					path.push_back(w);
+				} else if (on_stack[w] && number[w] < low[v])
+					low[v] = number[w];
+				continue;
+			}
+			path.pop_back();
+			if (!path.empty() && low[v] < low[path.back()])
+				low[path.back()] = low[v];
+			if (low[v] == number[v]) {
+				int w;
+				do {
+					w = stack.back();
+					stack.pop_back();
+					on_stack[w] = 0;
+					component[w] = count;
+				} while (w != v);
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+// nonzero pattern of row k of L: the nodes reachable from the entries of
+// column k of the upper triangle C, up the elimination tree, in s[top..n)
+static int ereach(const std::vector<int> & Cp, const std::vector<int> & Ci, int k, const std::vector<int> & parent,
+	std::vector<int> & s, std::vector<int> & mark)
+{
+	int n = (int) parent.size();
+	int top = n;
+	mark[k] = k;
+	for (int p = Cp[k]; p < Cp[k+1]; p++) {
+		int i = Ci[p];
+		if (i > k)
+			continue;
+		int len = 0;
+		for (; mark[i] != k; i = parent[i]) {
+			s[len++] = i;
+			mark[i] = k;
+		}
+		while (len > 0)
+			s[--top] = s[--len];
+	}
+	return top;
+}
+
+CSparseCholesky::CSparseCholesky()
+{
+	n = 0;
+	valid = false;
+}
+
+bool CSparseCholesky::factorize(CSparseMatrix & A, const int* order)
+{
+	valid = false;
+	n = A.numRows;
+
+	// blocks, and the permutation: blocks in solve order, cells of a block in the given order
+	std::vector<int> component;
+	int num_blocks = components(A, component);
+	block_start.assign(num_blocks + 1, 0);
+	for (int i = 0; i < n; i++)
+		block_start[component[i] + 1]++;
+	for (int b = 0; b < num_blocks; b++)
+		block_start[b+1] += block_start[b];
+	std::vector<int> fill(block_start.begin(), block_start.end() - 1);
+	perm.assign(n, 0);
+	for (int k = 0; k < n; k++) {
+		int i = order ? order[k] : k;
+		perm[fill[component[i]]++] = i;
+	}
+	std::vector<int> position(n);
+	for (int k = 0; k < n; k++)
+		position[perm[k]] = k;
+
+	// upper triangle of the permuted diagonal blocks by columns, and the couplings by rows
+	std::vector<int> count(n + 1, 0);
+	Cp.assign(n + 1, 0);
+	for (int i = 0; i < n; i++)
+		for (CMatrixElement* e = A.rowList[i]; e != NULL; e = e->rowNext) {
+			int pi = position[i], pj = position[e->j];
+			if (component[i] != component[e->j]) {
+				Cp[pi+1]++;
+				continue;
+			}
+			if (i != e->j && A.GetValue(e->j, i) != e->value)
+				return false;	// not symmetric inside the block
+			if (pi <= pj)
+				count[pj+1]++;
+		}
+	for (int k = 0; k < n; k++) {
+		count[k+1] += count[k];
+		Cp[k+1] += Cp[k];
+	}
+	std::vector<int> Up(count), Ui(count[n]);
+	std::vector<double> Ux(count[n]);
+	Cj.assign(Cp[n], 0);
+	Cx.assign(Cp[n], 0.);
+	std::vector<int> coupling_fill(Cp.begin(), Cp.end() - 1);
+	for (int i = 0; i < n; i++)
+		for (CMatrixElement* e = A.rowList[i]; e != NULL; e = e->rowNext) {
+			int pi = position[i], pj = position[e->j];
+			if (component[i] != component[e->j]) {
+				int p = coupling_fill[pi]++;
+				Cj[p] = e->j;
+				Cx[p] = e->value;
+			} else if (pi <= pj) {
+				int p = count[pj]++;
+				Ui[p] = pi;
+				Ux[p] = e->value;
+			}
+		}
+
+	// elimination tree of the upper triangle
+	std::vector<int> parent(n, -1), ancestor(n, -1);
+	for (int k = 0; k < n; k++)
+		for (int p = Up[k]; p < Up[k+1]; p++) {
+			int i = Ui[p];
+			while (i != -1 && i < k) {
+				int next = ancestor[i];
+				ancestor[i] = k;
+				if (next == -1)
+					parent[i] = k;
+				i = next;
+			}
+		}
+
+	// column counts of L, from the row patterns
+	std::vector<int> s(n), mark(n, -1);
+	Lp.assign(n + 1, 0);
+	for (int k = 0; k < n; k++) {
+		int top = ereach(Up, Ui, k, parent, s, mark);
+		for (int t = top; t < n; t++)
+			Lp[s[t]+1]++;
+		Lp[k+1]++;
+	}
+	for (int k = 0; k < n; k++)
+		Lp[k+1] += Lp[k];
+	Li.assign(Lp[n], 0);
+	Lx.assign(Lp[n], 0.);
+
+	// up-looking factorization, one row of L at a time
+	std::vector<int> next(Lp.begin(), Lp.end() - 1);
+	std::vector<double> x(n, 0.);
+	for (int k = 0; k < n; k++)
+		mark[k] = -1;
+	for (int k = 0; k < n; k++) {
+		int top = ereach(Up, Ui, k, parent, s, mark);
+		x[k] = 0.;
+		for (int p = Up[k]; p < Up[k+1]; p++)
+			x[Ui[p]] = Ux[p];
+		double d = x[k];
+		x[k] = 0.;
+		for (int t = top; t < n; t++) {
+			int j = s[t];
+			double lkj = x[j] / Lx[Lp[j]];
+			x[j] = 0.;
+			for (int p = Lp[j] + 1; p < next[j]; p++)
+				x[Li[p]] -= Lx[p]*lkj;
+			d -= lkj*lkj;
+			int p = next[j]++;
+			Li[p] = k;
+			Lx[p] = lkj;
+		}
+		if (d <= 0.)
+			return false;
+		int p = next[k]++;
+		Li[p] = k;
+		Lx[p] = sqrt(d);
+	}
+
+	work.assign(n, 0.);
+	valid = true;
+	return true;
+}
+
+void CSparseCholesky::solve(double* x, const double* b, double* work)
+{
+	for (int k = 0; k < n; k++)
+		work[k] = b[perm[k]];
+	int num_blocks = (int) block_start.size() - 1;
+	for (int blk = 0; blk < num_blocks; blk++) {
+		int k0 = block_start[blk], k1 = block_start[blk+1];
+		// x already holds every unknown this block reads from
+		for (int k = k0; k < k1; k++)
+			for (int p = Cp[k]; p < Cp[k+1]; p++)
+				work[k] -= Cx[p]*x[Cj[p]];
+		for (int j = k0; j < k1; j++) {
+			work[j] /= Lx[Lp[j]];
+			for (int p = Lp[j] + 1; p < Lp[j+1]; p++)
+				work[Li[p]] -= Lx[p]*work[j];
+		}
+		for (int j = k1 - 1; j >= k0; j--) {
+			for (int p = Lp[j] + 1; p < Lp[j+1]; p++)
+				work[j] -= Lx[p]*work[Li[p]];
+			work[j] /= Lx[Lp[j]];
+		}
+		for (int k = k0; k < k1; k++)
+			x[perm[k]] = work[k];
+	}
+}
+
+size_t CSparseCholesky::bytes()
+{
+	return (Lp.capacity() + Li.capacity() + perm.capacity() + block_start.capacity() + Cp.capacity() + Cj.capacity())*sizeof(int)
+		+ (Lx.capacity() + Cx.capacity() + work.capacity())*sizeof(double);
+}
@@ -0,0 +1,60 @@
+// SparseCholesky.h: cached direct solver for the constant CFluidSolver operators
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+class CSparseMatrix;
+
+// Elimination order of the cells of an n x n grid (index i + j*n) by
+// geometric nested dissection: the grid is cut in two by its middle row or
+// column, both halves are ordered the same way, and the cut goes last.
+void nested_dissection_order(int n, int* order);
+
+// Direct solver for matrices that are symmetric positive definite up to a
+// block lower triangular structure. The fluid operators are of that kind:
+// interior rows only couple interior cells, symmetrically, while the
+// boundary rows also read interior values, but not the other way round.
+//
+// factorize() splits the unknowns into the strongly connected components of
+// the matrix graph, orders the components so every one comes after those it
+// reads from, and orders the cells inside a component by the given fill-
+// reducing order. The symmetric diagonal blocks get one up-looking Cholesky
+// factorization; the couplings between blocks are kept as they are. solve()
+// then works through the blocks in order: subtract the couplings to blocks
+// already solved, and do the two triangular solves of the block.
+class CSparseCholesky
+{
+public:
+	int n;
+	bool valid;		// false until factorize() succeeds
+
+	// L, by columns, in the permuted numbering
+	std::vector<int> Lp, Li;
+	std::vector<double> Lx;
+
+	CSparseCholesky();
+
+	// order: a fill-reducing elimination order of all unknowns, or NULL for
+	// the natural one. Fails (and leaves valid false) if a diagonal block is
+	// not symmetric positive definite.
+	bool factorize(CSparseMatrix & A, const int* order);
+	void invalidate() {valid = false;};
+
+	// x may be b
+	void solve(double* x, const double* b) {solve(x, b, work.data());};
+	// with the caller's n doubles of work, so two solves can share the factor
+	void solve(double* x, const double* b, double* work);
+
+	long long nnz() {return (long long) Li.size();};
+	size_t bytes();	// heap held by the factor and its solve order, by vector capacity
+
+protected:
+	std::vector<int> perm;			// permuted position -> unknown
+	std::vector<int> block_start;	// blocks in solve order, as permuted ranges
+	std::vector<int> Cp, Cj;		// couplings to other blocks, by permuted row
+	std::vector<double> Cx;
+	std::vector<double> work;
+};
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include "BlockedSum.h"
 
 // User-defined tolerancy
 #define TOL 0.00005
@@ -51,6 +52,12 @@ public:
 	double *dzb;
 	double *dAp;
 	double *dATpb;
+	bool externalWork;	// the eight vectors above belong to the caller (setWorkBuffers)
+	double *partials;	// block sums of the solver's dot products (BlockedSum.h)
+
+	// preconditioned residual (sum of (r_i/a_ii)^2, the quantity compared with
+	// tol) when the last solve() returned
+	double lastResidual;
 public:
 
 	CSparseMatrix(int nRows, int nCols)
@@ -58,7 +65,10 @@ public:
 		numRows = numCols = 0;
 		rowList = colList = NULL;
 		diagonal = NULL;
+		partials = NULL;
 		dr = NULL;
+		externalWork = false;
+		lastResidual = 0.;
 		setDimensions(nRows,nCols);
 	}
 
@@ -78,7 +88,8 @@ public:
 		if(rowList != NULL)  delete [] rowList;  rowList  = NULL;
 		if(colList != NULL)  delete [] colList;  colList  = NULL;
 		if(diagonal != NULL) delete [] diagonal; diagonal = NULL;
-		if (dr != NULL) {
+		if(partials != NULL) delete [] partials; partials = NULL;
+		if (dr != NULL && !externalWork) {
 			delete[] dr;
 			delete[] drb;
 			delete[] dp;
@@ -91,14 +102,14 @@ public:
 	}
 
 	void
-		CSparseMatrix::setValues(int numEl, int i[], int j[], double vals[])
+		setValues(int numEl, int i[], int j[], double vals[])
 	{
 		for(int idx = 0; idx < numEl; idx++)
 			set1Value(i[idx],j[idx],vals[idx]);
 	}
 
 	void
-		CSparseMatrix::set1Value(int i, int j, double val)
+		set1Value(int i, int j, double val)
 	{
 		// Insertion in rows
         if ( fabs(val) < ZERO_TOL)
@@ -122,7 +133,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::modify1Value(int i, int j, double val)
+		modify1Value(int i, int j, double val)
 	{
 		CMatrixElement *theElem = GetElement(i,j);
 
@@ -133,7 +144,7 @@ public:
 	}
 
 	int
-		CSparseMatrix::DeleteElement(int i, int j)
+		DeleteElement(int i, int j)
 		//not fully tested
 	{
 		CMatrixElement *theElem;
@@ -191,7 +202,7 @@ public:
 		return 1;
 	}
 	void
-		CSparseMatrix::add1Value(int i, int j, double val)
+		add1Value(int i, int j, double val)
 	{
 		CMatrixElement *theElem = GetElement(i,j);
 
@@ -214,7 +225,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::addOneValue(int i, int j, double val)
+		addOneValue(int i, int j, double val)
 	{
 		CMatrixElement *theElem = GetElement(i,j);
 
@@ -225,7 +236,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::setRow(int i, CMatrixElement *head)
+		setRow(int i, CMatrixElement *head)
 	{
 		// Set it in the row
 		rowList[i] = head;
@@ -241,13 +252,13 @@ public:
 	}
 
 	void
-		CSparseMatrix::setDimensions(int nRows)
+		setDimensions(int nRows)
 	{
 		setDimensions(nRows, nRows);
 	}
 
 	void
-		CSparseMatrix::setDimensions(int nRows, int nCols)
+		setDimensions(int nRows, int nCols)
 	{
 		// Clean up anyway. Safer, since life is a jungle.
 		Cleanup();
@@ -256,6 +267,7 @@ public:
 		rowList = new CMatrixElement*[numRows];
 		colList = new CMatrixElement*[numCols];
 		diagonal = new double[numRows];
+		partials = new double[sum_blocks(numRows) + 1];
 		for(int k = 0; k < numRows; k++)
 		{
 			diagonal[k] = 0.;
@@ -264,18 +276,53 @@ public:
 		for(int l = 0; l < numCols; l++)
 			colList[l] = NULL;
 
-		dr = new double[numRows];
-		drb = new double[numRows];
-		dp = new double[numRows];
-		dpb = new double[numRows];
-		dz = new double[numRows];
-		dzb = new double[numRows];
-		dAp = new double[numRows];
-		dATpb = new double[numRows];
+		if (!externalWork) {
+			dr = new double[numRows];
+			drb = new double[numRows];
+			dp = new double[numRows];
+			dpb = new double[numRows];
+			dz = new double[numRows];
+			dzb = new double[numRows];
+			dAp = new double[numRows];
+			dATpb = new double[numRows];
+		}
+	}
+
+	// Solve with the caller's work vectors, 8 of numRows doubles each, from
+	// now on; they must stay valid (and large enough after any later
+	// setDimensions) until the next call. NULL goes back to the matrix's own.
+	void
+		setWorkBuffers(double* work[8])
+	{
+		if (dr != NULL && !externalWork) {
+			delete[] dr;
+			delete[] drb;
+			delete[] dp;
+			delete[] dpb;
+			delete[] dz;
+			delete[] dzb;
+			delete[] dAp;
+			delete[] dATpb;
+		}
+		dr = NULL;
+		externalWork = work != NULL;
+		if (externalWork) {
+			dr = work[0]; drb = work[1]; dp = work[2]; dpb = work[3];
+			dz = work[4]; dzb = work[5]; dAp = work[6]; dATpb = work[7];
+		} else if (numRows > 0) {
+			dr = new double[numRows];
+			drb = new double[numRows];
+			dp = new double[numRows];
+			dpb = new double[numRows];
+			dz = new double[numRows];
+			dzb = new double[numRows];
+			dAp = new double[numRows];
+			dATpb = new double[numRows];
+		}
 	}
 
 	CMatrixElement*
-		CSparseMatrix::GetElement(int i, int j)
+		GetElement(int i, int j)
 	{
 		CMatrixElement *theElem;
 		for(theElem = rowList[i]; theElem != NULL; theElem = theElem->rowNext)
@@ -285,7 +332,7 @@ public:
 	}
 
 	double
-		CSparseMatrix::GetValue(int i, int j)
+		GetValue(int i, int j)
 	{
 		CMatrixElement *theElem;
 		for(theElem = rowList[i]; theElem != NULL; theElem = theElem->rowNext)
@@ -295,14 +342,14 @@ public:
 	}
 
 	double
-		CSparseMatrix::diagonalElement(int i)
+		diagonalElement(int i)
 	{
 		assert(i < numRows);
 		return diagonal[i];
 	}
 
 	void
-		CSparseMatrix::Print()
+		Print()
 	{
 		CMatrixElement *theElem;
 		for(int i = 0; i < numRows; i++)
@@ -311,7 +358,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::PrintMathematica(FILE *fp)
+		PrintMathematica(FILE *fp)
 	{
 		int i, j;
 		fprintf(fp,"m = {");
@@ -329,7 +376,7 @@ public:
 		fprintf(fp,"}\n\n");
 	}
 	void 
-		CSparseMatrix::PrintMathematica_wyz(FILE *fp)
+		PrintMathematica_wyz(FILE *fp)
 	{
 		int i, j;
 		fprintf(fp,"This is a %d by %d matrix.\n",numRows,numCols);
@@ -353,7 +400,7 @@ public:
 	}
 
 	void 
-		CSparseMatrix::PrintMathematica_wyz2(FILE *fp)
+		PrintMathematica_wyz2(FILE *fp)
 	{
 		int i;
 		fprintf(fp,"m = {");
@@ -388,13 +435,14 @@ public:
 
 
 	void
-		CSparseMatrix::multMatVec(double *src,
+		multMatVec(double *src,
 		double *dest)
 	{
 		assert(src && dest);
-		CMatrixElement *theElem = NULL;
+		#pragma omp parallel for schedule(static) if (numRows >= SUM_PARALLEL_MIN)
 		for(int i = 0; i < numRows; i++)
 		{
+			CMatrixElement *theElem;
 			double sum = 0;
 			for(theElem = rowList[i];
 				theElem != NULL;
@@ -403,7 +451,7 @@ public:
 			dest[i] = sum;
 		}
 	}
-	void 	CSparseMatrix::multMatVec_yz(double *src,
+	void 	multMatVec_yz(double *src,
 		double * &det)
 	{
 		double *dest;
@@ -426,7 +474,7 @@ public:
 		//delete [] dest;
 	}
 
-    void 	CSparseMatrix::multMatVec_yz(double * src)
+    void 	multMatVec_yz(double * src)
     {
         double *dest;
         dest = new double [numRows];
@@ -448,16 +496,15 @@ public:
     }
 
 	void
-		CSparseMatrix::multTransMatVec(double *src,
+		multTransMatVec(double *src,
 		double *dest)
 	{
 		assert(src && dest);
-		double sum;
-
-		CMatrixElement *theElem = NULL;
+		#pragma omp parallel for schedule(static) if (numCols >= SUM_PARALLEL_MIN)
 		for(int j = 0; j < numCols; j++)
 		{
-			sum = 0.0;
+			CMatrixElement *theElem;
+			double sum = 0.0;
 			for(theElem = colList[j]; theElem != NULL; theElem = theElem->colNext)
 				sum += theElem->value * src[theElem->i];
 			dest[j] = sum;
@@ -465,7 +512,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::multTransMatVec_yz(double *src,
+		multTransMatVec_yz(double *src,
 		double *det)
 	{
 		
@@ -520,7 +567,7 @@ public:
     }
 
 	void
-		CSparseMatrix::multTransMatMat_yz()
+		multTransMatMat_yz()
 	{
 		// M = transpose(M)*M  <-> A * B
 		CSparseMatrix* tempMat = new CSparseMatrix(numCols, numCols);
@@ -582,7 +629,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::writeToFile(FILE *fp)
+		writeToFile(FILE *fp)
 	{
 		CMatrixElement *theElem;
 		for(int i = 0; i < numRows; i++)
@@ -591,11 +638,15 @@ public:
 	}
 
 	void
-		CSparseMatrix::readFromFile(FILE *fp)
+		readFromFile(FILE *fp)
 	{
 		int i,j;
 		double value;
+#ifdef _MSC_VER
 		while (fscanf_s(fp, "%d %d %lf", &i,&j,&value) != EOF)
+#else
+		while (fscanf(fp, "%d %d %lf", &i,&j,&value) != EOF)
+#endif
 		{
 			set1Value(i,j,value);
 		}
@@ -605,7 +656,7 @@ public:
 
 
 	void
-		CSparseMatrix::multTransMatMat()
+		multTransMatMat()
 	{
 		// M = transpose(M)*M
 		CSparseMatrix* tempMat = new CSparseMatrix(numCols, numCols);
@@ -651,7 +702,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::AddMatrix(CSparseMatrix *mat)
+		AddMatrix(CSparseMatrix *mat)
 	{
 		int i;
 		CMatrixElement *theElem, *matElem;
@@ -677,7 +728,7 @@ public:
 	}
 
 	void
-		CSparseMatrix::ScaleRow(int i, double s)
+		ScaleRow(int i, double s)
 	{
 		CMatrixElement *theElem;
 		for(theElem = rowList[i]; theElem != NULL; theElem = theElem->rowNext)
@@ -685,8 +736,33 @@ public:
 		diagonal[i] *= s;
 	}
 
+	//***************************************
+	// A = I + ratio (A - I): for an implicit operator of the form
+	// (I + h L) this changes the time step h in place, keeping the
+	// sparsity pattern (rows that are just the identity stay so)
+	//***************************************
+	void
+		rescaleImplicitStep(double ratio)
+	{
+		CMatrixElement *theElem;
+		for(int i = 0; i < numRows; i++)
+		{
+			for(theElem = rowList[i]; theElem != NULL; theElem = theElem->rowNext)
+			{
+				if(theElem->j == i)
+					theElem->value = 1. + ratio*(theElem->value - 1.);
+				else
+					theElem->value *= ratio;
+			}
+			diagonal[i] = 1. + ratio*(diagonal[i] - 1.);
+		}
+	}
+
 	//***************************************
 	// preconditionedBiConjugateGradient
+	// The vector updates run in parallel with OpenMP (when enabled); every
+	// dot product is a blocked_sum(), so the iterates, and with them the
+	// iteration count, are the same bits on any number of threads.
 	//***************************************
 	unsigned int 
 		solve(double x[],
@@ -694,24 +770,38 @@ public:
 		double tol,
 		const unsigned int iter_max)
 	{
+		double* work[9] = {dr, drb, dp, dpb, dz, dzb, dAp, dATpb, partials};
+		return solve(x, b, tol, iter_max, work, lastResidual);
+	}
 
-
+	// The same with the caller's work: the eight vectors of setWorkBuffers(),
+	// and in work[8] sum_blocks(numRows) + 1 doubles for the block sums.
+	// residual gets what lastResidual would. Nothing of the matrix is
+	// written, so solves with different work can share it at the same time.
+	unsigned int 
+		solve(double x[],
+		double b[],
+		double tol,
+		const unsigned int iter_max,
+		double* work[9],
+		double & residual)
+	{
+		double *dr = work[0], *drb = work[1], *dp = work[2], *dpb = work[3];
+		double *dz = work[4], *dzb = work[5], *dAp = work[6], *dATpb = work[7];
+		double *partials = work[8];
 		assert(dr && drb && dp && dpb && dz && dzb && dAp && dATpb);
 		double mag_r, mag_rOld, mag_pbAp, mag_Residual, Residual0, alpha, beta;
 
 		multMatVec(x,dAp);
-		mag_r = mag_Residual = Residual0 = 0.;
-		int i = 0;
-		for(i = 0; i < numRows; i++)
-		{
-
+		mag_r = blocked_sum(numRows, partials, [&](int i) {
 			dr[i] = drb[i] = b[i] - dAp[i];
 			dp[i] = dpb[i] = dz[i] = dzb[i] = dr[i]/diagonalElement(i);	// Simple preconditioning
-			mag_r += drb[i] * dz[i];
-			mag_Residual += dz[i] * dz[i];
-			Residual0 += b[i]*b[i]/(diagonalElement(i)*diagonalElement(i));
-		}
+			return drb[i] * dz[i];
+		});
+		mag_Residual = blocked_sum(numRows, partials, [&](int i) {return dz[i] * dz[i];});
+		Residual0 = blocked_sum(numRows, partials, [&](int i) {return b[i]*b[i]/(diagonalElement(i)*diagonalElement(i));});
 
+		residual = mag_Residual;
 		mag_Residual = Residual0*100; // Force the first iteration anyway.
 		if(Residual0 == 0)
 			Residual0 = 1.;	// To make it work even if ||b|| = 0
@@ -721,9 +811,7 @@ public:
 			nbIter++;
 			multMatVec(dp,dAp);
 			multTransMatVec(dpb,dATpb);
-			mag_pbAp = 0.0;
-			for(i = 0; i < numRows; i++)
-				mag_pbAp += dpb[i] * dAp[i];
+			mag_pbAp = blocked_sum(numRows, partials, [&](int i) {return dpb[i] * dAp[i];});
 
 			if(mag_pbAp == 0)
 			{
@@ -736,16 +824,14 @@ public:
 			else
 				alpha = mag_r / mag_pbAp;
 			mag_rOld = mag_r;
-			mag_r = 0.0;
-			for(i = 0; i < numRows; i++)
-			{
+			mag_r = blocked_sum(numRows, partials, [&](int i) {
 				x[i] += alpha * dp[i];
 				dr[i] -= alpha * dAp[i];
 				drb[i] -= alpha * dATpb[i];
 				dz[i] = dr[i]/diagonalElement(i);
 				dzb[i] = drb[i]/diagonalElement(i);
-				mag_r += drb[i] * dz[i];
-			}
+				return drb[i] * dz[i];
+			});
 
 			if(mag_rOld == 0)
 			{
@@ -757,13 +843,135 @@ public:
 				beta = 1.0;
 			else
 				beta = mag_r / mag_rOld;
-			mag_Residual = 0.;
-			for(i = 0; i < numRows; i++)
-			{
+			mag_Residual = blocked_sum(numRows, partials, [&](int i) {
 				dp[i] = dz[i] + beta * dp[i];
 				dpb[i] = dzb[i] + beta * dpb[i];
-				mag_Residual += dz[i] * dz[i];
-			}
+				return dz[i] * dz[i];
+			});
+			residual = mag_Residual;
+		}
+		return nbIter;
+	}
+
+	//***************************************
+	// Same solver restricted to a subset of the unknowns.
+	// Only the rows listed in rows[] (and flagged in mask[]) are solved for,
+	// every other unknown is treated as a fixed zero. x and b are only read
+	// and written on the subset, so the cost follows nrows instead of numRows.
+	//***************************************
+	void
+		multMatVecMasked(double *src, double *dest, const int *rows, int nrows, const unsigned char *mask)
+	{
+		#pragma omp parallel for schedule(static) if (nrows >= SUM_PARALLEL_MIN)
+		for(int k = 0; k < nrows; k++)
+		{
+			CMatrixElement *theElem;
+			int i = rows[k];
+			double sum = 0;
+			for(theElem = rowList[i]; theElem != NULL; theElem = theElem->rowNext)
+				if(mask[theElem->j])
+					sum += theElem->value * src[theElem->j];
+			dest[i] = sum;
+		}
+	}
+
+	void
+		multTransMatVecMasked(double *src, double *dest, const int *rows, int nrows, const unsigned char *mask)
+	{
+		#pragma omp parallel for schedule(static) if (nrows >= SUM_PARALLEL_MIN)
+		for(int k = 0; k < nrows; k++)
+		{
+			CMatrixElement *theElem;
+			int j = rows[k];
+			double sum = 0;
+			for(theElem = colList[j]; theElem != NULL; theElem = theElem->colNext)
+				if(mask[theElem->i])
+					sum += theElem->value * src[theElem->i];
+			dest[j] = sum;
+		}
+	}
+
+	unsigned int 
+		solve(double x[],
+		double b[],
+		double tol,
+		const unsigned int iter_max,
+		const int *rows,
+		int nrows,
+		const unsigned char *mask)
+	{
+		double* work[9] = {dr, drb, dp, dpb, dz, dzb, dAp, dATpb, partials};
+		return solve(x, b, tol, iter_max, rows, nrows, mask, work, lastResidual);
+	}
+
+	unsigned int 
+		solve(double x[],
+		double b[],
+		double tol,
+		const unsigned int iter_max,
+		const int *rows,
+		int nrows,
+		const unsigned char *mask,
+		double* work[9],
+		double & residual)
+	{
+		double *dr = work[0], *drb = work[1], *dp = work[2], *dpb = work[3];
+		double *dz = work[4], *dzb = work[5], *dAp = work[6], *dATpb = work[7];
+		double *partials = work[8];
+		assert(dr && drb && dp && dpb && dz && dzb && dAp && dATpb);
+		double mag_r, mag_rOld, mag_pbAp, mag_Residual, Residual0, alpha, beta;
+
+		multMatVecMasked(x,dAp,rows,nrows,mask);
+		mag_r = blocked_sum(nrows, partials, [&](int k) {
+			int i = rows[k];
+			dr[i] = drb[i] = b[i] - dAp[i];
+			dp[i] = dpb[i] = dz[i] = dzb[i] = dr[i]/diagonalElement(i);
+			return drb[i] * dz[i];
+		});
+		mag_Residual = blocked_sum(nrows, partials, [&](int k) {return dz[rows[k]] * dz[rows[k]];});
+		Residual0 = blocked_sum(nrows, partials, [&](int k) {
+			int i = rows[k];
+			return b[i]*b[i]/(diagonalElement(i)*diagonalElement(i));
+		});
+
+		residual = mag_Residual;
+		mag_Residual = Residual0*100; // Force the first iteration anyway.
+		if(Residual0 == 0)
+			Residual0 = 1.;
+		unsigned int nbIter = 0;
+		while(mag_Residual > tol && nbIter < iter_max)
+		{
+			nbIter++;
+			multMatVecMasked(dp,dAp,rows,nrows,mask);
+			multTransMatVecMasked(dpb,dATpb,rows,nrows,mask);
+			mag_pbAp = blocked_sum(nrows, partials, [&](int k) {return dpb[rows[k]] * dAp[rows[k]];});
+
+			if(mag_r == 0 && mag_pbAp == 0)
+				alpha = 1;
+			else
+				alpha = mag_r / mag_pbAp;
+			mag_rOld = mag_r;
+			mag_r = blocked_sum(nrows, partials, [&](int k) {
+				int i = rows[k];
+				x[i] += alpha * dp[i];
+				dr[i] -= alpha * dAp[i];
+				drb[i] -= alpha * dATpb[i];
+				dz[i] = dr[i]/diagonalElement(i);
+				dzb[i] = drb[i]/diagonalElement(i);
+				return drb[i] * dz[i];
+			});
+
+			if(mag_r == 0 && mag_rOld == 0)
+				beta = 1.0;
+			else
+				beta = mag_r / mag_rOld;
+			mag_Residual = blocked_sum(nrows, partials, [&](int k) {
+				int i = rows[k];
+				dp[i] = dz[i] + beta * dp[i];
+				dpb[i] = dzb[i] + beta * dpb[i];
+				return dz[i] * dz[i];
+			});
+			residual = mag_Residual;
 		}
 		return nbIter;
 	}
@@ -0,0 +1,272 @@
+#include "SparseOrdering.h"
+#include <algorithm>
+#include <utility>
+
+// the graph of A + A^T without the diagonal, as adjacency lists
+struct SAdjacency
+{
+	std::vector<int> start;	// rows + 1
+	std::vector<int> list;
+
+	int degree(int v) const {return start[v+1] - start[v];};
+};
+
+static void build_graph(CSparseMatrix & A, SAdjacency & g)
+{
+	assert(A.numRows == A.numCols);
+	int n = A.numRows;
+	std::vector<int> seen(n, -1);
+	g.start.resize(n + 1);
+	g.list.clear();
+	for (int v = 0; v < n; v++) {
+		g.start[v] = (int) g.list.size();
+		seen[v] = v;
+		for (CMatrixElement* e = A.rowList[v]; e != NULL; e = e->rowNext)
+			if (seen[e->j] != v) {
+				seen[e->j] = v;
+				g.list.push_back(e->j);
+			}
+		for (CMatrixElement* e = A.colList[v]; e != NULL; e = e->colNext)
+			if (seen[e->i] != v) {
+				seen[e->i] = v;
+				g.list.push_back(e->i);
+			}
+	}
+	g.start[n] = (int) g.list.size();
+}
+
+// Orders the rows of a subset of the graph, those with part[v] == label.
+// level[] is -1 for every row outside a search, and is again when done.
+class CCuthillMcKee
+{
+public:
+	const SAdjacency & g;
+	const int* part;
+	std::vector<int> level;
+
+	CCuthillMcKee(const SAdjacency & graph, const int* parts):
+		g(graph), part(parts), level(graph.start.size() - 1, -1) {};
+
+	// append the subset's rows in Cuthill-McKee order, component by component
+	// in the order members first reaches them
+	void order(const std::vector<int> & members, int label, std::vector<int> & out)
+	{
+		size_t first = out.size();
+		for (size_t k = 0; k < members.size(); k++)
+			if (level[members[k]] < 0)
+				breadth_first(peripheral(members[k], label), label, out);
+		clear(out, first);
+	};
+
+protected:
+	std::vector<int> next, scratch;
+
+	// Appends the rows reachable from root, level by level and every level in
+	// increasing degree of its rows; returns the number of levels
+	int breadth_first(int root, int label, std::vector<int> & out)
+	{
+		size_t first = out.size();
+		level[root] = 0;
+		out.push_back(root);
+		int levels = 1;
+		for (size_t k = first; k < out.size(); k++) {
+			int v = out[k];
+			next.clear();
+			for (int a = g.start[v]; a < g.start[v+1]; a++) {
+				int w = g.list[a];
+				if (part[w] == label && level[w] < 0) {
+					level[w] = level[v] + 1;
+					next.push_back(w);
+				}
+			}
+			const SAdjacency & graph = g;
+			std::sort(next.begin(), next.end(), [&graph](int x, int y) {
+				return graph.degree(x) < graph.degree(y) || (graph.degree(x) == graph.degree(y) && x < y);
+			});
+			out.insert(out.end(), next.begin(), next.end());
+			if (!next.empty() && level[v] + 2 > levels)
+				levels = level[v] + 2;
+		}
+		return levels;
+	};
+
+	void clear(const std::vector<int> & rows, size_t first)
+	{
+		for (size_t k = first; k < rows.size(); k++)
+			level[rows[k]] = -1;
+	};
+
+	// George and Liu: move the root to the thinnest row of the last level
+	// while that makes the level structure deeper
+	int peripheral(int root, int label)
+	{
+		scratch.clear();
+		int levels = breadth_first(root, label, scratch);
+		for (int tries = 0; tries < 8; tries++) {
+			int best = -1;
+			for (size_t k = 0; k < scratch.size(); k++)
+				if (level[scratch[k]] == levels - 1 && (best < 0 || g.degree(scratch[k]) < g.degree(best)))
+					best = scratch[k];
+			clear(scratch, 0);
+			scratch.clear();
+			int deeper = breadth_first(best, label, scratch);
+			if (deeper <= levels)
+				break;
+			root = best;
+			levels = deeper;
+		}
+		clear(scratch, 0);
+		return root;
+	};
+};
+
+void rcm_order(CSparseMatrix & A, int* order)
+{
+	SAdjacency g;
+	build_graph(A, g);
+	int n = A.numRows;
+	std::vector<int> part(n, 0), members(n), sequence;
+	for (int v = 0; v < n; v++)
+		members[v] = v;
+	CCuthillMcKee cm(g, part.data());
+	cm.order(members, 0, sequence);
+	for (int k = 0; k < n; k++)
+		order[k] = sequence[n-1 - k];
+}
+
+static void bisect(CCuthillMcKee & cm, std::vector<int> & part, const std::vector<int> & members, int label,
+	int & next_label, int part_rows, int*& out)
+{
+	std::vector<int> sequence;
+	cm.order(members, label, sequence);
+	if ((int) sequence.size() <= part_rows) {
+		for (size_t k = 0; k < sequence.size(); k++)
+			*out++ = sequence[k];
+		return;
+	}
+	size_t half = sequence.size()/2;
+	std::vector<int> first(sequence.begin(), sequence.begin() + half), second(sequence.begin() + half, sequence.end());
+	int a = next_label++, b = next_label++;
+	for (size_t k = 0; k < first.size(); k++)
+		part[first[k]] = a;
+	for (size_t k = 0; k < second.size(); k++)
+		part[second[k]] = b;
+	sequence.clear();
+	bisect(cm, part, first, a, next_label, part_rows, out);
+	bisect(cm, part, second, b, next_label, part_rows, out);
+}
+
+void partition_order(CSparseMatrix & A, int* order, int part_rows)
+{
+	SAdjacency g;
+	build_graph(A, g);
+	int n = A.numRows;
+	std::vector<int> part(n, 0), members(n);
+	for (int v = 0; v < n; v++)
+		members[v] = v;
+	CCuthillMcKee cm(g, part.data());
+	int next_label = 1;
+	int* out = order;
+	bisect(cm, part, members, 0, next_label, part_rows > 0 ? part_rows : 1, out);
+}
+
+int matrix_bandwidth(CSparseMatrix & A)
+{
+	int width = 0;
+	for (int i = 0; i < A.numRows; i++)
+		for (CMatrixElement* e = A.rowList[i]; e != NULL; e = e->rowNext) {
+			int d = e->j > i ? e->j - i : i - e->j;
+			width = d > width ? d : width;
+		}
+	return width;
+}
+
+long long matrix_profile(CSparseMatrix & A)
+{
+	long long profile = 0;
+	for (int i = 0; i < A.numRows; i++) {
+		int first = i;
+		for (CMatrixElement* e = A.rowList[i]; e != NULL; e = e->rowNext)
+			first = e->j < first ? e->j : first;
+		profile += i - first;
+	}
+	return profile;
+}
+
+void permute_matrix(CSparseMatrix & A, const int* order, CSparseMatrix & B)
+{
+	int n = A.numRows;
+	std::vector<int> position(n);
+	for (int k = 0; k < n; k++)
+		position[order[k]] = k;
+	B.setDimensions(n, n);
+	std::vector<std::pair<int, double> > row;
+	for (int k = 0; k < n; k++) {
+		row.clear();
+		for (CMatrixElement* e = A.rowList[order[k]]; e != NULL; e = e->rowNext)
+			row.push_back(std::make_pair(position[e->j], e->value));
+		//set1Value puts every element in front of its row
+		std::sort(row.begin(), row.end());
+		for (size_t c = row.size(); c-- > 0; )
+			B.set1Value(k, row[c].first, row[c].second);
+	}
+}
+
+void permute_vector(const double* x, const int* order, int count, double* y)
+{
+	for (int k = 0; k < count; k++)
+		y[k] = x[order[k]];
+}
+
+void unpermute_vector(const double* y, const int* order, int count, double* x)
+{
+	for (int k = 0; k < count; k++)
+		x[order[k]] = y[k];
+}
+
+CPermutedMatrix::CPermutedMatrix():
+permuted(0, 0)
+{
+	ordering = ORDER_NATURAL;
+	bandwidth[0] = bandwidth[1] = 0;
+	profile[0] = profile[1] = 0;
+}
+
+void CPermutedMatrix::build(CSparseMatrix & A, int new_ordering)
+{
+	int n = A.numRows;
+	ordering = new_ordering;
+	order.resize(n);
+	if (ordering == ORDER_RCM)
+		rcm_order(A, order.data());
+	else if (ordering == ORDER_PARTITION)
+		partition_order(A, order.data());
+	else
+		for (int k = 0; k < n; k++)
+			order[k] = k;
+	permute_matrix(A, order.data(), permuted);
+	px.resize(n);
+	pb.resize(n);
+	bandwidth[0] = matrix_bandwidth(A);
+	bandwidth[1] = matrix_bandwidth(permuted);
+	profile[0] = matrix_profile(A);
+	profile[1] = matrix_profile(permuted);
+}
+
+void CPermutedMatrix::multMatVec(const double* src, double* dest)
+{
+	int n = permuted.numRows;
+	permute_vector(src, order.data(), n, px.data());
+	permuted.multMatVec(px.data(), pb.data());
+	unpermute_vector(pb.data(), order.data(), n, dest);
+}
+
+unsigned int CPermutedMatrix::solve(double* x, const double* b, double tol, unsigned int iter_max)
+{
+	int n = permuted.numRows;
+	permute_vector(x, order.data(), n, px.data());
+	permute_vector(b, order.data(), n, pb.data());
+	unsigned int iterations = permuted.solve(px.data(), pb.data(), tol, iter_max);
+	unpermute_vector(px.data(), order.data(), n, x);
+	return iterations;
+}
@@ -0,0 +1,60 @@
+// SparseOrdering.h: bandwidth-reducing orders for CSparseMatrix
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <vector>
+#include "SparseMatrix.h"
+
+// orderings for CPermutedMatrix::build()
+enum { ORDER_NATURAL, ORDER_RCM, ORDER_PARTITION };
+
+// Every order is a permutation of the rows of a square matrix: order[k] is
+// the row (and column) that goes to position k. They are orders of the
+// graph of A + A^T, so the values and the symmetry of A do not matter.
+//
+// Reverse Cuthill-McKee: breadth first from a pseudo-peripheral row of
+// every connected component, the neighbours of a row in increasing degree,
+// and the whole sequence reversed. Rows that are coupled end up close, so
+// the columns a row reads lie in a narrow band around it.
+void rcm_order(CSparseMatrix & A, int* order);
+// Recursive bisection: the rows are put in Cuthill-McKee order and cut in
+// two halves, each of which is ordered and cut again, until a part has at
+// most part_rows rows. Every part is one contiguous range, so a product
+// mostly reads entries of its own part; a part of 512 rows is 4 KB of a vector.
+void partition_order(CSparseMatrix & A, int* order, int part_rows = 512);
+
+// largest |i - j| over the nonzeros
+int matrix_bandwidth(CSparseMatrix & A);
+// sum over the rows of the distance from the first nonzero to the diagonal
+long long matrix_profile(CSparseMatrix & A);
+
+// B = P A P^T: row and column order[k] of A become row and column k of B.
+// The rows of B are assembled in order, their elements by increasing column.
+void permute_matrix(CSparseMatrix & A, const int* order, CSparseMatrix & B);
+void permute_vector(const double* x, const int* order, int count, double* y);	// y[k] = x[order[k]]
+void unpermute_vector(const double* y, const int* order, int count, double* x);	// x[order[k]] = y[k]
+
+// A matrix kept in a bandwidth-reducing order, used in the original
+// numbering: the vectors are permuted on the way in and out, the product
+// and the BiCG iterations run on the reordered copy. The iterations are
+// those of A.solve() up to rounding.
+class CPermutedMatrix
+{
+public:
+	int ordering;				// ORDER_*
+	std::vector<int> order;
+	CSparseMatrix permuted;
+	int bandwidth[2];			// of A and of permuted
+	long long profile[2];
+
+	CPermutedMatrix();
+
+	// a copy of A, which may change or go afterwards
+	void build(CSparseMatrix & A, int new_ordering = ORDER_RCM);
+	void multMatVec(const double* src, double* dest);
+	unsigned int solve(double* x, const double* b, double tol, unsigned int iter_max);
+
+protected:
+	std::vector<double> px, pb;
+};
@@ -0,0 +1,22 @@
+// StopWatch.h: small wall-clock timer used by the benchmarks
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <chrono>
+
+class CStopWatch
+{
+public:
+	std::chrono::steady_clock::time_point start;
+
+	CStopWatch() {restart();};
+	void restart() {start = std::chrono::steady_clock::now();};
+
+	// elapsed time since the last restart
+	long long nanoseconds()
+	{
+		return (long long) std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	};
+	double seconds() {return nanoseconds() * 1e-9;};
+};
@@ -0,0 +1,171 @@
+#include "TaskGraph.h"
+#include <algorithm>
+#include <assert.h>
+
+CTaskGraph::CTaskGraph(int workers)
+{
+	this->workers = workers > 0 ? workers : 0;
+	wall_ns = work_ns = critical_ns = 0;
+	remaining = 0;
+	stopping = false;
+}
+
+CTaskGraph::~CTaskGraph(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	changed.notify_all();
+	for (size_t k = 0; k < pool.size(); k++)
+		pool[k].join();
+}
+
+void CTaskGraph::clear()
+{
+	//a step rebuilds the same graph, and add() hands every task the lists it
+	//had last time, so after the first rebuild this allocates nothing
+	spare.reserve(spare.size() + 2*tasks.size());
+	for (size_t k = tasks.size(); k-- > 0; ) {
+		tasks[k].after.clear();
+		tasks[k].before.clear();
+		spare.push_back(std::move(tasks[k].before));
+		spare.push_back(std::move(tasks[k].after));
+	}
+	tasks.clear();
+}
+
+int CTaskGraph::add(const char* name, int stage, std::function<void()> run)
+{
+	STask task;
+	task.name = name;
+	task.stage = stage;
+	task.run = run;
+	task.start_ns = task.end_ns = 0;
+	task.thread = 0;
+	task.chain_ns = 0;
+	task.chain_previous = -1;
+	for (std::vector<int>* list : {&task.after, &task.before})
+		if (!spare.empty()) {
+			list->swap(spare.back());
+			spare.pop_back();
+		}
+	tasks.push_back(std::move(task));
+	return (int) tasks.size() - 1;
+}
+
+void CTaskGraph::depends(int task, int on)
+{
+	assert(on < task);
+	tasks[task].after.push_back(on);
+	tasks[on].before.push_back(task);
+}
+
+void CTaskGraph::run()
+{
+	if ((int) pool.size() < workers)
+		for (int t = (int) pool.size(); t < workers; t++)
+			pool.push_back(std::thread(&CTaskGraph::worker, this, t + 1));
+
+	std::unique_lock<std::mutex> lock(mutex);
+	clock.restart();
+	remaining = (int) tasks.size();
+	waiting.resize(tasks.size());
+	ready.clear();
+	for (size_t k = 0; k < tasks.size(); k++) {
+		waiting[k] = (int) tasks[k].after.size();
+		if (waiting[k] == 0)
+			ready.push_back((int) k);
+	}
+	changed.notify_all();
+	while (remaining > 0) {
+		if (!ready.empty())
+			run_one(lock, 0);
+		else
+			changed.wait(lock);
+	}
+	wall_ns = clock.nanoseconds();
+	lock.unlock();
+	find_critical_path();
+}
+
+void CTaskGraph::worker(int thread)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		changed.wait(lock, [this] {return stopping || !ready.empty();});
+		if (stopping)
+			return;
+		run_one(lock, thread);
+	}
+}
+
+void CTaskGraph::run_one(std::unique_lock<std::mutex> & lock, int thread)
+{
+	// the first in sequence order, which is usually the one others wait for
+	std::vector<int>::iterator first = std::min_element(ready.begin(), ready.end());
+	int k = *first;
+	ready.erase(first);
+	lock.unlock();
+
+	STask & task = tasks[k];
+	task.thread = thread;
+	task.start_ns = clock.nanoseconds();
+	task.run();
+	task.end_ns = clock.nanoseconds();
+
+	lock.lock();
+	for (size_t s = 0; s < task.before.size(); s++)
+		if (--waiting[task.before[s]] == 0)
+			ready.push_back(task.before[s]);
+	remaining--;
+	changed.notify_all();
+}
+
+void CTaskGraph::find_critical_path()
+{
+	// the tasks are in dependency order, so one pass finds every longest chain
+	work_ns = critical_ns = 0;
+	for (size_t k = 0; k < tasks.size(); k++) {
+		STask & task = tasks[k];
+		long long longest = 0;
+		task.chain_previous = -1;
+		for (size_t a = 0; a < task.after.size(); a++)
+			if (tasks[task.after[a]].chain_ns > longest || task.chain_previous < 0) {
+				longest = tasks[task.after[a]].chain_ns;
+				task.chain_previous = task.after[a];
+			}
+		long long ns = task.end_ns - task.start_ns;
+		task.chain_ns = longest + ns;
+		work_ns += ns;
+		if (task.chain_ns > critical_ns)
+			critical_ns = task.chain_ns;
+	}
+}
+
+std::vector<int> CTaskGraph::critical_path()
+{
+	std::vector<int> path;
+	int last = -1;
+	for (size_t k = 0; k < tasks.size(); k++)
+		if (last < 0 || tasks[k].chain_ns > tasks[last].chain_ns)
+			last = (int) k;
+	for (int k = last; k >= 0; k = tasks[k].chain_previous)
+		path.push_back(k);
+	std::reverse(path.begin(), path.end());
+	return path;
+}
+
+void CTaskGraph::print(FILE* fp)
+{
+	std::vector<int> path = critical_path();
+	std::vector<bool> on_path(tasks.size(), false);
+	for (size_t k = 0; k < path.size(); k++)
+		on_path[path[k]] = true;
+	fprintf(fp, "Task graph: %d tasks on %d threads, wall %.1f us, work %.1f us, critical path %.1f us\n",
+		(int) tasks.size(), threads(), wall_ns*1e-3, work_ns*1e-3, critical_ns*1e-3);
+	fprintf(fp, "%-22s %6s %10s %10s %10s %8s\n", "task", "thread", "start us", "end us", "us", "critical");
+	for (size_t k = 0; k < tasks.size(); k++)
+		fprintf(fp, "%-22s %6d %10.1f %10.1f %10.1f %8s\n", tasks[k].name, tasks[k].thread, tasks[k].start_ns*1e-3,
+			tasks[k].end_ns*1e-3, (tasks[k].end_ns - tasks[k].start_ns)*1e-3, on_path[k] ? "*" : "");
+}
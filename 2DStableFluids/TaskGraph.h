@@ -0,0 +1,74 @@
+// TaskGraph.h: one solver step as a graph of dependent tasks, run on a few threads
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include "StopWatch.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+struct STask
+{
+	const char* name;
+	int stage;			// CSolverStats stage its time belongs to
+	std::function<void()> run;
+	std::vector<int> after;		// tasks this one depends on, all added before it
+	std::vector<int> before;	// tasks that depend on this one
+
+	// filled by CTaskGraph::run()
+	long long start_ns, end_ns;	// since the start of run()
+	int thread;					// 0: the caller of run()
+	long long chain_ns;			// the longest chain of dependencies ending here
+	int chain_previous;			// the task before this one on that chain, or -1
+};
+
+// Tasks are added in an order that would be right in sequence, so every
+// dependency comes before the tasks that wait for it. run() hands each task
+// to the calling thread or a worker as soon as its dependencies are done,
+// and returns when all are. The workers are started at the first run() and
+// sleep in between, so a step pays no thread creation.
+//
+// Afterwards every task has its start and end, and the graph has the
+// critical path: the chain of dependent tasks with the largest total time.
+// No number of threads gets a step below critical_ns; wall_ns - critical_ns
+// is time lost to waiting for a thread.
+class CTaskGraph
+{
+public:
+	std::vector<STask> tasks;
+	long long wall_ns;		// the last run()
+	long long work_ns;		// sum of its task times
+	long long critical_ns;	// the time of its critical path
+
+	CTaskGraph(int workers = 1);
+	~CTaskGraph(void);
+
+	void clear();	// the dependency lists keep their storage for the next graph
+	int add(const char* name, int stage, std::function<void()> run);
+	void depends(int task, int on);
+	void run();
+
+	int threads() {return workers + 1;};
+	std::vector<int> critical_path();	// first to last
+	void print(FILE* fp);	// the tasks of the last run(), critical ones starred
+
+protected:
+	int workers;
+	std::vector<std::thread> pool;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<int> ready;		// tasks whose dependencies are done, not yet started
+	std::vector<int> waiting;	// per task: dependencies not yet done
+	int remaining;				// tasks not yet finished
+	std::vector<std::vector<int> > spare;	// dependency lists of cleared tasks, reused by add()
+	bool stopping;
+	CStopWatch clock;
+
+	void worker(int thread);
+	void run_one(std::unique_lock<std::mutex> & lock, int thread);	// lock held, ready not empty
+	void find_critical_path();
+};
@@ -0,0 +1,46 @@
+// TripleBuffer.h: lock-free single writer / single reader frame exchange
+//////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <atomic>
+
+// Three slots: the writer fills its own slot, the reader holds its own, and
+// the third is the latest finished frame. publish() swaps the writer's slot
+// with the middle one, fetch() swaps the reader's slot with the middle one
+// if it holds a newer frame. Neither side ever waits for the other; a reader
+// that is slower than the writer just skips frames.
+//
+// The middle slot index and a "new frame" flag share one atomic word, so a
+// swap is a single exchange.
+template <class T>
+class CTripleBuffer
+{
+public:
+	T slots[3];
+
+	CTripleBuffer(): middle(1), write_index(0), read_index(2) {};
+
+	// writer side
+	T & write_slot() {return slots[write_index];};
+	void publish()
+	{
+		write_index = middle.exchange(write_index | FRESH) & INDEX;
+	};
+
+	// reader side: true if read_slot() now holds a frame it has not seen
+	bool fetch()
+	{
+		if (!(middle.load() & FRESH))
+			return false;
+		read_index = middle.exchange(read_index) & INDEX;
+		return true;
+	};
+	T & read_slot() {return slots[read_index];};
+
+protected:
+	enum { INDEX = 3, FRESH = 4 };
+	std::atomic<int> middle;
+	int write_index;	// only touched by the writer
+	int read_index;		// only touched by the reader
+};
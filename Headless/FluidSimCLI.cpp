@@ -0,0 +1,542 @@
+// FluidSimCLI.cpp: headless driver for CFluidSolver
+//
+// Runs the solver without the MFC view, as fast as it can, with sources
+// given on the command line or in a script file, and reports steps/sec.
+//////////////////////////////////////////////////////////////////////
+
+#include "FluidSolver.h"
+#include "Benchmark.h"
+#include "Checkpoint.h"
+#include "FrameRecorder.h"
+#include "FieldRaster.h"
+#include "MemoryUsage.h"
+#include "ParticleSystem.h"
+#include "StopWatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// A source or stir that is applied on every step in [first, last)
+struct SScriptedSource
+{
+	bool is_stir;
+	int i, j;
+	double rate;	// density per unit time, as the view injects 50 per unit time
+	double vx, vy;	// stir velocity
+	int first, last;
+	double radius;	// > 0: a Gaussian splat of density and velocity (add_splats)
+};
+
+static void usage()
+{
+	printf("usage: fluidsim [options]\n"
+		"  -n N                    grid size (default 60)\n"
+		"  -steps S                number of steps (default 500)\n"
+		"  -viscosity V            viscosity coefficient (default 0.1)\n"
+		"  -pressure-iterations K  pressure solve iterations (default 10)\n"
+		"  -source i,j,rate[,first,last]   density source at cell (i,j)\n"
+		"  -stir i,j,vx,vy[,first,last]    velocity source at cell (i,j)\n"
+		"  -splat i,j,r,rate,vx,vy[,first,last]  Gaussian splat of radius r cells\n"
+		"  -script FILE            sources from a file, one per line:\n"
+		"                            source i j rate [first last]\n"
+		"                            stir i j vx vy [first last]\n"
+		"                            splat i j r rate vx vy [first last]\n"
+		"  -obstacle x,y,r         solid disk of radius r cells (repeatable)\n"
+		"  -obstacle-velocity vx,vy  move every obstacle at this velocity\n"
+		"  -adaptive               CFL-driven sub-steps\n"
+		"  -advection sl|maccormack|bfecc\n"
+		"  -sparse                 skip empty tiles\n"
+		"  -direct                 solve with cached Cholesky factors instead of BiCG\n"
+		"  -huge-pages             put the solver fields on huge pages if available\n"
+		"  -sequential             run every step in sequence, not as a task graph\n"
+		"  -dump PREFIX            write the fields to PREFIX_density_STEP.txt and\n"
+		"                          PREFIX_velocity_STEP.txt after the last step\n"
+		"  -dump-every K           ... and every K steps\n"
+		"  -image PREFIX           write PREFIX_density_STEP.ppm and PREFIX_speed_STEP.ppm\n"
+		"                          with the dumps (after the last step, and -dump-every)\n"
+		"  -image-size WxH         image size (default 4n x 4n)\n"
+		"  -image-nearest          nearest instead of bilinear upscaling\n"
+		"  -colormap grey|heat|ice colormap of the images (default grey)\n"
+		"  -particles N            carry N tracer particles through the flow (RK2)\n"
+		"  -record FILE            record density frames to FILE in the background\n"
+		"  -record-every K         ... every K steps (default 1)\n"
+		"  -record-velocity        ... with velocity\n"
+		"  -restart FILE           continue from a checkpoint (its n and parameters\n"
+		"                          replace -n and the solver options)\n"
+		"  -checkpoint FILE        save a checkpoint after the last step\n"
+		"  -checkpoint-operators   ... including the matrices, for a bit-exact restart\n"
+		"  -bench                  run the solver benchmarks and exit\n"
+		"  -bench-fused N          fused against separate velocity passes up to n = N, and exit\n"
+		"  -stats                  print stage timings and solve statistics at the end\n"
+		"  -memory                 print the solver's memory by component at the end, and\n"
+		"                          the heap use of the steps (FLUID_COUNT_ALLOCATIONS builds)\n"
+		"  -quiet                  only print the summary line\n"
+		"Without sources, a smoke source near the bottom is stirred for 20 steps.\n");
+}
+
+static bool parse_source(const char *text, SScriptedSource & s)
+{
+	s.is_stir = false;
+	s.vx = s.vy = 0.;
+	s.first = 0;
+	s.last = -1;
+	s.radius = 0.;
+	int k = sscanf(text, "%d,%d,%lf,%d,%d", &s.i, &s.j, &s.rate, &s.first, &s.last);
+	return k == 3 || k == 5;
+}
+
+static bool parse_stir(const char *text, SScriptedSource & s)
+{
+	s.is_stir = true;
+	s.rate = 0.;
+	s.first = 0;
+	s.last = -1;
+	s.radius = 0.;
+	int k = sscanf(text, "%d,%d,%lf,%lf,%d,%d", &s.i, &s.j, &s.vx, &s.vy, &s.first, &s.last);
+	return k == 4 || k == 6;
+}
+
+static bool parse_splat(const char *text, SScriptedSource & s)
+{
+	s.is_stir = false;
+	s.first = 0;
+	s.last = -1;
+	int k = sscanf(text, "%d,%d,%lf,%lf,%lf,%lf,%d,%d", &s.i, &s.j, &s.radius, &s.rate, &s.vx, &s.vy, &s.first, &s.last);
+	return (k == 6 || k == 8) && s.radius > 0.;
+}
+
+// A solid disk, redrawn at every step where its velocity has taken it
+struct SObstacleDisk
+{
+	double x, y, radius;	// in cells
+};
+
+static bool read_script(const char *name, std::vector<SScriptedSource> & sources)
+{
+	FILE *fp = fopen(name, "r");
+	if (!fp) {
+		fprintf(stderr, "fluidsim: cannot open %s\n", name);
+		return false;
+	}
+	char line[256];
+	int number = 0;
+	bool ok = true;
+	while (ok && fgets(line, sizeof(line), fp)) {
+		number++;
+		char kind[16];
+		if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#')
+			continue;
+		SScriptedSource s;
+		s.first = 0;
+		s.last = -1;
+		s.radius = 0.;
+		int k;
+		if (strcmp(kind, "source") == 0) {
+			s.is_stir = false;
+			s.vx = s.vy = 0.;
+			k = sscanf(line, "%*s %d %d %lf %d %d", &s.i, &s.j, &s.rate, &s.first, &s.last);
+			ok = k == 3 || k == 5;
+		} else if (strcmp(kind, "stir") == 0) {
+			s.is_stir = true;
+			s.rate = 0.;
+			k = sscanf(line, "%*s %d %d %lf %lf %d %d", &s.i, &s.j, &s.vx, &s.vy, &s.first, &s.last);
+			ok = k == 4 || k == 6;
+		} else if (strcmp(kind, "splat") == 0) {
+			s.is_stir = false;
+			k = sscanf(line, "%*s %d %d %lf %lf %lf %lf %d %d", &s.i, &s.j, &s.radius, &s.rate, &s.vx, &s.vy, &s.first, &s.last);
+			ok = (k == 6 || k == 8) && s.radius > 0.;
+		} else
+			ok = false;
+		if (ok)
+			sources.push_back(s);
+		else
+			fprintf(stderr, "fluidsim: %s:%d: cannot parse \"%s\"\n", name, number, strtok(line, "\r\n"));
+	}
+	fclose(fp);
+	return ok;
+}
+
+// the density on [0, 1] and the speed on its own range
+static bool dump_images(CFluidSolver & solver, CFieldRaster & raster, const char *prefix, int step)
+{
+	char name[1024];
+	raster.auto_range = false;
+	raster.draw(solver.density, solver.n);
+	sprintf(name, "%.1000s_density_%06d.ppm", prefix, step);
+	if (!raster.write_ppm(name))
+		return false;
+	raster.auto_range = true;
+	raster.draw_speed(solver.velocity, solver.n);
+	sprintf(name, "%.1000s_speed_%06d.ppm", prefix, step);
+	return raster.write_ppm(name);
+}
+
+static bool dump_fields(CFluidSolver & solver, const char *prefix, int step)
+{
+	char name[1024];
+	int n = solver.n;
+	sprintf(name, "%.1000s_density_%06d.txt", prefix, step);
+	FILE *fp = fopen(name, "w");
+	if (!fp)
+		return false;
+	for (int j = 0; j < n; j++)
+		for (int i = 0; i < n; i++)
+			fprintf(fp, "%.9g%c", solver.density[i+j*n], i == n-1 ? '\n' : ' ');
+	fclose(fp);
+
+	sprintf(name, "%.1000s_velocity_%06d.txt", prefix, step);
+	fp = fopen(name, "w");
+	if (!fp)
+		return false;
+	for (int j = 0; j < n; j++)
+		for (int i = 0; i < n; i++)
+			fprintf(fp, "%.9g %.9g%c", solver.v(i,j)->x, solver.v(i,j)->y, i == n-1 ? '\n' : ' ');
+	fclose(fp);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	int n = 60;
+	int steps = 500;
+	double viscosity = 0.1;
+	int pressure_iterations = 10;
+	bool adaptive = false;
+	bool sparse = false;
+	bool direct = false;
+	bool huge_pages = false;
+	bool sequential = false;
+	int advection = ADVECT_SEMI_LAGRANGIAN;
+	const char *dump_prefix = NULL;
+	int dump_every = 0;
+	const char *image_prefix = NULL;
+	int image_width = 0, image_height = 0;
+	bool image_nearest = false;
+	int particle_count = 0;
+	int colormap = COLORMAP_GREY;
+	bool quiet = false;
+	bool print_stats = false;
+	bool print_memory = false;
+	const char *restart_path = NULL;
+	const char *checkpoint_path = NULL;
+	bool checkpoint_operators = false;
+	const char *record_path = NULL;
+	int record_every = 1;
+	bool record_velocity = false;
+	std::vector<SScriptedSource> sources;
+	std::vector<SObstacleDisk> obstacles;
+	vec2 obstacle_velocity;
+
+	for (int a = 1; a < argc; a++) {
+		const char *arg = argv[a];
+		const char *value = a+1 < argc ? argv[a+1] : NULL;
+		bool ok = true;
+		if (strcmp(arg, "-n") == 0 && value) {
+			n = atoi(value); a++;
+			ok = n >= 8;
+		} else if (strcmp(arg, "-steps") == 0 && value) {
+			steps = atoi(value); a++;
+			ok = steps >= 0;
+		} else if (strcmp(arg, "-viscosity") == 0 && value) {
+			viscosity = atof(value); a++;
+			ok = viscosity >= 0;
+		} else if (strcmp(arg, "-pressure-iterations") == 0 && value) {
+			pressure_iterations = atoi(value); a++;
+			ok = pressure_iterations > 0;
+		} else if (strcmp(arg, "-source") == 0 && value) {
+			SScriptedSource s;
+			ok = parse_source(value, s); a++;
+			if (ok)
+				sources.push_back(s);
+		} else if (strcmp(arg, "-stir") == 0 && value) {
+			SScriptedSource s;
+			ok = parse_stir(value, s); a++;
+			if (ok)
+				sources.push_back(s);
+		} else if (strcmp(arg, "-splat") == 0 && value) {
+			SScriptedSource s;
+			ok = parse_splat(value, s); a++;
+			if (ok)
+				sources.push_back(s);
+		} else if (strcmp(arg, "-script") == 0 && value) {
+			if (!read_script(value, sources))
+				return 1;
+			a++;
+		} else if (strcmp(arg, "-obstacle") == 0 && value) {
+			SObstacleDisk disk;
+			ok = sscanf(value, "%lf,%lf,%lf", &disk.x, &disk.y, &disk.radius) == 3 && disk.radius > 0.; a++;
+			if (ok)
+				obstacles.push_back(disk);
+		} else if (strcmp(arg, "-obstacle-velocity") == 0 && value) {
+			ok = sscanf(value, "%lf,%lf", &obstacle_velocity.x, &obstacle_velocity.y) == 2; a++;
+		} else if (strcmp(arg, "-adaptive") == 0) {
+			adaptive = true;
+		} else if (strcmp(arg, "-direct") == 0) {
+			direct = true;
+		} else if (strcmp(arg, "-huge-pages") == 0) {
+			huge_pages = true;
+		} else if (strcmp(arg, "-sequential") == 0) {
+			sequential = true;
+		} else if (strcmp(arg, "-advection") == 0 && value) {
+			if (strcmp(value, "sl") == 0)
+				advection = ADVECT_SEMI_LAGRANGIAN;
+			else if (strcmp(value, "maccormack") == 0)
+				advection = ADVECT_MACCORMACK;
+			else if (strcmp(value, "bfecc") == 0)
+				advection = ADVECT_BFECC;
+			else
+				ok = false;
+			a++;
+		} else if (strcmp(arg, "-sparse") == 0) {
+			sparse = true;
+		} else if (strcmp(arg, "-dump") == 0 && value) {
+			dump_prefix = value; a++;
+		} else if (strcmp(arg, "-image") == 0 && value) {
+			image_prefix = value; a++;
+		} else if (strcmp(arg, "-image-size") == 0 && value) {
+			ok = sscanf(value, "%dx%d", &image_width, &image_height) == 2 && image_width > 0 && image_height > 0;
+			a++;
+		} else if (strcmp(arg, "-image-nearest") == 0) {
+			image_nearest = true;
+		} else if (strcmp(arg, "-colormap") == 0 && value) {
+			colormap = -1;
+			for (int c = 0; c < NUM_COLORMAPS; c++)
+				if (strcmp(value, CColormap::preset_name(c)) == 0)
+					colormap = c;
+			ok = colormap >= 0;
+			a++;
+		} else if (strcmp(arg, "-particles") == 0 && value) {
+			particle_count = atoi(value); a++;
+			ok = particle_count > 0;
+		} else if (strcmp(arg, "-dump-every") == 0 && value) {
+			dump_every = atoi(value); a++;
+			ok = dump_every >= 0;
+		} else if (strcmp(arg, "-record") == 0 && value) {
+			record_path = value; a++;
+		} else if (strcmp(arg, "-record-every") == 0 && value) {
+			record_every = atoi(value); a++;
+			ok = record_every > 0;
+		} else if (strcmp(arg, "-record-velocity") == 0) {
+			record_velocity = true;
+		} else if (strcmp(arg, "-restart") == 0 && value) {
+			restart_path = value; a++;
+		} else if (strcmp(arg, "-checkpoint") == 0 && value) {
+			checkpoint_path = value; a++;
+		} else if (strcmp(arg, "-checkpoint-operators") == 0) {
+			checkpoint_operators = true;
+		} else if (strcmp(arg, "-bench-fused") == 0 && value) {
+			benchmark_fused_velocity(stdout, atoi(value));
+			return 0;
+		} else if (strcmp(arg, "-bench") == 0) {
+			run_all_benchmarks(stdout);
+			return 0;
+		} else if (strcmp(arg, "-stats") == 0) {
+			print_stats = true;
+		} else if (strcmp(arg, "-memory") == 0) {
+			print_memory = true;
+		} else if (strcmp(arg, "-quiet") == 0) {
+			quiet = true;
+		} else if (strcmp(arg, "-help") == 0 || strcmp(arg, "-h") == 0) {
+			usage();
+			return 0;
+		} else {
+			fprintf(stderr, "fluidsim: unknown option or missing value: %s\n", arg);
+			usage();
+			return 1;
+		}
+		if (!ok) {
+			fprintf(stderr, "fluidsim: bad value for %s\n", arg);
+			return 1;
+		}
+	}
+
+	CCheckpointFile restart;
+	if (restart_path) {
+		if (!restart.open(restart_path)) {
+			fprintf(stderr, "fluidsim: %s is not a checkpoint of this version\n", restart_path);
+			return 1;
+		}
+		n = restart.header->n;
+	}
+
+	if (sources.empty()) {
+		// the benchmark scene
+		SScriptedSource smoke = {false, n/2, n-10, 50., 0., 0., 0, -1, 0.};
+		SScriptedSource stir = {true, n/3, n/2, 0., 100., -50., 0, 20, 0.};
+		sources.push_back(smoke);
+		sources.push_back(stir);
+	}
+	for (size_t k = 0; k < sources.size(); k++)
+		if (sources[k].i < 0 || sources[k].i >= n || sources[k].j < 0 || sources[k].j >= n) {
+			fprintf(stderr, "fluidsim: source (%d,%d) is outside the %d x %d grid\n", sources[k].i, sources[k].j, n, n);
+			return 1;
+		}
+
+	CFluidSolver solver(n);
+	if (huge_pages) {
+		solver.arena.huge_pages = true;
+		solver.resize(n);
+	}
+	solver.viscosity_coef = viscosity;
+	solver.setup_velocity_diffusion_matrix(viscosity);
+	solver.pressure_iterations = pressure_iterations;
+	solver.adaptive_step = adaptive;
+	solver.direct_solve = direct;
+	solver.task_graph = !sequential;
+	solver.advection_mode = advection;
+	solver.set_sparse(sparse);
+	if (restart_path) {
+		CStopWatch restore_timer;
+		if (!restart.restore(solver)) {
+			fprintf(stderr, "fluidsim: cannot restore %s\n", restart_path);
+			return 1;
+		}
+		if (!quiet)
+			printf("restored %s in %.3f ms\n", restart_path, restore_timer.nanoseconds()*1e-6);
+		restart.close();
+	}
+
+	//the disks replace the obstacles of a restart
+	bool moving = obstacle_velocity.x != 0. || obstacle_velocity.y != 0.;
+	if (!obstacles.empty() || moving)
+		solver.obstacle_velocity = obstacle_velocity;
+	if (!obstacles.empty()) {
+		solver.obstacles.clear();
+		for (size_t k = 0; k < obstacles.size(); k++)
+			solver.obstacles.fill_disk(obstacles[k].x, obstacles[k].y, obstacles[k].radius, true);
+	}
+
+	if (!quiet)
+		printf("n = %d, %d steps, viscosity %g, %d source(s)\n", n, steps, viscosity, (int) sources.size());
+
+	CFieldRaster raster;
+	raster.bilinear = !image_nearest;
+	raster.colormap.set_preset(colormap);
+	raster.resize(image_width > 0 ? image_width : 4*n, image_height > 0 ? image_height : 4*n);
+
+	CFrameRecorder recorder;
+	if (record_path && !recorder.open(record_path, n, record_every, record_velocity)) {
+		fprintf(stderr, "fluidsim: cannot write %s\n", record_path);
+		return 1;
+	}
+
+	CParticleSystem particles;
+	particles.emit_box(1., 1., n - 2., n - 2., particle_count);
+
+	CStopWatch timer;
+	long long solve_ns = 0;
+	long long particle_ns = 0;
+	long long steady_allocations = 0;	// heap allocations of the updates after the first
+	long long update_peak_bytes = 0;	// the most heap an update held above its start
+	std::vector<SSplat> splats;
+	for (int step = 0; step < steps; step++) {
+		splats.clear();
+		for (size_t k = 0; k < sources.size(); k++) {
+			SScriptedSource & s = sources[k];
+			if (step < s.first || (s.last >= 0 && step >= s.last))
+				continue;
+			if (s.radius > 0.) {
+				SSplat splat = {(double) s.i, (double) s.j, s.radius, s.rate*solver.frame_time, vec2(s.vx, s.vy)};
+				splats.push_back(splat);
+			} else if (s.is_stir)
+				solver.set_velocity_source(s.i + s.j*n, vec2(s.vx, s.vy));
+			else
+				solver.set_density_source(s.i + s.j*n, s.rate*solver.frame_time);
+		}
+		solver.add_splats(splats.data(), (int) splats.size());
+		timer.restart();
+		if (moving && !obstacles.empty()) {
+			double t = solver.simulated_time;
+			solver.obstacles.clear();
+			for (size_t k = 0; k < obstacles.size(); k++)
+				solver.obstacles.fill_disk(obstacles[k].x + obstacle_velocity.x*t, obstacles[k].y + obstacle_velocity.y*t,
+					obstacles[k].radius, true);
+		}
+		reset_heap_peak();
+		SHeapCounts heap = heap_counts();
+		solver.update();
+		if (print_memory) {
+			SHeapCounts after = heap_counts();
+			if (step > 0)
+				steady_allocations += after.allocations - heap.allocations;
+			if (after.peak_bytes - heap.live_bytes > update_peak_bytes)
+				update_peak_bytes = after.peak_bytes - heap.live_bytes;
+		}
+		if (record_path)
+			recorder.capture(solver);
+		solve_ns += timer.nanoseconds();
+		if (particle_count > 0) {
+			timer.restart();
+			particles.advect(solver.velocity, n, solver.frame_time);
+			particle_ns += timer.nanoseconds();
+		}
+
+		if (dump_prefix && dump_every > 0 && (step+1) % dump_every == 0 && step+1 < steps)
+			if (!dump_fields(solver, dump_prefix, step+1)) {
+				fprintf(stderr, "fluidsim: cannot write %s fields\n", dump_prefix);
+				return 1;
+			}
+		if (image_prefix && dump_every > 0 && (step+1) % dump_every == 0 && step+1 < steps)
+			if (!dump_images(solver, raster, image_prefix, step+1)) {
+				fprintf(stderr, "fluidsim: cannot write %s images\n", image_prefix);
+				return 1;
+			}
+	}
+	if (record_path) {
+		if (!recorder.close()) {
+			fprintf(stderr, "fluidsim: writing %s failed\n", record_path);
+			return 1;
+		}
+		if (!quiet)
+			printf("recorded %lld frames to %s, %.1f MB, %.1f:1, %lld dropped\n", (long long) recorder.frames_written, record_path,
+				recorder.bytes_written*1e-6, (double) recorder.raw_bytes/recorder.bytes_written, (long long) recorder.frames_dropped);
+	}
+	if (checkpoint_path) {
+		CStopWatch save_timer;
+		if (!save_checkpoint(solver, checkpoint_path, checkpoint_operators)) {
+			fprintf(stderr, "fluidsim: cannot write %s\n", checkpoint_path);
+			return 1;
+		}
+		if (!quiet)
+			printf("saved %s in %.3f ms\n", checkpoint_path, save_timer.nanoseconds()*1e-6);
+	}
+	if (dump_prefix && !dump_fields(solver, dump_prefix, steps)) {
+		fprintf(stderr, "fluidsim: cannot write %s fields\n", dump_prefix);
+		return 1;
+	}
+	if (image_prefix && !dump_images(solver, raster, image_prefix, steps)) {
+		fprintf(stderr, "fluidsim: cannot write %s images\n", image_prefix);
+		return 1;
+	}
+
+	double total = 0.;
+	for (int k = 0; k < solver.size; k++)
+		total += solver.density[k];
+	double seconds = solve_ns*1e-9;
+	printf("steps %d  time %.3f s  steps/sec %.1f  ms/step %.3f  total density %.6g\n",
+		steps, seconds, seconds > 0 ? steps/seconds : 0., steps > 0 ? solve_ns*1e-6/steps : 0., total);
+	if (particle_count > 0)
+		printf("particles %d  time %.3f s  particles/sec %.3g\n", particles.count(), particle_ns*1e-9,
+			particle_ns > 0 ? particles.particle_steps*1e9/particle_ns : 0.);
+	if (print_stats) {
+		solver.stats.print(stdout);
+		printf("fields: %.1f MB in one block, %s pages\n", solver.arena.used()/1e6, solver.arena.on_huge_pages() ? "huge" : "normal");
+		printf("velocity passes: %.2f MB moved in the last step\n", solver.velocity_bytes/1e6);
+		if (solver.obstacles.any())
+			printf("obstacles: %d solid cells, divergence residual %.3g\n", solver.obstacles.solid_cells, solver.divergence_residual());
+		if (solver.task_graph)
+			solver.step_graph.print(stdout);
+	}
+	if (print_memory) {
+		CMemoryReport report;
+		report.measure(solver);
+		report.print(stdout);
+		if (heap_counting())
+			printf("heap: %lld allocations in the %d updates after the first, at most %lld bytes above the start of an update\n",
+				steady_allocations, steps > 0 ? steps - 1 : 0, update_peak_bytes);
+		else
+			printf("heap: not counted (build with FLUID_COUNT_ALLOCATIONS)\n");
+	}
+	return 0;
+}
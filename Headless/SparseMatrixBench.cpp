@@ -0,0 +1,376 @@
+// SparseMatrixBench.cpp: microbenchmarks for the CSparseMatrix kernels
+//
+// Every kernel runs on 5-point Poisson matrices (the pressure Laplacian of an
+// n x n grid), on the same matrices with the cells numbered at random (as an
+// unstructured mesh may come), and on random sparse matrices with a
+// dominant diagonal. The product and the solve are then run again on the
+// matrix reordered by reverse Cuthill-McKee (_rcm) and by recursive
+// bisection (_partition), after the time of ordering and permuting. One
+// line is written per matrix and kernel, as CSV or JSON, so runs before and
+// after a change can be compared with a script.
+//
+// Columns:
+//   ns_per_nnz  time of one kernel call divided by the nonzeros of the input
+//   gb_per_s    effective bandwidth: the bytes the kernel has to touch (every
+//               CMatrixElement once, plus one read of the source entry and the
+//               destination vector) over the time; empty where not meaningful
+//   iterations  BiCG iterations of solve() to reach the tolerance
+//   result_nnz  nonzeros of the product for multMatrix
+//   bandwidth   largest |i - j| of the matrix the kernel ran on
+//   profile     sum over its rows of the distance from the first nonzero to the diagonal
+//////////////////////////////////////////////////////////////////////
+
+#include "SparseMatrix.h"
+#include "SparseOrdering.h"
+#include "StopWatch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+static bool json = false;
+static bool first_record = true;
+static double min_time = 0.2;	// seconds each timed kernel is repeated for
+
+// bandwidth and profile of the matrix the next records are about
+static int bandwidth = 0;
+static long long profile = 0;
+
+static void record(const char *matrix, int rows, long long nnz, const char *kernel, int repetitions,
+	double seconds, double bytes, int iterations, long long result_nnz)
+{
+	double per_call = seconds/repetitions;
+	double ns_per_nnz = per_call*1e9/nnz;
+	if (json) {
+		printf("%s\n  {\"matrix\": \"%s\", \"rows\": %d, \"nnz\": %lld, \"kernel\": \"%s\", \"repetitions\": %d, "
+			"\"ms\": %.6f, \"ns_per_nnz\": %.4f, ", first_record ? "[" : ",", matrix, rows, nnz, kernel, repetitions,
+			per_call*1e3, ns_per_nnz);
+		if (bytes > 0)
+			printf("\"gb_per_s\": %.4f, ", bytes/per_call*1e-9);
+		else
+			printf("\"gb_per_s\": null, ");
+		printf("\"iterations\": %d, \"result_nnz\": %lld, \"bandwidth\": %d, \"profile\": %lld}", iterations, result_nnz,
+			bandwidth, profile);
+	} else {
+		if (first_record)
+			printf("matrix,rows,nnz,kernel,repetitions,ms,ns_per_nnz,gb_per_s,iterations,result_nnz,bandwidth,profile\n");
+		printf("%s,%d,%lld,%s,%d,%.6f,%.4f,", matrix, rows, nnz, kernel, repetitions, per_call*1e3, ns_per_nnz);
+		if (bytes > 0)
+			printf("%.4f", bytes/per_call*1e-9);
+		printf(",%d,%lld,%d,%lld\n", iterations, result_nnz, bandwidth, profile);
+	}
+	first_record = false;
+	fflush(stdout);
+}
+
+// a matrix as triplets, so assembly can be timed on its own
+struct STriplets
+{
+	int rows;
+	std::vector<int> i, j;
+	std::vector<double> value;
+
+	void add(int r, int c, double v) {i.push_back(r); j.push_back(c); value.push_back(v);};
+	long long nnz() {return (long long) value.size();};
+	void assemble(CSparseMatrix & m)
+	{
+		m.setDimensions(rows);
+		for (size_t k = 0; k < value.size(); k++)
+			m.set1Value(i[k], j[k], value[k]);
+	};
+};
+
+static void poisson(STriplets & t, int n)
+{
+	t.rows = n*n;
+	for (int y = 0; y < n; y++)
+		for (int x = 0; x < n; x++) {
+			int c = x + y*n;
+			if (x > 0) t.add(c, c-1, -1.);
+			if (x < n-1) t.add(c, c+1, -1.);
+			if (y > 0) t.add(c, c-n, -1.);
+			if (y < n-1) t.add(c, c+n, -1.);
+			t.add(c, c, 4.);
+		}
+}
+
+// the same matrix with the cell of every row drawn at random
+static void shuffled_poisson(STriplets & t, int n, unsigned int seed)
+{
+	std::vector<int> id(n*n);
+	for (int c = 0; c < n*n; c++)
+		id[c] = c;
+	unsigned int state = seed;
+	for (int c = n*n - 1; c > 0; c--) {
+		state = state*1664525u + 1013904223u;
+		int other = (int) ((state >> 8) % (unsigned int) (c + 1));
+		int swap = id[c];
+		id[c] = id[other];
+		id[other] = swap;
+	}
+	STriplets grid;
+	poisson(grid, n);
+	t.rows = grid.rows;
+	for (size_t k = 0; k < grid.value.size(); k++)
+		t.add(id[grid.i[k]], id[grid.j[k]], grid.value[k]);
+}
+
+// per_row distinct off-diagonal columns per row, diagonal larger than the row sum
+static void random_sparse(STriplets & t, int rows, int per_row, unsigned int seed)
+{
+	t.rows = rows;
+	unsigned int state = seed;
+	std::vector<int> used;
+	for (int r = 0; r < rows; r++) {
+		used.clear();
+		double sum = 0.;
+		while ((int) used.size() < per_row) {
+			state = state*1664525u + 1013904223u;
+			int c = (int) (state % (unsigned int) rows);
+			bool seen = c == r;
+			for (size_t k = 0; k < used.size() && !seen; k++)
+				seen = used[k] == c;
+			if (seen)
+				continue;
+			used.push_back(c);
+			state = state*1664525u + 1013904223u;
+			double v = -((state >> 8) % 1000 + 1) / 1000.;
+			t.add(r, c, v);
+			sum += -v;
+		}
+		t.add(r, r, sum + 1.);
+	}
+}
+
+static void run_kernels(const char *name, STriplets & t)
+{
+	int rows = t.rows;
+	long long nnz = t.nnz();
+	CStopWatch timer;
+	int reps;
+
+	// assembly with set1Value, into a fresh matrix every time
+	CSparseMatrix A(rows, rows);
+	bandwidth = 0;
+	profile = 0;
+	reps = 0;
+	timer.restart();
+	do {
+		t.assemble(A);
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "set1Value", reps, timer.seconds(), 0., 0, 0);
+
+	double *x = new double[rows];
+	double *y = new double[rows];
+	double *b = new double[rows];
+	for (int k = 0; k < rows; k++)
+		x[k] = 1. + (k % 7)*0.1;
+	double spmv_bytes = (double) nnz*(sizeof(CMatrixElement) + sizeof(double)) + 2.*rows*sizeof(double);
+
+	bandwidth = matrix_bandwidth(A);
+	profile = matrix_profile(A);
+	reps = 0;
+	timer.restart();
+	do {
+		A.multMatVec(x, y);
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "multMatVec", reps, timer.seconds(), spmv_bytes, 0, 0);
+
+	reps = 0;
+	timer.restart();
+	do {
+		A.multTransMatVec(x, y);
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "multTransMatVec", reps, timer.seconds(), spmv_bytes, 0, 0);
+
+	// solve A x = A y from x = 0; one run, the iteration count is the point.
+	// y is not constant: the random rows all sum to 1, so A * 1 = 1 and
+	// BiCG breaks down on the first step.
+	for (int k = 0; k < rows; k++)
+		y[k] = 1. + (k % 7)*0.1;
+	A.multMatVec(y, b);
+	for (int k = 0; k < rows; k++)
+		x[k] = 0.;
+	timer.restart();
+	int iterations = (int) A.solve(x, b, 1e-10, 5000);
+	double seconds = timer.seconds();
+	// per iteration: two products (A and A^T) and the vector updates
+	record(name, rows, nnz, "solve", 1, seconds, iterations*(2.*spmv_bytes + 10.*rows*sizeof(double)), iterations, 0);
+
+	// the same product and solve in the two orders; the product runs on the
+	// reordered copy with vectors in its numbering, as inside a solve, while
+	// the solve goes through CPermutedMatrix from and to the original one
+	const char *orderings[2] = {"rcm", "partition"};
+	for (int o = 0; o < 2; o++) {
+		char kernel[64];
+		CPermutedMatrix P;
+		timer.restart();
+		P.build(A, o == 0 ? ORDER_RCM : ORDER_PARTITION);
+		double build_seconds = timer.seconds();
+		bandwidth = P.bandwidth[1];
+		profile = P.profile[1];
+		sprintf(kernel, "order_%s", orderings[o]);
+		record(name, rows, nnz, kernel, 1, build_seconds, 0., 0, 0);
+
+		for (int k = 0; k < rows; k++)
+			x[k] = 1. + (k % 7)*0.1;
+		reps = 0;
+		timer.restart();
+		do {
+			P.permuted.multMatVec(x, y);
+			reps++;
+		} while (timer.seconds() < min_time);
+		sprintf(kernel, "multMatVec_%s", orderings[o]);
+		record(name, rows, nnz, kernel, reps, timer.seconds(), spmv_bytes, 0, 0);
+
+		for (int k = 0; k < rows; k++)
+			x[k] = 0.;
+		timer.restart();
+		iterations = (int) P.solve(x, b, 1e-10, 5000);
+		seconds = timer.seconds();
+		sprintf(kernel, "solve_%s", orderings[o]);
+		record(name, rows, nnz, kernel, 1, seconds, iterations*(2.*spmv_bytes + 10.*rows*sizeof(double)), iterations, 0);
+	}
+	bandwidth = matrix_bandwidth(A);
+	profile = matrix_profile(A);
+
+	// A*A through add1Value
+	reps = 0;
+	long long product_nnz = 0;
+	timer.restart();
+	do {
+		CSparseMatrix *P = A.MultMatrix_bb(&A);
+		if (reps == 0)
+			for (int r = 0; r < P->numRows; r++)
+				for (CMatrixElement *e = P->rowList[r]; e != NULL; e = e->rowNext)
+					product_nnz++;
+		delete P;
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "MultMatrix_bb", reps, timer.seconds(), 0., 0, product_nnz);
+
+	// B += A, B starting as a copy of A so every element is found by GetElement
+	CSparseMatrix B(rows, rows);
+	reps = 0;
+	double add_seconds = 0.;
+	timer.restart();
+	do {
+		t.assemble(B);
+		CStopWatch add_timer;
+		B.AddMatrix(&A);
+		add_seconds += add_timer.seconds();
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "AddMatrix", reps, add_seconds, 0., 0, 0);
+
+	// GetElement on every stored (i,j), in triplet order
+	reps = 0;
+	long long found = 0;
+	timer.restart();
+	do {
+		for (size_t k = 0; k < t.value.size(); k++)
+			found += A.GetElement(t.i[k], t.j[k]) != NULL;
+		reps++;
+	} while (timer.seconds() < min_time);
+	record(name, rows, nnz, "GetElement", reps, timer.seconds(), 0., 0, 0);
+	if (found != nnz*reps)
+		fprintf(stderr, "sparsebench: GetElement missed entries of %s\n", name);
+
+	delete[] x;
+	delete[] y;
+	delete[] b;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: sparsebench [-json] [-min-time SECONDS] [-poisson n1,n2,...] [-shuffled n1,n2,...]\n"
+		"                   [-random rows1,rows2,...] [-per-row K]\n"
+		"  defaults: -poisson 32,64,128,256 -shuffled 64,256 -random 4096,16384,65536 -per-row 8 -min-time 0.2\n");
+}
+
+static bool parse_list(const char *text, std::vector<int> & values)
+{
+	values.clear();
+	const char *p = text;
+	while (*p) {
+		char *end;
+		long v = strtol(p, &end, 10);
+		if (end == p || v < 2)
+			return false;
+		values.push_back((int) v);
+		p = *end == ',' ? end+1 : end;
+		if (*end && *end != ',')
+			return false;
+	}
+	return !values.empty();
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<int> poisson_sizes, shuffled_sizes, random_sizes;
+	poisson_sizes.push_back(32);
+	poisson_sizes.push_back(64);
+	poisson_sizes.push_back(128);
+	poisson_sizes.push_back(256);
+	shuffled_sizes.push_back(64);
+	shuffled_sizes.push_back(256);
+	random_sizes.push_back(4096);
+	random_sizes.push_back(16384);
+	random_sizes.push_back(65536);
+	int per_row = 8;
+
+	for (int a = 1; a < argc; a++) {
+		const char *value = a+1 < argc ? argv[a+1] : NULL;
+		bool ok = true;
+		if (strcmp(argv[a], "-json") == 0)
+			json = true;
+		else if (strcmp(argv[a], "-min-time") == 0 && value) {
+			min_time = atof(value); a++;
+			ok = min_time >= 0;
+		} else if (strcmp(argv[a], "-poisson") == 0 && value) {
+			ok = parse_list(value, poisson_sizes); a++;
+		} else if (strcmp(argv[a], "-shuffled") == 0 && value) {
+			ok = parse_list(value, shuffled_sizes); a++;
+		} else if (strcmp(argv[a], "-random") == 0 && value) {
+			ok = parse_list(value, random_sizes); a++;
+		} else if (strcmp(argv[a], "-per-row") == 0 && value) {
+			per_row = atoi(value); a++;
+			ok = per_row > 0;
+		} else
+			ok = false;
+		if (!ok) {
+			usage();
+			return 1;
+		}
+	}
+
+	char name[64];
+	for (size_t k = 0; k < poisson_sizes.size(); k++) {
+		STriplets t;
+		poisson(t, poisson_sizes[k]);
+		sprintf(name, "poisson%d", poisson_sizes[k]);
+		run_kernels(name, t);
+	}
+	for (size_t k = 0; k < shuffled_sizes.size(); k++) {
+		STriplets t;
+		shuffled_poisson(t, shuffled_sizes[k], 777u + k);
+		sprintf(name, "shuffled%d", shuffled_sizes[k]);
+		run_kernels(name, t);
+	}
+	for (size_t k = 0; k < random_sizes.size(); k++) {
+		if (per_row >= random_sizes[k]) {
+			fprintf(stderr, "sparsebench: -per-row %d is too many for %d rows\n", per_row, random_sizes[k]);
+			return 1;
+		}
+		STriplets t;
+		random_sparse(t, random_sizes[k], per_row, 12345u + k);
+		sprintf(name, "random%d", random_sizes[k]);
+		run_kernels(name, t);
+	}
+	if (json)
+		printf(first_record ? "[]\n" : "\n]\n");
+	return 0;
+}